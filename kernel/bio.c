@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -19,37 +19,361 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+static int statsbcache(char*, int);
+
+// Buffers are hashed by (dev, blockno) into buckets, each with
+// its own lock, which protects the chain and the blockno, refcnt
+// and used of the buffers on it, so that looking up and
+// releasing blocks in different buckets don't contend.
+//
+// Buffers come in groups of BPERPG, each group a page from
+// kalloc() holding their headers and data. The cache starts
+// with enough groups for NBUF buffers, and grows a group at a
+// time on misses while memory is plentiful, up to BCACHEPCT
+// percent of the memory free at boot. When kalloc() runs out,
+// or kswapd wants memory, bshrink() gives unused groups back.
+//
+// A buffer with no references can be recycled for another
+// block, picked by a clock (second-chance) sweep over the
+// groups. bcache.lock serializes recycling, growing and
+// shrinking, and protects the dev of every buffer, the ring
+// and the hand; only its holder takes two bucket locks at once,
+// so that can't deadlock.
+#define BPERPG    3     // what fits in a page with the headers
+#define BGROWFREE 512   // the cache doesn't grow below this many free pages
+#define BUCKET(dev, blockno) (&bcache.bucket[((dev) * 31 + (blockno)) % bcache.nbucket])
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;             // chain, through next
+  uint64 hits;
+  uint64 misses;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct bgroup {
+  struct bgroup *prev;          // ring of groups
+  struct bgroup *next;
+  struct buf buf[BPERPG];
+  uchar data[BPERPG][BSIZE];
+};
+
+struct {
+  struct spinlock lock;
+  struct bgroup *hand;          // clock hand: group,
+  int handi;                    // and buffer in it
+  int ngroup;
+  int mingroup;
+  int maxgroup;
+  struct bucket *bucket;
+  int nbucket;
+  int order;                    // of the kalloc_pages() block holding bucket
+  uint64 ngrow;                 // groups added to the cache
+  uint64 nshrink;               // and given back
 } bcache;
 
+// blocks queued for kreadahead by breadahead().
+#define NRA     64
+#define RABATCH 16
+
+struct {
+  struct spinlock lock;
+  struct {
+    uint dev;
+    uint blockno;
+  } q[NRA];
+  uint head;                    // taken up to here,
+  uint tail;                    // queued up to here
+  uint64 nqueued;
+  uint64 ndropped;              // asked for with the queue full
+} ra;
+
+// turn page, from kalloc(), into a group of buffers that hold
+// no block.
+static struct bgroup*
+ginit(void *page)
+{
+  struct bgroup *g = page;
+
+  for(int i = 0; i < BPERPG; i++){
+    struct buf *b = &g->buf[i];
+    initsleeplock(&b->lock, "buffer");
+    b->dev = 0;
+    b->refcnt = 0;
+    b->used = 0;
+    b->data = g->data[i];
+  }
+  return g;
+}
+
+// Add g to the cache, its buffers the next the clock hand
+// recycles. Caller must hold bcache.lock.
+static void
+gadd(struct bgroup *g)
+{
+  if(bcache.hand == 0){
+    g->prev = g->next = g;
+  } else {
+    g->next = bcache.hand;
+    g->prev = bcache.hand->prev;
+    g->prev->next = g;
+    bcache.hand->prev = g;
+  }
+  bcache.hand = g;
+  bcache.handi = 0;
+  bcache.ngroup++;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  void *page;
+  int i;
 
+  if(sizeof(struct bgroup) > PGSIZE)
+    panic("binit: BPERPG");
   initlock(&bcache.lock, "bcache");
+  initlock(&ra.lock, "readahead");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  bcache.mingroup = (NBUF + BPERPG - 1) / BPERPG;
+  bcache.maxgroup = kfreepages() / 100 * BCACHEPCT;
+  if(bcache.maxgroup < bcache.mingroup)
+    bcache.maxgroup = bcache.mingroup;
+
+  // a bucket per group, as far as one block from kalloc_pages() goes.
+  for(bcache.order = 0; bcache.order < MAXORDER; bcache.order++)
+    if((PGSIZE << bcache.order) / sizeof(struct bucket) >= bcache.maxgroup)
+      break;
+  if((bcache.bucket = kalloc_pages(bcache.order)) == 0)
+    panic("binit: buckets");
+  bcache.nbucket = (PGSIZE << bcache.order) / sizeof(struct bucket);
+  if(bcache.nbucket > bcache.maxgroup)
+    bcache.nbucket = bcache.maxgroup;
+  memset(bcache.bucket, 0, PGSIZE << bcache.order);
+  for(i = 0; i < bcache.nbucket; i++)
+    initticketlock(&bcache.bucket[i].lock, "bcache.bucket");
+
+  for(i = 0; i < bcache.mingroup; i++){
+    if((page = kalloc()) == 0)
+      panic("binit: buffers");
+    gadd(ginit(page));
+  }
+  statsregister("bcache", statsbcache, 0);
+}
+
+// the buffer for block blockno of dev in bucket bk, or 0.
+// caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// take b, which holds no references, off bucket bk.
+// caller must hold bcache.lock and bk->lock.
+static void
+bunhash(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+  b->dev = 0;
+}
+
+// Find a buffer to recycle, with the clock hand: one that holds
+// no block, or else one with no references that hasn't been
+// used since the hand last passed it, clearing used on the way.
+// Takes it off its bucket. Returns it, or 0 if all are in use.
+// Caller must hold bcache.lock, and no bucket lock.
+static struct buf*
+bvictim(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  // two turns, to come back to buffers given a second chance.
+  for(int n = 0; n < 2 * BPERPG * bcache.ngroup; n++){
+    b = &bcache.hand->buf[bcache.handi];
+    if(++bcache.handi == BPERPG){
+      bcache.hand = bcache.hand->next;
+      bcache.handi = 0;
+    }
+    if(b->dev == 0)
+      return b;
+    bk = BUCKET(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt == 0){
+      if(b->used == 0){
+        bunhash(bk, b);
+        release(&bk->lock);
+        return b;
+      }
+      b->used = 0;
+    }
+    release(&bk->lock);
   }
+  return 0;
+}
+
+// Add a group to the cache, if memory is plentiful and it may
+// grow. Allocates before taking bcache.lock, since kalloc() may
+// call bshrink().
+static void
+bgrow(void)
+{
+  void *page;
+
+  if(bcache.ngroup >= bcache.maxgroup || kfreepages() < BGROWFREE)
+    return;
+  if((page = kalloc()) == 0)
+    return;
+  acquire(&bcache.lock);
+  if(bcache.ngroup >= bcache.maxgroup){
+    release(&bcache.lock);
+    kfree(page);
+    return;
+  }
+  gadd(ginit(page));
+  bcache.ngrow++;
+  release(&bcache.lock);
+}
+
+// Give up to npages groups of buffers with no references back
+// to kalloc(), leaving the cache no smaller than NBUF buffers, and
+// starting with the groups the clock hand would recycle next.
+// Returns the number of pages freed.
+int
+bshrink(int npages)
+{
+  struct bgroup *g, *next;
+  struct bucket *bk;
+  struct buf *b;
+  int i, n = 0, busy;
+
+  if(bcache.ngroup <= bcache.mingroup)
+    return 0;
+  acquire(&bcache.lock);
+  g = bcache.hand;
+  for(int left = bcache.ngroup; left > 0 && n < npages &&
+        bcache.ngroup > bcache.mingroup; left--, g = next){
+    next = g->next;
+    // look first, so as not to drop the blocks of a group
+    // that has a buffer in use; one might still be taken
+    // before it is unhashed, and keep the group.
+    busy = 0;
+    for(i = 0; i < BPERPG; i++)
+      if(g->buf[i].dev && g->buf[i].refcnt)
+        busy = 1;
+    if(busy)
+      continue;
+    for(i = 0; i < BPERPG; i++){
+      b = &g->buf[i];
+      if(b->dev == 0)
+        continue;
+      bk = BUCKET(b->dev, b->blockno);
+      acquire(&bk->lock);
+      if(b->refcnt == 0)
+        bunhash(bk, b);
+      else
+        busy = 1;
+      release(&bk->lock);
+    }
+    if(busy)
+      continue;
+
+    if(bcache.hand == g){
+      bcache.hand = next;
+      bcache.handi = 0;
+    }
+    g->prev->next = next;
+    next->prev = g->prev;
+    kfree(g);
+    bcache.ngroup--;
+    bcache.nshrink++;
+    n++;
+  }
+  release(&bcache.lock);
+  return n;
+}
+
+// Recycle a buffer for block blockno of dev, which wasn't
+// cached when the caller looked. Returns 1 with it in *bp, with
+// one reference and locked, 0 if another process has since
+// recycled one for the block, -1 if all buffers are in use.
+// Adds a buffer to the cache instead if there's memory to spare.
+// The buffer is locked before it goes into its bucket, so that
+// whoever finds it there waits until the caller has filled it.
+static int
+bnew(uint dev, uint blockno, struct buf **bp)
+{
+  struct bucket *bk = BUCKET(dev, blockno);
+  struct buf *b;
+
+  bgrow();
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    return 0;
+  }
+
+  if((b = bvictim()) == 0){
+    release(&bcache.lock);
+    return -1;
+  }
+  // with no references, no one holds its lock, so this
+  // doesn't sleep.
+  if(b->lock.locked)
+    panic("bnew: locked");
+  acquiresleep(&b->lock);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->used = 0;
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  bk->misses++;
+  release(&bk->lock);
+  release(&bcache.lock);
+  *bp = b;
+  return 1;
+}
+
+// Make the cache never smaller than n buffers, for the log,
+// which pins the blocks of its transactions in it.
+void
+breserve(int n)
+{
+  void *page;
+
+  acquire(&bcache.lock);
+  if((n + BPERPG - 1) / BPERPG > bcache.mingroup)
+    bcache.mingroup = (n + BPERPG - 1) / BPERPG;
+  if(bcache.maxgroup < bcache.mingroup)
+    bcache.maxgroup = bcache.mingroup;
+  while(bcache.ngroup < bcache.mingroup){
+    release(&bcache.lock);
+    if((page = kalloc()) == 0)
+      panic("breserve");
+    acquire(&bcache.lock);
+    gadd(ginit(page));
+  }
+  release(&bcache.lock);
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +382,39 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk = BUCKET(dev, blockno);
   struct buf *b;
+  int r;
 
-  acquire(&bcache.lock);
+  for(;;){
+    acquire(&bk->lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
+    // Is the block already cached?
+    if((b = bfind(bk, dev, blockno)) != 0){
       b->refcnt++;
-      release(&bcache.lock);
+      bk->hits++;
+      release(&bk->lock);
       acquiresleep(&b->lock);
       return b;
     }
-  }
+    release(&bk->lock);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+    // Not cached.
+    if((r = bnew(dev, blockno, &b)) < 0)
+      panic("bget: no buffers");
+    if(r > 0)
       return b;
-    }
   }
-  panic("bget: no buffers");
+}
+
+// Read or write b from or to its device.
+static void
+bdevrw(struct buf *b, int write)
+{
+  if(b->dev == RAMDEV)
+    ramdiskrw(b, write);
+  else
+    virtio_disk_rw(b, write);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -93,61 +422,198 @@ struct buf*
 bread(uint dev, uint blockno)
 {
   struct buf *b;
+  struct proc *p;
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    bdevrw(b, 0);
     b->valid = 1;
+    if((p = myproc()) != 0)
+      p->nbread++;
   }
   return b;
 }
 
+// Return a locked buf for the indicated block with its
+// contents zeroed rather than read, for a block just allocated.
+struct buf*
+bzeroed(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+  return b;
+}
+
+// Ask for block blockno of dev, which is likely to be read
+// soon, to be read into the cache in the background, unless
+// it's already there, or the cache is too small to spare
+// buffers for it.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk = BUCKET(dev, blockno);
+  struct buf *b;
+
+  // the ram disk reads as fast on demand as ahead of time.
+  if(dev == RAMDEV)
+    return;
+
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    return;
+
+  acquire(&ra.lock);
+  if(ra.tail - ra.head == NRA || bcache.ngroup * BPERPG < 2 * NBUF){
+    ra.ndropped++;
+  } else {
+    ra.q[ra.tail % NRA].dev = dev;
+    ra.q[ra.tail % NRA].blockno = blockno;
+    ra.tail++;
+    ra.nqueued++;
+    wakeup(&ra);
+  }
+  release(&ra.lock);
+}
+
+// kreadahead, a kernel process, reads the blocks breadahead()
+// queues, up to RABATCH at a time, all in flight at once. It
+// takes only new buffers, which bnew() locks before anyone else
+// can find them, so it never waits for a buffer lock, and no one
+// can fill one of them first; a reader that wants one of them
+// waits for its buffer, rather than reading it again.
+static void
+kreadahead(void)
+{
+  struct buf *bs[RABATCH], *b;
+  uint dev, blockno;
+  int n;
+
+  // still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  for(;;){
+    acquire(&ra.lock);
+    while(ra.head == ra.tail)
+      sleep(&ra, &ra.lock);
+    for(n = 0; n < RABATCH && ra.head != ra.tail; ){
+      dev = ra.q[ra.head % NRA].dev;
+      blockno = ra.q[ra.head % NRA].blockno;
+      ra.head++;
+      release(&ra.lock);
+      if(bnew(dev, blockno, &b) > 0)
+        bs[n++] = b;
+      acquire(&ra.lock);
+    }
+    release(&ra.lock);
+
+    virtio_disk_submit(bs, n, 0);
+    for(int i = 0; i < n; i++){
+      virtio_disk_wait(bs[i]);
+      bs[i]->valid = 1;
+      brelse(bs[i]);
+    }
+  }
+}
+
+void
+readaheadinit(void)
+{
+  kproc("kreadahead", kreadahead);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
+  struct proc *p;
+
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  bdevrw(b, 1);
+  if((p = myproc()) != 0)
+    p->nbwrite++;
+}
+
+// Write the contents of the n buffers in bs to disk, all in
+// flight at once. All must be locked.
+void
+bwritev(struct buf **bs, int n)
+{
+  struct proc *p;
+
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+  virtio_disk_rwv(bs, n, 1);
+  if((p = myproc()) != 0)
+    p->nbwrite += n;
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Note that it was used, for recycling.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = BUCKET(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  b->used = 1;
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = BUCKET(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = BUCKET(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+static int
+statsbcache(char *buf, int sz)
+{
+  uint64 hits = 0, misses = 0;
+  int longest = 0;
 
+  for(int i = 0; i < bcache.nbucket; i++){
+    struct bucket *bk = &bcache.bucket[i];
+    int len = 0;
+    hits += bk->hits;
+    misses += bk->misses;
+    acquire(&bk->lock);
+    for(struct buf *b = bk->head; b; b = b->next)
+      len++;
+    release(&bk->lock);
+    if(len > longest)
+      longest = len;
+  }
+  return snprintf(buf, sz, "bcache: buffers %d max %d grown %d shrunk %d hits %d misses %d buckets %d longest %d\n"
+                  "bcache: hit rate %d%%\n"
+                  "readahead: queued %d dropped %d\n",
+                  bcache.ngroup * BPERPG, bcache.maxgroup * BPERPG, (int)bcache.ngrow,
+                  (int)bcache.nshrink, (int)hits, (int)misses, bcache.nbucket, longest,
+                  hits + misses ? (int)(hits * 100 / (hits + misses)) : 0,
+                  (int)ra.nqueued, (int)ra.ndropped);
+}
@@ -1,12 +1,12 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
-  uint dev;
+  uint dev;    // 0 if it holds no block
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  int used;         // released since the clock hand passed?
+  struct buf *next; // hash bucket chain
+  uchar *data;      // BSIZE bytes, usually in its group; see bio.c
 };
 
@@ -21,6 +21,9 @@
 #include "riscv.h"
 #include "defs.h"
 #include "proc.h"
+#include "poll.h"
+
+static int statsconsole(char*, int);
 
 #define BACKSPACE 0x100
 #define C(x)  ((x)-'@')  // Control-x
@@ -45,29 +48,33 @@ struct {
   struct spinlock lock;
   
   // input
-#define INPUT_BUF 128
+#define INPUT_BUF 512
   char buf[INPUT_BUF];
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+  uint64 nin;       // input characters stored
+  uint64 noverflow; // dropped because buf was full
 } cons;
 
 //
-// user write()s to the console go here.
+// user write()s to the console go here,
+// copied in and handed to the uart a chunk at a time.
 //
 int
 consolewrite(int user_src, uint64 src, int n)
 {
-  int i;
-
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  char buf[128];
+  int i, m;
+
+  for(i = 0; i < n; i += m){
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    uartputc(c);
+    uartwrite(buf, m);
   }
-  release(&cons.lock);
 
   return i;
 }
@@ -166,13 +173,18 @@ consoleintr(int c)
 
       // store for consumption by consoleread().
       cons.buf[cons.e++ % INPUT_BUF] = c;
+      cons.nin++;
 
       if(c == '\n' || c == C('D') || cons.e == cons.r+INPUT_BUF){
         // wake up consoleread() if a whole line (or end-of-file)
         // has arrived.
         cons.w = cons.e;
         wakeup(&cons.r);
+        pollwake();
       }
+    } else if(c != 0){
+      // no room; a reader isn't keeping up.
+      cons.noverflow++;
     }
     break;
   }
@@ -180,6 +192,19 @@ consoleintr(int c)
   release(&cons.lock);
 }
 
+// a read won't block once a whole line has arrived.
+int
+consolepoll(void)
+{
+  int r = POLLOUT;
+
+  acquire(&cons.lock);
+  if(cons.r != cons.w)
+    r |= POLLIN;
+  release(&cons.lock);
+  return r;
+}
+
 void
 consoleinit(void)
 {
@@ -191,4 +216,13 @@ consoleinit(void)
   // to consoleread and consolewrite.
   devsw[CONSOLE].read = consoleread;
   devsw[CONSOLE].write = consolewrite;
+  devsw[CONSOLE].poll = consolepoll;
+  statsregister("console", statsconsole, 0);
+}
+
+static int
+statsconsole(char *buf, int sz)
+{
+  return snprintf(buf, sz, "console: in %d overflow %d\n",
+                  (int)cons.nin, (int)cons.noverflow);
 }
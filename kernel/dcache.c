@@ -0,0 +1,148 @@
+//
+// Name cache.
+// Remembers what names in directories lead to, so that namex()
+// can walk paths it has walked before without locking or reading
+// the directories. An entry maps a (directory, name) pair to the
+// inode number the name has there, or to 0 if it has none.
+//
+// The cache is a hash table with one entry per slot; a new entry
+// replaces whatever its slot held. Entries are only entered and
+// changed with the directory locked, by the lookups that find
+// them and by dirlink() and dirunlink(), which keeps them in step
+// with the directory. Freeing a directory's inode drops all of
+// its entries, since its inode number may be reused.
+//
+// Writers serialize on dcache.lock, and bump the slot's seq
+// before and after changing it; readers take no lock, and try
+// again if seq was odd or changed while they copied the slot.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+static int statsdcache(char*, int);
+
+struct dentry {
+  uint seq;
+  uint dev;
+  uint dinum;                 // directory, or 0 if the slot is free
+  uint inum;                  // what name leads to, or 0
+  char name[DIRSIZ];
+};
+
+static struct {
+  struct spinlock lock;
+  struct dentry d[NDCACHE];
+  uint64 hits;
+  uint64 misses;
+} dcache;
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+  statsregister("dcache", statsdcache, 0);
+}
+
+static struct dentry*
+dslot(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return &dcache.d[h % NDCACHE];
+}
+
+// Look name up in directory dp, which need not be locked.
+// Returns 1 and sets *inum, to 0 if dp has no such entry, if the
+// cache knows; returns 0 if it doesn't. Sets *seq for
+// dcachestill().
+int
+dcachelookup(struct inode *dp, char *name, uint *inum, uint *seq)
+{
+  struct dentry *d = dslot(dp->dev, dp->inum, name);
+  struct dentry e;
+
+  do {
+    *seq = d->seq;
+    __sync_synchronize();
+    e = *d;
+    __sync_synchronize();
+  } while((*seq & 1) || d->seq != *seq);
+
+  if(e.dinum != dp->inum || e.dev != dp->dev || namecmp(name, e.name) != 0){
+    __sync_fetch_and_add(&dcache.misses, 1);
+    return 0;
+  }
+  __sync_fetch_and_add(&dcache.hits, 1);
+  *inum = e.inum;
+  return 1;
+}
+
+// Is the entry dcachelookup() found, with *seq set to seq,
+// unchanged? If so, and a reference to its inode was taken in
+// between, the inode can't have been freed; dirunlink() changes
+// the entry before the inode's last link goes.
+int
+dcachestill(struct inode *dp, char *name, uint seq)
+{
+  struct dentry *d = dslot(dp->dev, dp->inum, name);
+
+  __sync_synchronize();
+  return d->seq == seq;
+}
+
+// Note that name in directory dp leads to inum, or to nothing
+// if inum is 0. Caller must hold dp->lock.
+void
+dcacheenter(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d = dslot(dp->dev, dp->inum, name);
+
+  acquire(&dcache.lock);
+  d->seq++;
+  __sync_synchronize();
+  d->dev = dp->dev;
+  d->dinum = dp->inum;
+  d->inum = inum;
+  strncpy(d->name, name, DIRSIZ);
+  __sync_synchronize();
+  d->seq++;
+  release(&dcache.lock);
+}
+
+// Drop the entries of directory inum, which is being freed.
+void
+dcachepurge(uint dev, uint inum)
+{
+  acquire(&dcache.lock);
+  for(struct dentry *d = dcache.d; d < &dcache.d[NDCACHE]; d++){
+    if(d->dinum != inum || d->dev != dev)
+      continue;
+    d->seq++;
+    __sync_synchronize();
+    d->dinum = 0;
+    __sync_synchronize();
+    d->seq++;
+  }
+  release(&dcache.lock);
+}
+
+static int
+statsdcache(char *buf, int sz)
+{
+  int n = 0;
+
+  for(int i = 0; i < NDCACHE; i++)
+    if(dcache.d[i].dinum)
+      n++;
+  return snprintf(buf, sz, "dcache: entries %d of %d hits %d misses %d\n",
+                  n, NDCACHE, (int)dcache.hits, (int)dcache.misses);
+}
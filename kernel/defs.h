@@ -5,9 +5,12 @@ struct inode;
 struct pipe;
 struct proc;
 struct spinlock;
+struct shm;
 struct sleeplock;
+struct slabcache;
 struct stat;
 struct superblock;
+struct vma;
 #ifdef LAB_NET
 struct mbuf;
 struct sock;
@@ -16,31 +19,65 @@ struct sock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bzeroed(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
+void            breserve(int);
+void            breadahead(uint, uint);
+void            readaheadinit(void);
 
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcachelookup(struct inode*, char*, uint*, uint*);
+int             dcachestill(struct inode*, char*, uint);
+void            dcacheenter(struct inode*, char*, uint);
+void            dcachepurge(uint, uint);
+
+// pcache.c
+void            pcacheinit(void);
+uint64          pcacheget(struct inode*, uint64);
+void            pcacheput(struct inode*, uint64, uint64);
+void            pcacheinval(struct inode*);
+int             pcacheshrink(int);
+
 // exec.c
 int             exec(char*, char**);
+int             execload(struct proc*, char*, char**);
+int             execpaged(struct proc*, uint64);
+int             execfault(struct proc*, uint64);
 
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
+int             fdlowest(struct proc*);
+void            fdset(struct proc*, int, struct file*);
+int             fdgrow(struct proc*);
+void            fdreset(struct proc*);
 int             fileread(struct file*, uint64, int n);
+int             filepoll(struct file*);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesend(struct file*, struct file*, int);
+int             filepread(struct file*, uint64, int, uint);
+int             filepwrite(struct file*, uint64, int, uint);
+void            fileprefetch(struct file*, uint, int);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+void            dirunlink(struct inode*, uint);
+void            dirindex(void);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
@@ -57,39 +94,88 @@ int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+int             ismount(struct inode*);
+void            iprefetch(struct inode*, uint, uint);
 
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
+void            ramdiskrw(struct buf*, int);
+
+// futex.c
+void            futexinit(void);
+int             futex(uint64, int, int);
 
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kzalloc(void);
+int             kfreepages(void);
+int             kzerofill(void);
+void            krefpage(void *);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            ksplitpages(void *, int);
+int             krefcount(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_sync(void);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
+void            end_opn(int);
+int             log_bigop(void);
+
+// mmap.c
+void            mmapinit(void);
+uint64          mmapbase(struct proc*);
+struct vma*     vmalookup(struct proc*, uint64);
+uint64          mmap(uint64, int, int, struct file*, uint64);
+int             mmapfault(struct proc*, uint64, int);
+int             munmap(uint64, uint64);
+void            munmapall(struct proc*, int);
+int             mmapfork(struct proc*, struct proc*);
+uint64          shmat(int, uint64);
+int             shmdt(uint64);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, uint64, int, int);
+int             pipewrite(struct pipe*, uint64, int, int);
+int             pipesend(struct pipe*, uint64, int);
+int             piperesize(struct pipe*, int);
+int             pipepoll(struct pipe*, int);
+
+// prof.c
+extern volatile int profiling;
+void            profinit(void);
+void            profsample(uint64, int);
 
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
+void            kprintinit(void);
+void            kprintwake(void);
 
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             spawn(char*, char**, int*, int);
+int             clone(uint64, uint64, uint64);
+int             join(int, uint64);
+void            threadunmap(struct proc*, pagetable_t);
+int             schedtick(void);
+int             setpriority(int, int);
+int             setaffinity(int, uint64);
+uint64          getaffinity(int);
+void            kproc(char*, void (*)(void));
+int             growproc(int, uint64*);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -97,6 +183,7 @@ struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+struct proc*    procnext(struct proc*);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
@@ -104,6 +191,7 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -116,10 +204,30 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            initticketlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+struct slabcache* slabcreate(char*, uint, void (*)(void*));
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+
+// swap.c
+void            swapinit(void);
+int             swapin(pte_t*);
+void            swapfree(pte_t);
+void            swapdup(pte_t);
+int             swapwait(struct proc*);
+
+// shm.c
+void            shminit(void);
+struct shm*     shmget(int, int);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -143,6 +251,9 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// sysfile.c
+void            argfdput(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -150,10 +261,24 @@ void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
 
+// timer.c
+int             clockintr(void);
+void            tickupdate(void);
+int             tsleep(int);
+uint64          nsec(void);
+void            pollwake(void);
+void            pollcount(int);
+uint            pollgen(void);
+int             pollsleep(uint, int);
+void            timeridle(void);
+void            timerbusy(void);
+void            timerkick(int);
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
-void            uartputc(int);
+void            uartbufinit(void);
+void            uartwrite(char*, int);
 void            uartputc_sync(int);
 int             uartgetc(void);
 
@@ -162,8 +287,11 @@ void            kvminit(void);
 void            kvminithart(void);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
+int             proc_pgtblpages(struct proc*);
+int             proc_residentpages(struct proc*);
 void            ukvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+int             mapmegapages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
@@ -171,14 +299,34 @@ uint64          uvmdealloc(pagetable_t, uint64, uint64);
 #ifdef SOL_COW
 #else
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+uint64          uvmgetpage(struct proc*, uint64);
+int             uvmputpage(struct proc*, uint64, uint64);
+void            uvmprefault(uint64, uint64);
 #endif
+int             uvmcow(pagetable_t, uint64);
+int             uvmsplit(pagetable_t, uint64);
+int             uvmfault(uint64, int);
+int             uvmfaultmap(struct proc*, uint64, uint64, int);
+int             uvmunshare(struct proc*);
+int             uvmtouch(uint64, uint64);
+void            asidinit(void);
+void            asidswitch(struct proc*);
+uint64          uvmsatp(struct proc*);
+uint64          kvmsatp(struct proc*);
+void            satpswitch(uint64);
+void            tlbtrampoline(void);
+void            tlbflush(struct proc*);
+void            tlbflushpage(struct proc*, uint64);
 pagetable_t     uvmcreate_kpgtbl();
-void            uvmfree_kpgtbl(pagetable_t);
+void            uvmfree_kpgtbl(pagetable_t, pagetable_t);
 void            uvmfree(pagetable_t, uint64);
+void            uvmrecycle(pagetable_t, pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int*);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -194,6 +342,10 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwv(struct buf **, int, int);
+void            virtio_disk_flush(void);
+void            virtio_disk_submit(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -203,7 +355,9 @@ void            virtio_disk_intr(void);
 
 // stats.c
 void            statsinit(void);
-void            statsinc(void);
+void            statsregister(char*, int (*)(char*, int), void (*)(void));
+void            statscounter(char*, char*, uint64*, int);
+void            histadd(uint64*, uint64);
 
 // sprintf.c
 int             snprintf(char*, int, char*, ...);
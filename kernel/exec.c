@@ -7,19 +7,23 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
-
+// Load the program at path into p, replacing its user memory,
+// and set p up to start running it on its next return to user
+// space. p is the current process, or a new one that hasn't yet
+// run and whose lock isn't held (see spawn()).
+// Returns argc, or -1 if there is no program to load.
 int
-exec(char *path, char **argv)
+execload(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *execip = 0, *oldip;
   struct proghdr ph;
+  struct execseg seg[NEXECSEG];
+  int nseg = 0;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -38,7 +42,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program segments; execfault() reads their
+  // pages in from ip when they are first touched.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,25 +53,35 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    // the kernel page table mirrors user memory below PLIC only.
+    if(ph.vaddr + ph.memsz >= PLIC)
       goto bad;
-    sz = sz1;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nseg == NEXECSEG)
       goto bad;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].memsz = ph.memsz;
+    seg[nseg].off = ph.off;
+    seg[nseg].flags = ph.flags;
+    nseg++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep a reference to ip for the new image.
+  iunlock(ip);
   end_op();
+  execip = ip;
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
+  if(sz + 2*PGSIZE >= PLIC)
+    goto bad;
   uint64 sz1;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
@@ -109,19 +124,36 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p, 1);
   oldpagetable = p->pagetable;
+  oldip = p->execip;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->execip = execip;
+  memmove(p->execseg, seg, sizeof(seg));
+  p->nexecseg = nseg;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
 
-  // clear previous mapping
-  copy_upgtbl(pagetable, p->kpagetable, oldsz, 0);
-  // update the new user pgtbl to kernel pgtbl
-  copy_upgtbl(pagetable, p->kpagetable, 0, p->sz);
+  // point the kernel pgtbl at the new user pgtbl before
+  // freeing the old one, whose leaf tables it shares. the
+  // old one may have leaf tables above oldsz, left by sbrk.
+  copy_upgtbl(pagetable, p->kpagetable, 0, PLIC);
+  if(p == myproc())
+    tlbflush(p);
+  threadunmap(p, oldpagetable);
+  proc_freepagetable(oldpagetable, oldsz);
+  if(oldip){
+    begin_op();
+    iput(oldip);
+    end_op();
+  }
 
-  if (p->pid == 1) {
+  // map init's image in before printing its page table, whose
+  // leaves for the text, guard and stack pages the lab expects.
+  if (p->pid == 1 && p == myproc()) {
+    for(uint64 va = 0; va < sz - 2*PGSIZE; va += PGSIZE)
+      uvmfault(va, PTE_R);
     vmprint(p->pagetable);
   }
 
@@ -134,33 +166,85 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(execip){
+    begin_op();
+    iput(execip);
+    end_op();
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+int
+exec(char *path, char **argv)
+{
+  struct proc *p = myproc();
+
+  // the other threads would be left running in the old image.
+  if(p->leader->nthread > 1)
+    return -1;
+  return execload(p, path, argv);
+}
+
+// Is the page at va of p's image read in from its executable,
+// by execfault(), when it is first touched?
+int
+execpaged(struct proc *p, uint64 va)
 {
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
+  va = PGROUNDDOWN(va);
+  for(int i = 0; i < p->nexecseg; i++){
+    struct execseg *sg = &p->execseg[i];
+    if(va < sg->va + sg->filesz && va + PGSIZE > sg->va)
+      return 1;
   }
-  
   return 0;
 }
+
+// Map the page at va of p's image, which execpaged() says is
+// read from the executable, for a fault on it. All processes
+// running the same executable share the page, through the page
+// cache: read-only, and copy-on-write if a writable segment
+// covers any of it. Returns 0 on success, -1 if the executable
+// can't be read, or -2 if out of memory.
+int
+execfault(struct proc *p, uint64 va)
+{
+  struct inode *ip = p->execip;
+  uint64 lo, hi, pa;
+  int perm = PTE_R|PTE_X|PTE_U, r;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  for(int i = 0; i < p->nexecseg; i++){
+    struct execseg *sg = &p->execseg[i];
+    if(va < sg->va + sg->memsz && va + PGSIZE > sg->va &&
+       (sg->flags & ELF_PROG_FLAG_WRITE))
+      perm |= PTE_COW;
+  }
+
+  ilock(ip);
+  if((pa = pcacheget(ip, va)) == 0){
+    if((mem = kzalloc()) == 0){
+      iunlock(ip);
+      return -2;
+    }
+    for(int i = 0; i < p->nexecseg; i++){
+      struct execseg *sg = &p->execseg[i];
+      lo = va > sg->va ? va : sg->va;
+      hi = va + PGSIZE < sg->va + sg->filesz ? va + PGSIZE : sg->va + sg->filesz;
+      if(lo >= hi)
+        continue;
+      if(readi(ip, 0, (uint64)mem + (lo - va), sg->off + (lo - sg->va), hi - lo) != hi - lo){
+        iunlock(ip);
+        kfree(mem);
+        return -1;
+      }
+    }
+    pa = (uint64)mem;
+    pcacheput(ip, va, pa);
+  }
+  iunlock(ip);
+
+  if((r = uvmfaultmap(p, va, pa, perm)) != 0)
+    kfree((void*)pa);
+  return r < 0 ? -2 : 0;
+}
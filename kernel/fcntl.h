@@ -3,3 +3,31 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+#define O_NONBLOCK 0x800
+
+// what read() and write() of an O_NONBLOCK pipe or console
+// return instead of sleeping.
+#define EAGAIN    (-2)
+
+// for fcntl().
+#define F_GETFL   1   // get O_NONBLOCK and the access mode
+#define F_SETFL   2   // set O_NONBLOCK as in arg
+
+// for readv() and writev().
+struct iovec {
+  uint64 base;    // address of a buffer
+  uint64 len;     // and its length
+};
+
+#define IOV_MAX   16  // most iovecs a call takes
+
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+
+#define FUTEX_WAIT      0
+#define FUTEX_WAKE      1
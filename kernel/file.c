@@ -12,17 +12,20 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "poll.h"
+#include "fcntl.h"
 
 struct devsw devsw[NDEV];
-struct {
-  struct spinlock lock;
-  struct file file[NFILE];
-} ftable;
+
+// struct files come from a slab cache, whose per-hart magazines
+// keep most allocations and frees off any shared lock, and their
+// reference counts are changed atomically.
+static struct slabcache *filecache;
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  filecache = slabcreate("file", sizeof(struct file), 0);
 }
 
 // Allocate a file structure.
@@ -31,27 +34,19 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = slaballoc(filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if(__sync_fetch_and_add(&f->ref, 1) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -59,27 +54,86 @@ filedup(struct file *f)
 void
 fileclose(struct file *f)
 {
-  struct file ff;
+  int n;
 
-  acquire(&ftable.lock);
-  if(f->ref < 1)
-    panic("fileclose");
-  if(--f->ref > 0){
-    release(&ftable.lock);
+  if((n = __sync_sub_and_fetch(&f->ref, 1)) > 0)
     return;
-  }
-  ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
-  release(&ftable.lock);
+  if(n < 0)
+    panic("fileclose");
 
-  if(ff.type == FD_PIPE){
-    pipeclose(ff.pipe, ff.writable);
-  } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+  if(f->type == FD_PIPE){
+    pipeclose(f->pipe, f->writable);
+  } else if(f->type == FD_INODE || f->type == FD_DEVICE){
     begin_op();
-    iput(ff.ip);
+    iput(f->ip);
     end_op();
   }
+  f->type = FD_NONE;
+  slabfree(filecache, f);
+}
+
+// Descriptor tables. A process starts out with room for NOFILE
+// open files in ofile0, and moves to a page with room for MAXFD
+// the first time it needs more. fdused has a bit for each open
+// descriptor, so that the lowest free one is found a word at a
+// time. The caller must hold l->sharelock, if l has other
+// threads, to use these or l->ofile.
+
+// The lowest free descriptor of l, or -1 if it has MAXFD open.
+int
+fdlowest(struct proc *l)
+{
+  for(int i = 0; i < MAXFD/64; i++)
+    if(~l->fdused[i])
+      return i*64 + __builtin_ctzl(~l->fdused[i]);
+  return -1;
+}
+
+// Make descriptor fd of l refer to f, or to nothing if f is 0.
+void
+fdset(struct proc *l, int fd, struct file *f)
+{
+  l->ofile[fd] = f;
+  if(f)
+    l->fdused[fd/64] |= 1L << (fd%64);
+  else
+    l->fdused[fd/64] &= ~(1L << (fd%64));
+}
+
+// Give l's table room for MAXFD descriptors. Returns 0, or -1
+// if there is no memory for it. Takes l->sharelock.
+int
+fdgrow(struct proc *l)
+{
+  struct file **t;
+
+  if(l->nofile == MAXFD)
+    return 0;
+  if((t = kalloc()) == 0)
+    return -1;
+  memset(t, 0, PGSIZE);
+  acquire(&l->sharelock);
+  if(l->nofile < MAXFD){
+    memmove(t, l->ofile, l->nofile * sizeof(t[0]));
+    l->ofile = t;
+    l->nofile = MAXFD;
+    t = 0;
+  }
+  release(&l->sharelock);
+  if(t)
+    kfree(t);
+  return 0;
+}
+
+// Put p, whose files are all closed, back on ofile0.
+void
+fdreset(struct proc *p)
+{
+  if(p->ofile && p->ofile != p->ofile0)
+    kfree(p->ofile);
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
+  memset(p->fdused, 0, sizeof(p->fdused));
 }
 
 // Get metadata about file f.
@@ -101,6 +155,33 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Which of POLLIN, POLLOUT and POLLHUP are true of f now.
+// Inodes, and devices without a poll function, never block.
+int
+filepoll(struct file *f)
+{
+  int r = POLLIN|POLLOUT;
+
+  if(f->type == FD_PIPE)
+    r = pipepoll(f->pipe, f->writable);
+  else if(f->type == FD_DEVICE && f->major >= 0 && f->major < NDEV && devsw[f->major].poll)
+    r = devsw[f->major].poll();
+  if(!f->readable)
+    r &= ~POLLIN;
+  if(!f->writable)
+    r &= ~POLLOUT;
+  return r;
+}
+
+// Would a read (POLLIN) or write (POLLOUT) of device major
+// sleep? Asks its poll function, so a reader that another
+// reader beats to the data may still sleep.
+static int
+devwouldblock(int major, int event)
+{
+  return devsw[major].poll && (devsw[major].poll() & event) == 0;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -112,10 +193,12 @@ fileread(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
+    if(f->nonblock && devwouldblock(f->major, POLLIN))
+      return EAGAIN;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
@@ -129,50 +212,75 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Start reading in what a read of n bytes of f at offset off
+// will want, if f is an inode.
+void
+fileprefetch(struct file *f, uint off, int n)
+{
+  if(f->type != FD_INODE || !f->readable || n <= 0)
+    return;
+  ilock(f->ip);
+  iprefetch(f->ip, off, n);
+  iunlock(f->ip);
+}
+
+// Write n bytes at addr, a user address if user_src is set,
+// to inode file f at offset *off, advancing *off.
+static int
+inodewrite(struct file *f, int user_src, uint64 addr, int n, uint *off)
+{
+  int r;
+
+  // write as many blocks at a time as a bulk transaction
+  // allows, including i-node, indirect block, allocation
+  // blocks, and 2 blocks of slop for non-aligned writes.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int nop = log_bigop();
+  int max = ((nop-1-1-2) / 2) * BSIZE;
+  int i = 0;
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    begin_opn(nop);
+    ilock(f->ip);
+    f->ip->rsvhint = (n - i) / BSIZE + 1;
+    if ((r = writei(f->ip, user_src, addr + i, *off, n1)) > 0)
+      *off += r;
+    iunlock(f->ip);
+    end_opn(nop);
+
+    if(r < 0)
+      break;
+    if(r != n1)
+      panic("short filewrite");
+    i += r;
+  }
+  return i == n ? n : -1;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
+    if(f->nonblock && devwouldblock(f->major, POLLOUT))
+      return EAGAIN;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r < 0)
-        break;
-      if(r != n1)
-        panic("short filewrite");
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = inodewrite(f, 1, addr, n, &f->off);
   } else {
     panic("filewrite");
   }
@@ -180,3 +288,76 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Read from inode file f at offset off, leaving f->off be.
+// addr is a user virtual address.
+int
+filepread(struct file *f, uint64 addr, int n, uint off)
+{
+  int r;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  r = readi(f->ip, 1, addr, off, n);
+  iunlock(f->ip);
+  return r;
+}
+
+// Write to inode file f at offset off, leaving f->off be.
+// addr is a user virtual address.
+int
+filepwrite(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  return inodewrite(f, 1, addr, n, &off);
+}
+
+// Move up to n bytes from inode file in, at its offset, to
+// out, a pipe, device or inode file, without copying them
+// through user space. Returns how many, or -1.
+int
+filesend(struct file *out, struct file *in, int n)
+{
+  int r, m, done = 0;
+  char *mem;
+
+  if(!in->readable || !out->writable || in->type != FD_INODE)
+    return -1;
+  if(out->type != FD_PIPE && out->type != FD_DEVICE && out->type != FD_INODE)
+    return -1;
+  if(out->type == FD_DEVICE &&
+     (out->major < 0 || out->major >= NDEV || !devsw[out->major].write))
+    return -1;
+
+  while(done < n){
+    m = n - done;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    if((mem = kalloc()) == 0)
+      break;
+    ilock(in->ip);
+    if((r = readi(in->ip, 0, (uint64)mem, in->off, m)) > 0)
+      in->off += r;
+    iunlock(in->ip);
+    if(r <= 0){
+      kfree(mem);
+      break;
+    }
+
+    if(out->type == FD_PIPE){
+      // the pipe takes the page.
+      m = pipesend(out->pipe, (uint64)mem, r);
+    } else {
+      if(out->type == FD_DEVICE)
+        m = devsw[out->major].write(0, (uint64)mem, r);
+      else
+        m = inodewrite(out, 0, (uint64)mem, r, &out->off);
+      kfree(mem);
+    }
+    if(m != r)
+      return done > 0 ? done : -1;
+    done += r;
+  }
+  return done;
+}
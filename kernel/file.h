@@ -7,6 +7,7 @@ struct file {
   int ref; // reference count
   char readable;
   char writable;
+  char nonblock;     // O_NONBLOCK: pipes and devices return EAGAIN
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
 #ifdef LAB_NET
@@ -25,27 +26,42 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // hash chain; see iget()
+  struct inode *prev; // LRU list, while ref is 0
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint raoff;         // offset the last read ended at,
+  uint rawin;         // readahead window, in blocks,
+  uint raend;         // and block readahead has been asked up to
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-#ifdef SOL_FS
-#else
-  uint addrs[NDIRECT+1];
-#endif
+  uint addrs[NDIRECT+3];
+
+  uint runbn;         // blocks [runbn, runbn+runlen) are
+  uint runlen;        // at runaddr onwards; see bmap()
+  uint runaddr;
+  uint rsvnext;       // blocks reserved for the next ones
+  uint rsvend;        // allocated; see balloc()
+  uint rsvhint;       // blocks a write in progress will take
+  int pcached;        // has pages in the page cache?
 };
 
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(void);          // which of POLLIN, POLLOUT; if 0, both
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
 #define STATS   2
+#define KMSG    3
+#define PROF    4
+#define COUNTERS 5
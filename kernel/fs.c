@@ -21,10 +21,15 @@
 #include "buf.h"
 #include "file.h"
 
+static int statsfs(char*, int);
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
-// there should be one superblock per disk device, but we run with
-// only one device
+// one superblock per disk device: sb for the root disk, and
+// tmpsb for the ram disk, which tmpfsinit() makes up.
 struct superblock sb; 
+static struct superblock tmpsb;
+
+#define SB(dev) ((dev) == RAMDEV ? tmpsb : sb)
 
 // Read the super block.
 static void
@@ -37,6 +42,9 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void fsmapinit(int dev);
+static void tmpfsinit(void);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,60 +52,228 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  fsmapinit(dev);
+  tmpfsinit();
+}
+
+// Blocks.
+//
+// To find free blocks without reading the whole bitmap, the
+// kernel counts the free blocks each bitmap block maps, and
+// starts looking where the last search ended (the cursor) or,
+// better, right after the block the file has before the new
+// one (the goal).
+//
+// So that files written at the same time don't interleave, a
+// file taking a new block also reserves the free blocks after
+// it, as many as it is likely to write, for its next ones: the
+// inode's window [rsvnext, rsvend). Other files' searches pass
+// reserved blocks over unless there are no others. Windows are
+// only kept in memory, in their device's fsmap, and are given up
+// when the inode's last reference goes; they are hints, and a
+// block is only allocated once its bit in the on-disk bitmap is
+// set.
+
+#define RSVMIN 8    // blocks a window holds at least,
+#define RSVMAX 64   // and at most
+
+struct fsmap {
+  struct spinlock lock;
+  uint nbmap;                   // bitmap blocks
+  uint *nfree;                  // free blocks each one maps
+  uchar *rsv;                   // bit per block: in a window?
+  int nfreeorder, rsvorder;
+  uint cursor;
+  uint64 nalloc;
+  uint64 nnear;                 // allocations that got the goal
+};
+
+// one per device, like superblocks.
+static struct fsmap fsmaps[2];
+
+#define FSMAP(dev) (&fsmaps[(dev) == RAMDEV])
+#define RSV(m, b)  ((m)->rsv[(b)/8] & (1 << ((b)%8)))
+
+static int
+pgorder(uint bytes)
+{
+  int order = 0;
+
+  while((PGSIZE << order) < bytes)
+    order++;
+  return order;
 }
 
-// Zero a block.
 static void
-bzero(int dev, int bno)
+fsmapinit(int dev)
 {
+  struct fsmap *map = FSMAP(dev);
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  initlock(&map->lock, "fsmap");
+  map->nbmap = (SB(dev).size + BPB - 1) / BPB;
+  map->nfreeorder = pgorder(map->nbmap * sizeof(uint));
+  map->rsvorder = pgorder((SB(dev).size + 7) / 8);
+  if((map->nfree = kalloc_pages(map->nfreeorder)) == 0 ||
+     (map->rsv = kalloc_pages(map->rsvorder)) == 0)
+    panic("fsmapinit");
+  memset(map->rsv, 0, PGSIZE << map->rsvorder);
+  for(int i = 0; i < map->nbmap; i++){
+    bp = bread(dev, SB(dev).bmapstart + i);
+    map->nfree[i] = 0;
+    for(int bi = 0; bi < BPB && i*BPB + bi < SB(dev).size; bi++)
+      if((bp->data[bi/8] & (1 << (bi%8))) == 0)
+        map->nfree[i]++;
+    brelse(bp);
+  }
+}
+
+// Find a free block at or after start, wrapping around, and
+// mark it allocated. Blocks in windows are passed over unless
+// steal is set. Reserves up to *n free blocks right after it,
+// and sets *n to how many. Returns 0 if there is none.
+static uint
+bpick(uint dev, uint start, int steal, uint *n)
+{
+  struct fsmap *map = FSMAP(dev);
+  struct buf *bp;
+  uint i, bi, b, c, w;
+
+  for(uint k = 0; k <= map->nbmap; k++){
+    i = (start / BPB + k) % map->nbmap;
+    if(map->nfree[i] == 0)
+      continue;
+    bp = bread(dev, SB(dev).bmapstart + i);
+    acquire(&map->lock);
+    for(bi = (k == 0 ? start % BPB : 0); bi < BPB && i*BPB + bi < SB(dev).size; bi++){
+      if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+        bi += 7;
+        continue;
+      }
+      b = i*BPB + bi;
+      if((bp->data[bi/8] & (1 << (bi%8))) || (RSV(map, b) && !steal))
+        continue;
+      bp->data[bi/8] |= 1 << (bi%8);  // Mark block in use.
+      map->rsv[b/8] &= ~(1 << (b%8));
+      map->nfree[i]--;
+      for(w = 0; w < *n && bi+1+w < BPB && b+1+w < SB(dev).size; w++){
+        c = bi+1+w;
+        if((bp->data[c/8] & (1 << (c%8))) || RSV(map, b+1+w))
+          break;
+        map->rsv[(b+1+w)/8] |= 1 << ((b+1+w)%8);
+      }
+      *n = w;
+      map->cursor = b + 1;
+      release(&map->lock);
+      log_write(bp);
+      brelse(bp);
+      return b;
+    }
+    release(&map->lock);
+    brelse(bp);
+  }
+  return 0;
+}
+
+// mark block b, from a window, allocated. returns -1 if
+// another file's search took it first.
+static int
+btake(uint dev, uint b)
+{
+  struct fsmap *map = FSMAP(dev);
+  struct buf *bp;
+  int bi = b % BPB, m = 1 << (bi % 8);
+
+  bp = bread(dev, BBLOCK(b, SB(dev)));
+  acquire(&map->lock);
+  map->rsv[b/8] &= ~(1 << (b%8));
+  if(bp->data[bi/8] & m){
+    release(&map->lock);
+    brelse(bp);
+    return -1;
+  }
+  bp->data[bi/8] |= m;
+  map->nfree[b / BPB]--;
+  release(&map->lock);
   log_write(bp);
   brelse(bp);
+  return 0;
 }
 
-// Blocks.
+// Give up what is left of ip's window.
+static void
+bunreserve(struct inode *ip)
+{
+  struct fsmap *map = FSMAP(ip->dev);
 
-// Allocate a zeroed disk block.
+  acquire(&map->lock);
+  for(uint b = ip->rsvnext; b < ip->rsvend; b++)
+    map->rsv[b/8] &= ~(1 << (b%8));
+  ip->rsvnext = ip->rsvend = 0;
+  release(&map->lock);
+}
+
+// Allocate a zeroed disk block for ip, at goal if goal is
+// not 0 and it can. Caller must hold ip->lock.
 static uint
-balloc(uint dev)
+balloc(struct inode *ip, uint goal)
 {
-  int b, bi, m;
+  struct fsmap *map = FSMAP(ip->dev);
   struct buf *bp;
+  uint b, n, start;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(ip->rsvnext < ip->rsvend && (goal == 0 || goal == ip->rsvnext)){
+    b = ip->rsvnext++;
+    if(btake(ip->dev, b) == 0){
+      __sync_fetch_and_add(&map->nnear, 1);
+      goto found;
     }
-    brelse(bp);
   }
-  panic("balloc: out of blocks");
+
+  bunreserve(ip);
+  n = ip->rsvhint;
+  if(n < RSVMIN)
+    n = RSVMIN;
+  if(n > RSVMAX)
+    n = RSVMAX;
+  n--;
+  start = (goal == 0 || goal >= SB(ip->dev).size) ? map->cursor : goal;
+  if((b = bpick(ip->dev, start, 0, &n)) == 0){
+    n = 0;
+    if((b = bpick(ip->dev, start, 1, &n)) == 0)
+      panic("balloc: out of blocks");
+  }
+  if(b == goal)
+    __sync_fetch_and_add(&map->nnear, 1);
+  ip->rsvnext = b + 1;
+  ip->rsvend = b + 1 + n;
+
+found:
+  // no need to read what is about to be zeroed.
+  bp = bzeroed(ip->dev, b);
+  log_write(bp);
+  brelse(bp);
+  __sync_fetch_and_add(&map->nalloc, 1);
+  return b;
 }
 
 // Free a disk block.
 static void
 bfree(int dev, uint b)
 {
+  struct fsmap *map = FSMAP(dev);
   struct buf *bp;
   int bi, m;
 
-  bp = bread(dev, BBLOCK(b, sb));
+  bp = bread(dev, BBLOCK(b, SB(dev)));
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  acquire(&map->lock);
+  map->nfree[b / BPB]++;
+  release(&map->lock);
   log_write(bp);
   brelse(bp);
 }
@@ -127,18 +303,19 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and current
+//   directories). iget() finds or creates a cache entry and
+//   increments its ref; iput() decrements ref. An entry whose
+//   ref has fallen to zero stays cached, on an LRU list, until
+//   iget() needs it for another inode.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, which stays set until the entry is reused
+//   or iput() frees the inode, so that finding an entry
+//   still cached saves reading it.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,29 +339,53 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The cache is a hash table of entries allocated as needed.
+// Each bucket's lock protects its chain and the ref, dev and
+// inum of the entries on it. icache.lock serializes the misses,
+// which take another inode's entry or allocate one, and only its
+// holder may hold two bucket locks; icache.lrulock protects the
+// LRU list. Entries are reused once there are NINODE of them.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 61
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;
+};
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct spinlock lrulock;
+  struct inode lru;             // unreferenced entries; lru.next is the oldest
+  struct ibucket bucket[NIBUCKET];
+  int n;                        // entries allocated
+  uint64 hits;
+  uint64 misses;
 } icache;
 
+static struct slabcache *inodecache;
+
+static void
+inodector(void *p)
+{
+  initsleeplock(&((struct inode*)p)->lock, "inode");
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
-  initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  initticketlock(&icache.lock, "icache");
+  initlock(&icache.lrulock, "icache.lru");
+  for(int i = 0; i < NIBUCKET; i++)
+    initlock(&icache.bucket[i].lock, "icache.bucket");
+  icache.lru.prev = &icache.lru;
+  icache.lru.next = &icache.lru;
+  inodecache = slabcreate("inode", sizeof(struct inode), inodector);
+  statsregister("fs", statsfs, 0);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -199,8 +400,8 @@ ialloc(uint dev, short type)
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
+  for(inum = 1; inum < SB(dev).ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, SB(dev)));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
@@ -224,7 +425,7 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  bp = bread(ip->dev, IBLOCK(ip->inum, SB(ip->dev)));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
@@ -236,37 +437,113 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
+#define IBUCKET(inum) (&icache.bucket[(inum) % NIBUCKET])
+
+static void
+lruremove(struct inode *ip)
+{
+  acquire(&icache.lrulock);
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  release(&icache.lrulock);
+}
+
+// the entry for (dev, inum) in bk, with a reference added,
+// or 0. caller must hold bk->lock.
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruremove(ip);
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// an entry to hold another inode: a new one, or the least
+// recently used unreferenced one, taken off its chain.
+// caller must hold icache.lock and bk->lock.
+static struct inode*
+ivictim(struct ibucket *bk)
+{
+  struct inode *ip, **pp;
+  struct ibucket *vb;
+
+  for(;;){
+    acquire(&icache.lrulock);
+    ip = icache.lru.next;
+    release(&icache.lrulock);
+    if(icache.n < NINODE || ip == &icache.lru){
+      if((ip = slaballoc(inodecache)) == 0)
+        panic("iget: no inodes");
+      ip->pcached = 0;
+      icache.n++;
+      return ip;
+    }
+    // a hit may take ip back before we have its bucket.
+    vb = IBUCKET(ip->inum);
+    if(vb != bk)
+      acquire(&vb->lock);
+    if(ip->ref == 0){
+      lruremove(ip);
+      for(pp = &vb->head; *pp != ip; pp = &(*pp)->hnext)
+        ;
+      *pp = ip->hnext;
+      if(vb != bk)
+        release(&vb->lock);
+      // its program pages are cached under it.
+      pcacheinval(ip);
+      return ip;
+    }
+    if(vb != bk)
+      release(&vb->lock);
+  }
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
+  struct ibucket *bk = IBUCKET(inum);
+  struct inode *ip;
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) != 0){
+    release(&bk->lock);
+    __sync_fetch_and_add(&icache.hits, 1);
+    return ip;
   }
+  release(&bk->lock);
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
+  // Recycle an inode cache entry, looking again
+  // in case another miss on it came first.
+  acquire(&icache.lock);
+  acquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) == 0){
+    ip = ivictim(bk);
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    ip->raoff = 0;
+    ip->rawin = 0;
+    ip->raend = 0;
+    ip->runlen = 0;
+    ip->rsvnext = ip->rsvend = 0;
+    ip->rsvhint = 0;
+    ip->hnext = bk->head;
+    bk->head = ip;
+    __sync_fetch_and_add(&icache.misses, 1);
+  }
+  release(&bk->lock);
   release(&icache.lock);
 
   return ip;
@@ -277,9 +554,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk = IBUCKET(ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -297,7 +576,7 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread(ip->dev, IBLOCK(ip->inum, SB(ip->dev)));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
@@ -332,7 +611,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk = IBUCKET(ip->inum);
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,8 +622,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&bk->lock);
 
+    if(ip->type == T_DIR)
+      dcachepurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -350,11 +633,21 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&bk->lock);
   }
 
-  ip->ref--;
-  release(&icache.lock);
+  if(--ip->ref == 0){
+    bunreserve(ip);
+    // entries of freed inodes are reused first.
+    acquire(&icache.lrulock);
+    struct inode *at = ip->valid ? &icache.lru : icache.lru.next;
+    ip->next = at;
+    ip->prev = at->prev;
+    at->prev->next = ip;
+    at->prev = ip;
+    release(&icache.lrulock);
+  }
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -370,38 +663,111 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], the next NDINDIRECT in
+// the blocks listed in block ip->addrs[NDIRECT+1], and the
+// next NTINDIRECT a level further down from ip->addrs[NDIRECT+2].
+//
+// So that the blocks of big files don't each cost a walk down
+// the indirect blocks, bmap() remembers in the inode the run
+// of consecutive disk blocks that the last walk ended in, and
+// maps the blocks of file in it with no reads at all.
+
+// note the run of consecutive disk blocks that block bn of ip,
+// found at a[i] in an indirect block, starts.
+static void
+bmaprun(struct inode *ip, uint bn, uint *a, uint i)
+{
+  uint n;
+
+  for(n = 1; i + n < NINDIRECT && a[i+n] == a[i] + n; n++)
+    ;
+  ip->runbn = bn;
+  ip->runaddr = a[i];
+  ip->runlen = n;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap1 allocates one if alloc is
+// set, and otherwise returns 0.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap1(struct inode *ip, uint bn, int alloc)
 {
-  uint addr, *a;
+  uint addr, *a, fbn = bn, i, level, per;
   struct buf *bp;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0 && alloc)
+      ip->addrs[bn] = addr = balloc(ip, bn > 0 && ip->addrs[bn-1] ? ip->addrs[bn-1] + 1 : 0);
     return addr;
   }
+  if(bn - ip->runbn < ip->runlen)
+    return ip->runaddr + (bn - ip->runbn);
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+  // how many levels of indirect blocks lead to it, and how
+  // many blocks each entry of the top one leads to.
+  level = 1;
+  per = NINDIRECT;
+  while(bn >= per){
+    bn -= per;
+    if(++level > 3)
+      panic("bmap: out of range");
+    per *= NINDIRECT;
+  }
+
+  // Load indirect blocks, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    if(!alloc)
+      return 0;
+    ip->addrs[NDIRECT+level-1] = addr = balloc(ip, 0);
+  }
+  for(; level > 0; level--){
+    per /= NINDIRECT;
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+    i = bn / per;
+    bn %= per;
+    if((addr = a[i]) == 0){
+      if(!alloc){
+        brelse(bp);
+        return 0;
+      }
+      a[i] = addr = balloc(ip, i > 0 && a[i-1] ? a[i-1] + 1 : 0);
       log_write(bp);
     }
+    if(level == 1)
+      bmaprun(ip, fbn, a, i);
     brelse(bp);
-    return addr;
   }
+  return addr;
+}
+
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  return bmap1(ip, bn, 1);
+}
+
+// free the blocks that indirect block addr, with level-1
+// levels of indirect blocks below it, leads to, and addr.
+static void
+itruncind(uint dev, uint addr, int level)
+{
+  struct buf *bp;
+  uint *a;
 
-  panic("bmap: out of range");
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(int j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(level > 1)
+      itruncind(dev, a[j], level-1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -409,10 +775,9 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
+  pcacheinval(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -420,17 +785,14 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < 3; i++){
+    if(ip->addrs[NDIRECT+i]){
+      itruncind(ip->dev, ip->addrs[NDIRECT+i], i+1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+  ip->runlen = 0;
+  bunreserve(ip);
 
   ip->size = 0;
   iupdate(ip);
@@ -448,6 +810,52 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential readahead. A read of ip that starts where the
+// last one ended doubles its readahead window, up to RAMAX
+// blocks, and any other read closes it. The blocks of
+// the read after its first, and the window beyond them, go to
+// breadahead(), which reads them into the buffer cache in the
+// background while the reader waits for the first.
+// Caller must hold ip->lock.
+#define RAMIN 4
+#define RAMAX 32
+
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, nblocks;
+  uint first = off / BSIZE, last = (off + n - 1) / BSIZE;
+
+  if(off == ip->raoff)
+    ip->rawin = ip->rawin ? min(2 * ip->rawin, RAMAX) : RAMIN;
+  else {
+    ip->rawin = 0;
+    ip->raend = 0;
+  }
+  ip->raoff = off + n;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(last + 1 + ip->rawin, nblocks);
+  for(bn = first + 1 > ip->raend ? first + 1 : ip->raend; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
+// Ask for the blocks holding [off, off+n) of ip, up to its
+// end, to be read in the background, for a read that is to
+// come. Caller must hold ip->lock.
+void
+iprefetch(struct inode *ip, uint off, uint n)
+{
+  if(off >= ip->size || n == 0)
+    return;
+  if(n > ip->size - off)
+    n = ip->size - off;
+  for(uint bn = off / BSIZE; bn <= (off + n - 1) / BSIZE; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -462,6 +870,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -487,8 +897,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if((uint64)off + n > (uint64)MAXFILE*BSIZE)
     return -1;
+  // cached pages of a program would no longer match it.
+  pcacheinval(ip);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -521,6 +933,227 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory indexes; see struct dxhead in fs.h. All of these
+// are called with dp locked, and the ones that change the index
+// inside a transaction. A change writes the header and a bucket
+// or two, so that dirlink() stays within an FS op's share of the
+// log. Building an index doesn't fit in the same op as the
+// create() that grew the directory, which writes up to six
+// blocks (inode, bitmap, and new directory data blocks), so it
+// gets an op of its own; see dirindex().
+
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+static struct buf*
+dxbread(struct inode *dp, uint k)
+{
+  return bread(dp->dev, bmap(dp, DIRIDX + k));
+}
+
+// Return the locked header block of dp's index, or 0 if dp has
+// none. If stale is set, also return a header that no longer
+// matches the directory, which a kernel that doesn't know about
+// indexes has grown.
+static struct buf*
+dxhead(struct inode *dp, int stale)
+{
+  struct buf *bp;
+  struct dxhead *h;
+  uint addr;
+
+  if(dp->size <= DXMIN*BSIZE || (addr = bmap1(dp, DIRIDX, 0)) == 0)
+    return 0;
+  bp = bread(dp->dev, addr);
+  h = (struct dxhead*)bp->data;
+  if(h->magic != DXMAGIC || (h->size != dp->size && !stale)){
+    brelse(bp);
+    return 0;
+  }
+  return bp;
+}
+
+// Look name up in the index whose header is hb. Returns the
+// inum of its entry and sets *poff, or returns 0.
+static uint
+dxlookup(struct inode *dp, struct buf *hb, char *name, uint *poff)
+{
+  struct dxhead *h = (struct dxhead*)hb->data;
+  struct dxbucket *b;
+  struct buf *bp;
+  struct dirent de;
+  uint hash = dirhash(name), k;
+
+  k = h->bucket[hash & ((1 << h->depth) - 1)];
+  while(k != 0){
+    bp = dxbread(dp, k);
+    b = (struct dxbucket*)bp->data;
+    for(int i = 0; i < b->n; i++){
+      if(b->e[i].hash != hash)
+        continue;
+      if(readi(dp, 0, (uint64)&de, b->e[i].slot*sizeof(de), sizeof(de)) != sizeof(de))
+        panic("dxlookup read");
+      if(de.inum != 0 && namecmp(name, de.name) == 0){
+        *poff = b->e[i].slot*sizeof(de);
+        brelse(bp);
+        return de.inum;
+      }
+    }
+    k = b->next;
+    brelse(bp);
+  }
+  return 0;
+}
+
+// Add an entry for dirent slot with name hash to the index,
+// splitting its bucket if it is full. Returns 0, or -1 if the
+// index would need more than maxblock blocks.
+static int
+dxinsert(struct inode *dp, struct buf *hb, uint hash, uint slot, uint maxblock)
+{
+  struct dxhead *h = (struct dxhead*)hb->data;
+  struct dxbucket *b, *nb;
+  struct buf *bp, *nbp;
+  uint k, nk, bit;
+
+  for(;;){
+    k = h->bucket[hash & ((1 << h->depth) - 1)];
+    bp = dxbread(dp, k);
+    b = (struct dxbucket*)bp->data;
+    if(b->n < DXNENT){
+      b->e[b->n].hash = hash;
+      b->e[b->n].slot = slot;
+      b->n++;
+      log_write(bp);
+      brelse(bp);
+      return 0;
+    }
+    if(h->nblock >= maxblock){
+      brelse(bp);
+      return -1;
+    }
+
+    nk = h->nblock++;
+    nbp = dxbread(dp, nk);
+    nb = (struct dxbucket*)nbp->data;
+    memset(nb, 0, sizeof(*nb));
+    if(b->depth == DXMAXDEPTH){
+      // can't split: chain a new block in front.
+      nb->depth = b->depth;
+      nb->next = k;
+      for(int i = 0; i < (1 << h->depth); i++)
+        if(h->bucket[i] == k)
+          h->bucket[i] = nk;
+    } else {
+      if(b->depth == h->depth){
+        for(int i = 0; i < (1 << h->depth); i++)
+          h->bucket[i + (1 << h->depth)] = h->bucket[i];
+        h->depth++;
+      }
+      // move the entries with the next bit of hash set.
+      bit = 1 << b->depth;
+      b->depth++;
+      nb->depth = b->depth;
+      for(int i = 0; i < b->n; ){
+        if(b->e[i].hash & bit){
+          nb->e[nb->n++] = b->e[i];
+          b->e[i] = b->e[--b->n];
+        } else
+          i++;
+      }
+      for(int i = 0; i < (1 << h->depth); i++)
+        if(h->bucket[i] == k && (i & bit))
+          h->bucket[i] = nk;
+      log_write(bp);
+    }
+    log_write(nbp);
+    brelse(nbp);
+    brelse(bp);
+  }
+}
+
+// Remove the entry for dirent slot with name hash.
+static void
+dxremove(struct inode *dp, struct buf *hb, uint hash, uint slot)
+{
+  struct dxhead *h = (struct dxhead*)hb->data;
+  struct dxbucket *b;
+  struct buf *bp;
+  uint k;
+
+  k = h->bucket[hash & ((1 << h->depth) - 1)];
+  while(k != 0){
+    bp = dxbread(dp, k);
+    b = (struct dxbucket*)bp->data;
+    for(int i = 0; i < b->n; i++){
+      if(b->e[i].hash == hash && b->e[i].slot == slot){
+        b->e[i] = b->e[--b->n];
+        log_write(bp);
+        brelse(bp);
+        return;
+      }
+    }
+    k = b->next;
+    brelse(bp);
+  }
+  panic("dxremove");
+}
+
+// Index dp, which has grown past DXMIN blocks. The op writes
+// the doubly-indirect block and the indirect block under it, at
+// most DXBUILDMAX index blocks, up to two bitmap blocks, and dp's
+// inode: MAXOPBLOCKS. Names that would split buckets more than
+// that allows leave dp without an index.
+#define DXBUILDMAX 5
+
+static void
+dxbuild(struct inode *dp)
+{
+  struct buf *hb, *bp;
+  struct dxhead *h;
+  struct dxbucket *b;
+  struct dirent de;
+  uint off;
+
+  hb = dxbread(dp, 0);
+  h = (struct dxhead*)hb->data;
+  memset(h, 0, sizeof(*h));
+  h->magic = DXMAGIC;
+  h->depth = 1;
+  h->nblock = 3;
+  for(int k = 1; k < 3; k++){
+    h->bucket[k-1] = k;
+    bp = dxbread(dp, k);
+    b = (struct dxbucket*)bp->data;
+    memset(b, 0, sizeof(*b));
+    b->depth = 1;
+    log_write(bp);
+    brelse(bp);
+  }
+  for(off = 0; off < dp->size; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dxbuild read");
+    if(de.inum != 0){
+      if(dxinsert(dp, hb, dirhash(de.name), off / sizeof(de), DXBUILDMAX) < 0){
+        h->magic = 0;
+        break;
+      }
+    } else if(h->nfree < DXNFREE)
+      h->free[h->nfree++] = off / sizeof(de);
+  }
+  h->size = dp->size;
+  log_write(hb);
+  brelse(hb);
+  iupdate(dp);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -528,10 +1161,21 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct buf *hb;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if((hb = dxhead(dp, 0)) != 0){
+    inum = dxlookup(dp, hb, name, &off);
+    brelse(hb);
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -556,6 +1200,8 @@ dirlink(struct inode *dp, char *name, uint inum)
   int off;
   struct dirent de;
   struct inode *ip;
+  struct buf *hb;
+  struct dxhead *h;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -563,22 +1209,201 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if((hb = dxhead(dp, 1)) != 0){
+    h = (struct dxhead*)hb->data;
+    if(h->size != dp->size){
+      // changed behind the index's back.
+      h->magic = 0;
+      log_write(hb);
+      brelse(hb);
+      hb = 0;
+    }
+  }
+
+  if(hb){
+    // take a free slot the index knows of, or append.
+    off = dp->size;
+    while(h->nfree > 0){
+      uint o = h->free[--h->nfree] * sizeof(de);
+      if(readi(dp, 0, (uint64)&de, o, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0){
+        off = o;
+        break;
+      }
+    }
+    if(off + sizeof(de) > DIRIDX*BSIZE){
+      brelse(hb);
+      return -1;
+    }
+  } else {
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
   }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcacheenter(dp, name, inum);
+
+  if(hb){
+    h->size = dp->size;
+    if(dxinsert(dp, hb, dirhash(name), off / sizeof(de), 0xffff) < 0)
+      h->magic = 0;
+    log_write(hb);
+    brelse(hb);
+    iupdate(dp);
+  } else if(off == DXMIN*BSIZE && myproc()->dxdir == 0)
+    myproc()->dxdir = idup(dp);
 
   return 0;
 }
 
+// Build the index of the directory that dirlink() grew past
+// DXMIN blocks during this system call, in an FS op of its own.
+// Called by syscall() once the call is done.
+void
+dirindex(void)
+{
+  struct proc *p = myproc();
+  struct inode *dp = p->dxdir;
+  struct buf *hb;
+
+  p->dxdir = 0;
+  begin_op();
+  ilock(dp);
+  if((hb = dxhead(dp, 1)) != 0)
+    brelse(hb);
+  else if(dp->type == T_DIR && dp->nlink > 0 && dp->size > DXMIN*BSIZE)
+    dxbuild(dp);
+  iunlockput(dp);
+  end_op();
+}
+
+// Remove the directory entry at offset off of dp.
+void
+dirunlink(struct inode *dp, uint off)
+{
+  struct dirent de;
+  struct buf *hb;
+  struct dxhead *h;
+
+  if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirunlink read");
+  if((hb = dxhead(dp, 0)) != 0){
+    h = (struct dxhead*)hb->data;
+    dxremove(dp, hb, dirhash(de.name), off / sizeof(de));
+    if(h->nfree < DXNFREE)
+      h->free[h->nfree++] = off / sizeof(de);
+    log_write(hb);
+    brelse(hb);
+  }
+  dcacheenter(dp, de.name, 0);
+  memset(&de, 0, sizeof(de));
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirunlink");
+}
+
+// Mounts
+//
+// The ram disk holds a file system of its own, tmpfs, mounted on
+// /tmp: namex() goes on to its root in place of the directory
+// there, and back up from its root's "..". Its blocks skip the
+// log (see log_write()), since they don't survive a crash anyway.
+
+// the directory the ram disk is mounted on, or 0. Holding a
+// reference keeps it in the inode cache, so that namex() can
+// tell it by its address.
+static struct inode *tmpmnt;
+
+// Format the ram disk as an empty file system, and mount it
+// on /tmp if the root file system has a directory there.
+static void
+tmpfsinit(void)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  struct dirent *de;
+  uint nbitmap = RAMFSSIZE/BPB + 1;
+  uint root;
+  struct inode *ip;
+
+  // no log, and no swap area.
+  tmpsb.magic = FSMAGIC;
+  tmpsb.size = RAMFSSIZE;
+  tmpsb.ninodes = RAMNINODES;
+  tmpsb.inodestart = 2;
+  tmpsb.bmapstart = 2 + RAMNINODES/IPB + 1;
+  root = tmpsb.bmapstart + nbitmap;
+  tmpsb.nblocks = RAMFSSIZE - root;
+
+  bp = bzeroed(RAMDEV, 1);
+  memmove(bp->data, &tmpsb, sizeof(tmpsb));
+  bwrite(bp);
+  brelse(bp);
+
+  // the blocks up to the root directory's are in use.
+  for(uint i = 0; i < nbitmap; i++){
+    bp = bzeroed(RAMDEV, tmpsb.bmapstart + i);
+    for(uint b = i*BPB; b <= root && b < (i+1)*BPB; b++)
+      bp->data[(b%BPB)/8] |= 1 << (b%8);
+    bwrite(bp);
+    brelse(bp);
+  }
+
+  bp = bzeroed(RAMDEV, IBLOCK(ROOTINO, tmpsb));
+  dip = (struct dinode*)bp->data + ROOTINO%IPB;
+  dip->type = T_DIR;
+  dip->nlink = 1;
+  dip->size = 2 * sizeof(struct dirent);
+  dip->addrs[0] = root;
+  bwrite(bp);
+  brelse(bp);
+
+  bp = bzeroed(RAMDEV, root);
+  de = (struct dirent*)bp->data;
+  de[0].inum = de[1].inum = ROOTINO;
+  safestrcpy(de[0].name, ".", DIRSIZ);
+  safestrcpy(de[1].name, "..", DIRSIZ);
+  bwrite(bp);
+  brelse(bp);
+
+  fsmapinit(RAMDEV);
+
+  begin_op();
+  if((ip = namei("/tmp")) != 0){
+    ilock(ip);
+    if(ip->type == T_DIR)
+      tmpmnt = idup(ip);
+    iunlockput(ip);
+  }
+  end_op();
+}
+
+// Is ip a directory something is mounted on?
+int
+ismount(struct inode *ip)
+{
+  return ip == tmpmnt && ip != 0;
+}
+
+// The inode namex() goes on with after finding ip: the root
+// of the ram disk in place of the directory it's mounted on.
+static struct inode*
+mountcross(struct inode *ip)
+{
+  if(!ismount(ip))
+    return ip;
+  iput(ip);
+  return iget(RAMDEV, ROOTINO);
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -626,6 +1451,7 @@ static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  uint inum, seq;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
@@ -633,6 +1459,25 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if(tmpmnt && ip->dev == RAMDEV && ip->inum == ROOTINO &&
+       namecmp(name, "..") == 0){
+      // up from the ram disk's root: .. of its mount point.
+      iput(ip);
+      ip = idup(tmpmnt);
+    }
+    if(!(nameiparent && *path == '\0') && dcachelookup(ip, name, &inum, &seq)){
+      // ip is a directory, or the cache wouldn't know it.
+      next = inum ? iget(ip->dev, inum) : 0;
+      if(dcachestill(ip, name, seq)){
+        iput(ip);
+        if(next == 0)
+          return 0;
+        ip = mountcross(next);
+        continue;
+      }
+      if(next)
+        iput(next);
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -643,12 +1488,14 @@ namex(char *path, int nameiparent, char *name)
       iunlock(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
+    next = dirlookup(ip, name, 0);
+    dcacheenter(ip, name, next ? next->inum : 0);
+    if(next == 0){
       iunlockput(ip);
       return 0;
     }
     iunlockput(ip);
-    ip = next;
+    ip = mountcross(next);
   }
   if(nameiparent){
     iput(ip);
@@ -669,3 +1516,21 @@ nameiparent(char *path, char *name)
 {
   return namex(path, 1, name);
 }
+
+static int
+statsfs(char *buf, int sz)
+{
+  struct fsmap *map = FSMAP(ROOTDEV);
+  int unused = 0, nfree = 0;
+
+  acquire(&icache.lrulock);
+  for(struct inode *ip = icache.lru.next; ip != &icache.lru; ip = ip->next)
+    unused++;
+  release(&icache.lrulock);
+  for(int i = 0; i < map->nbmap; i++)
+    nfree += map->nfree[i];
+  return snprintf(buf, sz, "icache: inodes %d unreferenced %d hits %d misses %d\n"
+                  "balloc: free %d allocs %d at goal %d\n",
+                  icache.n, unused, (int)icache.hits, (int)icache.misses,
+                  nfree, (int)map->nalloc, (int)map->nnear);
+}
@@ -7,7 +7,7 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                            free bit map | data blocks | swap area ]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -20,13 +20,22 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of first swap block
+  uint nswap;        // Number of swap blocks
+  uint nopblocks;    // Max # of blocks an FS op writes; see begin_op()
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// most log blocks, header included, that the log header,
+// with its count and checksum, can describe.
+#define MAXNLOG (BSIZE / sizeof(uint) - 1)
+
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +44,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+3];   // Data block addresses; see bmap()
 };
 
 // Inodes per block.
@@ -58,3 +67,39 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory that grows past DXMIN blocks gets a hash index,
+// kept in the blocks of the directory file from DIRIDX on, past
+// its size, so that code that only knows the linear format still
+// sees the same dirents. Block DIRIDX holds a struct dxhead,
+// whose bucket[] maps the low depth bits of an entry's name hash
+// to the index block of its bucket (extendible hashing); each
+// bucket is a chain of struct dxbuckets, and only ones already
+// split DXMAXDEPTH ways get more than one.
+#define DIRIDX     (NDIRECT + NINDIRECT + NDINDIRECT/2)
+#define DXMIN      2
+#define DXMAGIC    0x78646972
+#define DXMAXDEPTH 8
+#define DXNFREE    64
+#define DXNENT     ((BSIZE - 8) / 8)
+
+struct dxhead {
+  uint magic;                  // DXMAGIC, or 0 if dropped
+  uint size;                   // directory size it indexes
+  ushort depth;                // bits of hash bucket[] is indexed by
+  ushort nblock;               // index blocks in use, this one included
+  ushort nfree;
+  ushort pad;
+  uint free[DXNFREE];          // some free dirent slots
+  ushort bucket[1<<DXMAXDEPTH];
+};
+
+struct dxbucket {
+  ushort n;                    // entries in use
+  ushort depth;                // bits of hash its entries share
+  uint next;                   // next index block of the chain, or 0
+  struct {
+    uint hash;
+    uint slot;                 // dirent number in the directory
+  } e[DXNENT];
+};
+
@@ -0,0 +1,85 @@
+//
+// Futexes, for user-space locks that enter the kernel only
+// when contended. futex(addr, FUTEX_WAIT, val) sleeps if the
+// int at addr still holds val, and futex(addr, FUTEX_WAKE, n)
+// wakes up to n of the processes sleeping on addr.
+//
+// Sleepers are keyed by the physical address of the int, so
+// that threads, and processes sharing memory, agree on it. The
+// compare and the sleep are done holding a lock hashed from
+// that address, which FUTEX_WAKE also takes, so a wakeup after
+// the int has changed can't be missed.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
+#include "defs.h"
+
+#define NFUTEXLOCK 31
+
+struct spinlock futexlocks[NFUTEXLOCK];
+
+#define FUTEXLOCK(pa) (&futexlocks[((pa) / sizeof(int)) % NFUTEXLOCK])
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEXLOCK; i++)
+    initlock(&futexlocks[i], "futex");
+}
+
+// the physical address of the user int at addr in the current
+// process, faulting its page in writable, or 0.
+static uint64
+futexaddr(uint64 addr)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+  pte_t *pte;
+
+  if(addr % sizeof(int) != 0 || addr >= PLIC)
+    return 0;
+  pte = walk(p->pagetable, addr, 0);
+  if((pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0) &&
+     uvmfault(addr, PTE_W) < 0)
+    return 0;
+  if((pa = walkaddr(p->pagetable, addr)) == 0)
+    return 0;
+  return pa + addr % PGSIZE;
+}
+
+// Returns 0 after a FUTEX_WAIT that slept, the number woken for
+// FUTEX_WAKE, or -1.
+int
+futex(uint64 addr, int op, int val)
+{
+  struct spinlock *lk;
+  uint64 pa;
+  int r = 0;
+
+  if((pa = futexaddr(addr)) == 0)
+    return -1;
+  lk = FUTEXLOCK(pa);
+
+  acquire(lk);
+  switch(op){
+  case FUTEX_WAIT:
+    if(*(int*)pa != val || myproc()->killed)
+      r = -1;
+    else
+      sleep((void*)pa, lk);
+    break;
+  case FUTEX_WAKE:
+    r = wakeupn((void*)pa, val);
+    break;
+  default:
+    r = -1;
+  }
+  release(lk);
+  return r;
+}
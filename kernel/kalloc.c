@@ -1,6 +1,13 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates blocks of 2^order
+// contiguous 4096-byte pages from a buddy allocator,
+// with per-hart caches of single pages in front of it.
+// Idle harts keep a pool of zeroed pages for kzalloc().
+//
+// Pages are filled with junk when allocated and freed,
+// to catch dangling references, only if the kernel is
+// built with KDEBUG defined (make KDEBUG=1).
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +16,8 @@
 #include "riscv.h"
 #include "defs.h"
 
+static int statskalloc(char*, int);
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -16,52 +25,351 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;     // only on the buddy free lists
 };
 
+// page number relative to KERNBASE, for the per-page
+// arrays below.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define REF2PA(i)  (KERNBASE + (uint64)(i) * PGSIZE)
+#define NPAGE      PA2REF(PHYSTOP)
+
+// the buddy allocator. a free block of 2^order pages starts
+// at a page number that is a multiple of 2^order, and is on
+// free[order]; state[] of its first page is BFREE|order.
+// freeing a block merges it with its buddy, the block it
+// would have been split from, whenever that is free too.
+#define BFREE 0x80
+
 struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1];  // circular lists, with sentinels
+  int nfree[MAXORDER+1];        // blocks on each list
+  uchar state[NPAGE];
+} buddy;
+
+// each hart has its own free list of single pages, so that
+// harts don't contend for one lock. a hart whose list is empty
+// refills it with a batch from the buddy allocator, or steals
+// a batch from another hart; one whose list grows long gives
+// a batch back to the buddy allocator.
+#define KSTEAL 64
+
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;            // pages on freelist
+  uint64 nalloc;        // kalloc()s served from this list
+  uint64 nkfree;        // pages freed to this list
+  uint64 nsteal;        // pages stolen by this hart
+  uint64 contended;     // times lock was found held
+} kmem[NCPU];
+
+// reference counts for physical pages, so that copy-on-write
+// fork can share a page among several page tables. indexed
+// by page number relative to KERNBASE.
+struct {
+  struct spinlock lock;
+  int count[NPAGE];
+} kref;
+
+// pages zeroed by idle harts, each with one reference.
+#define NZERO 256
+
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+  uint64 hit;           // kzalloc()s served from the pool
+  uint64 miss;          // kzalloc()s that had to zero a page
+} kzero;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initticketlock(&kmem[i].lock, "kmem");
+  initticketlock(&buddy.lock, "buddy");
+  for(int o = 0; o <= MAXORDER; o++)
+    buddy.free[o].next = buddy.free[o].prev = &buddy.free[o];
+  initlock(&kref.lock, "kref");
+  initlock(&kzero.lock, "kzero");
   freerange(end, (void*)PHYSTOP);
+  statsregister("kalloc", statskalloc, 0);
+  statscounter("kalloc", "alloc", &kmem[0].nalloc, sizeof(kmem[0]));
+  statscounter("kalloc", "kfree", &kmem[0].nkfree, sizeof(kmem[0]));
+  statscounter("kalloc", "steal", &kmem[0].nsteal, sizeof(kmem[0]));
+  statscounter("kalloc", "contended", &kmem[0].contended, sizeof(kmem[0]));
+}
+
+static void
+kmemlock(struct kmem *km)
+{
+  if(km->lock.locked)
+    __sync_fetch_and_add(&km->contended, 1);
+  acquire(&km->lock);
+}
+
+static void
+bpush(struct run *r, int order)
+{
+  struct run *h = &buddy.free[order];
+
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  buddy.nfree[order]++;
+  buddy.state[PA2REF(r)] = BFREE | order;
+}
+
+static void
+bremove(struct run *r, int order)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  buddy.nfree[order]--;
+  buddy.state[PA2REF(r)] = 0;
+}
+
+// take a block of 2^order pages, splitting a bigger one if
+// need be. caller must hold buddy.lock.
+static struct run*
+balloc(int order)
+{
+  struct run *r;
+  int o;
+
+  for(o = order; o <= MAXORDER; o++)
+    if(buddy.nfree[o] > 0)
+      break;
+  if(o > MAXORDER)
+    return 0;
+  r = buddy.free[o].next;
+  bremove(r, o);
+  // give back the upper halves.
+  while(o > order){
+    o--;
+    bpush((struct run*)((char*)r + (PGSIZE << o)), o);
+  }
+  return r;
 }
 
+// return a block of 2^order pages, merging it with its
+// buddies. caller must hold buddy.lock.
+static void
+bfree(void *pa, int order)
+{
+  uint64 i = PA2REF(pa), b;
+
+  while(order < MAXORDER){
+    b = i ^ (1L << order);
+    if(b + (1L << order) > NPAGE || buddy.state[b] != (BFREE | order))
+      break;
+    bremove((struct run*)REF2PA(b), order);
+    if(b < i)
+      i = b;
+    order++;
+  }
+  bpush((struct run*)REF2PA(i), order);
+}
+
+// Hand the pages of [pa_start, pa_end) to the buddy allocator,
+// as the biggest aligned blocks that fit, so that the work is
+// per block, not per page; balloc() splits them when it must.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 i = PA2REF(PGROUNDUP((uint64)pa_start));
+  uint64 e = PA2REF(PGROUNDDOWN((uint64)pa_end));
+  int o;
+
+  acquire(&buddy.lock);
+  while(i < e){
+    for(o = MAXORDER; o > 0; o--)
+      if((i & ((1L << o) - 1)) == 0 && i + (1L << o) <= e)
+        break;
+#ifdef KDEBUG
+    memset((void*)REF2PA(i), 1, PGSIZE << o);
+#endif
+    bfree((void*)REF2PA(i), o);
+    i += 1L << o;
+  }
+  release(&buddy.lock);
+}
+
+// Add a reference to the page of physical memory pointed
+// at by pa, which must have been returned by kalloc().
+// Each reference is dropped by a call to kfree().
+void
+krefpage(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefpage");
+
+  acquire(&kref.lock);
+  if(kref.count[PA2REF(pa)] < 1)
+    panic("krefpage: free page");
+  kref.count[PA2REF(pa)]++;
+  release(&kref.lock);
+}
+
+// Return the number of references to the page at pa.
+int
+krefcount(void *pa)
+{
+  int n;
+
+  acquire(&kref.lock);
+  n = kref.count[PA2REF(pa)];
+  release(&kref.lock);
+  return n;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed at
+// by pa, and free it once the last reference is gone. The page
+// should have been returned by a call to kalloc().
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *batch = 0;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP) {
     printf("%p %p %p\n", pa, end, PHYSTOP);
     panic("kfree");
   }
 
+  acquire(&kref.lock);
+  if(kref.count[PA2REF(pa)] < 1)
+    panic("kfree: free page");
+  n = --kref.count[PA2REF(pa)];
+  release(&kref.lock);
+  if(n > 0)
+    return;
+
+#ifdef KDEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  struct kmem *km = &kmem[cpuid()];
+  kmemlock(km);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  km->nkfree++;
+  if(km->nfree > 2*KSTEAL){
+    // give a batch back, so that it can merge into bigger blocks.
+    for(n = 0; n < KSTEAL; n++){
+      r = km->freelist;
+      km->freelist = r->next;
+      r->next = batch;
+      batch = r;
+    }
+    km->nfree -= KSTEAL;
+  }
+  release(&km->lock);
+  pop_off();
+
+  if(batch){
+    acquire(&buddy.lock);
+    for(; batch; batch = r){
+      r = batch->next;
+      bfree(batch, 0);
+    }
+    release(&buddy.lock);
+  }
+}
+
+// Refill km, this hart's empty list, with up to KSTEAL pages
+// from the buddy allocator or, failing that, another hart's
+// list. Interrupts must be off.
+static void
+krefill(struct kmem *km)
+{
+  struct run *head = 0, *tail = 0, *r;
+  int n;
+
+  acquire(&buddy.lock);
+  for(n = 0; n < KSTEAL && (r = balloc(0)) != 0; n++){
+    r->next = head;
+    head = r;
+    if(tail == 0)
+      tail = r;
+  }
+  release(&buddy.lock);
+
+  // start with the next hart's list, to spread the theft.
+  for(int i = 1; n == 0 && i < NCPU; i++){
+    struct kmem *v = &kmem[(km - kmem + i) % NCPU];
+    if(v->nfree == 0)
+      continue;
+    kmemlock(v);
+    head = r = v->freelist;
+    tail = 0;
+    for(n = 0; r && n < KSTEAL; n++){
+      tail = r;
+      r = r->next;
+    }
+    v->freelist = r;
+    v->nfree -= n;
+    release(&v->lock);
+    km->nsteal += n;
+  }
+  if(n == 0)
+    return;
+
+  kmemlock(km);
+  tail->next = km->freelist;
+  km->freelist = head;
+  km->nfree += n;
+  release(&km->lock);
+}
+
+// take a page, asking the buffer cache for memory when there
+// is none if reclaim is set.
+static void *
+kalloc1(int reclaim)
+{
+  struct run *r;
+
+  push_off();
+  struct kmem *km = &kmem[cpuid()];
+  if(km->freelist == 0)
+    krefill(km);
+  kmemlock(km);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+    km->nalloc++;
+  }
+  release(&km->lock);
+  pop_off();
+
+  if(r == 0){
+    // out of memory; fall back on the zeroed pool, whose
+    // pages already have their reference.
+    acquire(&kzero.lock);
+    if((r = kzero.list) != 0){
+      kzero.list = r->next;
+      kzero.n--;
+    }
+    release(&kzero.lock);
+    // and then on the buffer cache, which can give pages back.
+    if(r == 0 && reclaim && bshrink(KSTEAL) > 0)
+      return kalloc1(reclaim);
+  } else
+    kref.count[PA2REF(r)] = 1;
+#ifdef KDEBUG
+  if(r)
+    memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,16 +377,171 @@ kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  return kalloc1(1);
+}
+
+// Allocate one zeroed page of physical memory, from the pool
+// kept by idle harts if it has one. Returns 0 if the memory
+// cannot be allocated.
+void *
+kzalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  acquire(&kzero.lock);
+  if((r = kzero.list) != 0){
+    kzero.list = r->next;
+    kzero.n--;
+    kzero.hit++;
+  } else
+    kzero.miss++;
+  release(&kzero.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    r->next = 0;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
 }
+
+// Zero one page for the kzalloc() pool, if it is not full.
+// Called by the scheduler when there is nothing to run.
+// Returns 1 if it zeroed a page, 0 if there was nothing to do.
+int
+kzerofill(void)
+{
+  struct run *r;
+
+  if(kzero.n >= NZERO)
+    return 0;
+  // not at the expense of cached blocks.
+  if((r = kalloc1(0)) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kzero.lock);
+  if(kzero.n >= NZERO){
+    release(&kzero.lock);
+    kfree((void*)r);
+    return 0;
+  }
+  r->next = kzero.list;
+  kzero.list = r;
+  kzero.n++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if there is no free block that big.
+// Such a block can't be shared with krefpage(), and must be
+// freed with kfree_pages() and the same order.
+void *
+kalloc_pages(int order)
+{
+  struct run *r;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  acquire(&buddy.lock);
+  r = balloc(order);
+  release(&buddy.lock);
+
+  if(r){
+    kref.count[PA2REF(r)] = 1;
+#ifdef KDEBUG
+    memset((char*)r, 5, PGSIZE << order); // fill with junk
+#endif
+  }
+  return (void*)r;
+}
+
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < end ||
+     (uint64)pa + (PGSIZE << order) > PHYSTOP || order > MAXORDER)
+    panic("kfree_pages");
+  if(kref.count[PA2REF(pa)] != 1)
+    panic("kfree_pages: not allocated");
+  kref.count[PA2REF(pa)] = 0;
+
+#ifdef KDEBUG
+  memset(pa, 1, PGSIZE << order);
+#endif
+  acquire(&buddy.lock);
+  bfree(pa, order);
+  release(&buddy.lock);
+}
+
+// Roughly how many pages are free, without taking any locks.
+int
+kfreepages(void)
+{
+  int n = kzero.n;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  for(int o = 0; o <= MAXORDER; o++)
+    n += buddy.nfree[o] << o;
+  return n;
+}
+
+// Turn a block from kalloc_pages() into 2^order single pages,
+// each with one reference, as if each came from kalloc().
+void
+ksplitpages(void *pa, int order)
+{
+  uint64 i = PA2REF(pa);
+
+  if(kref.count[i] != 1)
+    panic("ksplitpages");
+  for(uint64 j = 1; j < (1L << order); j++)
+    kref.count[i + j] = 1;
+}
+
+static int
+statskalloc(char *buf, int sz)
+{
+  int n = 0, o, free = 0, largest = -1, cached = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    struct kmem *km = &kmem[i];
+    n += snprintf(buf+n, sz-n, "kmem %d: free %d alloc %d kfree %d steal %d contended %d\n",
+                  i, km->nfree, (int)km->nalloc, (int)km->nkfree, (int)km->nsteal,
+                  (int)km->contended);
+    cached += km->nfree;
+  }
+
+  // how much of the free memory is in blocks of at
+  // least a megapage, which is what big allocations need.
+  acquire(&buddy.lock);
+  n += snprintf(buf+n, sz-n, "buddy free blocks:");
+  for(o = 0; o <= MAXORDER; o++){
+    n += snprintf(buf+n, sz-n, " %d", buddy.nfree[o]);
+    free += buddy.nfree[o] << o;
+    if(buddy.nfree[o])
+      largest = o;
+  }
+  int mega = 0;
+  for(o = MEGAORDER; o <= MAXORDER; o++)
+    mega += buddy.nfree[o] << o;
+  release(&buddy.lock);
+  n += snprintf(buf+n, sz-n, "\nbuddy free pages %d largest order %d megapage free %d%%\n",
+                free, largest, free ? mega * 100 / free : 0);
+  n += snprintf(buf+n, sz-n, "kzero: pool %d hit %d miss %d\n",
+                kzero.n, (int)kzero.hit, (int)kzero.miss);
+  n += snprintf(buf+n, sz-n, "free pages %d of %d at tick %d\n",
+                free + cached + kzero.n, (int)PA2REF(PHYSTOP) - (int)PA2REF(PGROUNDUP((uint64)end)),
+                ticks);
+  return n;
+}
@@ -3,207 +3,410 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
+static int statslog(char*, int);
+static void logreset(void);
+
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. klogd, a kernel process, commits the open transaction
+// once none of its FS system calls is active, and while it
+// writes one transaction to disk, the next one collects the
+// updates of the calls that come along meanwhile, however many.
+// Thus there is never any reasoning required about whether a
+// commit might write an uncommitted system call's updates to
+// disk, and the busier the file system is, the more calls each
+// commit covers.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until klogd has taken the transaction. end_op()
+// doesn't wait for the commit; log_sync() does, for fsync().
+//
+// klogd commits from copies of the blocks, taken while no FS
+// system call is active, so that the next transaction can
+// change the cached blocks while they are being written to the
+// log and installed. The cached blocks stay pinned until they
+// are installed.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
+//   and a checksum of them and of their contents
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The header and the blocks of a commit go to the disk all in
+// flight at once; they are consecutive, so they go as a few big
+// requests. The commit point is when they are all on disk: a
+// header that got there without all of its blocks fails its
+// checksum, and recovery ignores it. Recovery reads the log and
+// installs it in bulk too, with one flush of the disk's write
+// cache before it clears the log.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint sum;        // see logsum()
+  int block[MAXNLOG-1];
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // data blocks in the log, size-1.
+  int opblocks;    // blocks begin_op() reserves.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they may write, all told.
+  int closing;     // klogd is taking the transaction, please wait.
   int dev;
+  uint seq;        // number of the open transaction.
+  uint done;       // transactions up to this one are on disk.
   struct logheader lh;
+
+  // the transaction klogd is committing: its cached
+  // blocks, and bufs for I/O on copies of them.
+  struct logheader clh;
+  struct buf *cbuf[MAXNLOG-1];
+  struct buf buf[MAXNLOG-1];  // data from pages of kalloc()
+  struct buf *iov[MAXNLOG];
+  struct buf hbuf;  // for the header block
+  uchar hdata[BSIZE];
+
+  uint64 ncommit;
+  uint64 nblock;   // blocks committed
+  uint64 nop;      // FS system calls committed
+  int ops;         // FS system calls in the open transaction
+
+  // histogram by log2, as in proc.c, of commit times in time
+  // CSR cycles, from taking the transaction until its blocks
+  // are installed.
+  uint64 chist[NHIST];
+
+  int nrecover;    // blocks recover_from_log() installed,
+  int torn;        // or 1 if it found a torn commit instead,
+  uint64 rcycles;  // and time CSR cycles it took
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void klogd(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  uchar *page = 0;
+
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  if (log.size < 2 || log.size > MAXNLOG)
+    panic("initlog: log size");
+  log.cap = log.size - 1;
+  log.opblocks = sb->nopblocks ? sb->nopblocks : MAXOPBLOCKS;
+  if (log.opblocks > log.cap)
+    panic("initlog: op blocks");
   log.dev = dev;
+  log.seq = 1;
+  log.hbuf.data = log.hdata;
+  for (int i = 0; i < log.cap; i++) {
+    if (i % (PGSIZE/BSIZE) == 0 && (page = kalloc()) == 0)
+      panic("initlog: kalloc");
+    log.buf[i].data = page + (i % (PGSIZE/BSIZE)) * BSIZE;
+  }
+  // the cache must hold the blocks of the open transaction
+  // and of the one klogd is committing, and then some.
+  breserve(2*log.cap + log.opblocks);
   recover_from_log();
+  kproc("klogd", klogd);
+  statsregister("log", statslog, logreset);
+  statscounter("log", "commits", &log.ncommit, 0);
+  statscounter("log", "blocks", &log.nblock, 0);
+  statscounter("log", "calls", &log.nop, 0);
+}
+
+// Write or read blocks [0, n) of the log copies, to or from
+// their home locations if home is set, or else to or from
+// the log.
+static void
+log_io(int n, int home, int write)
+{
+  for (int i = 0; i < n; i++) {
+    log.buf[i].dev = log.dev;
+    log.buf[i].blockno = home ? log.clh.block[i] : log.start+i+1;
+    log.iov[i] = &log.buf[i];
+  }
+  virtio_disk_rwv(log.iov, n, write);
 }
 
 // Copy committed blocks from log to their home location
 static void
 install_trans(void)
 {
-  int tail;
+  log_io(log.clh.n, 1, 1);
+}
+
+// FNV-1a, a word at a time, of the first n blocks of log.clh:
+// their numbers, and their contents in the log copies.
+static uint
+logsum(int n)
+{
+  uint h = 2166136261;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  h = (h ^ n) * 16777619;
+  for (int i = 0; i < n; i++) {
+    uint *w = (uint*)log.buf[i].data;
+    h = (h ^ log.clh.block[i]) * 16777619;
+    for (int j = 0; j < BSIZE/sizeof(uint); j++)
+      h = (h ^ w[j]) * 16777619;
   }
+  return h;
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into log.clh
 static void
 read_head(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct logheader *lh = (struct logheader *) (log.hdata);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+
+  log.hbuf.dev = log.dev;
+  log.hbuf.blockno = log.start;
+  virtio_disk_rw(&log.hbuf, 0);
+  log.clh.n = lh->n;
+  log.clh.sum = lh->sum;
+  // not a header anything wrote; nothing to recover.
+  if (log.clh.n < 0 || log.clh.n > log.cap)
+    log.clh.n = 0;
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Copy log.clh, with the checksum of the log copies, into the
+// header block.
 static void
-write_head(void)
+fill_head(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logheader *hb = (struct logheader *) (log.hdata);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  hb->n = log.clh.n;
+  hb->sum = log.clh.n > 0 ? logsum(log.clh.n) : 0;
+  for (i = 0; i < log.clh.n; i++) {
+    hb->block[i] = log.clh.block[i];
   }
-  bwrite(buf);
-  brelse(buf);
+  log.hbuf.dev = log.dev;
+  log.hbuf.blockno = log.start;
+}
+
+// Write log.clh to disk.
+static void
+write_head(void)
+{
+  fill_head();
+  virtio_disk_rw(&log.hbuf, 1);
+}
+
+// Write the header and the modified blocks to the log, all in
+// flight at once. This is the true point at which the
+// current transaction commits.
+static void
+write_trans(void)
+{
+  fill_head();
+  log.iov[0] = &log.hbuf;
+  for (int i = 0; i < log.clh.n; i++) {
+    log.buf[i].dev = log.dev;
+    log.buf[i].blockno = log.start+i+1;
+    log.iov[i+1] = &log.buf[i];
+  }
+  virtio_disk_rwv(log.iov, log.clh.n+1, 1);
 }
 
 static void
 recover_from_log(void)
 {
+  uint64 t0 = r_time();
+
   read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  if (log.clh.n > 0) {
+    log_io(log.clh.n, 0, 0); // read the log, if committed,
+    if (logsum(log.clh.n) == log.clh.sum) {
+      install_trans();       // and copy it to disk
+      virtio_disk_flush();
+      log.nrecover = log.clh.n;
+    } else
+      log.torn = 1;
+    log.clh.n = 0;
+    write_head(); // clear the log
+  }
+  log.rcycles = r_time() - t0;
+  if (log.nrecover > 0 || log.torn)
+    printf("log: recovered %d blocks%s in %d us\n", log.nrecover,
+           log.torn ? ", ignoring a torn commit," : "",
+           (int)(log.rcycles / (TIMEFREQ / 1000000)));
 }
 
-// called at the start of each FS system call.
+// called at the start of an FS system call that writes up to
+// n blocks. bulk writers reserve log_bigop() blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if(n > log.cap)
+    panic("begin_opn");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + log.reserved + n > log.cap){
+      // this op might exhaust log space; wait for klogd
+      // to take the transaction.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the start of each FS system call.
 void
-end_op(void)
+begin_op(void)
 {
-  int do_commit = 0;
+  begin_opn(log.opblocks);
+}
 
+// called at the end of an FS system call that began with
+// begin_opn(n).
+// klogd commits once this was the last outstanding operation.
+void
+end_opn(int n)
+{
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  log.reserved -= n;
+  log.ops++;
+  // klogd may be waiting for the transaction to be
+  // ready, and begin_op() for log space.
+  wakeup(&log);
+  if(log.lh.n > 0)
+    wakeup(&log.clh);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(log.opblocks);
 }
 
-// Copy modified blocks from cache to log.
-static void
-write_log(void)
+// How many blocks a bulk writer should reserve: half the log,
+// so that other callers aren't shut out, but no less than
+// begin_op() does.
+int
+log_bigop(void)
 {
-  int tail;
+  return log.cap / 2 > log.opblocks ? log.cap / 2 : log.opblocks;
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+// Wait until the updates of the FS system calls that have
+// finished are on disk.
+void
+log_sync(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  // they are in the open transaction, or in the one
+  // klogd is committing, if any.
+  seq = log.lh.n > 0 ? log.seq : log.seq - 1;
+  while((int)(log.done - seq) < 0)
+    sleep(&log.done, &log.lock);
+  release(&log.lock);
+}
+
+// Copy log.clh's modified blocks from the cache, and
+// remember which buffers they are, to unpin them later.
+static void
+copy_trans(void)
+{
+  for (int i = 0; i < log.clh.n; i++) {
+    struct buf *b = bread(log.dev, log.clh.block[i]); // cache block
+    memmove(log.buf[i].data, b->data, BSIZE);
+    log.cbuf[i] = b;
+    brelse(b);  // still pinned
   }
 }
 
 static void
-commit()
+klogd(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
+  uint seq;
+  uint64 t0;
+
+  // still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  for(;;){
+    acquire(&log.lock);
+    while(log.lh.n == 0)
+      sleep(&log.clh, &log.lock);
+    // take the transaction once its last call ends.
+    log.closing = 1;
+    while(log.outstanding > 0)
+      sleep(&log, &log.lock);
+    t0 = r_time();
+    log.clh = log.lh;
     log.lh.n = 0;
+    seq = log.seq++;
+    log.nop += log.ops;
+    log.ops = 0;
+    release(&log.lock);
+
+    // no FS system call is active until closing is clear.
+    copy_trans();
+    acquire(&log.lock);
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_trans();   // Write header and modified blocks to log -- the real commit
+    install_trans(); // Now install writes to home locations
+    for (int i = 0; i < log.clh.n; i++)
+      bunpin(log.cbuf[i]);
+    log.ncommit++;
+    log.nblock += log.clh.n;
+    log.clh.n = 0;
     write_head();    // Erase the transaction from the log
+
+    acquire(&log.lock);
+    histadd(log.chist, r_time() - t0);
+    log.done = seq;
+    wakeup(&log.done);
+    release(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// klogd will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -213,13 +416,21 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct proc *p;
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
+  // the ram disk doesn't survive a crash, so there is nothing
+  // for the log to keep consistent: write its blocks through.
+  if (b->dev == RAMDEV) {
+    bwrite(b);
+    return;
+  }
+
   acquire(&log.lock);
   for (i = 0; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorbtion
@@ -229,7 +440,35 @@ log_write(struct buf *b)
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
     log.lh.n++;
+    // the writer is charged for each block it adds.
+    if ((p = myproc()) != 0)
+      p->nbwrite++;
   }
   release(&log.lock);
 }
 
+static int
+statslog(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "log: commits %d blocks %d calls %d\n"
+               "log: recovered %d torn %d in %d us\n"
+               "log histograms: log2(cycles):count\n"
+               "log commit:",
+               (int)log.ncommit, (int)log.nblock, (int)log.nop,
+               log.nrecover, log.torn, (int)(log.rcycles / (TIMEFREQ / 1000000)));
+  for (int i = 0; i < NHIST; i++)
+    if (log.chist[i])
+      n += snprintf(buf+n, sz-n, " %d:%d", i, (int)log.chist[i]);
+  n += snprintf(buf+n, sz-n, "\n");
+  return n;
+}
+
+static void
+logreset(void)
+{
+  acquire(&log.lock);
+  memset(log.chist, 0, sizeof(log.chist));
+  release(&log.lock);
+}
@@ -6,11 +6,60 @@
 
 volatile static int started = 0;
 
+// Boot timing, for the statistics device: the time CSR when
+// hart 0 entered main(), when it finished each phase of it,
+// and when each hart went on to scheduler().
+#define NPHASE 8
+
+static uint64 boot0;
+static struct {
+  char *name;
+  uint64 t;
+} phases[NPHASE];
+static int nphase;
+static uint64 hartup[NCPU];
+
+static void
+phase(char *name)
+{
+  if(nphase < NPHASE){
+    phases[nphase].name = name;
+    phases[nphase].t = r_time();
+    nphase++;
+  }
+}
+
+#define US(t) ((int)((t) / (TIMEFREQ / 1000000)))
+
+static int
+statsboot(char *buf, int sz)
+{
+  uint64 last = boot0, up = 0;
+  int n;
+
+  n = snprintf(buf, sz, "boot firmware: %d us\n", US(boot0));
+  for(int i = 0; i < nphase; i++){
+    n += snprintf(buf+n, sz-n, "boot %s: %d us\n", phases[i].name,
+                  US(phases[i].t - last));
+    last = phases[i].t;
+  }
+  for(int i = 0; i < NCPU; i++){
+    if(hartup[i] == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "boot hart %d: up at %d us\n", i, US(hartup[i]));
+    if(hartup[i] > up)
+      up = hartup[i];
+  }
+  n += snprintf(buf+n, sz-n, "boot total: %d us\n", US(up));
+  return n;
+}
+
 // start() jumps here in supervisor mode on all CPUs.
 void
 main()
 {
   if(cpuid() == 0){
+    boot0 = r_time();
     consoleinit();
 #if defined(LAB_PGTBL) || defined(LAB_LOCK)
     statsinit();
@@ -19,23 +68,45 @@ main()
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
+    phase("console");
     kinit();         // physical page allocator
+    phase("kinit");
+    uartbufinit();   // console output ring
+    slabinit();      // small-object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    asidinit();      // probe ASID bits
+    phase("vm");
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
+    phase("proc");
     binit();         // buffer cache
     iinit();         // inode cache
+    dcacheinit();    // name cache
+    pcacheinit();    // executable page cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    mmapinit();      // VMA cache
+    shminit();       // shared memory segments
+    futexinit();     // futex locks
+    phase("fs");
     virtio_disk_init(); // emulated hard disk
+    ramdiskinit();   // ram disk for /tmp
 #ifdef LAB_NET
     pci_init();
     sockinit();
 #endif    
+    phase("disk");
     userinit();      // first user process
+    swapinit();      // kswapd
+    readaheadinit(); // kreadahead
+    kprintinit();    // kprintd, and the kmsg device
+    profinit();      // profile device
+    phase("user");
+    statsregister("boot", statsboot, 0);
     __sync_synchronize();
     started = 1;
   } else {
@@ -48,5 +119,6 @@ main()
     plicinithart();   // ask PLIC for device interrupts
   }
 
+  hartup[cpuid()] = r_time();
   scheduler();        
 }
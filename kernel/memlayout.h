@@ -30,6 +30,13 @@
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
+// the CLINT again, at a kernel virtual address above user memory,
+// so that supervisor mode can program timers with a per-process
+// kernel page table in use (see timer.c).
+#define KCLINT 0x40000000L
+#define KCLINT_MTIMECMP(hartid) (KCLINT + 0x4000 + 8*(hartid))
+#define KCLINT_MTIME (KCLINT + 0xBFF8)
+
 // qemu puts programmable interrupt controller here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -65,3 +72,19 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// thread t of a process has its trapframe at TRAPFRAMET(t),
+// and its kernel stack at KSTACK(t).
+#define TRAPFRAMET(t) (TRAPFRAME - (t)*PGSIZE)
+
+// below the threads' trapframes, a page user code may read but
+// not write, which the kernel keeps up to date with what some
+// system calls would return; ulib.c answers them from it.
+#define USYSCALL (TRAPFRAMET(NTHREAD))
+
+struct usyscall {
+  int pid;               // the process's
+  int nthread;           // threads in it; each has its own pid
+  uint64 tickcycles;     // ticks is the time CSR / tickcycles
+  uint64 timefreq;       // which counts timefreq a second
+};
@@ -0,0 +1,366 @@
+//
+// Memory-mapped files and shared memory.
+// Each process has a small table of VMAs, each describing
+// a range of its address space backed by an open file or
+// by a shared memory segment (see shm.c).
+// Pages are read in from the file on first touch, by
+// mmapfault(), and dirty pages of MAP_SHARED mappings
+// are written back to the file on munmap and exit.
+// Segment pages are mapped in on first touch too.
+//
+// Mappings are placed top-down below PLIC, the highest
+// user address the per-process kernel page table mirrors;
+// the heap grows up towards them.
+//
+// The VMAs of a process with threads are its leader's, and
+// are changed under the leader's sharelock. Mappings can't be
+// removed while there are threads, so a VMA found stays put.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+static struct slabcache *vmacache;
+
+void
+mmapinit(void)
+{
+  vmacache = slabcreate("vma", sizeof(struct vma), 0);
+}
+
+// lowest address used by p's mappings, or PLIC.
+// sbrk may not grow the heap past it.
+uint64
+mmapbase(struct proc *p)
+{
+  uint64 base = PLIC;
+
+  for(int i = 0; i < NVMA; i++)
+    if(p->vma[i] && p->vma[i]->addr < base)
+      base = p->vma[i]->addr;
+  return base;
+}
+
+// the VMA of p that contains va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  for(int i = 0; i < NVMA; i++){
+    struct vma *v = p->vma[i];
+    if(v && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// find the highest free range of len bytes below PLIC
+// and above the heap. returns 0 if there is none.
+static uint64
+mmapplace(struct proc *p, uint64 len)
+{
+  uint64 end = PLIC;
+  int moved;
+
+  do {
+    moved = 0;
+    if(end < len || end - len < PGROUNDUP(p->sz))
+      return 0;
+    for(int i = 0; i < NVMA; i++){
+      struct vma *v = p->vma[i];
+      if(v && v->addr < end && v->addr + v->len > end - len){
+        end = v->addr;
+        moved = 1;
+      }
+    }
+  } while(moved);
+  return end - len;
+}
+
+// Add a VMA of len bytes to p, placed by mmapplace(), with
+// the rest of its fields up to the caller. Returns it, or 0.
+static struct vma*
+vmacreate(struct proc *p, uint64 len)
+{
+  struct vma *v;
+  uint64 addr;
+  int i;
+
+  for(i = 0; i < NVMA; i++)
+    if(p->vma[i] == 0)
+      break;
+  len = PGROUNDUP(len);
+  if(i == NVMA || (addr = mmapplace(p, len)) == 0)
+    return 0;
+  if((v = slaballoc(vmacache)) == 0)
+    return 0;
+
+  v->addr = addr;
+  v->len = len;
+  v->f = 0;
+  v->shm = 0;
+  p->vma[i] = v;
+  return v;
+}
+
+// Map len bytes of f, starting at offset off, into the current
+// process. Returns the address of the mapping, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+
+  acquire(&p->sharelock);
+  if((v = vmacreate(p, len)) == 0){
+    release(&p->sharelock);
+    return -1;
+  }
+  v->prot = prot;
+  v->flags = flags;
+  v->off = off;
+  v->f = filedup(f);
+  release(&p->sharelock);
+  return v->addr;
+}
+
+// Map the shared memory segment with key into the current
+// process, creating it with len bytes if there is none.
+// Returns the address of the mapping, or -1.
+uint64
+shmat(int key, uint64 len)
+{
+  struct proc *p = myproc()->leader;
+  struct shm *s;
+  struct vma *v;
+
+  if(len == 0 || len > NSHMPAGE * PGSIZE)
+    return -1;
+  if((s = shmget(key, PGROUNDUP(len) / PGSIZE)) == 0)
+    return -1;
+  acquire(&p->sharelock);
+  if((v = vmacreate(p, len)) == 0){
+    release(&p->sharelock);
+    shmput(s);
+    return -1;
+  }
+  v->prot = PROT_READ | PROT_WRITE;
+  v->flags = MAP_SHARED;
+  v->off = 0;
+  v->shm = s;
+  release(&p->sharelock);
+  return v->addr;
+}
+
+// Unmap the shared memory segment mapped at va.
+int
+shmdt(uint64 va)
+{
+  struct vma *v = vmalookup(myproc()->leader, va);
+
+  if(v == 0 || v->shm == 0 || v->addr != va)
+    return -1;
+  return munmap(v->addr, v->len);
+}
+
+// Read in the page of a mapping that holds va, for a fault
+// on it. Returns 0 on success, -1 if va isn't mapped or the
+// mapping doesn't allow the access, -2 if out of memory.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  char *mem;
+  int perm, r;
+
+  va = PGROUNDDOWN(va);
+  // a thread may be filling the VMA in.
+  acquire(&p->sharelock);
+  v = vmalookup(p, va);
+  release(&p->sharelock);
+  if(v == 0)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  if(!write && (v->prot & (PROT_READ|PROT_EXEC)) == 0)
+    return -1;
+
+  perm = PTE_U;
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  if(v->shm){
+    uint64 pa = v->shm->page[(v->off + (va - v->addr)) / PGSIZE];
+    krefpage((void*)pa);
+    if((r = uvmfaultmap(p, va, pa, perm)) != 0)
+      kfree((void*)pa);
+    return r < 0 ? -2 : 0;
+  }
+
+  if((mem = kzalloc()) == 0)
+    return -2;
+  ilock(v->f->ip);
+  if(readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE) < 0){
+    iunlock(v->f->ip);
+    kfree(mem);
+    return -1;
+  }
+  iunlock(v->f->ip);
+
+  if((r = uvmfaultmap(p, va, (uint64)mem, perm)) != 0)
+    kfree(mem);
+  return r < 0 ? -2 : 0;
+}
+
+// write the dirty pages of [va, va+len) in MAP_SHARED
+// mapping v back to its file.
+static void
+mmapwriteback(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  int nop = log_bigop();
+  int max = ((nop-1-1-2) / 2) * BSIZE;
+  uint64 a, off, pa;
+  uint n, n1, i;
+  pte_t *pte;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    off = v->off + (a - v->addr);
+    for(i = 0; i < PGSIZE; i += n1){
+      begin_opn(nop);
+      ilock(ip);
+      // don't grow the file; the rest of the page
+      // past its end is not part of it.
+      n = 0;
+      if(off + i < ip->size)
+        n = ip->size - (off + i);
+      n1 = PGSIZE - i;
+      if(n1 > max)
+        n1 = max;
+      if(n1 > n)
+        n1 = n;
+      if(n1 > 0)
+        writei(ip, 0, pa + i, off + i, n1);
+      iunlock(ip);
+      end_opn(nop);
+      if(n1 == 0)
+        break;
+    }
+  }
+}
+
+// Unmap [va, va+len) of mapping p->vma[i] from p's page
+// table, writing dirty MAP_SHARED pages back first if
+// writeback is set, and shrink or free the mapping.
+static void
+vmaunmap(struct proc *p, int i, uint64 va, uint64 len, int writeback)
+{
+  struct vma *v = p->vma[i];
+
+  if(writeback && v->f && v->flags == MAP_SHARED)
+    mmapwriteback(p, v, va, len);
+  uvmunmap(p->pagetable, va, len / PGSIZE, 1);
+
+  if(va == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    if(v->f)
+      fileclose(v->f);
+    else
+      shmput(v->shm);
+    slabfree(vmacache, v);
+    p->vma[i] = 0;
+  }
+}
+
+// Remove [va, va+len) from the current process's mappings.
+// The range must be at the start or the end of a mapping,
+// or the whole of it.
+int
+munmap(uint64 va, uint64 len)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+  int i;
+
+  // other threads' harts might keep using the pages.
+  if(va % PGSIZE != 0 || len == 0 || p->nthread > 1)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmalookup(p, va)) == 0 || va + len > v->addr + v->len)
+    return -1;
+  if(va != v->addr && va + len != v->addr + v->len)
+    return -1;
+
+  for(i = 0; p->vma[i] != v; i++)
+    ;
+  vmaunmap(p, i, va, len, 1);
+  tlbflush(p);
+  return 0;
+}
+
+// Remove all of p's mappings, so that its page table can be
+// freed. Writes back dirty pages only if writeback is set.
+void
+munmapall(struct proc *p, int writeback)
+{
+  for(int i = 0; i < NVMA; i++){
+    struct vma *v = p->vma[i];
+    if(v)
+      vmaunmap(p, i, v->addr, v->len, writeback);
+  }
+}
+
+// Give child np p's mappings. Pages already read in are
+// shared: copy-on-write for MAP_PRIVATE, and writable in
+// both for MAP_SHARED. Returns 0 on success, -1 on failure,
+// after which freeproc(np) undoes what was done.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  for(int i = 0; i < NVMA; i++){
+    struct vma *v = p->vma[i];
+    if(v == 0)
+      continue;
+    if((np->vma[i] = slaballoc(vmacache)) == 0)
+      return -1;
+    *np->vma[i] = *v;
+    if(v->f)
+      filedup(v->f);
+    else
+      shmdup(v->shm);
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->addr + v->len,
+                v->flags == MAP_PRIVATE) < 0)
+      return -1;
+    copy_upgtbl(np->pagetable, np->kpagetable, v->addr, v->addr + v->len);
+  }
+  return 0;
+}
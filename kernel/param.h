@@ -1,13 +1,33 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       256  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NOFILE       16  // open files per process, before its table grows
+#define MAXFD       512  // open files per process, once it has
+#define NVMA         16  // memory-mapped files per process
+#define NTHREAD      16  // threads per process, itself included
+#define NEXECSEG     4   // demand-paged program segments per process
+#define NSHM         16  // shared memory segments per system
+#define NSHMPAGE     256 // pages per shared memory segment
+#define MAXORDER     10  // largest kalloc_pages() block is 2^MAXORDER pages
+#define NINODE       100 // i-nodes to cache before reusing unreferenced ones
+#define NDCACHE      256 // entries in the name cache
+#define NPCACHE      512 // executable pages to cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define RAMDEV        2  // device number of the ram disk mounted on /tmp
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  10  // max # of blocks an FS op writes, unless mkfs -o says otherwise
+#define LOGSIZE      (MAXOPBLOCKS*3)  // data blocks in on-disk log, unless mkfs -l says otherwise
+#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache at boot; the log asks for more
+#define BCACHEPCT    25    // percent of free memory at boot the block cache may grow to
+#define FSSIZE       4000  // size of file system in blocks, unless mkfs -s says otherwise
+#define SWAPSIZE     16384 // size of swap area after it, in blocks
+#define RAMFSSIZE    2048  // size of the ram disk, in blocks
+#define RAMNINODES   200   // inodes on it
 #define MAXPATH      128   // maximum file path name
+#define NPRIO        3     // scheduling priority levels, 0 highest
+#define PRIOQUANTA   { 1, 2, 4 }  // timer ticks a process may run at each level
+#define PRIOBOOST    50    // ticks between boosts of all processes to level 0
+#define TICKCYCLES   1000000 // CLINT cycles per clock tick; about 1/10th second in qemu
+#define PROFCYCLES   100000 // CLINT cycles between timer interrupts while profiling
+#define TIMEFREQ     10000000 // CLINT cycles, the time CSR's counts, per second in qemu
+#define NHIST        32    // buckets of a log2 histogram (histadd)
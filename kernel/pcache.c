@@ -0,0 +1,195 @@
+//
+// Page cache for executables.
+// Keeps the pages execfault() reads in from a program, keyed by
+// its in-core inode and the page's address in the image, so that
+// the next process to fault on the same page just maps it too.
+// Pages are mapped read-only, copy-on-write if their segment is
+// writable, so whoever stores to one gets a private copy and the
+// cached page stays as the file has it.
+//
+// Changing a file drops its pages (see writei() and itrunc()),
+// as does recycling its in-core inode, since the inode is the
+// key; processes keep the pages they have mapped. The cache holds
+// at most NPCACHE pages, and gives up pages no process maps when
+// it is full or memory runs short.
+//
+// All of it is protected by pcache.lock. An inode's pages are
+// only added and dropped with the inode locked, or unreferenced.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+static int statspcache(char*, int);
+
+#define NPCBUCKET 61
+
+struct pcpage {
+  struct inode *ip;
+  uint64 va;
+  uint64 pa;
+  struct pcpage *next;          // hash chain
+};
+
+static struct {
+  struct spinlock lock;
+  struct pcpage *bucket[NPCBUCKET];
+  struct slabcache *cache;
+  int n;                        // pages cached
+  int hand;                     // bucket the next eviction looks at
+  uint64 hits;
+  uint64 misses;
+  uint64 ndropped;              // pages invalidated or evicted
+} pcache;
+
+#define PCBUCKET(ip, va) \
+  (&pcache.bucket[((uint64)(ip) / sizeof(struct inode) + (va) / PGSIZE) % NPCBUCKET])
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.cache = slabcreate("pcache", sizeof(struct pcpage), 0);
+  statsregister("pcache", statspcache, 0);
+}
+
+// Return the cached page at va of ip's image, with a reference
+// added for the caller, or 0. Caller must hold ip->lock.
+uint64
+pcacheget(struct inode *ip, uint64 va)
+{
+  struct pcpage *pp;
+  uint64 pa = 0;
+
+  if(!ip->pcached)
+    return 0;
+  acquire(&pcache.lock);
+  for(pp = *PCBUCKET(ip, va); pp; pp = pp->next){
+    if(pp->ip == ip && pp->va == va){
+      pa = pp->pa;
+      krefpage((void*)pa);
+      break;
+    }
+  }
+  if(pa)
+    pcache.hits++;
+  else
+    pcache.misses++;
+  release(&pcache.lock);
+  return pa;
+}
+
+// Drop *ppp from the cache. Caller must hold pcache.lock.
+static void
+pcdrop(struct pcpage **ppp)
+{
+  struct pcpage *pp = *ppp;
+
+  *ppp = pp->next;
+  kfree((void*)pp->pa);
+  slabfree(pcache.cache, pp);
+  pcache.n--;
+  pcache.ndropped++;
+}
+
+// Drop up to n pages that only the cache holds, sweeping the
+// buckets from where the last sweep stopped. Returns how many.
+// Caller must hold pcache.lock.
+static int
+pcevict(int n)
+{
+  struct pcpage **ppp;
+  int freed = 0;
+
+  for(int i = 0; i < NPCBUCKET && freed < n; i++){
+    ppp = &pcache.bucket[pcache.hand];
+    while(*ppp && freed < n){
+      if(krefcount((void*)(*ppp)->pa) == 1){
+        pcdrop(ppp);
+        freed++;
+      } else
+        ppp = &(*ppp)->next;
+    }
+    if(freed < n)
+      pcache.hand = (pcache.hand + 1) % NPCBUCKET;
+  }
+  return freed;
+}
+
+// Remember pa as the page at va of ip's image, taking a
+// reference to it, unless the cache is full of pages in use.
+// Caller must hold ip->lock.
+void
+pcacheput(struct inode *ip, uint64 va, uint64 pa)
+{
+  struct pcpage *pp;
+
+  if((pp = slaballoc(pcache.cache)) == 0)
+    return;
+  acquire(&pcache.lock);
+  if(pcache.n >= NPCACHE && pcevict(1) == 0){
+    release(&pcache.lock);
+    slabfree(pcache.cache, pp);
+    return;
+  }
+  krefpage((void*)pa);
+  pp->ip = ip;
+  pp->va = va;
+  pp->pa = pa;
+  pp->next = *PCBUCKET(ip, va);
+  *PCBUCKET(ip, va) = pp;
+  pcache.n++;
+  ip->pcached = 1;
+  release(&pcache.lock);
+}
+
+// Drop ip's pages, because its file is changing or its
+// in-core inode is being reused. Caller must hold ip->lock,
+// or ip must be unreferenced.
+void
+pcacheinval(struct inode *ip)
+{
+  struct pcpage **ppp;
+
+  if(!ip->pcached)
+    return;
+  acquire(&pcache.lock);
+  for(int i = 0; i < NPCBUCKET; i++){
+    ppp = &pcache.bucket[i];
+    while(*ppp){
+      if((*ppp)->ip == ip)
+        pcdrop(ppp);
+      else
+        ppp = &(*ppp)->next;
+    }
+  }
+  ip->pcached = 0;
+  release(&pcache.lock);
+}
+
+// Give back up to npages pages that no process maps, for
+// kswapd. Returns how many.
+int
+pcacheshrink(int npages)
+{
+  int n;
+
+  acquire(&pcache.lock);
+  n = pcevict(npages);
+  release(&pcache.lock);
+  return n;
+}
+
+static int
+statspcache(char *buf, int sz)
+{
+  return snprintf(buf, sz, "pcache: pages %d of %d hits %d misses %d dropped %d\n",
+                  pcache.n, NPCACHE, (int)pcache.hits, (int)pcache.misses,
+                  (int)pcache.ndropped);
+}
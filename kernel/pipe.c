@@ -7,18 +7,50 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "poll.h"
+#include "fcntl.h"
 
-#define PIPESIZE 512
+#define NPIPEPAGE 16
+#define PIPEMAXORDER 4  // data rings hold at most 16 pages
 
+// Small writes go through the data ring, of one page to start
+// with, a power of two pages if pipesize() asks for more. Bytes
+// are copied in and out of it a span at a time: as much as is
+// contiguous in the ring and in the user's page. Page-aligned
+// whole pages of the writer's heap, written while the data
+// ring is empty, are instead lent to the
+// pipe copy-on-write and queued in page[], and are mapped
+// into the reader's heap if it reads into a page-aligned
+// whole page, or copied out otherwise. To keep the bytes
+// in order, at most one of the two holds data at a time.
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // the data ring,
+  uint size;      // of this many bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
+  uint64 page[NPIPEPAGE]; // physical addresses of lent pages
+  uint npread;    // number of pages read
+  uint npwrite;   // number of pages written
+  uint poff;      // bytes already read of page[npread]
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+static struct slabcache *pipecache;
+
+static void
+pipector(void *obj)
+{
+  initlock(&((struct pipe*)obj)->lock, "pipe");
+}
+
+void
+pipeinit(void)
+{
+  pipecache = slabcreate("pipe", sizeof(struct pipe), pipector);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +60,21 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = slaballoc(pipecache)) == 0)
+    goto bad;
+  if((pi->data = kalloc_pages(0)) == 0){
+    slabfree(pipecache, pi);
+    pi = 0;
     goto bad;
+  }
+  pi->size = PGSIZE;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
-  initlock(&pi->lock, "pipe");
+  pi->npwrite = 0;
+  pi->npread = 0;
+  pi->poff = 0;
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -46,8 +86,6 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
-  if(pi)
-    kfree((char*)pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -55,6 +93,73 @@ pipealloc(struct file **f0, struct file **f1)
   return -1;
 }
 
+static int
+pipeorder(uint size)
+{
+  int order = 0;
+
+  while((PGSIZE << order) < size)
+    order++;
+  return order;
+}
+
+// how many of n bytes can go in one copy to or from ring
+// position pos, with avail bytes of room or data there.
+static int
+span(struct pipe *pi, uint pos, uint avail, int n)
+{
+  uint m = pi->size - pos % pi->size;
+
+  if(m > avail)
+    m = avail;
+  if(m > n)
+    m = n;
+  return m;
+}
+
+// Give pi a data ring of at least size bytes, if this would
+// make room for what it holds and isn't too big. Returns the
+// size of the ring, or -1. A size of 0 just asks.
+int
+piperesize(struct pipe *pi, int size)
+{
+  char *data, *old;
+  int order, oldorder;
+  uint n;
+
+  if(size == 0)
+    return pi->size;
+  if(size < 0 || size > (PGSIZE << PIPEMAXORDER))
+    return -1;
+  order = pipeorder(size);
+  if((data = kalloc_pages(order)) == 0)
+    return -1;
+
+  acquire(&pi->lock);
+  n = pi->nwrite - pi->nread;
+  if(n > (PGSIZE << order)){
+    release(&pi->lock);
+    kfree_pages(data, order);
+    return -1;
+  }
+  for(uint i = 0, m; i < n; i += m){
+    m = span(pi, pi->nread + i, n - i, n - i);
+    memmove(data + i, &pi->data[(pi->nread + i) % pi->size], m);
+  }
+  old = pi->data;
+  oldorder = pipeorder(pi->size);
+  pi->data = data;
+  pi->size = PGSIZE << order;
+  pi->nread = 0;
+  pi->nwrite = n;
+  // writers may fit now.
+  wakeup(&pi->nwrite);
+  pollwake();
+  release(&pi->lock);
+  kfree_pages(old, oldorder);
+  return PGSIZE << order;
+}
+
 void
 pipeclose(struct pipe *pi, int writable)
 {
@@ -66,62 +171,193 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwake();
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    for(; pi->npread != pi->npwrite; pi->npread++)
+      kfree((void*)pi->page[pi->npread % NPIPEPAGE]);
+    kfree_pages(pi->data, pipeorder(pi->size));
+    slabfree(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// Returns EAGAIN, or how much was written, instead of
+// sleeping for room if nonblock is set.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, uint64 addr, int n, int nonblock)
 {
-  int i;
-  char ch;
-  struct proc *pr = myproc();
+  int i, m, page, lend;
+  uint64 pa;
+  struct proc *pr = myproc()->leader;
 
   acquire(&pi->lock);
-  for(i = 0; i < n; i++){
-    while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
+  lend = 1;
+  for(i = 0; i < n; ){
+    // a page is lent only if the data ring is empty, so as not
+    // to wait for it to drain; otherwise its bytes are copied.
+    page = lend && (addr + i) % PGSIZE == 0 && n - i >= PGSIZE &&
+           pi->nwrite == pi->nread;
+    // wait for room: for a page, in the page queue; for bytes,
+    // in the data ring, once no pages wait. then decide again.
+    if(page ? pi->npwrite == pi->npread + NPIPEPAGE
+            : pi->npwrite != pi->npread || pi->nwrite == pi->nread + pi->size){  //DOC: pipewrite-full
       if(pi->readopen == 0 || pr->killed){
         release(&pi->lock);
         return -1;
       }
+      if(nonblock)
+        goto out;
       wakeup(&pi->nread);
+      pollwake();
       sleep(&pi->nwrite, &pi->lock);
+      continue;
     }
-    if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    if(page){
+      if((pa = uvmgetpage(pr, addr + i)) != 0){
+        pi->page[pi->npwrite++ % NPIPEPAGE] = pa;
+        i += PGSIZE;
+      } else {
+        // not a page that can be lent; copy its bytes.
+        lend = 0;
+      }
+      continue;
+    }
+    // up to the end of the page, which may be lent.
+    m = span(pi, pi->nwrite, pi->nread + pi->size - pi->nwrite, n - i);
+    if(m > PGSIZE - (addr + i) % PGSIZE)
+      m = PGSIZE - (addr + i) % PGSIZE;
+    if(copyin(pr->pagetable, &pi->data[pi->nwrite % pi->size], addr + i, m) == -1)
       break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    pi->nwrite += m;
+    i += m;
+    wakeup(&pi->nread);
+    if((addr + i) % PGSIZE == 0)
+      lend = 1;
   }
+ out:
   wakeup(&pi->nread);
+  pollwake();
   release(&pi->lock);
-  return i;
+  return nonblock && i == 0 && n > 0 ? EAGAIN : i;
 }
 
+// Write the n bytes of kernel page pa to the pipe, for
+// sendfile(), taking over pa: a whole page is queued as
+// if lent, and a part of one is copied into the data ring.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+pipesend(struct pipe *pi, uint64 pa, int n)
 {
-  int i;
-  struct proc *pr = myproc();
-  char ch;
+  int i, page = n == PGSIZE;
+  struct proc *pr = myproc()->leader;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  for(i = 0; i < n; ){
+    while(page ? pi->nwrite != pi->nread || pi->npwrite == pi->npread + NPIPEPAGE
+               : pi->npwrite != pi->npread || pi->nwrite == pi->nread + pi->size){
+      if(pi->readopen == 0 || pr->killed){
+        release(&pi->lock);
+        kfree((void*)pa);
+        return -1;
+      }
+      wakeup(&pi->nread);
+      pollwake();
+      sleep(&pi->nwrite, &pi->lock);
+    }
+    if(page){
+      pi->page[pi->npwrite++ % NPIPEPAGE] = pa;
+      wakeup(&pi->nread);
+      pollwake();
+      release(&pi->lock);
+      return n;
+    }
+    while(i < n && pi->nwrite != pi->nread + pi->size){
+      int m = span(pi, pi->nwrite, pi->nread + pi->size - pi->nwrite, n - i);
+      memmove(&pi->data[pi->nwrite % pi->size], (char*)pa + i, m);
+      pi->nwrite += m;
+      i += m;
+    }
+  }
+  wakeup(&pi->nread);
+  pollwake();
+  release(&pi->lock);
+  kfree((void*)pa);
+  return n;
+}
+
+// Returns EAGAIN instead of sleeping for data if nonblock
+// is set.
+int
+piperead(struct pipe *pi, uint64 addr, int n, int nonblock)
+{
+  int i, m;
+  struct proc *pr = myproc()->leader;
+  uint64 pa;
+
+  acquire(&pi->lock);
+  while(pi->nread == pi->nwrite && pi->npread == pi->npwrite && pi->writeopen){  //DOC: pipe-empty
     if(pr->killed){
       release(&pi->lock);
       return -1;
     }
+    if(nonblock){
+      release(&pi->lock);
+      return EAGAIN;
+    }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n; ){  //DOC: piperead-copy
+    if(pi->npread != pi->npwrite){
+      pa = pi->page[pi->npread % NPIPEPAGE];
+      if(pi->poff == 0 && (addr + i) % PGSIZE == 0 && n - i >= PGSIZE &&
+         uvmputpage(pr, addr + i, pa) == 0){
+        // the reader's page table now holds the reference.
+        pi->npread++;
+        i += PGSIZE;
+        continue;
+      }
+      m = PGSIZE - pi->poff;
+      if(m > n - i)
+        m = n - i;
+      if(copyout(pr->pagetable, addr + i, (char*)pa + pi->poff, m) == -1)
+        break;
+      i += m;
+      pi->poff += m;
+      if(pi->poff == PGSIZE){
+        kfree((void*)pa);
+        pi->npread++;
+        pi->poff = 0;
+      }
+    } else if(pi->nread != pi->nwrite){
+      m = span(pi, pi->nread, pi->nwrite - pi->nread, n - i);
+      if(copyout(pr->pagetable, addr + i, &pi->data[pi->nread % pi->size], m) == -1)
+        break;
+      pi->nread += m;
+      i += m;
+    } else {
       break;
+    }
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pollwake();
   release(&pi->lock);
   return i;
 }
+
+// Which of POLLIN, POLLOUT and POLLHUP are true of the end of
+// pi that is writable, or not.
+int
+pipepoll(struct pipe *pi, int writable)
+{
+  int r = 0;
+
+  acquire(&pi->lock);
+  if(pi->nread != pi->nwrite || pi->npread != pi->npwrite || !pi->writeopen)
+    r |= POLLIN;
+  if((pi->npwrite == pi->npread && pi->nwrite != pi->nread + pi->size) || !pi->readopen)
+    r |= POLLOUT;
+  if(writable ? !pi->readopen : !pi->writeopen)
+    r |= POLLHUP;
+  release(&pi->lock);
+  return r;
+}
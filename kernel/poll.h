@@ -0,0 +1,16 @@
+// The files poll() waits on, and what for: user code sets fd
+// and events, and poll() sets revents to those of events, and
+// of POLLHUP and POLLNVAL, that are true of fd.
+
+#define NPOLL 64        // most fds one poll() looks at
+
+#define POLLIN   0x01   // a read won't block
+#define POLLOUT  0x04   // a write won't block
+#define POLLHUP  0x10   // the other end of a pipe is closed
+#define POLLNVAL 0x20   // fd isn't open
+
+struct pollfd {
+  int fd;
+  short events;
+  short revents;
+};
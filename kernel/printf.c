@@ -1,6 +1,18 @@
 //
 // formatted console output -- printf, panic.
 //
+// Until kprintd, a kernel process, starts, and again once the
+// kernel panics, printf() writes straight to the uart under
+// pr.lock, a byte at a time. In between, each hart formats into
+// a log buffer of its own, with only its interrupts off, and
+// kprintd copies what the harts wrote to the uart's output ring
+// and to a history of recent messages, which the kmsg device
+// reads out. Each hart's buffer has one writer, the hart, and
+// one reader, kprintd, so neither takes a lock. printf() may be
+// called holding any lock, so it can't wake kprintd itself; it
+// marks its hart, and pop_off() calls kprintwake() once the hart
+// holds no spinlocks.
+//
 
 #include <stdarg.h>
 
@@ -15,18 +27,60 @@
 #include "defs.h"
 #include "proc.h"
 
+static int statsprintf(char*, int);
+
 volatile int panicked = 0;
 
 // lock to avoid interleaving concurrent printf's.
 static struct {
   struct spinlock lock;
   int locking;
+  int async;      // kprintd is running, and the kernel hasn't panicked
+  struct spinlock wlock;
+  int pending;    // logged since kprintd last looked; under wlock
 } pr;
 
+#define LOGBUFSZ 4096   // bytes of a hart's log buffer
+#define KMSGSZ   16384  // bytes of history kept
+
+struct logbuf {
+  char buf[LOGBUFSZ];
+  uint64 w;       // written up to here, for kprintd to see
+  uint64 pw;      // and up to here by the printf() under way
+  uint64 r;       // kprintd has taken up to here
+  uint64 ndrop;   // bytes dropped because buf was full
+  uint64 nmdrop;  // messages that lost any
+};
+
+static struct logbuf logs[NCPU];
+
+static struct {
+  struct spinlock lock;
+  char buf[KMSGSZ];
+  uint64 w;       // bytes written, ever
+  uint64 r;       // where the next read of kmsg starts, or 0
+} kmsg;
+
 static char digits[] = "0123456789abcdef";
 
+// send c to l, or to the uart if l is 0. what goes to the
+// uart under pr.lock, while booting, goes in the history too;
+// kprintd isn't adding to it yet.
 static void
-printint(int xx, int base, int sign)
+putc(struct logbuf *l, int c)
+{
+  if(l == 0){
+    consputc(c);
+    if(pr.locking)
+      kmsg.buf[kmsg.w++ % KMSGSZ] = c;
+  } else if(l->pw - l->r < LOGBUFSZ)
+    l->buf[l->pw++ % LOGBUFSZ] = c;
+  else
+    l->ndrop++;
+}
+
+static void
+printint(struct logbuf *l, int xx, int base, int sign)
 {
   char buf[16];
   int i;
@@ -46,17 +100,17 @@ printint(int xx, int base, int sign)
     buf[i++] = '-';
 
   while(--i >= 0)
-    consputc(buf[i]);
+    putc(l, buf[i]);
 }
 
 static void
-printptr(uint64 x)
+printptr(struct logbuf *l, uint64 x)
 {
   int i;
-  consputc('0');
-  consputc('x');
+  putc(l, '0');
+  putc(l, 'x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
+    putc(l, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the console. only understands %d, %x, %p, %s.
@@ -65,11 +119,20 @@ printf(char *fmt, ...)
 {
   va_list ap;
   int i, c, locking;
+  struct logbuf *l = 0;
+  uint64 ndrop = 0;
   char *s;
 
-  locking = pr.locking;
+  locking = pr.locking && !pr.async;
   if(locking)
     acquire(&pr.lock);
+  else if(pr.async){
+    // interrupts off, so that nothing else on this hart
+    // prints in the middle, and it stays on this hart.
+    push_off();
+    l = &logs[cpuid()];
+    ndrop = l->ndrop;
+  }
 
   if (fmt == 0)
     panic("null fmt");
@@ -77,7 +140,7 @@ printf(char *fmt, ...)
   va_start(ap, fmt);
   for(i = 0; (c = fmt[i] & 0xff) != 0; i++){
     if(c != '%'){
-      consputc(c);
+      putc(l, c);
       continue;
     }
     c = fmt[++i] & 0xff;
@@ -85,39 +148,63 @@ printf(char *fmt, ...)
       break;
     switch(c){
     case 'd':
-      printint(va_arg(ap, int), 10, 1);
+      printint(l, va_arg(ap, int), 10, 1);
       break;
     case 'x':
-      printint(va_arg(ap, int), 16, 1);
+      printint(l, va_arg(ap, int), 16, 1);
       break;
     case 'p':
-      printptr(va_arg(ap, uint64));
+      printptr(l, va_arg(ap, uint64));
       break;
     case 's':
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        putc(l, *s);
       break;
     case '%':
-      consputc('%');
+      putc(l, '%');
       break;
     default:
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c);
+      putc(l, '%');
+      putc(l, c);
       break;
     }
   }
+  va_end(ap);
 
   if(locking)
     release(&pr.lock);
+  else if(l){
+    // let kprintd see the whole message at once.
+    __sync_synchronize();
+    l->w = l->pw;
+    if(l->ndrop != ndrop)
+      l->nmdrop++;
+    mycpu()->kick = 1;
+    pop_off();
+  }
+}
+
+// write what the harts have logged, but kprintd hasn't
+// taken, straight to the uart. for panic().
+static void
+logflush(void)
+{
+  for(struct logbuf *l = logs; l < &logs[NCPU]; l++)
+    for(uint64 r = l->r; r != l->w; r++)
+      consputc(l->buf[r % LOGBUFSZ]);
 }
 
 void
 panic(char *s)
 {
   pr.locking = 0;
+  if(pr.async){
+    pr.async = 0;
+    logflush();
+  }
   printf("panic: ");
   printf(s);
   printf("\n");
@@ -130,5 +217,125 @@ void
 printfinit(void)
 {
   initlock(&pr.lock, "pr");
+  initlock(&kmsg.lock, "kmsg");
+  initlock(&pr.wlock, "kprintd");
   pr.locking = 1;
 }
+
+// append n bytes at buf to the history.
+static void
+kmsgappend(char *buf, int n)
+{
+  acquire(&kmsg.lock);
+  for(int i = 0; i < n; i++)
+    kmsg.buf[kmsg.w++ % KMSGSZ] = buf[i];
+  release(&kmsg.lock);
+}
+
+static void
+kprintd(void)
+{
+  struct logbuf *l;
+  uint64 w, n;
+  int idle;
+
+  // still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  // from now on printf() leaves the uart to kprintd.
+  pr.async = 1;
+
+  for(;;){
+    idle = 1;
+    for(l = logs; l < &logs[NCPU]; l++){
+      w = l->w;
+      __sync_synchronize();
+      while(l->r != w){
+        // up to w, or to the end of buf.
+        n = w - l->r;
+        if(n > LOGBUFSZ - l->r % LOGBUFSZ)
+          n = LOGBUFSZ - l->r % LOGBUFSZ;
+        uartwrite(&l->buf[l->r % LOGBUFSZ], n);
+        kmsgappend(&l->buf[l->r % LOGBUFSZ], n);
+        __sync_synchronize();
+        l->r += n;
+        idle = 0;
+      }
+    }
+    if(idle){
+      acquire(&pr.wlock);
+      while(pr.pending == 0)
+        sleep(&pr.pending, &pr.wlock);
+      pr.pending = 0;
+      release(&pr.wlock);
+    }
+  }
+}
+
+// wake kprintd for what printf() logged. called by pop_off()
+// on a hart that printf() marked, once it holds no spinlocks.
+void
+kprintwake(void)
+{
+  if(!pr.async)
+    return;
+  acquire(&pr.wlock);
+  if(pr.pending == 0){
+    pr.pending = 1;
+    wakeup(&pr.pending);
+  }
+  release(&pr.wlock);
+}
+
+// user read()s of the kmsg device go here: the history, from
+// its oldest byte, and then 0 for end of file.
+int
+kmsgread(int user_dst, uint64 dst, int n)
+{
+  uint64 start, m;
+
+  acquire(&kmsg.lock);
+  start = kmsg.w > KMSGSZ ? kmsg.w - KMSGSZ : 0;
+  if(kmsg.r < start)
+    kmsg.r = start;
+  m = kmsg.w - kmsg.r;
+  if(m == 0){
+    // start over next time.
+    kmsg.r = 0;
+    release(&kmsg.lock);
+    return 0;
+  }
+  if(m > n)
+    m = n;
+  if(m > KMSGSZ - kmsg.r % KMSGSZ)
+    m = KMSGSZ - kmsg.r % KMSGSZ;
+  if(either_copyout(user_dst, dst, &kmsg.buf[kmsg.r % KMSGSZ], m) == -1){
+    release(&kmsg.lock);
+    return -1;
+  }
+  kmsg.r += m;
+  release(&kmsg.lock);
+  return m;
+}
+
+// start kprintd, once there are processes.
+void
+kprintinit(void)
+{
+  devsw[KMSG].read = kmsgread;
+  kproc("kprintd", kprintd);
+  statsregister("printf", statsprintf, 0);
+}
+
+static int
+statsprintf(char *buf, int sz)
+{
+  uint64 ndrop = 0, nmdrop = 0;
+
+  for(struct logbuf *l = logs; l < &logs[NCPU]; l++){
+    ndrop += l->ndrop;
+    nmdrop += l->nmdrop;
+  }
+  return snprintf(buf, sz, "printf: logged %d dropped %d messages %d bytes\n",
+                  (int)kmsg.w, (int)nmdrop, (int)ndrop);
+}
@@ -6,46 +6,171 @@
 #include "proc.h"
 #include "defs.h"
 
-struct cpu cpus[NCPU];
+static int statsproc(char*, int);
+static int statsrunq(char*, int);
+static int statssched(char*, int);
+static void schedreset(void);
 
-struct proc proc[NPROC];
+struct cpu cpus[NCPU];
 
 struct proc *initproc;
 
-int nextpid = 1;
-struct spinlock pid_lock;
+// The process table. struct procs come from a slab cache as
+// they are needed, up to NPROC of them, and are kept when their
+// processes die, UNUSED on the free list, so a struct proc is
+// never re-allocated as anything else. The all list links every
+// one ever allocated and only grows, so it can be walked with
+// no lock. Live (not UNUSED) processes are also on the live
+// list, and hashed by pid. ptable.lock protects the lists, the
+// hash and nextpid; a process's lock is taken before it.
+#define NPIDHASH 67
+
+struct {
+  struct spinlock lock;
+  struct proc *all;
+  struct proc *free;
+  struct proc *live;
+  struct proc *hash[NPIDHASH];
+  int nproc;                    // struct procs allocated
+  int nextpid;
+} ptable;
+
+static struct slabcache *procslab;
+
+#define PIDHASH(pid) (&ptable.hash[(uint)(pid) % NPIDHASH])
+
+// Each process has a list of its children, linked through
+// their sibling fields, so that wait() and exit() needn't scan
+// the table. Only a process itself adds children and takes
+// them off (in fork() and wait()), and only it walks the list,
+// so it can do so without a lock; but exit() hands orphans to
+// init by splicing them onto the front of init's list. So
+// changes to a list are made under childlock, which is taken
+// after any proc lock and held while taking no other.
+struct spinlock childlock;
 
 extern void forkret(void);
 static void wakeup1(struct proc *chan);
+static void ready(struct proc *p);
 static void freeproc(struct proc *p);
+static void addchild(struct proc *p, struct proc *np);
 
 extern char trampoline[]; // trampoline.S
 
+// Per-hart queues of RUNNABLE processes. A process goes on the
+// queue of the hart it last ran on, whose caches and TLB may
+// still hold it, and a hart with nothing of its own to run
+// steals from the longest queue of another: a process that
+// stopped running less than HOTCYCLES ago is left to its own
+// hart, and one is only ever run on the harts its affinity
+// mask allows. A process's lock is taken before its queue's lock.
+//
+// Each queue has NPRIO levels, run highest first (a multi-level
+// feedback queue). A process that runs out its level's quantum
+// drops a level, so processes that mostly sleep keep priority
+// over those that compute. Every PRIOBOOST ticks all processes
+// go back up to their nice level, so that none starve.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int nlevel[NPRIO];
+  int n;
+  uint boosted;                 // last boost applied to the queue
+  uint64 runs;                  // processes this hart ran
+  uint64 steals;                // of them, taken from another queue
+  uint64 migrations;            // of them, last run on another hart
+} runqs[NCPU];
+
+#define ALLCPUS   ((1L << NCPU) - 1)
+#define HOTCYCLES (TIMEFREQ / 2000)  // half a millisecond
+
+static uint64 onlinecpus;       // harts in scheduler(), by bit
+
+static int quantum[NPRIO] = PRIOQUANTA;
+
+#define BOOST() ((uint)(ticks / PRIOBOOST))
+
+// Per-hart histograms of scheduling latencies, in time CSR
+// cycles, by log2: bucket i counts times in [2^i, 2^(i+1)).
+// A hart updates only its own, with interrupts off, so they
+// need no lock; readers and statswrite() may see them torn.
+
+struct schedhist {
+  uint64 wait[NHIST];           // RUNNABLE until run
+  uint64 run[NHIST];            // running until sched()
+  uint64 sleep[NHIST];          // SLEEPING until ready()
+} schedhists[NCPU];
+
+static struct proc *runqget(struct runq *rq, int id);
+static int runqpending(void);
+static struct proc *runqsteal(int id);
+
+// Sleeping processes, on queues hashed by channel, so that
+// wakeup() looks only at processes that may be sleeping on its
+// channel. A queue's lock protects the chan and wqnext of the
+// processes on it, and is taken before their locks.
+#define NWAITQ 61
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitqs[NWAITQ];
+
+#define WAITQ(chan) (&waitqs[(uint64)(chan) % NWAITQ])
+
+// The trapframes, page tables and kernel stacks of dead
+// processes, ready for allocproc() to give to new ones without
+// building them again. Every process maps its trapframe at
+// TRAPFRAME and its kernel stack at KSTACK(0), so any process
+// can take any of them.
+#define NPROCCACHE 8
+
+struct procmem {
+  struct trapframe *trapframe;
+  struct usyscall *usyscall;
+  pagetable_t pagetable;        // maps both
+  pagetable_t kpagetable;       // maps a kernel stack
+};
+
+struct {
+  struct spinlock lock;
+  struct procmem mem[NPROCCACHE];
+  int n;
+  uint64 hits;
+  uint64 misses;
+} proccache;
+
+static void
+procctor(void *obj)
+{
+  struct proc *p = obj;
+
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  initlock(&p->sharelock, "share");
+}
+
 // initialize the proc table at boot time.
 void
 procinit(void)
 {
-  struct proc *p;
-  
-  initlock(&pid_lock, "nextpid");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-
-      // Allocate a page for the process's kernel stack.
-      // Map it high in memory, followed by an invalid
-      // guard page.
-
-      /* comment out here, move this functionality to allocproc
-      char *pa = kalloc();
-      if(pa == 0)
-        panic("kalloc");
-      uint64 va = KSTACK((int) (p - proc));
-      kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-      p->kstack = va;
-      */
-      p->kstack = 0;
-  }
+  initticketlock(&ptable.lock, "ptable");
+  initlock(&childlock, "children");
+  ptable.nextpid = 1;
+  procslab = slabcreate("proc", sizeof(struct proc), procctor);
+  initlock(&proccache.lock, "proccache");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runqs[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitqs[i].lock, "waitq");
   kvminithart();
+  statsregister("proc", statsproc, 0);
+  statsregister("runq", statsrunq, 0);
+  statsregister("sched", statssched, schedreset);
+  statscounter("sched", "runs", &runqs[0].runs, sizeof(runqs[0]));
+  statscounter("sched", "steals", &runqs[0].steals, sizeof(runqs[0]));
+  statscounter("sched", "migrations", &runqs[0].migrations, sizeof(runqs[0]));
 }
 
 // Must be called with interrupts disabled,
@@ -77,42 +202,260 @@ myproc(void) {
   return p;
 }
 
-int
-allocpid() {
-  int pid;
-  
-  acquire(&pid_lock);
-  pid = nextpid;
-  nextpid = nextpid + 1;
-  release(&pid_lock);
+// The process after p in the table, or the first if p is 0;
+// 0 after the last. Needs no lock, but the process may be
+// UNUSED, or die after the call.
+struct proc*
+procnext(struct proc *p)
+{
+  return p ? p->allnext : ptable.all;
+}
 
-  return pid;
+// The process with pid, or 0. Returns without its lock, so the
+// caller must check p->pid again once it holds p->lock.
+static struct proc*
+procfind(int pid)
+{
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  for(p = *PIDHASH(pid); p; p = p->hnext)
+    if(p->pid == pid)
+      break;
+  release(&ptable.lock);
+  return p;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Take an UNUSED proc from the free list, or a new one from
+// the slab cache, and give it a pid. Returns it locked and
+// USED, or 0 if the table is full or memory has run out.
 static struct proc*
-allocproc(void)
+procget(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
+  acquire(&ptable.lock);
+  if((p = ptable.free) != 0){
+    ptable.free = p->next;
+  } else if(ptable.nproc < NPROC && (p = slaballoc(procslab)) != 0){
+    // no one can see p until it is on the all list.
+    p->allnext = ptable.all;
+    __sync_synchronize();
+    ptable.all = p;
+    ptable.nproc++;
+  }
+  release(&ptable.lock);
+  if(p == 0)
+    return 0;
+
+  // freeproc() may still hold the lock of a proc it has just
+  // put on the free list.
+  acquire(&p->lock);
+  p->state = USED;
+  acquire(&ptable.lock);
+  p->pid = ptable.nextpid++;
+  p->prev = 0;
+  p->next = ptable.live;
+  if(ptable.live)
+    ptable.live->prev = p;
+  ptable.live = p;
+  p->hnext = *PIDHASH(p->pid);
+  *PIDHASH(p->pid) = p;
+  release(&ptable.lock);
+  return p;
+}
+
+// Take p off the live list and out of the hash, and put it
+// on the free list. p->lock must be held.
+static void
+procput(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&ptable.lock);
+  for(pp = PIDHASH(p->pid); *pp != p; pp = &(*pp)->hnext)
+    ;
+  *pp = p->hnext;
+  if(p->prev)
+    p->prev->next = p->next;
+  else
+    ptable.live = p->next;
+  if(p->next)
+    p->next->prev = p->prev;
+  p->next = ptable.free;
+  ptable.free = p;
+  release(&ptable.lock);
+}
+
+// Give p a trapframe, page tables and kernel stack from the
+// cache. Returns 0, or -1 if the cache is empty.
+static int
+procmemget(struct proc *p)
+{
+  struct procmem *m;
+
+  acquire(&proccache.lock);
+  if(proccache.n == 0){
+    proccache.misses++;
+    release(&proccache.lock);
+    return -1;
+  }
+  m = &proccache.mem[--proccache.n];
+  p->trapframe = m->trapframe;
+  p->usyscall = m->usyscall;
+  p->pagetable = m->pagetable;
+  p->kpagetable = m->kpagetable;
+  p->kstack = KSTACK(0);
+  proccache.hits++;
+  release(&proccache.lock);
+  return 0;
+}
+
+// Keep dead p's trapframe, page tables and kernel stack in the
+// cache if there is room, taking them from p. p's page tables
+// must hold no user memory.
+static void
+procmemput(struct proc *p)
+{
+  struct procmem *m;
+
+  acquire(&proccache.lock);
+  if(proccache.n < NPROCCACHE){
+    m = &proccache.mem[proccache.n++];
+    m->trapframe = p->trapframe;
+    m->usyscall = p->usyscall;
+    m->pagetable = p->pagetable;
+    m->kpagetable = p->kpagetable;
+    p->trapframe = 0;
+    p->usyscall = 0;
+    p->pagetable = 0;
+    p->kpagetable = 0;
+    p->kstack = 0;
+  }
+  release(&proccache.lock);
+}
+
+// Give p, a new thread of leader l, a trapframe and kernel
+// stack in a free slot of l's page tables, reusing the pages an
+// earlier thread left there if there are any. Returns 0, or -1
+// if l has NTHREAD threads or memory has run out.
+static int
+threadmem(struct proc *p, struct proc *l)
+{
+  char *tf = 0, *ks = 0;
+  int t;
+
+  acquire(&l->sharelock);
+  for(t = 1; t < NTHREAD && (l->tslots & (1 << t)); t++)
+    ;
+  if(t == NTHREAD)
+    goto bad;
+  if((l->tslotsmapped & (1 << t)) == 0){
+    if((tf = kalloc()) == 0 || (ks = kalloc()) == 0)
+      goto bad;
+    if(mappages(l->pagetable, TRAPFRAMET(t), PGSIZE, (uint64)tf, PTE_R | PTE_W) != 0)
+      goto bad;
+    if(mappages(l->kpagetable, KSTACK(t), PGSIZE, (uint64)ks, PTE_R | PTE_W) != 0){
+      uvmunmap(l->pagetable, TRAPFRAMET(t), 1, 0);
+      goto bad;
     }
+    l->tslotsmapped |= 1 << t;
   }
+  p->trapframe = (struct trapframe*)PTE2PA(*walk(l->pagetable, TRAPFRAMET(t), 0));
+  p->pagetable = l->pagetable;
+  p->kpagetable = l->kpagetable;
+  p->kstack = KSTACK(t);
+  p->tslot = t;
+  p->leader = l;
+  l->tslots |= 1 << t;
+  l->nthread++;
+  l->usyscall->nthread = l->nthread;
+  p->tsibling = l->threads;
+  l->threads = p;
+  release(&l->sharelock);
   return 0;
 
-found:
-  p->pid = allocpid();
+bad:
+  release(&l->sharelock);
+  if(tf)
+    kfree(tf);
+  if(ks)
+    kfree(ks);
+  return -1;
+}
+
+// Take dead thread p out of its leader's group. Its pages stay
+// mapped in the slot, for the next thread; other harts' TLBs may
+// still hold them.
+static void
+threadfree(struct proc *p)
+{
+  struct proc *l = p->leader, **pp;
+
+  acquire(&l->sharelock);
+  for(pp = &l->threads; *pp != p; pp = &(*pp)->tsibling)
+    ;
+  *pp = p->tsibling;
+  l->tslots &= ~(1 << p->tslot);
+  l->nthread--;
+  l->usyscall->nthread = l->nthread;
+  release(&l->sharelock);
+
+  p->trapframe = 0;
+  p->pagetable = 0;
+  p->kpagetable = 0;
+  p->kstack = 0;
+  p->tslot = 0;
+  p->leader = p;
+}
+
+// Free the trapframes and kernel stacks that dead threads of l
+// left in pagetable, l's user page table, and in its kernel page
+// table. l must have no threads left, and have flushed its TLB
+// entries for them, if need be.
+void
+threadunmap(struct proc *l, pagetable_t pagetable)
+{
+  for(int t = 1; t < NTHREAD; t++){
+    if(l->tslotsmapped & (1 << t)){
+      uvmunmap(pagetable, TRAPFRAMET(t), 1, 1);
+      uvmunmap(l->kpagetable, KSTACK(t), 1, 1);
+    }
+  }
+  l->tslotsmapped = 0;
+}
+
+// Get an UNUSED proc from the process table.
+// If found, initialize state required to run in the kernel,
+// and return with p->lock held. If l is not 0, the proc is a
+// thread of the leader l, sharing its page tables.
+// If there are no free procs, or a memory allocation fails, return 0.
+static struct proc*
+allocproc(struct proc *l)
+{
+  struct proc *p;
 
-  // Allocate a trapframe page.
-  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+  if((p = procget()) == 0)
+    return 0;
+  p->leader = p;
+  p->nthread = 1;
+  p->tslots = 1;
+
+  if(l){
+    if(threadmem(p, l) == 0)
+      goto ready;
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
+  if(procmemget(p) == 0)
+    goto mem;
+
+  // Allocate a trapframe page, and the USYSCALL page.
+  if((p->trapframe = (struct trapframe *)kalloc()) == 0 ||
+     (p->usyscall = (struct usyscall *)kzalloc()) == 0){
+    freeproc(p);
     release(&p->lock);
     return 0;
   }
@@ -141,6 +484,29 @@ found:
   ukvmmap(p->kpagetable, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
   p->kstack = va;
 
+mem:
+  p->usyscall->pid = p->pid;
+  p->usyscall->nthread = 1;
+  p->usyscall->tickcycles = TICKCYCLES;
+  p->usyscall->timefreq = TIMEFREQ;
+
+ready:
+  fdreset(p);
+  p->cpu = -1;
+  p->affinity = ALLCPUS;
+  p->ranat = 0;
+  p->nmigrate = 0;
+  p->nice = 0;
+  p->prio = 0;
+  p->slice = 0;
+  p->boosted = BOOST();
+  p->runtime = 0;
+  p->tracemask = 0;
+  p->nsyscall = 0;
+  p->syscycles = 0;
+  p->nbread = 0;
+  p->nbwrite = 0;
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -156,11 +522,30 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  if(p->leader != p)
+    threadfree(p);
+  if(p->tslotsmapped)
+    threadunmap(p, p->pagetable);
+
+  // drop any mappings (and their files and shared memory
+  // segments) left by a failed fork.
+  if(p->pagetable)
+    munmapall(p, 0);
+
+  // strip the page tables back to what allocproc() built, and
+  // keep them for the next process if the cache has room.
+  if(p->trapframe && p->usyscall && p->pagetable && p->kpagetable && p->kstack){
+    uvmrecycle(p->pagetable, p->kpagetable, p->sz);
+    p->sz = 0;
+    procmemput(p);
+  }
+
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+  if(p->usyscall)
+    kfree((void*)p->usyscall);
+  p->usyscall = 0;
 
   if (p->kstack != 0) {
     // find the kernel stack pa
@@ -168,17 +553,28 @@ freeproc(struct proc *p)
     kfree((void *)PTE2PA(*pte));
   }
 
-  // then free the tbl entrys
+  // then free the tbl entrys, before the user page
+  // table whose leaf tables they share.
   if (p->kpagetable) {
-    uvmfree_kpgtbl(p->kpagetable);
+    uvmfree_kpgtbl(p->kpagetable, p->pagetable);
   }
+  if(p->pagetable)
+    proc_freepagetable(p->pagetable, p->sz);
 
   p->pagetable = 0;
   p->kpagetable = 0;
   p->kstack = 0;
+  p->asidgen = 0;
+  fdreset(p);
+  p->nexecseg = 0;
+  p->swappable = 0;
+  p->swapwaits = 0;
   p->sz = 0;
+  procput(p);
   p->pid = 0;
   p->parent = 0;
+  p->child = 0;
+  p->sibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
@@ -216,6 +612,15 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // and the USYSCALL page, which user code may read.
+  if(mappages(pagetable, USYSCALL, PGSIZE,
+              (uint64)(p->usyscall), PTE_R | PTE_U) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;
 }
 
@@ -226,6 +631,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, USYSCALL, 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -247,7 +653,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy init's instructions
@@ -265,35 +671,45 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  ready(p);
 
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
+// Grow or shrink user memory by n bytes, setting *oldsz
+// to the size before.
 // Return 0 on success, -1 on failure.
 int
-growproc(int n)
+growproc(int n, uint64 *oldsz)
 {
   uint sz;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
-  sz = p->sz;
+  acquire(&p->sharelock);
+  sz = *oldsz = p->sz;
   if(n > 0){
-    // prevent user alloc higher than clint
-    if (PGROUNDUP(sz + n) >= PLIC) {
+    // prevent user alloc higher than plic, or into mmap()ed files
+    if (PGROUNDUP(sz + n) > mmapbase(p) || PGROUNDUP(sz + n) >= PLIC) {
+      release(&p->sharelock);
       return -1;
     }
 
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // pages are allocated on first touch, by uvmfault().
+    sz += n;
+  } else if(n < 0){
+    // other threads' harts might keep using the freed pages.
+    if(p->nthread > 1 ||
+       (sz = uvmdealloc(p->pagetable, sz, sz + n)) == p->sz){
+      release(&p->sharelock);
       return -1;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // the kernel page table shares the user's leaf tables, so
+    // only split or freed megapages need mirroring.
+    copy_upgtbl(p->pagetable, p->kpagetable, sz, p->sz);
+    tlbflush(p);
   }
-  // update the kernel page table
-  copy_upgtbl(p->pagetable, p->kpagetable, p->sz, sz);
   p->sz = sz;
+  release(&p->sharelock);
   return 0;
 }
 
@@ -306,22 +722,40 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // the child would get a copy of only one thread.
+  if(p->leader->nthread > 1)
+    return -1;
+
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
+  // Share user memory copy-on-write between parent and child.
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   copy_upgtbl(np->pagetable, np->kpagetable, 0, p->sz);
+  // uvmcopy() split the parent's megapages.
+  copy_upgtbl(p->pagetable, p->kpagetable, 0, p->sz);
+  if(mmapfork(p, np) < 0 || (p->nofile > NOFILE && fdgrow(np) < 0)){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  // the parent's writable pages are now read-only COW pages;
+  // drop the stale TLB entries.
+  tlbflush(p);
 
   np->sz = p->sz;
 
-  np->parent = p;
+  addchild(p, np);
+  np->nice = np->prio = p->nice;
+  np->tracemask = p->tracemask;
+  np->affinity = p->affinity;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -330,46 +764,209 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
+  for(i = 0; i < p->nofile; i++)
     if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
+      fdset(np, i, filedup(p->ofile[i]));
   np->cwd = idup(p->cwd);
+  if(p->execip)
+    np->execip = idup(p->execip);
+  memmove(np->execseg, p->execseg, sizeof(p->execseg));
+  np->nexecseg = p->nexecseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  ready(np);
+
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a new process running the program at path, without
+// copying the parent: the child gets fresh user memory from
+// execload() and, for each i < nfd, the parent's descriptor
+// fds[i] as its descriptor i (none if fds[i] is -1). It gets
+// no other open files. Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, int *fds, int nfd)
+{
+  int i, argc, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  if((np = allocproc(0)) == 0)
+    return -1;
+  // np is USED, so no one else will take it, and nothing looks
+  // at it until it is RUNNABLE; loading the program may sleep.
+  release(&np->lock);
+
+  // a thread's files are its leader's.
+  acquire(&l->sharelock);
+  for(i = 0; i < nfd; i++){
+    if(fds[i] == -1)
+      continue;
+    if(fds[i] < 0 || fds[i] >= l->nofile || l->ofile[fds[i]] == 0)
+      break;
+    fdset(np, i, filedup(l->ofile[fds[i]]));
+  }
+  release(&l->sharelock);
+  np->cwd = idup(p->cwd);
+
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  if(i < nfd || (argc = execload(np, path, argv)) < 0){
+    for(i = 0; i < nfd; i++){
+      if(np->ofile[i]){
+        fileclose(np->ofile[i]);
+        fdset(np, i, 0);
+      }
+    }
+    begin_op();
+    iput(np->cwd);
+    end_op();
+    np->cwd = 0;
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
 
+  acquire(&np->lock);
+  addchild(p, np);
+  np->nice = np->prio = p->nice;
+  np->tracemask = p->tracemask;
+  np->affinity = p->affinity;
+  pid = np->pid;
+  ready(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Start a thread of the current process that runs fn(arg) on
+// the user stack whose top is stack. It shares the memory and
+// open files of the process, and starts in the same working
+// directory. Returns its pid (the thread id), or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+  int tid;
+
+  // threads can't break copy-on-write sharing; see uvmunshare().
+  if(l->nthread == 1 && uvmunshare(l) < 0)
+    return -1;
+  if((np = allocproc(l)) == 0)
+    return -1;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+  np->parent = l;
+  np->cwd = idup(p->cwd);
+  np->nice = np->prio = p->nice;
+  np->tracemask = p->tracemask;
+  np->affinity = p->affinity;
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  tid = np->pid;
+  ready(np);
+  release(&np->lock);
+  return tid;
+}
+
+// Wait for thread tid of the current process to exit, and
+// store its exit status at addr if addr is not 0. If intr is
+// set, give up if the caller is killed. Returns tid, or -1.
+static int
+tjoin(int tid, uint64 addr, int intr)
+{
+  struct proc *t;
+  struct proc *p = myproc();
+
+  if((t = procfind(tid)) == 0)
+    return -1;
+  acquire(&t->lock);
+  for(;;){
+    // t may have died and been reused since procfind().
+    if(t->pid != tid || t == p || t->leader == t || t->leader != p->leader){
+      release(&t->lock);
+      return -1;
+    }
+    if(t->state == ZOMBIE)
+      break;
+    if(intr && p->killed){
+      release(&t->lock);
+      return -1;
+    }
+    // an exiting thread wakes its joiners holding t->lock.
+    sleep(t, &t->lock);
+  }
+  if(addr != 0 && copyout(p->pagetable, addr, (char *)&t->xstate,
+                          sizeof(t->xstate)) < 0){
+    release(&t->lock);
+    return -1;
+  }
+  freeproc(t);
+  release(&t->lock);
+  return tid;
+}
+
+int
+join(int tid, uint64 addr)
+{
+  return tjoin(tid, addr, 1);
+}
+
+// Make np a child of p, the current process or thread: a
+// child is the thread's that forked or spawned it, and only
+// that thread's wait() finds it. Caller must hold np->lock.
+static void
+addchild(struct proc *p, struct proc *np)
+{
+  np->parent = p;
+  acquire(&childlock);
+  np->sibling = p->child;
+  p->child = np;
+  release(&childlock);
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold p->lock.
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
-
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    // this code uses pp->parent without holding pp->lock.
-    // acquiring the lock first could cause a deadlock
-    // if pp or a child of pp were also in exit()
-    // and about to try to lock p.
-    if(pp->parent == p){
-      // pp->parent can't change between the check and the acquire()
-      // because only the parent changes it, and we're the parent.
-      acquire(&pp->lock);
-      pp->parent = initproc;
-      // we should wake up init here, but that would require
-      // initproc->lock, which would be a deadlock, since we hold
-      // the lock on one of init's children (pp). this is why
-      // exit() always wakes init (before acquiring any locks).
-      release(&pp->lock);
-    }
+  struct proc *pp, *last = 0;
+
+  for(pp = p->child; pp; pp = pp->sibling){
+    // pp->parent can't change before the acquire()
+    // because only the parent changes it, and we're the parent.
+    acquire(&pp->lock);
+    pp->parent = initproc;
+    // we should wake up init here, but that would require
+    // initproc->lock, which would be a deadlock, since we hold
+    // the lock on one of init's children (pp). this is why
+    // exit() always wakes init (before acquiring any locks).
+    release(&pp->lock);
+    last = pp;
   }
+  if(last == 0)
+    return;
+
+  // init may be walking its list, so it must see the rest
+  // of the splice before the new head.
+  acquire(&childlock);
+  last->sibling = initproc->child;
+  __sync_synchronize();
+  initproc->child = p->child;
+  p->child = 0;
+  release(&childlock);
 }
 
 // Exit the current process.  Does not return.
@@ -383,19 +980,62 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  if(p != p->leader){
+    // a thread exits alone; its memory and files are the
+    // leader's. the children it spawned go to init, as below.
+    begin_op();
+    iput(p->cwd);
+    end_op();
+    p->cwd = 0;
+
+    if(p->child){
+      acquire(&initproc->lock);
+      wakeup1(initproc);
+      release(&initproc->lock);
+    }
+    acquire(&p->lock);
+    reparent(p);
+    p->xstate = status;
+    p->state = ZOMBIE;
+    wakeup(p);
+    sched();
+    panic("zombie exit");
+  }
+
+  // Take the threads down first: they use the memory and
+  // the files about to be freed.
+  for(;;){
+    acquire(&p->sharelock);
+    struct proc *t = p->threads;
+    int tid = t ? t->pid : 0;
+    release(&p->sharelock);
+    if(t == 0)
+      break;
+    kill(tid);
+    tjoin(tid, 0, 0);
+  }
+
+  // Write back and remove memory-mapped files, while
+  // their files are still open.
+  munmapall(p, 1);
+
   // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
+  for(int fd = 0; fd < p->nofile; fd++){
     if(p->ofile[fd]){
       struct file *f = p->ofile[fd];
       fileclose(f);
-      p->ofile[fd] = 0;
+      fdset(p, fd, 0);
     }
   }
+  fdreset(p);
 
   begin_op();
   iput(p->cwd);
+  if(p->execip)
+    iput(p->execip);
   end_op();
   p->cwd = 0;
+  p->execip = 0;
 
   // we might re-parent a child to init. we can't be precise about
   // waking up init, since we can't acquire its lock once we've
@@ -443,7 +1083,7 @@ exit(int status)
 int
 wait(uint64 addr)
 {
-  struct proc *np;
+  struct proc *np, **pp;
   int havekids, pid;
   struct proc *p = myproc();
 
@@ -452,33 +1092,34 @@ wait(uint64 addr)
   acquire(&p->lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through our children looking for exited ones.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      // this code uses np->parent without holding np->lock.
-      // acquiring the lock first would cause a deadlock,
-      // since np might be an ancestor, and we already hold p->lock.
-      if(np->parent == p){
-        // np->parent can't change between the check and the acquire()
-        // because only the parent changes it, and we're the parent.
-        acquire(&np->lock);
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
-          freeproc(np);
+    for(pp = &p->child; (np = *pp) != 0; pp = &np->sibling){
+      // np->parent can't change before the acquire()
+      // because only the parent changes it, and we're the parent.
+      acquire(&np->lock);
+      havekids = 1;
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                                sizeof(np->xstate)) < 0) {
           release(&np->lock);
           release(&p->lock);
-          return pid;
+          return -1;
         }
+        acquire(&childlock);
+        // orphans may have been spliced in ahead of np.
+        while(*pp != np)
+          pp = &(*pp)->sibling;
+        *pp = np->sibling;
+        release(&childlock);
+        freeproc(np);
         release(&np->lock);
+        release(&p->lock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -504,47 +1145,351 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
+  uint64 start, now;
   
   c->proc = 0;
+  __sync_fetch_and_or(&onlinecpus, 1L << id);
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
     
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
+    if((p = runqget(&runqs[id], -1)) == 0)
+      p = runqsteal(id);
+    if(p == 0){
+#if !defined (LAB_FS)
+      intr_on();
+      // zero pages for kzalloc() while there is nothing
+      // to run, checking for runnable processes in between.
+      // then wait without timer ticks, for the next tsleep()
+      // deadline or for a kick from ready(); a process queued
+      // before timeridle() is seen here instead. wfi returns
+      // for an interrupt even with interrupts off.
+      if(kzerofill() == 0){
+        intr_off();
+        timeridle();
+        if(!runqpending())
+          asm volatile("wfi");
+        timerbusy();
+      }
+#endif
+      continue;
+    }
 
-        // switch to per process kernel pgtbl
-        w_satp(MAKE_SATP(p->kpagetable));
-        sfence_vma();
+    // p may still be on its way into sched() on another hart
+    // after yield() or sleep(); its lock makes us wait for it.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: queued process not runnable");
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    if(p->cpu >= 0 && p->cpu != id){
+      __sync_fetch_and_add(&runqs[id].migrations, 1);
+      p->nmigrate++;
+    }
+    p->cpu = id;
+    c->proc = p;
+    __sync_fetch_and_add(&runqs[id].runs, 1);
+    start = r_time();
+    histadd(schedhists[id].wait, start - p->stamp);
+
+    // switch to per process kernel pgtbl
+    asidswitch(p);
+    satpswitch(kvmsatp(p));
+
+    swtch(&c->context, &p->context);
+
+    // p's kernel pgtbl may be freed once p->lock is released.
+    satpswitch(kvmsatp(0));
+
+    now = r_time();
+    histadd(schedhists[id].run, now - start);
+    p->ranat = now;
+    if(p->state == SLEEPING)
+      p->stamp = now;
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
+  }
+}
 
-        swtch(&c->context, &p->context);
+// put p at the tail of its level of rq.
+// caller must hold rq->lock.
+static void
+runqput(struct runq *rq, struct proc *p)
+{
+  int l = p->prio;
+
+  p->rqnext = 0;
+  if(rq->tail[l])
+    rq->tail[l]->rqnext = p;
+  else
+    rq->head[l] = p;
+  rq->tail[l] = p;
+  rq->nlevel[l]++;
+  rq->n++;
+}
 
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+// Move every process on rq back up to its nice level.
+// caller must hold rq->lock.
+static void
+runqboost(struct runq *rq)
+{
+  struct proc *p, *next, *all = 0, **tail = &all;
+
+  for(int l = 0; l < NPRIO; l++){
+    *tail = rq->head[l];
+    if(rq->tail[l])
+      tail = &rq->tail[l]->rqnext;
+    rq->head[l] = rq->tail[l] = 0;
+    rq->nlevel[l] = 0;
+  }
+  rq->n = 0;
+  for(p = all; p; p = next){
+    next = p->rqnext;
+    p->prio = p->nice;
+    p->slice = 0;
+    p->boosted = rq->boosted;
+    runqput(rq, p);
+  }
+}
 
-        found = 1;
-      }
-      release(&p->lock);
+// The hart for p to queue on when it may not go back to the one
+// it last ran on: this one if its mask allows, else the allowed
+// hart with the shortest queue.
+static int
+runqpick(struct proc *p)
+{
+  int id, best = -1;
+  uint64 ok = p->affinity & onlinecpus;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  if(ok == 0 || (ok & (1L << id)))
+    return id;
+  for(int i = 0; i < NCPU; i++)
+    if((ok & (1L << i)) && (best < 0 || runqs[i].n < runqs[best].n))
+      best = i;
+  return best;
+}
+
+// Make p RUNNABLE and put it on the queue of the hart it last
+// ran on, or of this hart if it hasn't run yet, or of another
+// if its affinity mask no longer allows that one.
+// Caller must hold p->lock.
+static void
+ready(struct proc *p)
+{
+  struct runq *rq;
+  uint64 now;
+
+  if(!holding(&p->lock))
+    panic("ready");
+  now = r_time();
+  if(p->state == SLEEPING){
+    push_off();
+    histadd(schedhists[cpuid()].sleep, now - p->stamp);
+    pop_off();
+  }
+  p->stamp = now;
+  p->state = RUNNABLE;
+  if(p->boosted != BOOST()){
+    p->boosted = BOOST();
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+  if(p->prio < p->nice)
+    p->prio = p->nice;
+  if(p->cpu >= 0 && (p->affinity & (1L << p->cpu)))
+    rq = &runqs[p->cpu];
+  else
+    rq = &runqs[runqpick(p)];
+
+  acquire(&rq->lock);
+  runqput(rq, p);
+  release(&rq->lock);
+  timerkick(rq - runqs);
+}
+
+// Is any process queued, for this hart to run or steal?
+static int
+runqpending(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    if(runqs[i].n > 0)
+      return 1;
+  return 0;
+}
+
+// May hart id take p from another hart's queue? Not if p's mask
+// forbids it, nor while p's own hart may still have it cached.
+static int
+stealable(struct proc *p, int id, uint64 now)
+{
+  return (p->affinity & (1L << id)) && now - p->ranat >= HOTCYCLES;
+}
+
+// Take the first process of the highest level of rq, or if
+// id >= 0 the first that hart id may steal, or return 0.
+static struct proc*
+runqget(struct runq *rq, int id)
+{
+  struct proc *p = 0, *prev, **pp;
+  uint64 now = r_time();
+
+  if(rq->n == 0)
+    return 0;
+  acquire(&rq->lock);
+  if(rq->boosted != BOOST()){
+    rq->boosted = BOOST();
+    runqboost(rq);
+  }
+  for(int l = 0; l < NPRIO && p == 0; l++){
+    prev = 0;
+    for(pp = &rq->head[l]; (p = *pp) != 0; pp = &p->rqnext){
+      if(id < 0 || stealable(p, id, now))
+        break;
+      prev = p;
     }
-#if !defined (LAB_FS)
-    if(found == 0) {
-      intr_on();
-      // switch back to global kernel pgtbl
-      kvminithart();
-      asm volatile("wfi");
+    if(p){
+      *pp = p->rqnext;
+      if(rq->tail[l] == p)
+        rq->tail[l] = prev;
+      rq->nlevel[l]--;
+      rq->n--;
     }
-#else
-    ;
-#endif
   }
+  release(&rq->lock);
+  return p;
+}
+
+// Account a timer tick to the current process. Returns 1 if it
+// should yield: it has used up its quantum, and drops a level,
+// or a process of higher priority is waiting for this hart.
+int
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq;
+
+  if(p == 0 || p->state != RUNNING)
+    return 0;
+  p->runtime++;
+  if(p->boosted != BOOST()){
+    p->boosted = BOOST();
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+  if(++p->slice >= quantum[p->prio]){
+    p->slice = 0;
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    return 1;
+  }
+  // the counts are read without the lock; a miss just waits
+  // for the next tick.
+  push_off();
+  rq = &runqs[cpuid()];
+  pop_off();
+  for(int l = 0; l < p->prio; l++)
+    if(rq->nlevel[l] > 0)
+      return 1;
+  return 0;
+}
+
+// Let process pid run only on the harts in mask, by bit; those
+// that are not running are left out. Returns 0, or -1 if there
+// is no such process or no such hart. If that is the calling
+// process, it moves off this hart at once if it must; others
+// move when they are next queued.
+int
+setaffinity(int pid, uint64 mask)
+{
+  struct proc *p;
+  int moved;
+
+  if((mask &= onlinecpus) == 0 || (p = procfind(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return -1;
+  }
+  p->affinity = mask;
+  moved = p == myproc() && (mask & (1L << p->cpu)) == 0;
+  release(&p->lock);
+  if(moved)
+    yield();
+  return 0;
+}
+
+// The affinity mask of process pid, or -1 if there is none.
+uint64
+getaffinity(int pid)
+{
+  struct proc *p;
+  uint64 mask;
+
+  if((p = procfind(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  mask = p->pid == pid && p->state != UNUSED ? p->affinity & onlinecpus : -1;
+  release(&p->lock);
+  return mask;
+}
+
+// Set the nice level of process pid, the priority it starts at
+// and is boosted back to. Returns 0, or -1 if there is no such
+// process.
+int
+setpriority(int pid, int nice)
+{
+  struct proc *p;
+
+  if(nice < 0 || nice >= NPRIO || (p = procfind(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return -1;
+  }
+  p->nice = nice;
+  // others pick it up when they are next queued.
+  if(p == myproc())
+    p->prio = nice;
+  release(&p->lock);
+  return 0;
+}
+
+// Take a process from the longest queue of another hart for
+// hart id to run, or from any other that has one it may steal,
+// or return 0 if there is none.
+static struct proc*
+runqsteal(int id)
+{
+  struct runq *busiest = 0;
+  struct proc *p = 0;
+
+  // the lengths are read without locks; runqget() rechecks.
+  for(int i = 0; i < NCPU; i++){
+    if(i != id && runqs[i].n > 0 && (busiest == 0 || runqs[i].n > busiest->n))
+      busiest = &runqs[i];
+  }
+  if(busiest == 0)
+    return 0;
+  if((p = runqget(busiest, id)) == 0){
+    for(int i = 0; i < NCPU && p == 0; i++)
+      if(i != id && &runqs[i] != busiest)
+        p = runqget(&runqs[i], id);
+  }
+  if(p)
+    __sync_fetch_and_add(&runqs[id].steals, 1);
+  return p;
 }
 
 // Switch to scheduler.  Must hold only p->lock
@@ -580,11 +1525,27 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  ready(p);
   sched();
   release(&p->lock);
 }
 
+// Start a kernel process that runs fn, which never returns.
+// Like a fork child, it first runs holding its p->lock, and
+// must release it. It has no user memory.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc(0)) == 0)
+    panic("kproc");
+  p->context.ra = (uint64)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  ready(p);
+  release(&p->lock);
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -612,6 +1573,16 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = WAITQ(chan);
+  struct proc **pp;
+
+  // Get on chan's wait queue while still holding lk, so
+  // that any wakeup(chan) after lk is released finds p.
+  acquire(&wq->lock);
+  p->chan = chan;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
@@ -625,46 +1596,76 @@ sleep(void *chan, struct spinlock *lk)
   }
 
   // Go to sleep.
-  p->chan = chan;
   p->state = SLEEPING;
 
   sched();
 
-  // Tidy up.
+  // Tidy up: get off the queue, unless wakeup() took p off
+  // already. p->lock comes after wq->lock.
+  release(&p->lock);
+  acquire(&wq->lock);
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext){
+    if(*pp == p){
+      *pp = p->wqnext;
+      break;
+    }
+  }
   p->chan = 0;
+  release(&wq->lock);
 
   // Reacquire original lock.
-  if(lk != &p->lock){
-    release(&p->lock);
-    acquire(lk);
-  }
+  acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
+// Must be called without any p->lock but the caller's own.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeupn(chan, -1);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+// Wake up at most n processes sleeping on chan, all of them
+// if n is -1. Returns how many were woken.
+int
+wakeupn(void *chan, int n)
+{
+  struct waitq *wq = WAITQ(chan);
+  struct proc *p, **pp;
+  int woken = 0;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != 0 && woken != n; ){
+    if(p->chan == chan){
+      // if p is still on its way into sched(), it holds
+      // p->lock until it is SLEEPING. a kill() may have
+      // woken it already, leaving it on the queue.
+      acquire(&p->lock);
+      if(p->state == SLEEPING){
+        *pp = p->wqnext;
+        ready(p);
+        release(&p->lock);
+        woken++;
+        continue;
+      }
+      release(&p->lock);
     }
-    release(&p->lock);
+    pp = &p->wqnext;
   }
+  release(&wq->lock);
+  return woken;
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
-// Caller must hold p->lock.
+// Caller must hold p->lock. p takes itself off its wait
+// queue when it runs.
 static void
 wakeup1(struct proc *p)
 {
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    ready(p);
   }
 }
 
@@ -676,20 +1677,21 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  if((p = procfind(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  // p may have died and been reused since procfind().
+  if(p->pid != pid){
     release(&p->lock);
+    return -1;
   }
-  return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    ready(p);
+  }
+  release(&p->lock);
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -730,6 +1732,7 @@ procdump(void)
 {
   static char *states[] = {
   [UNUSED]    "unused",
+  [USED]      "used  ",
   [SLEEPING]  "sleep ",
   [RUNNABLE]  "runble",
   [RUNNING]   "run   ",
@@ -739,14 +1742,97 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
+  for(p = ptable.live; p; p = p->next){
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %s ptpages %d prio %d runtime %d reads %d writes %d", p->pid,
+           state, p->name, proc_pgtblpages(p), p->prio, (int)p->runtime,
+           (int)p->nbread, (int)p->nbwrite);
     printf("\n");
   }
 }
+
+// Per-process memory use, for the statistics device:
+// user size, pages present, and page-table pages. Also how
+// often allocproc() found ready-made memory in the cache.
+static int
+statsproc(char *buf, int sz)
+{
+  struct proc *p;
+  int n, hits, total;
+
+  acquire(&proccache.lock);
+  hits = proccache.hits;
+  total = proccache.hits + proccache.misses;
+  n = snprintf(buf, sz, "proc cache: cached %d hits %d misses %d hit rate %d%%\n",
+               proccache.n, hits, total - hits, total ? hits * 100 / total : 0);
+  release(&proccache.lock);
+
+  for(p = procnext(0); p; p = procnext(p)){
+    acquire(&p->lock);
+    if(p->state != UNUSED && p->state != USED && p->state != ZOMBIE)
+      n += snprintf(buf+n, sz-n, "proc %d %s: sz %d resident %d ptpages %d "
+                    "syscalls %d cycles %d cpu %d migrations %d reads %d writes %d\n",
+                    p->pid, p->name, (int)p->sz, proc_residentpages(p),
+                    proc_pgtblpages(p), (int)p->nsyscall, (int)p->syscycles,
+                    p->cpu, (int)p->nmigrate, (int)p->nbread, (int)p->nbwrite);
+    release(&p->lock);
+  }
+  return n;
+}
+
+// Run-queue lengths, and how many processes each hart ran and
+// stole, for the statistics device.
+static int
+statsrunq(char *buf, int sz)
+{
+  int n = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    struct runq *rq = &runqs[i];
+    acquire(&rq->lock);
+    if(rq->runs > 0 || rq->n > 0)
+      n += snprintf(buf+n, sz-n, "runq %d: len %d runs %d steals %d migrations %d\n",
+                    i, rq->n, (int)rq->runs, (int)rq->steals, (int)rq->migrations);
+    release(&rq->lock);
+  }
+  return n;
+}
+
+static int
+statshist(char *buf, int sz, int id, char *name, uint64 *h)
+{
+  int n;
+
+  n = snprintf(buf, sz, "sched %d %s:", id, name);
+  for(int i = 0; i < NHIST; i++)
+    if(h[i])
+      n += snprintf(buf+n, sz-n, " %d:%d", i, (int)h[i]);
+  n += snprintf(buf+n, sz-n, "\n");
+  return n;
+}
+
+static int
+statssched(char *buf, int sz)
+{
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "sched histograms: log2(cycles):count\n");
+  for(int i = 0; i < NCPU; i++){
+    struct schedhist *s = &schedhists[i];
+    if(runqs[i].runs == 0)
+      continue;
+    n += statshist(buf+n, sz-n, i, "wait", s->wait);
+    n += statshist(buf+n, sz-n, i, "run", s->run);
+    n += statshist(buf+n, sz-n, i, "sleep", s->sleep);
+  }
+  return n;
+}
+
+static void
+schedreset(void)
+{
+  memset(schedhists, 0, sizeof(schedhists));
+}
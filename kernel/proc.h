@@ -24,6 +24,8 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this TLB was flushed for.
+  int kick;                   // printf() logged; pop_off() wakes kprintd.
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,28 +82,124 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
-enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
+// a memory-mapped file, see mmap.c.
+struct vma {
+  uint64 addr;                 // start, page-aligned
+  uint64 len;                  // bytes, page-aligned
+  int prot;                    // PROT_READ etc.
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  uint64 off;                  // file (or segment) offset of addr
+  struct file *f;              // the file mapped, or 0
+  struct shm *shm;             // or the shared memory segment
+};
+
+// a shared memory segment; see shm.c.
+struct shm {
+  int key;
+  int ref;                     // VMAs that map it
+  int npages;
+  uint64 page[NSHMPAGE];       // physical addresses
+};
+
+// a program segment, paged in from the executable by execfault().
+struct execseg {
+  uint64 va;                   // start, page-aligned
+  uint64 filesz;               // bytes backed by the file
+  uint64 memsz;                // bytes in memory; the rest is zero
+  uint off;                    // file offset of va
+  uint flags;                  // ELF_PROG_FLAG_*
+};
+
+#define NFHELD 2  // files argfd() may hold at once
+
 struct proc {
   struct spinlock lock;
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
   struct proc *parent;         // Parent process
-  void *chan;                  // If non-zero, sleeping on chan
+  void *chan;                  // If non-zero, sleeping on chan (its wait queue's lock)
+  struct proc *wqnext;         // Next on chan's wait queue (ditto)
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Hart it last ran on, or -1
+  struct proc *rqnext;         // Next on its run queue
+  int nice;                    // Priority level it is boosted back to
+  uint64 affinity;             // Harts it may run on, by bit; see setaffinity()
+
+  // ptable.lock must be held when using these:
+  struct proc *next;           // Next on the live or free list
+  struct proc *prev;           // Previous on the live list
+  struct proc *hnext;          // Next in its pid hash chain
+  struct proc *allnext;        // Next in the table; set once
+
+  // childlock must be held when changing these:
+  struct proc *child;          // First child
+  struct proc *sibling;        // Next child of parent
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   pagetable_t kpagetable;      // kernel page table
+  uint asid;                   // ASID of pagetable; kpagetable uses asid+1
+  uint64 asidgen;              // ASID generation that asid belongs to
+  uint64 asidcpus;             // harts that may cache entries for asid
   struct trapframe *trapframe; // data page for trampoline.S
+  struct usyscall *usyscall;   // mapped at USYSCALL; 0 in a thread
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
+  struct file **ofile;         // Open files: ofile0, or a page of MAXFD; see fdgrow()
+  int nofile;                  // Descriptors ofile has room for
+  uint64 fdused[MAXFD/64];     // Bitmap of open descriptors
+  struct file *ofile0[NOFILE];
+  struct vma *vma[NVMA];       // Memory-mapped files
+  struct inode *execip;        // Executable, for demand paging
+  struct execseg execseg[NEXECSEG]; // Its segments
+  int nexecseg;
+  int swappable;               // kswapd may take pages while not RUNNING
+  int swapwaits;               // ticks the current fault waited for memory
+  uint64 tracemask;            // System calls to log, by bit; see trace()
+  uint64 nsyscall;             // System calls made
+  uint64 syscycles;            // time CSR cycles spent in them
+  uint64 nbread;               // Disk blocks it read into the buffer cache
+  uint64 nbwrite;              // and wrote, or added to a log transaction
+
+  // scheduling; changed by the process itself while it runs,
+  // by ready() under p->lock, and by a boost while it's queued.
+  int prio;                    // Current priority level
+  int slice;                   // Ticks run at this level
+  uint boosted;                // Last boost it got
+  uint64 runtime;              // Ticks run in all
+  uint64 stamp;                // r_time() when it last became RUNNABLE or SLEEPING
+  uint64 ranat;                // r_time() when it last stopped running
+  uint64 nmigrate;             // Times it ran on another hart than the last
+
+  // threads; see clone(). a thread shares the memory and the
+  // open files of its leader, which uses its own fields for
+  // them, and has only its own trapframe and kernel stack.
+  struct proc *leader;         // Process whose memory it uses: itself, unless a thread
+  int tslot;                   // Slot of its trapframe and kernel stack
+  struct file *fheld[NFHELD];  // Files argfd() holds for the current system call
+  int nfheld;
+
+  // of a leader; sharelock must be held when changing these,
+  // the page tables, or ofile.
+  struct spinlock sharelock;
+  struct proc *threads;        // Its other threads, linked through tsibling
+  struct proc *tsibling;
+  int nthread;                 // Threads, itself included
+  uint tslots;                 // Slots in use
+  uint tslotsmapped;           // Slots whose pages are mapped
+
+  // tickslock must be held when using these:
+  uint wakeat;                 // Tick tsleep() waits for
+  void *tchan;                 // What to wake at wakeat
+  struct proc *tnext;          // Next in tsleep(), by wakeat
   struct inode *cwd;           // Current directory
+  struct inode *dxdir;         // Directory to index after this system call; see dirindex()
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,142 @@
+//
+// Sampling profiler.
+// While profiling is on, every hart takes a timer interrupt each
+// PROFCYCLES, not just at each tick, and usertrap() and
+// kerneltrap() pass the interrupted pc to profsample(), which
+// adds it to the hart's ring of samples. Reads of the profile
+// device take samples out of the rings; writes of "1" and "0"
+// turn profiling on, emptying the rings, and off.
+//
+// Each ring has one writer, its hart with interrupts off, and
+// one reader, under prof.lock, so it needs no lock of its own.
+// While profiling is off, profsample() only tests the flag.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "prof.h"
+#include "defs.h"
+
+static int statsprof(char*, int);
+
+#define NPROFSAMPLE 256   // samples each hart's ring holds
+
+volatile int profiling;
+
+struct profring {
+  struct profsample s[NPROFSAMPLE];
+  uint64 w;               // samples taken
+  uint64 r;               // samples read
+  uint64 ndrop;           // not taken because the ring was full
+};
+
+static struct {
+  struct spinlock lock;
+  struct profring ring[NCPU];
+} prof;
+
+// Record that this hart was at pc, in user mode if user is
+// set, when the timer interrupted it. Interrupts are off.
+void
+profsample(uint64 pc, int user)
+{
+  struct profring *r;
+  struct profsample *s;
+  struct proc *p;
+
+  if(!profiling)
+    return;
+  r = &prof.ring[cpuid()];
+  if(r->w - r->r == NPROFSAMPLE){
+    r->ndrop++;
+    return;
+  }
+  s = &r->s[r->w % NPROFSAMPLE];
+  p = myproc();
+  s->pc = pc;
+  s->user = user;
+  s->pid = p ? p->pid : 0;
+  safestrcpy(s->name, p ? p->name : "", sizeof(s->name));
+  // let the reader see the sample only once it's all there.
+  __sync_synchronize();
+  r->w++;
+}
+
+// user read()s of the profile device go here: whole samples,
+// as many as fit in n bytes and have been taken.
+int
+profread(int user_dst, uint64 dst, int n)
+{
+  struct profring *r;
+  int m = 0;
+  uint64 w;
+
+  acquire(&prof.lock);
+  for(r = prof.ring; r < &prof.ring[NCPU]; r++){
+    w = r->w;
+    __sync_synchronize();
+    while(r->r != w && n - m >= sizeof(struct profsample)){
+      if(either_copyout(user_dst, dst + m, &r->s[r->r % NPROFSAMPLE],
+                        sizeof(struct profsample)) == -1){
+        release(&prof.lock);
+        return -1;
+      }
+      m += sizeof(struct profsample);
+      __sync_synchronize();
+      r->r++;
+    }
+  }
+  release(&prof.lock);
+  return m;
+}
+
+// user write()s of the profile device go here: "1" turns
+// profiling on, and "0" off.
+int
+profwrite(int user_src, uint64 src, int n)
+{
+  char c;
+
+  if(n < 1 || either_copyin(&c, user_src, src, 1) == -1)
+    return -1;
+  if(c != '0' && c != '1')
+    return -1;
+  acquire(&prof.lock);
+  if(c == '1' && !profiling){
+    // harts don't add samples while it's off.
+    for(struct profring *r = prof.ring; r < &prof.ring[NCPU]; r++)
+      r->r = r->w;
+  }
+  profiling = c == '1';
+  release(&prof.lock);
+  return n;
+}
+
+void
+profinit(void)
+{
+  initlock(&prof.lock, "prof");
+  devsw[PROF].read = profread;
+  devsw[PROF].write = profwrite;
+  statsregister("prof", statsprof, 0);
+}
+
+static int
+statsprof(char *buf, int sz)
+{
+  uint64 n = 0, ndrop = 0;
+
+  for(struct profring *r = prof.ring; r < &prof.ring[NCPU]; r++){
+    n += r->w;
+    ndrop += r->ndrop;
+  }
+  return snprintf(buf, sz, "prof: on %d samples %d dropped %d\n",
+                  profiling, (int)n, (int)ndrop);
+}
@@ -0,0 +1,9 @@
+// A sample of what a hart was running at a timer interrupt,
+// as read from the profile device.
+
+struct profsample {
+  uint64 pc;            // sepc, user or kernel
+  int pid;              // of the process interrupted, or 0
+  int user;             // 1 if it was in user mode
+  char name[16];        // its name, for finding its .sym file
+};
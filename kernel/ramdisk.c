@@ -1,5 +1,7 @@
 //
-// ramdisk that uses the disk image loaded by qemu -initrd fs.img
+// ramdisk: a block device kept in memory, RAMDEV, which fsinit()
+// formats as an empty file system and mounts on /tmp. Reads and
+// writes are copies, with no device or interrupt to wait for.
 //
 
 #include "types.h"
@@ -12,34 +14,49 @@
 #include "fs.h"
 #include "buf.h"
 
+static int statsramdisk(char*, int);
+
+#define BPERPAGE (PGSIZE / BSIZE)
+
+static struct {
+  char *page[(RAMFSSIZE + BPERPAGE - 1) / BPERPAGE];
+  uint64 nread;
+  uint64 nwrite;
+} ramdisk;
+
 void
 ramdiskinit(void)
 {
+  for(int i = 0; i < NELEM(ramdisk.page); i++)
+    if((ramdisk.page[i] = kzalloc()) == 0)
+      panic("ramdiskinit");
+  statsregister("ramdisk", statsramdisk, 0);
 }
 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Read or write b, which must be locked.
 void
-ramdiskrw(struct buf *b)
+ramdiskrw(struct buf *b, int write)
 {
+  char *addr;
+
   if(!holdingsleep(&b->lock))
     panic("ramdiskrw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("ramdiskrw: nothing to do");
-
-  if(b->blockno >= FSSIZE)
+  if(b->blockno >= RAMFSSIZE)
     panic("ramdiskrw: blockno too big");
 
-  uint64 diskaddr = b->blockno * BSIZE;
-  char *addr = (char *)RAMDISK + diskaddr;
-
-  if(b->flags & B_DIRTY){
-    // write
+  addr = ramdisk.page[b->blockno / BPERPAGE] + (b->blockno % BPERPAGE) * BSIZE;
+  if(write){
     memmove(addr, b->data, BSIZE);
-    b->flags &= ~B_DIRTY;
+    __sync_fetch_and_add(&ramdisk.nwrite, 1);
   } else {
-    // read
     memmove(b->data, addr, BSIZE);
-    b->flags |= B_VALID;
+    __sync_fetch_and_add(&ramdisk.nread, 1);
   }
 }
+
+static int
+statsramdisk(char *buf, int sz)
+{
+  return snprintf(buf, sz, "ramdisk: blocks %d reads %d writes %d\n",
+                  RAMFSSIZE, (int)ramdisk.nread, (int)ramdisk.nwrite);
+}
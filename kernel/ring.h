@@ -0,0 +1,38 @@
+// A submission and completion ring, in user memory, for
+// ringenter(): user code queues operations at sqtail, and
+// ringenter() performs them in order, from sqhead on, posting
+// each one's result at cqtail. Indices run freely, and are
+// taken modulo RINGSIZE. Each side advances only its own two.
+
+#define RINGSIZE 64     // entries in each queue; a power of 2
+
+#define RING_READ   1   // read(fd, addr, n)
+#define RING_WRITE  2   // write(fd, addr, n)
+#define RING_PREAD  3   // pread(fd, addr, n, off)
+#define RING_PWRITE 4   // pwrite(fd, addr, n, off)
+#define RING_OPEN   5   // open(addr, n)
+#define RING_CLOSE  6   // close(fd)
+
+struct sqe {
+  int op;               // RING_*
+  int fd;
+  uint64 addr;          // buffer, or path for RING_OPEN
+  int n;                // bytes, or mode for RING_OPEN
+  uint off;
+  uint64 data;          // passed through to the completion
+};
+
+struct cqe {
+  uint64 data;
+  int res;              // what the system call would return
+  int pad;
+};
+
+struct ring {
+  uint sqhead;          // advanced by the kernel
+  uint sqtail;          // by user code
+  uint cqhead;          // by user code
+  uint cqtail;          // by the kernel
+  struct sqe sq[RINGSIZE];
+  struct cqe cq[RINGSIZE];
+};
@@ -40,6 +40,7 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User memory
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -186,6 +187,15 @@ w_mtvec(uint64 x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// address-space identifier field of satp. TLB entries are tagged
+// with the ASID, so switching between tagged page tables does not
+// require a flush. ASID 0 is used as "untagged".
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK (0xFFFFL << SATP_ASID_SHIFT)
+#define SATP_ASID(satp) (((satp) & SATP_ASID_MASK) >> SATP_ASID_SHIFT)
+#define MAKE_SATP_ASID(pagetable, asid) \
+  (MAKE_SATP(pagetable) | (((uint64)(asid)) << SATP_ASID_SHIFT))
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void 
@@ -248,6 +258,21 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor Counter-Enable
+static inline void 
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+static inline uint64
+r_scounteren()
+{
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -257,6 +282,24 @@ r_time()
   return x;
 }
 
+// cycles and instructions retired by this hart, which
+// user mode may read too; see trapinithart().
+static inline uint64
+r_cycle()
+{
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
+static inline uint64
+r_instret()
+{
+  uint64 x;
+  asm volatile("csrr %0, instret" : "=r" (x) );
+  return x;
+}
+
 // enable device interrupts
 static inline void
 intr_on()
@@ -319,6 +362,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries tagged with one ASID.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
+// flush the TLB entry for one page of one ASID.
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
@@ -331,6 +388,10 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty: written since mapped
+#define PTE_COW (1L << 8) // RSW bit: copy-on-write page shared after fork
+#define PTE_SWAP (1L << 9) // RSW bit, with PTE_V clear: page is in swap
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -344,6 +405,13 @@ sfence_vma()
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
 #define PX(level, va) ((((uint64) (va)) >> PXSHIFT(level)) & PXMASK)
 
+// bytes mapped by a leaf PTE at level; a level-1 leaf is a
+// 2MB megapage.
+#define PXSIZE(level)   (1L << PXSHIFT(level))
+#define MEGAPGSIZE      PXSIZE(1)
+#define MEGAORDER       9               // a megapage is 2^9 pages
+#define PTE_LEAF(pte)   (((pte) & (PTE_R|PTE_W|PTE_X)) != 0)
+
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
 // Sv39, to avoid having to sign-extend virtual addresses
@@ -0,0 +1,97 @@
+//
+// Shared memory segments.
+// A segment is a set of zeroed pages named by a key. shmat()
+// maps a segment into a process, creating it if need be, as a
+// VMA with no file (see mmap.c); its pages are mapped in on
+// first touch, each mapping holding a reference to the page.
+// A segment lives as long as some VMA refers to it, fork()ed
+// copies included.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtable;
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shm");
+}
+
+// Find the segment with key, or create one of npages pages if
+// there is none. Returns it with a reference added, or 0 if an
+// existing segment is too small or memory has run out.
+struct shm*
+shmget(int key, int npages)
+{
+  struct shm *s, *free = 0;
+
+  if(npages <= 0 || npages > NSHMPAGE)
+    return 0;
+
+  acquire(&shmtable.lock);
+  for(s = shmtable.shm; s < &shmtable.shm[NSHM]; s++){
+    if(s->ref > 0 && s->key == key){
+      if(npages > s->npages){
+        release(&shmtable.lock);
+        return 0;
+      }
+      s->ref++;
+      release(&shmtable.lock);
+      return s;
+    }
+    if(s->ref == 0 && free == 0)
+      free = s;
+  }
+  if((s = free) == 0){
+    release(&shmtable.lock);
+    return 0;
+  }
+  for(s->npages = 0; s->npages < npages; s->npages++){
+    if((s->page[s->npages] = (uint64)kzalloc()) == 0){
+      while(s->npages > 0)
+        kfree((void*)s->page[--s->npages]);
+      release(&shmtable.lock);
+      return 0;
+    }
+  }
+  s->key = key;
+  s->ref = 1;
+  release(&shmtable.lock);
+  return s;
+}
+
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmtable.lock);
+  if(s->ref < 1)
+    panic("shmdup");
+  s->ref++;
+  release(&shmtable.lock);
+}
+
+// Drop a reference to s, freeing its pages with the last one.
+// Pages still mapped somewhere keep the references of their
+// mappings.
+void
+shmput(struct shm *s)
+{
+  acquire(&shmtable.lock);
+  if(s->ref < 1)
+    panic("shmput");
+  if(--s->ref == 0){
+    while(s->npages > 0)
+      kfree((void*)s->page[--s->npages]);
+  }
+  release(&shmtable.lock);
+}
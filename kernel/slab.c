@@ -0,0 +1,214 @@
+//
+// Slab allocator, for small fixed-size kernel objects.
+// Each cache hands out objects of one size, carved out of
+// pages from kalloc() (slabs). An object's slab is the page
+// it lies in. Objects are run through the cache's constructor
+// once, when their slab is created, and must be freed in their
+// constructed state, so that allocation needn't initialize
+// them again.
+//
+// Each hart keeps a magazine of a few free objects per cache,
+// so that most allocations and frees take no lock.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+static int statsslab(char*, int);
+
+#define NSLABCACHE 16
+#define MAGSIZE    8
+
+// header at the start of each slab page; objects follow.
+struct slab {
+  struct slab *next;
+  int inuse;                    // objects handed out, or in magazines
+  uint64 used[PGSIZE/8/64];     // bitmap of objects in use
+};
+
+struct slabcache {
+  struct spinlock lock;
+  char *name;
+  uint size;                    // object size, rounded up to 8
+  uint nper;                    // objects per slab
+  void (*ctor)(void*);
+  struct slab *slabs;
+  int nslab;
+  int nfree;                    // free objects in slabs
+  uint64 nalloc;
+  struct {
+    int n;
+    void *obj[MAGSIZE];
+  } mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct slabcache cache[NSLABCACHE];
+  int n;
+} slabs;
+
+#define SLABHDR  ((sizeof(struct slab) + 7) & ~7)
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+  statsregister("slab", statsslab, 0);
+}
+
+// Create a cache of objects of the given size. ctor, if not 0,
+// initializes each object once, when its slab is allocated.
+struct slabcache*
+slabcreate(char *name, uint size, void (*ctor)(void*))
+{
+  struct slabcache *c;
+
+  size = (size + 7) & ~7;
+  if(size == 0 || size > (PGSIZE - SLABHDR) / 2)
+    panic("slabcreate: size");
+  acquire(&slabs.lock);
+  if(slabs.n == NSLABCACHE)
+    panic("slabcreate: too many caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  initlock(&c->lock, "slabcache");
+  c->name = name;
+  c->size = size;
+  c->nper = (PGSIZE - SLABHDR) / size;
+  c->ctor = ctor;
+  return c;
+}
+
+static void*
+slabobj(struct slabcache *c, struct slab *s, int i)
+{
+  return (char*)s + SLABHDR + i * c->size;
+}
+
+// allocate a new slab for c. caller must hold c->lock.
+static struct slab*
+slabgrow(struct slabcache *c)
+{
+  struct slab *s;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  memset(s, 0, SLABHDR);
+  if(c->ctor)
+    for(int i = 0; i < c->nper; i++)
+      c->ctor(slabobj(c, s, i));
+  s->next = c->slabs;
+  c->slabs = s;
+  c->nslab++;
+  c->nfree += c->nper;
+  return s;
+}
+
+// move up to n objects from c's slabs into the magazine
+// mobj, which holds *mn. caller must hold c->lock.
+static void
+slabtake(struct slabcache *c, int *mn, void **mobj, int n)
+{
+  struct slab *s;
+
+  for(s = c->slabs; s && n > 0; s = s->next){
+    for(int i = 0; s->inuse < c->nper && i < c->nper && n > 0; i++){
+      if(s->used[i/64] & (1L << (i%64)))
+        continue;
+      s->used[i/64] |= 1L << (i%64);
+      s->inuse++;
+      c->nfree--;
+      mobj[(*mn)++] = slabobj(c, s, i);
+      n--;
+    }
+  }
+  if(n > 0 && slabgrow(c))
+    slabtake(c, mn, mobj, n);
+}
+
+// return obj to its slab, freeing the slab if it is empty
+// and c has other free objects. caller must hold c->lock.
+static void
+slabput(struct slabcache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+  struct slab **pp;
+  int i = ((char*)obj - (char*)s - SLABHDR) / c->size;
+
+  if((s->used[i/64] & (1L << (i%64))) == 0)
+    panic("slabfree: not allocated");
+  s->used[i/64] &= ~(1L << (i%64));
+  s->inuse--;
+  c->nfree++;
+  if(s->inuse == 0 && c->nfree > c->nper){
+    for(pp = &c->slabs; *pp != s; pp = &(*pp)->next)
+      ;
+    *pp = s->next;
+    c->nslab--;
+    c->nfree -= c->nper;
+    kfree(s);
+  }
+}
+
+// Allocate an object from c. Returns 0 if out of memory.
+void*
+slaballoc(struct slabcache *c)
+{
+  void *obj = 0;
+
+  push_off();
+  int id = cpuid();
+  if(c->mag[id].n == 0){
+    acquire(&c->lock);
+    slabtake(c, &c->mag[id].n, c->mag[id].obj, MAGSIZE/2);
+    release(&c->lock);
+  }
+  if(c->mag[id].n > 0){
+    obj = c->mag[id].obj[--c->mag[id].n];
+    __sync_fetch_and_add(&c->nalloc, 1);
+  }
+  pop_off();
+  return obj;
+}
+
+// Free obj, which came from slaballoc(c), in its
+// constructed state.
+void
+slabfree(struct slabcache *c, void *obj)
+{
+  push_off();
+  int id = cpuid();
+  if(c->mag[id].n == MAGSIZE){
+    acquire(&c->lock);
+    while(c->mag[id].n > MAGSIZE/2)
+      slabput(c, c->mag[id].obj[--c->mag[id].n]);
+    release(&c->lock);
+  }
+  c->mag[id].obj[c->mag[id].n++] = obj;
+  pop_off();
+}
+
+static int
+statsslab(char *buf, int sz)
+{
+  int n = 0;
+
+  for(int i = 0; i < slabs.n; i++){
+    struct slabcache *c = &slabs.cache[i];
+    int cached = 0;
+    acquire(&c->lock);
+    for(int j = 0; j < NCPU; j++)
+      cached += c->mag[j].n;
+    n += snprintf(buf+n, sz-n, "slab %s: size %d inuse %d cached %d free %d slabs %d allocs %d\n",
+                  c->name, c->size, c->nslab * c->nper - c->nfree - cached, cached,
+                  c->nfree, c->nslab, (int)c->nalloc);
+    release(&c->lock);
+  }
+  return n;
+}
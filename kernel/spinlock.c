@@ -8,12 +8,73 @@
 #include "proc.h"
 #include "defs.h"
 
+// Locks are profiled by class: all the locks of one name (all
+// the proc locks, say) share a class, which counts per hart
+// their acquires, the acquires that had to spin, the spins, and
+// the longest any was held. Keeping per-hart counts in the
+// class, rather than counts in each lock, keeps the profiler
+// off the cache lines it measures, and locks in freed memory
+// needn't be unregistered. A lock with no class (classlock, or
+// one never passed to initlock()) isn't profiled.
+#define NLOCKCLASS 64
+#define NLOCKTOP   10
+
+struct lockclass {
+  char *name;
+  struct {
+    uint64 acquires;
+    uint64 contended;
+    uint64 spins;
+    uint64 maxhold;             // in time CSR cycles
+  } cpu[NCPU];
+};
+
+static struct lockclass lockclasses[NLOCKCLASS];
+static int nlockclass;
+static struct spinlock classlock;
+
+// the class of locks named name, or 0 if there are too many.
+static struct lockclass*
+lockclass(char *name)
+{
+  struct lockclass *c = 0;
+
+  acquire(&classlock);
+  for(int i = 0; i < nlockclass; i++){
+    if(strncmp(lockclasses[i].name, name, 32) == 0){
+      c = &lockclasses[i];
+      break;
+    }
+  }
+  if(c == 0 && nlockclass < NLOCKCLASS){
+    c = &lockclasses[nlockclass++];
+    c->name = name;
+  }
+  release(&classlock);
+  return c;
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->ticketed = 0;
+  lk->class = lockclass(name);
+}
+
+// Like initlock(), but make lk a ticket lock, for hot locks:
+// harts get it in the order they asked for it, so none starves,
+// and they wait by reading lk->serving instead of by atomic
+// swaps that keep its cache line bouncing between them.
+void
+initticketlock(struct spinlock *lk, char *name)
+{
+  initlock(lk, name);
+  lk->ticket = 0;
+  lk->serving = 0;
+  lk->ticketed = 1;
 }
 
 // Acquire the lock.
@@ -21,16 +82,27 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint64 spins = 0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  if(lk->ticketed){
+    // take a ticket, and wait for it to be served. only the
+    // holder writes lk->locked.
+    uint t = __sync_fetch_and_add(&lk->ticket, 1);
+    while(*(volatile uint*)&lk->serving != t)
+      spins++;
+    lk->locked = 1;
+  } else {
+    // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+    //   a5 = 1
+    //   s1 = &lk->locked
+    //   amoswap.w.aq a5, a5, (s1)
+    while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
+      spins++;
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +112,17 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+
+  if(lk->class){
+    struct lockclass *c = lk->class;
+    int id = cpuid();
+    c->cpu[id].acquires++;
+    if(spins){
+      c->cpu[id].contended++;
+      c->cpu[id].spins += spins;
+    }
+    lk->start = r_time();
+  }
 }
 
 // Release the lock.
@@ -49,6 +132,13 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+  if(lk->class){
+    uint64 held = r_time() - lk->start;
+    int id = cpuid();
+    if(held > lk->class->cpu[id].maxhold)
+      lk->class->cpu[id].maxhold = held;
+  }
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -67,6 +157,11 @@ release(struct spinlock *lk)
   //   s1 = &lk->locked
   //   amoswap.w zero, zero, (s1)
   __sync_lock_release(&lk->locked);
+  if(lk->ticketed){
+    // serve the next ticket; the fence above keeps the
+    // critical section's stores before it.
+    __sync_fetch_and_add(&lk->serving, 1);
+  }
 
   pop_off();
 }
@@ -105,6 +200,70 @@ pop_off(void)
   if(c->noff < 1)
     panic("pop_off");
   c->noff -= 1;
+  if(c->noff == 0 && c->kick){
+    // printf() logged while locks were held; see printf.c.
+    // kprintwake()'s own locks must not lose intena.
+    int intena = c->intena;
+    c->kick = 0;
+    kprintwake();
+    c->intena = intena;
+  }
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Report the NLOCKTOP classes of locks that spun the most.
+// Called by statsread(), holding its lock.
+int
+statslock(char *buf, int sz)
+{
+  // too big for the kernel stack.
+  static struct lockstat {
+    char *name;
+    uint64 acquires, contended, spins, maxhold;
+  } t[NLOCKCLASS];
+  struct lockstat tmp;
+  uint64 acquires = 0, spins = 0;
+  int n, nc, i, j;
+
+  acquire(&classlock);
+  nc = nlockclass;
+  release(&classlock);
+  for(i = 0; i < nc; i++){
+    struct lockclass *c = &lockclasses[i];
+    memset(&t[i], 0, sizeof(t[i]));
+    t[i].name = c->name;
+    for(j = 0; j < NCPU; j++){
+      t[i].acquires += c->cpu[j].acquires;
+      t[i].contended += c->cpu[j].contended;
+      t[i].spins += c->cpu[j].spins;
+      if(c->cpu[j].maxhold > t[i].maxhold)
+        t[i].maxhold = c->cpu[j].maxhold;
+    }
+    acquires += t[i].acquires;
+    spins += t[i].spins;
+    // insertion sort, most spins first.
+    for(j = i; j > 0 && t[j-1].spins < t[j].spins; j--){
+      tmp = t[j-1];
+      t[j-1] = t[j];
+      t[j] = tmp;
+    }
+  }
+
+  n = snprintf(buf, sz, "locks: classes %d acquires %d spins %d\n",
+               nc, (int)acquires, (int)spins);
+  for(i = 0; i < nc && i < NLOCKTOP; i++)
+    n += snprintf(buf+n, sz-n, "lock %s: acquires %d contended %d spins %d maxhold %d\n",
+                  t[i].name, (int)t[i].acquires, (int)t[i].contended,
+                  (int)t[i].spins, (int)t[i].maxhold);
+  return n;
+}
+
+void
+lockreset(void)
+{
+  acquire(&classlock);
+  for(int i = 0; i < nlockclass; i++)
+    memset(lockclasses[i].cpu, 0, sizeof(lockclasses[i].cpu));
+  release(&classlock);
+}
@@ -2,8 +2,17 @@
 struct spinlock {
   uint locked;       // Is the lock held?
 
+  // For ticket locks; see initticketlock():
+  int ticketed;      // Is it a ticket lock?
+  uint ticket;       // Next ticket to hand out.
+  uint serving;      // Ticket whose holder may have the lock.
+
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For profiling:
+  struct lockclass *class;  // Locks of its name; see spinlock.c.
+  uint64 start;             // r_time() when it was acquired.
 };
 
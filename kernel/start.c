@@ -38,6 +38,9 @@ start()
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // let supervisor mode read the cycle, time and instret CSRs.
+  w_mcounteren(r_mcounteren() | 7);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -59,17 +62,16 @@ timerinit()
   // each CPU has a separate source of timer interrupts.
   int id = r_mhartid();
 
-  // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
-  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
+  // ask the CLINT for the first timer interrupt. after that
+  // the timer is one-shot: supervisor mode programs each
+  // interrupt itself (see timer.c).
+  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + TICKCYCLES;
 
   // prepare information in scratch[] for timervec.
   // scratch[0..3] : space for timervec to save registers.
   // scratch[4] : address of CLINT MTIMECMP register.
-  // scratch[5] : desired interval (in cycles) between timer interrupts.
   uint64 *scratch = &mscratch0[32 * id];
   scratch[4] = CLINT_MTIMECMP(id);
-  scratch[5] = interval;
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -1,3 +1,21 @@
+//
+// The statistics and counters devices.
+// Subsystems register, with statsregister(), a function that
+// formats what they have to report, and one that resets what can
+// be reset; and, with statscounter(), named counters, kept per
+// hart or as one count. Registration may come at any time, even
+// before statsinit().
+//
+// A read of the statistics device streams each subsystem's text
+// in turn, under a "== name" line, so there is no limit to how
+// much they can say in all; only one subsystem's must fit in
+// BUFSZ. A read of the counters device returns a struct
+// counterrec for each counter, for tools. At the end both return
+// 0 and start over. Any write of the statistics device resets
+// the counters and the subsystems, and starts the next read
+// afresh.
+//
+
 #include <stdarg.h>
 
 #include "types.h"
@@ -7,53 +25,207 @@
 #include "fs.h"
 #include "file.h"
 #include "riscv.h"
+#include "stats.h"
 #include "defs.h"
 
-#define BUFSZ 4096
+#define BUFSZ    16384  // text of one subsystem
+#define NSTATSRC 32     // subsystems
+#define NCOUNTER 64     // counters
+
+struct statsrc {
+  char *name;
+  int (*fmt)(char*, int);       // or 0
+  void (*reset)(void);          // or 0
+};
+
+struct counter {
+  char *sys;
+  char *name;
+  uint64 *v;                    // the count, or hart 0's
+  int stride;                   // bytes to the next hart's, or 0
+};
+
+// zeroed, which acquire() takes, like lockclass()'s lock, so
+// that subsystems initialized before statsinit() can register.
+// entries are only added, and are filled in before the count
+// that covers them goes up.
+static struct spinlock reglock;
+static struct statsrc srcs[NSTATSRC];
+static int nsrc;
+static struct counter ctrs[NCOUNTER];
+static int nctr;
+
 static struct {
   struct spinlock lock;
   char buf[BUFSZ];
-  int sz;
-  int off;
+  int sz;                       // text buf holds,
+  int off;                      // and how much of it has been read
+  int src;                      // next subsystem to format
+  int ctr;                      // next counter to read
 } stats;
 
-int statscopyin(char*, int);
 int statslock(char*, int);
-  
+int statstimer(char*, int);
+int statssyscall(char*, int);
+void lockreset(void);
+void syscallreset(void);
+
+// Register subsystem name, with fmt to format its text into a
+// buffer of sz bytes, returning how much it wrote, and reset to
+// reset it. Either may be 0.
+void
+statsregister(char *name, int (*fmt)(char*, int), void (*reset)(void))
+{
+  acquire(&reglock);
+  if(nsrc == NSTATSRC)
+    panic("statsregister");
+  srcs[nsrc].name = name;
+  srcs[nsrc].fmt = fmt;
+  srcs[nsrc].reset = reset;
+  __sync_synchronize();
+  nsrc++;
+  release(&reglock);
+}
+
+// Register the counter name of subsystem sys, at v. If stride
+// is not 0, each hart has its own, stride bytes after the last
+// one's, as in an array of per-hart structs.
+void
+statscounter(char *sys, char *name, uint64 *v, int stride)
+{
+  acquire(&reglock);
+  if(nctr == NCOUNTER)
+    panic("statscounter");
+  ctrs[nctr].sys = sys;
+  ctrs[nctr].name = name;
+  ctrs[nctr].v = v;
+  ctrs[nctr].stride = stride;
+  __sync_synchronize();
+  nctr++;
+  release(&reglock);
+}
+
+// count t in log2 histogram h: bucket i counts values in
+// [2^i, 2^(i+1)), the last everything above. The add is atomic,
+// so harts may share a histogram without a lock.
+void
+histadd(uint64 *h, uint64 t)
+{
+  int i = 0;
+
+  while((t >>= 1) != 0 && i < NHIST-1)
+    i++;
+  __sync_fetch_and_add(&h[i], 1);
+}
+
+static uint64*
+ctrslot(struct counter *c, int cpu)
+{
+  return (uint64*)((char*)c->v + cpu * c->stride);
+}
+
+// format subsystem s into stats.buf: its text, or else
+// its counters' totals.
+static void
+statsfill(struct statsrc *s)
+{
+  int n;
+
+  n = snprintf(stats.buf, BUFSZ, "== %s\n", s->name);
+  if(s->fmt){
+    n += s->fmt(stats.buf+n, BUFSZ-n);
+  } else {
+    for(struct counter *c = ctrs; c < &ctrs[nctr]; c++){
+      uint64 t = 0;
+      if(strncmp(c->sys, s->name, 32) != 0)
+        continue;
+      for(int i = 0; i < (c->stride ? NCPU : 1); i++)
+        t += *ctrslot(c, i);
+      n += snprintf(stats.buf+n, BUFSZ-n, "%s %s: %d\n", c->sys, c->name, (int)t);
+    }
+  }
+  stats.sz = n;
+  stats.off = 0;
+}
+
 int
 statswrite(int user_src, uint64 src, int n)
 {
-  return -1;
+  acquire(&stats.lock);
+  for(int i = 0; i < nsrc; i++)
+    if(srcs[i].reset)
+      srcs[i].reset();
+  for(struct counter *c = ctrs; c < &ctrs[nctr]; c++)
+    for(int i = 0; i < (c->stride ? NCPU : 1); i++)
+      *ctrslot(c, i) = 0;
+  stats.sz = 0;
+  stats.off = 0;
+  stats.src = 0;
+  stats.ctr = 0;
+  release(&stats.lock);
+  return n;
 }
 
 int
 statsread(int user_dst, uint64 dst, int n)
 {
-  int m;
+  int m = 0, k;
 
   acquire(&stats.lock);
-
-  if(stats.sz == 0) {
-#ifdef LAB_PGTBL
-    stats.sz = statscopyin(stats.buf, BUFSZ);
-#endif
-#ifdef LAB_LOCK
-    stats.sz = statslock(stats.buf, BUFSZ);
-#endif
-  }
-  m = stats.sz - stats.off;
-
-  if (m > 0) {
-    if(m > n)
-      m  = n;
-    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) != -1) {
-      stats.off += m;
+  while(m < n){
+    if(stats.off == stats.sz){
+      if(stats.src == nsrc)
+        break;
+      statsfill(&srcs[stats.src++]);
+      continue;
     }
-  } else {
-    m = -1;
+    k = stats.sz - stats.off;
+    if(k > n - m)
+      k = n - m;
+    if(either_copyout(user_dst, dst + m, stats.buf + stats.off, k) == -1){
+      release(&stats.lock);
+      return -1;
+    }
+    stats.off += k;
+    m += k;
+  }
+  if(m == 0){
+    // the end, which the next read starts over from.
     stats.sz = 0;
     stats.off = 0;
+    stats.src = 0;
+  }
+  release(&stats.lock);
+  return m;
+}
+
+// reads of the counters device go here: as many whole
+// records as fit in n bytes.
+static int
+counterread(int user_dst, uint64 dst, int n)
+{
+  struct counterrec r;
+  struct counter *c;
+  int m = 0;
+
+  acquire(&stats.lock);
+  while(stats.ctr < nctr && n - m >= sizeof(r)){
+    c = &ctrs[stats.ctr];
+    memset(&r, 0, sizeof(r));
+    safestrcpy(r.sys, c->sys, sizeof(r.sys));
+    safestrcpy(r.name, c->name, sizeof(r.name));
+    r.ncpu = c->stride ? NCPU : 1;
+    for(int i = 0; i < r.ncpu; i++)
+      r.n[i] = *ctrslot(c, i);
+    if(either_copyout(user_dst, dst + m, &r, sizeof(r)) == -1){
+      release(&stats.lock);
+      return -1;
+    }
+    m += sizeof(r);
+    stats.ctr++;
   }
+  if(m == 0)
+    stats.ctr = 0;
   release(&stats.lock);
   return m;
 }
@@ -63,7 +235,12 @@ statsinit(void)
 {
   initlock(&stats.lock, "stats");
 
+  // what has no init function of its own.
+  statsregister("lock", statslock, lockreset);
+  statsregister("timer", statstimer, 0);
+  statsregister("syscall", statssyscall, syscallreset);
+
   devsw[STATS].read = statsread;
   devsw[STATS].write = statswrite;
+  devsw[COUNTERS].read = counterread;
 }
-
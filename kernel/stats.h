@@ -0,0 +1,9 @@
+// A counter registered with statscounter(), as read from the
+// counters device.
+
+struct counterrec {
+  char sys[16];         // subsystem
+  char name[16];
+  int ncpu;             // n[] used: NCPU if counted per hart, else 1
+  uint64 n[NCPU];
+};
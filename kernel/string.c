@@ -1,13 +1,36 @@
 #include "types.h"
 
+// memset() and memmove() go a 64-bit word at a time, eight
+// words (a cache line) per turn of their main loops, once dst
+// is aligned; memmove() only if src is aligned the same way,
+// since RISC-V harts may trap on misaligned words. The ends,
+// and the rest, go a byte at a time.
+
+#define WSIZE  8
+#define WMASK  (WSIZE - 1)
+#define LINE   (8 * WSIZE)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  char *d = (char *) dst;
+  uint64 w, *wd;
+
+  for(; n > 0 && ((uint64)d & WMASK); n--)
+    *d++ = c;
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(; n >= LINE; n -= LINE, d += LINE){
+    wd = (uint64*)d;
+    wd[0] = w; wd[1] = w; wd[2] = w; wd[3] = w;
+    wd[4] = w; wd[5] = w; wd[6] = w; wd[7] = w;
   }
+  for(; n >= WSIZE; n -= WSIZE, d += WSIZE)
+    *(uint64*)d = w;
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -27,22 +50,60 @@ memcmp(const void *v1, const void *v2, uint n)
   return 0;
 }
 
+// copy a line from s to d, loading it all before
+// storing any, so that it may overlap.
+static inline void
+line(uint64 *d, const uint64 *s)
+{
+  uint64 w0 = s[0], w1 = s[1], w2 = s[2], w3 = s[3];
+  uint64 w4 = s[4], w5 = s[5], w6 = s[6], w7 = s[7];
+
+  d[0] = w0; d[1] = w1; d[2] = w2; d[3] = w3;
+  d[4] = w4; d[5] = w5; d[6] = w6; d[7] = w7;
+}
+
 void*
 memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  int words;
 
   s = src;
   d = dst;
+  words = (((uint64)s ^ (uint64)d) & WMASK) == 0;
   if(s < d && s + n > d){
+    // dst overlaps the end of src: copy from the end down.
     s += n;
     d += n;
+    if(words){
+      for(; n > 0 && ((uint64)d & WMASK); n--)
+        *--d = *--s;
+      for(; n >= LINE; n -= LINE){
+        s -= LINE;
+        d -= LINE;
+        line((uint64*)d, (const uint64*)s);
+      }
+      for(; n >= WSIZE; n -= WSIZE){
+        s -= WSIZE;
+        d -= WSIZE;
+        *(uint64*)d = *(const uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(words){
+      for(; n > 0 && ((uint64)d & WMASK); n--)
+        *d++ = *s++;
+      for(; n >= LINE; n -= LINE, s += LINE, d += LINE)
+        line((uint64*)d, (const uint64*)s);
+      for(; n >= WSIZE; n -= WSIZE, s += WSIZE, d += WSIZE)
+        *(uint64*)d = *(const uint64*)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -0,0 +1,324 @@
+//
+// Swapping.
+// When free memory runs low, kswapd, a kernel process, writes
+// pages of user processes out to the swap area that mkfs leaves
+// after the file system, picking them with a clock (second-chance)
+// sweep over their page tables: a page whose PTE_A is set gets
+// the bit cleared and is passed over once.
+//
+// A swapped-out page's PTE keeps its permission bits, with PTE_V
+// clear and PTE_SWAP set, and holds the number of its swap slot
+// in place of a physical page number. The next touch of it faults,
+// and uvmfault() reads it back in with swapin(). fork() shares
+// swap slots, counting references to each.
+//
+// Processes with threads keep their pages: kswapd couldn't
+// flush the TLBs of the harts the other threads run on.
+//
+// kswapd only takes pages of a process that isn't running and is
+// parked where the kernel is not using its memory: preempted in
+// usertrap(), or waiting there for memory after a page fault found
+// none (p->swappable). So system calls never see user pages vanish
+// under them.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+
+static int statsswap(char*, int);
+
+#define NSWAPSLOT (SWAPSIZE / (PGSIZE / BSIZE))
+#define SWAPLOW   128   // kswapd starts writing out below this many free pages
+#define SWAPHIGH  256   // and stops once this many are free
+#define SWAPWAIT  100   // ticks a fault waits for memory before giving up
+#define SWAPPOLL  10    // ticks between looks at free memory while it's plentiful
+
+#define PTE2SWAP(pte) ((uint)((pte) >> 10))
+#define SWAP2PTE(s)   ((uint64)(s) << 10)
+
+extern struct superblock sb;
+
+struct {
+  struct spinlock lock;
+  uint start;                   // first block of the swap area
+  uint nslot;                   // 0 until the superblock is read
+  uint nused;
+  uchar ref[NSWAPSLOT];         // PTEs that hold each slot
+  struct proc *hand;            // clock hand: process,
+  uint64 handva;                // and address in it
+  uint64 nout;                  // pages written out
+  uint64 nin;                   // pages read back in
+  uint64 nwait;                 // faults that waited for memory
+
+  // one page of I/O at a time, through bufs that aren't
+  // in the buffer cache.
+  struct sleeplock iolock;
+  struct buf buf[PGSIZE / BSIZE];
+  uchar data[PGSIZE / BSIZE][BSIZE];
+} swap;
+
+static void kswapd(void);
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.iolock, "swapio");
+  for(int i = 0; i < PGSIZE / BSIZE; i++)
+    swap.buf[i].data = swap.data[i];
+  kproc("kswapd", kswapd);
+  statsregister("swap", statsswap, 0);
+}
+
+// read or write slot s from or to swap.buf.
+// caller must hold swap.iolock.
+static void
+swapio(uint s, int write)
+{
+  struct buf *bs[PGSIZE / BSIZE];
+
+  for(int i = 0; i < PGSIZE / BSIZE; i++){
+    struct buf *b = &swap.buf[i];
+    b->dev = ROOTDEV;
+    b->blockno = swap.start + s * (PGSIZE / BSIZE) + i;
+    bs[i] = b;
+  }
+  // consecutive blocks, so one request.
+  virtio_disk_rwv(bs, PGSIZE / BSIZE, write);
+}
+
+// copy the page at pa to swap.buf, or back if tobuf is 0.
+static void
+swapcopy(char *pa, int tobuf)
+{
+  for(int i = 0; i < PGSIZE / BSIZE; i++){
+    if(tobuf)
+      memmove(swap.buf[i].data, pa + i * BSIZE, BSIZE);
+    else
+      memmove(pa + i * BSIZE, swap.buf[i].data, BSIZE);
+  }
+}
+
+static int
+slotalloc(void)
+{
+  int s = -1;
+
+  acquire(&swap.lock);
+  for(int i = 0; i < swap.nslot; i++){
+    if(swap.ref[i] == 0){
+      swap.ref[i] = 1;
+      swap.nused++;
+      s = i;
+      break;
+    }
+  }
+  release(&swap.lock);
+  return s;
+}
+
+// Drop a reference to the swap slot in PTE pte.
+void
+swapfree(pte_t pte)
+{
+  uint s = PTE2SWAP(pte);
+
+  acquire(&swap.lock);
+  if(s >= swap.nslot || swap.ref[s] == 0)
+    panic("swapfree");
+  if(--swap.ref[s] == 0)
+    swap.nused--;
+  release(&swap.lock);
+}
+
+// Add a reference to the swap slot in PTE pte.
+void
+swapdup(pte_t pte)
+{
+  uint s = PTE2SWAP(pte);
+
+  acquire(&swap.lock);
+  if(s >= swap.nslot || swap.ref[s] == 0)
+    panic("swapdup");
+  swap.ref[s]++;
+  release(&swap.lock);
+}
+
+// Find the next page of q after swap.handva to write out, giving
+// pages with PTE_A set a second chance. Returns its PTE, or 0 at
+// the end of q's memory. Caller must hold q->lock.
+static pte_t*
+swapvictim(struct proc *q)
+{
+  pte_t *pte;
+  int level, aged = 0;
+  pte_t *victim = 0;
+
+  while(victim == 0 && swap.handva < q->sz){
+    uint64 va = swap.handva;
+    level = 1;
+    pte = walklevel(q->pagetable, va, 0, &level);
+    if(pte == 0 || (*pte & PTE_V) == 0 || PTE_LEAF(*pte)){
+      // no leaf table here, or a megapage: skip it all.
+      swap.handva = (va + MEGAPGSIZE) & ~(MEGAPGSIZE - 1);
+      continue;
+    }
+    swap.handva = va + PGSIZE;
+    pte = walk(q->pagetable, va, 0);
+    if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      aged = 1;
+      continue;
+    }
+    // shared pages stay, whether copy-on-write or lent to a pipe.
+    if(krefcount((void*)PTE2PA(*pte)) != 1)
+      continue;
+    victim = pte;
+  }
+  if(aged || victim){
+    // drop q's TLB entries, so that the hardware sets PTE_A
+    // again, and none map the victim: q gets new ASIDs.
+    q->asidgen = 0;
+  }
+  return victim;
+}
+
+// Write one page out to swap. Returns 0 on success, -1 if
+// there is nothing to write out or no room for it.
+static int
+swapout(void)
+{
+  struct proc *q;
+  pte_t *pte;
+  char *pa;
+  int s;
+
+  if((s = slotalloc()) < 0)
+    return -1;
+  acquiresleep(&swap.iolock);
+  // two turns, to come back to pages given a second chance.
+  for(int turns = 0; turns < 2; ){
+    if(swap.hand == 0){
+      swap.hand = procnext(0);
+      turns++;
+    }
+    q = swap.hand;
+    acquire(&q->lock);
+    if((q->state == RUNNABLE || q->state == SLEEPING) && q->swappable &&
+       q->pagetable && q->leader == q && q->nthread == 1 &&
+       (pte = swapvictim(q)) != 0){
+      // copy the page out and unmap it while q can't run;
+      // a fault on it will wait for swap.iolock, and so for
+      // the write to finish.
+      pa = (char*)PTE2PA(*pte);
+      swapcopy(pa, 1);
+      *pte = SWAP2PTE(s) | (PTE_FLAGS(*pte) & ~PTE_V) | PTE_SWAP;
+      release(&q->lock);
+      kfree(pa);
+      swapio(s, 1);
+      swap.nout++;
+      releasesleep(&swap.iolock);
+      return 0;
+    }
+    release(&q->lock);
+    swap.hand = procnext(q);
+    swap.handva = 0;
+  }
+  releasesleep(&swap.iolock);
+  swapfree(SWAP2PTE(s));
+  return -1;
+}
+
+// Read the swapped-out page that user PTE pte holds back into
+// memory. Returns 0 on success, -2 if out of memory.
+int
+swapin(pte_t *pte)
+{
+  char *mem;
+  pte_t old;
+
+  if((mem = kalloc()) == 0)
+    return -2;
+  acquiresleep(&swap.iolock);
+  // another thread may have read it in first.
+  if((*pte & PTE_SWAP) == 0){
+    releasesleep(&swap.iolock);
+    kfree(mem);
+    return 0;
+  }
+  old = *pte;
+  swapio(PTE2SWAP(old), 0);
+  swapcopy(mem, 0);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(old) & ~PTE_SWAP) | PTE_V | PTE_A;
+  releasesleep(&swap.iolock);
+  swapfree(old);
+  __sync_fetch_and_add(&swap.nin, 1);
+  return 0;
+}
+
+// Called by usertrap() after a page fault in p found no free
+// memory. Waits a tick for kswapd to write pages out, with p's
+// own pages up for grabs too. Returns 1 if the fault should be
+// retried, 0 if swapping can't help.
+int
+swapwait(struct proc *p)
+{
+  if(swap.nslot == 0 || swap.nused == swap.nslot || p->swapwaits >= SWAPWAIT)
+    return 0;
+  p->swapwaits++;
+  __sync_fetch_and_add(&swap.nwait, 1);
+  p->swappable = 1;
+  tsleep(1);
+  p->swappable = 0;
+  return 1;
+}
+
+static void
+kswapd(void)
+{
+  // still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  for(;;){
+    // look every tick while memory is short, and otherwise
+    // seldom, so as not to keep idle harts from sleeping.
+    tsleep(kfreepages() < SWAPHIGH ? 1 : SWAPPOLL);
+
+    if(swap.nslot == 0){
+      // wait for the first process to read the superblock.
+      if(sb.magic != FSMAGIC || sb.nswap == 0)
+        continue;
+      swap.start = sb.swapstart;
+      swap.nslot = sb.nswap / (PGSIZE / BSIZE);
+      if(swap.nslot > NSWAPSLOT)
+        swap.nslot = NSWAPSLOT;
+    }
+
+    if(kfreepages() < SWAPLOW){
+      // cached blocks and program pages are cheaper to give
+      // up than user pages.
+      bshrink(SWAPHIGH - kfreepages());
+      pcacheshrink(SWAPHIGH - kfreepages());
+      while(kfreepages() < SWAPHIGH && swapout() == 0)
+        ;
+    }
+  }
+}
+
+static int
+statsswap(char *buf, int sz)
+{
+  return snprintf(buf, sz, "swap: slots %d used %d out %d in %d wait %d\n",
+                  swap.nslot, swap.nused, (int)swap.nout, (int)swap.nin,
+                  (int)swap.nwait);
+}
@@ -11,7 +11,7 @@
 int
 fetchaddr(uint64 addr, uint64 *ip)
 {
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
   if(addr >= p->sz || addr+sizeof(uint64) > p->sz)
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
@@ -104,6 +104,29 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_wait(void);
 extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_ringenter(void);
+extern uint64 sys_pipesize(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_fcntl(void);
+extern uint64 sys_nanotime(void);
+extern uint64 sys_trace(void);
+extern uint64 sys_setaffinity(void);
+extern uint64 sys_getaffinity(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -127,20 +150,153 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_spawn]   sys_spawn,
+[SYS_setpriority] sys_setpriority,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex]   sys_futex,
+[SYS_fsync]   sys_fsync,
+[SYS_sendfile] sys_sendfile,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_ringenter] sys_ringenter,
+[SYS_pipesize] sys_pipesize,
+[SYS_poll]    sys_poll,
+[SYS_fcntl]   sys_fcntl,
+[SYS_nanotime] sys_nanotime,
+[SYS_trace]   sys_trace,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_getaffinity] sys_getaffinity,
+};
+
+static char *syscallnames[] = {
+[SYS_fork]    "fork",
+[SYS_exit]    "exit",
+[SYS_wait]    "wait",
+[SYS_pipe]    "pipe",
+[SYS_read]    "read",
+[SYS_kill]    "kill",
+[SYS_exec]    "exec",
+[SYS_fstat]   "fstat",
+[SYS_chdir]   "chdir",
+[SYS_dup]     "dup",
+[SYS_getpid]  "getpid",
+[SYS_sbrk]    "sbrk",
+[SYS_sleep]   "sleep",
+[SYS_uptime]  "uptime",
+[SYS_open]    "open",
+[SYS_write]   "write",
+[SYS_mknod]   "mknod",
+[SYS_unlink]  "unlink",
+[SYS_link]    "link",
+[SYS_mkdir]   "mkdir",
+[SYS_close]   "close",
+[SYS_mmap]    "mmap",
+[SYS_munmap]  "munmap",
+[SYS_shmat]   "shmat",
+[SYS_shmdt]   "shmdt",
+[SYS_spawn]   "spawn",
+[SYS_setpriority] "setpriority",
+[SYS_clone]   "clone",
+[SYS_join]    "join",
+[SYS_futex]   "futex",
+[SYS_fsync]   "fsync",
+[SYS_sendfile] "sendfile",
+[SYS_pread]   "pread",
+[SYS_pwrite]  "pwrite",
+[SYS_readv]   "readv",
+[SYS_writev]  "writev",
+[SYS_ringenter] "ringenter",
+[SYS_pipesize] "pipesize",
+[SYS_poll]    "poll",
+[SYS_fcntl]   "fcntl",
+[SYS_nanotime] "nanotime",
+[SYS_trace]   "trace",
+[SYS_setaffinity] "setaffinity",
+[SYS_getaffinity] "getaffinity",
 };
 
+// Per-system-call counts and latencies, in time CSR cycles
+// (which all harts share, unlike cycle, so a call that moves
+// to another hart is still timed right), with a histogram by
+// log2: bucket i counts calls that took [2^i, 2^(i+1)).
+// Updated atomically, as calls on different harts may finish
+// at once; readers and statswrite() may see them torn.
+
+static struct {
+  uint64 calls;
+  uint64 cycles;
+  uint64 hist[NHIST];
+} sysstats[NELEM(syscalls)];
+
+static void
+syscallcount(int num, uint64 t)
+{
+  __sync_fetch_and_add(&sysstats[num].calls, 1);
+  __sync_fetch_and_add(&sysstats[num].cycles, t);
+  histadd(sysstats[num].hist, t);
+}
+
 void
 syscall(void)
 {
   int num;
   struct proc *p = myproc();
+  uint64 a0, a1, a2, start, t;
 
   num = p->trapframe->a7;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    a0 = p->trapframe->a0;
+    a1 = p->trapframe->a1;
+    a2 = p->trapframe->a2;
+    start = r_time();
     p->trapframe->a0 = syscalls[num]();
+    argfdput();
+    if(p->dxdir)
+      dirindex();
+    t = r_time() - start;
+    syscallcount(num, t);
+    p->nsyscall++;
+    p->syscycles += t;
+    // exit doesn't come back, so isn't traced.
+    if(p->tracemask & (1L << num))
+      printf("%d %s: %s(%p, %p, %p) -> %d\n", p->pid, p->name,
+             syscallnames[num], a0, a1, a2, (int)p->trapframe->a0);
   } else {
     printf("%d %s: unknown sys call %d\n",
             p->pid, p->name, num);
     p->trapframe->a0 = -1;
   }
 }
+
+int
+statssyscall(char *buf, int sz)
+{
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "syscall histograms: log2(cycles):count\n");
+  for(int i = 0; i < NELEM(syscalls); i++){
+    if(sysstats[i].calls == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "syscall %s: calls %d cycles %d:",
+                  syscallnames[i], (int)sysstats[i].calls,
+                  (int)sysstats[i].cycles);
+    for(int j = 0; j < NHIST; j++)
+      if(sysstats[i].hist[j])
+        n += snprintf(buf+n, sz-n, " %d:%d", j, (int)sysstats[i].hist[j]);
+    n += snprintf(buf+n, sz-n, "\n");
+  }
+  return n;
+}
+
+void
+syscallreset(void)
+{
+  memset(sysstats, 0, sizeof(sysstats));
+}
@@ -20,3 +20,26 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_shmat  24
+#define SYS_shmdt  25
+#define SYS_spawn  26
+#define SYS_setpriority 27
+#define SYS_clone  28
+#define SYS_join   29
+#define SYS_futex  30
+#define SYS_fsync  31
+#define SYS_sendfile 32
+#define SYS_pread  33
+#define SYS_pwrite 34
+#define SYS_readv  35
+#define SYS_writev 36
+#define SYS_ringenter 37
+#define SYS_pipesize 38
+#define SYS_poll 39
+#define SYS_fcntl 40
+#define SYS_nanotime 41
+#define SYS_trace 42
+#define SYS_setaffinity 43
+#define SYS_getaffinity 44
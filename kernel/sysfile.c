@@ -15,6 +15,42 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "ring.h"
+#include "poll.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Return the struct file that file descriptor fd refers to.
+// The open files of a thread are its leader's. Another thread
+// may close fd while the system call uses f, so a thread holds
+// a reference to f until the call returns; see argfdput().
+static int
+fdfile(int fd, struct file **pf)
+{
+  struct file *f = 0;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  if(fd < 0)
+    return -1;
+  if(l->nthread > 1){
+    acquire(&l->sharelock);
+    // a call that takes more descriptors than there is room to
+    // hold fails, rather than run without a reference.
+    if(fd < l->nofile && (f = l->ofile[fd]) != 0){
+      if(p->nfheld == NFHELD)
+        f = 0;
+      else
+        p->fheld[p->nfheld++] = filedup(f);
+    }
+    release(&l->sharelock);
+  } else
+    f = fd < l->nofile ? l->ofile[fd] : 0;
+  if(f == 0)
+    return -1;
+  *pf = f;
+  return 0;
+}
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -24,9 +60,7 @@ argfd(int n, int *pfd, struct file **pf)
   int fd;
   struct file *f;
 
-  if(argint(n, &fd) < 0)
-    return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(argint(n, &fd) < 0 || fdfile(fd, &f) < 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -35,21 +69,55 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
-// Allocate a file descriptor for the given file.
-// Takes over file reference from caller on success.
+// Drop the references argfd() held for the system call
+// that is returning.
+void
+argfdput(void)
+{
+  struct proc *p = myproc();
+
+  while(p->nfheld > 0)
+    fileclose(p->fheld[--p->nfheld]);
+}
+
+// Allocate the lowest free file descriptor for the given file,
+// growing the table if it is full. Takes over file reference
+// from caller on success.
 static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
-  for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+  for(;;){
+    acquire(&p->sharelock);
+    if((fd = fdlowest(p)) >= 0 && fd < p->nofile){
+      fdset(p, fd, f);
+      release(&p->sharelock);
       return fd;
     }
+    release(&p->sharelock);
+    if(fd < 0 || fdgrow(p) < 0)
+      return -1;
   }
-  return -1;
+}
+
+// Free file descriptor fd, if it still refers to f; another
+// thread may have closed it. Returns 0, with the caller now
+// owning the descriptor's reference to f, or -1.
+static int
+fdclear(int fd, struct file *f)
+{
+  struct proc *p = myproc()->leader;
+  int r = -1;
+
+  acquire(&p->sharelock);
+  if(fd < p->nofile && p->ofile[fd] == f){
+    fdset(p, fd, 0);
+    r = 0;
+  }
+  release(&p->sharelock);
+  return r;
 }
 
 uint64
@@ -75,6 +143,7 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  uvmprefault(p, n);
   return fileread(f, p, n);
 }
 
@@ -87,23 +156,123 @@ sys_write(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  uvmprefault(p, n);
 
   return filewrite(f, p, n);
 }
 
+// read or write at an explicit offset, leaving the file's own.
+static int
+rwat(int write)
+{
+  struct file *f;
+  int n;
+  uint64 p, off;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0 ||
+     argaddr(3, &off) < 0 || n < 0 || off > 0xffffffff)
+    return -1;
+  uvmprefault(p, n);
+  return write ? filepwrite(f, p, n, off) : filepread(f, p, n, off);
+}
+
+uint64
+sys_pread(void)
+{
+  return rwat(0);
+}
+
+uint64
+sys_pwrite(void)
+{
+  return rwat(1);
+}
+
+// read into or write from each buffer of an iovec array in
+// turn, stopping at the first one that comes up short.
+static int
+rwvec(int write)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int n, r, total = 0;
+  uint64 uiov;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &uiov) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(n < 0 || n > IOV_MAX ||
+     copyin(myproc()->leader->pagetable, (char*)iov, uiov, n*sizeof(iov[0])) < 0)
+    return -1;
+  for(int i = 0; i < n; i++){
+    if(iov[i].len > 0x7fffffff)
+      return -1;
+  }
+
+  for(int i = 0; i < n; i++){
+    uvmprefault(iov[i].base, iov[i].len);
+    if(write)
+      r = filewrite(f, iov[i].base, iov[i].len);
+    else
+      r = fileread(f, iov[i].base, iov[i].len);
+    if(r < 0)
+      return total > 0 ? total : -1;
+    total += r;
+    if(r < iov[i].len)
+      break;
+  }
+  return total;
+}
+
+uint64
+sys_readv(void)
+{
+  return rwvec(0);
+}
+
+uint64
+sys_writev(void)
+{
+  return rwvec(1);
+}
+
 uint64
 sys_close(void)
 {
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  if(argfd(0, &fd, &f) < 0 || fdclear(fd, f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
 
+// Wait until the file system's changes so far, the file's
+// among them, are on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
+
+// Copy up to n bytes from file descriptor in to out in the
+// kernel; see filesend().
+uint64
+sys_sendfile(void)
+{
+  struct file *out, *in;
+  int n;
+
+  if(argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesend(out, in, n);
+}
+
 uint64
 sys_fstat(void)
 {
@@ -185,7 +354,6 @@ uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
@@ -210,14 +378,12 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if((ip->type == T_DIR && !isdirempty(ip)) || ismount(ip)){
     iunlockput(ip);
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -283,17 +449,14 @@ create(char *path, short type, short major, short minor)
   return ip;
 }
 
-uint64
-sys_open(void)
+// Open path with mode omode. Returns a new file descriptor,
+// or -1.
+static int
+fileopen(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
+  int fd;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
-    return -1;
 
   begin_op();
 
@@ -309,7 +472,7 @@ sys_open(void)
       return -1;
     }
     ilock(ip);
-    if(ip->type == T_DIR && omode != O_RDONLY){
+    if(ip->type == T_DIR && (omode & ~O_NONBLOCK) != O_RDONLY){
       iunlockput(ip);
       end_op();
       return -1;
@@ -322,9 +485,7 @@ sys_open(void)
     return -1;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op();
     return -1;
@@ -340,6 +501,7 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->nonblock = (omode & O_NONBLOCK) != 0;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
@@ -348,9 +510,26 @@ sys_open(void)
   iunlock(ip);
   end_op();
 
+  // another thread may use fd as soon as it is allocated,
+  // so f must be ready by then.
+  if((fd = fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int omode;
+
+  if(argstr(0, path, MAXPATH) < 0 || argint(1, &omode) < 0)
+    return -1;
+  return fileopen(path, omode);
+}
+
 uint64
 sys_mkdir(void)
 {
@@ -412,19 +591,17 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Copy the user argument vector at uargv into argv[MAXARG],
+// a page per string. Returns 0, or -1 with argv freed.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -440,6 +617,26 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
+
+ bad:
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+  return -1;
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  int i;
+  uint64 uargv;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
 
   int ret = exec(path, argv);
 
@@ -447,11 +644,31 @@ sys_exec(void)
     kfree(argv[i]);
 
   return ret;
+}
+
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  int i, nfd, fds[NOFILE];
+  uint64 uargv, ufds;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0 ||
+     argaddr(2, &ufds) < 0 || argint(3, &nfd) < 0)
+    return -1;
+  if(nfd < 0 || nfd > NOFILE)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)fds, ufds, nfd*sizeof(int)) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = spawn(path, argv, fds, nfd);
 
- bad:
   for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
     kfree(argv[i]);
-  return -1;
+
+  return ret;
 }
 
 uint64
@@ -468,19 +685,260 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+    if(fd0 < 0 || fdclear(fd0, rf) == 0)
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    if(fdclear(fd0, rf) == 0)
+      fileclose(rf);
+    if(fdclear(fd1, wf) == 0)
+      fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+// Which of the events pf asks about, and of POLLHUP, are
+// true of its fd now; POLLNVAL if it isn't open.
+static int
+fdpoll(struct proc *l, struct pollfd *pf)
+{
+  struct file *f;
+  int r = POLLNVAL;
+
+  if(pf->fd < 0)
+    return 0;
+  // not fdfile(), which holds a reference per call.
+  if(l->nthread > 1)
+    acquire(&l->sharelock);
+  if(pf->fd < l->nofile && (f = l->ofile[pf->fd]) != 0)
+    r = filepoll(f) & (pf->events | POLLHUP);
+  if(l->nthread > 1)
+    release(&l->sharelock);
+  return r;
+}
+
+// Wait until one of nfds fds is ready for what it asks, or for
+// timeout ticks, forever if timeout < 0. Returns how many are.
+uint64
+sys_poll(void)
+{
+  struct proc *p = myproc();
+  struct pollfd fds[NPOLL];
+  uint64 addr;
+  int nfds, timeout, n;
+  uint gen, start;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &nfds) < 0 || argint(2, &timeout) < 0)
+    return -1;
+  if(nfds < 0 || nfds > NPOLL ||
+     copyin(p->pagetable, (char*)fds, addr, nfds * sizeof(fds[0])) < 0)
+    return -1;
+
+  pollcount(1);
+  start = ticks;
+  for(;;){
+    gen = pollgen();
+    n = 0;
+    for(int i = 0; i < nfds; i++)
+      if((fds[i].revents = fdpoll(p->leader, &fds[i])) != 0)
+        n++;
+    if(n > 0 || timeout == 0 || (timeout > 0 && ticks - start >= timeout))
+      break;
+    if(pollsleep(gen, timeout < 0 ? -1 : timeout - (ticks - start)) < 0){
+      n = -1;
+      break;
+    }
+  }
+  pollcount(0);
+
+  if(n >= 0 && copyout(p->pagetable, addr, (char*)fds, nfds * sizeof(fds[0])) < 0)
+    return -1;
+  return n;
+}
+
+// F_GETFL returns fd's access mode and O_NONBLOCK if set;
+// F_SETFL sets O_NONBLOCK as arg has it, for every fd that
+// shares fd's open file.
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &cmd) < 0 || argint(2, &arg) < 0)
+    return -1;
+  switch(cmd){
+  case F_GETFL:
+    return (f->readable && f->writable ? O_RDWR : f->writable ? O_WRONLY : O_RDONLY) |
+           (f->nonblock ? O_NONBLOCK : 0);
+  case F_SETFL:
+    f->nonblock = (arg & O_NONBLOCK) != 0;
+    return 0;
+  }
+  return -1;
+}
+
+// set the capacity of the data ring of the pipe fd is an
+// end of to at least n bytes, or just return it if n is 0.
+uint64
+sys_pipesize(void)
+{
+  struct file *f;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(f->type != FD_PIPE)
+    return -1;
+  return piperesize(f->pipe, n);
+}
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off;
+  int prot, flags;
+  struct file *f;
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0 || argint(2, &prot) < 0
+     || argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argaddr(5, &off) < 0)
+    return -1;
+  // addr is only a hint, and is ignored.
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0)
+    return -1;
+  return munmap(addr, len);
+}
+
+#define RINGBATCH 16   // entries ringenter() takes at once
+
+// Perform the operation e describes, as its system call would,
+// and return what that would.
+static int
+ringop(struct sqe *e)
+{
+  char path[MAXPATH];
+  struct file *f;
+
+  if(e->op == RING_OPEN){
+    if(fetchstr(e->addr, path, MAXPATH) < 0)
+      return -1;
+    return fileopen(path, e->n);
+  }
+  if(fdfile(e->fd, &f) < 0)
+    return -1;
+  switch(e->op){
+  case RING_READ:
+    uvmprefault(e->addr, e->n);
+    return fileread(f, e->addr, e->n);
+  case RING_WRITE:
+    uvmprefault(e->addr, e->n);
+    return filewrite(f, e->addr, e->n);
+  case RING_PREAD:
+    uvmprefault(e->addr, e->n);
+    return filepread(f, e->addr, e->n, e->off);
+  case RING_PWRITE:
+    uvmprefault(e->addr, e->n);
+    return filepwrite(f, e->addr, e->n, e->off);
+  case RING_CLOSE:
+    if(fdclear(e->fd, f) < 0)
+      return -1;
+    fileclose(f);
+    return 0;
+  }
+  return -1;
+}
+
+// Start reading in the blocks that the reads among the n
+// entries e will want, so that the disk has all of them to
+// work on at once, rather than one read's at a time.
+static void
+ringprefetch(struct sqe *e, int n)
+{
+  struct file *f;
+  uint off;
+
+  for(int i = 0; i < n; i++){
+    if((e[i].op != RING_READ && e[i].op != RING_PREAD) || fdfile(e[i].fd, &f) < 0)
+      continue;
+    off = e[i].off;
+    if(e[i].op == RING_READ){
+      // where the reads of the file before it leave off.
+      off = f->off;
+      for(int j = 0; j < i; j++)
+        if(e[j].op == RING_READ && e[j].fd == e[i].fd)
+          off += e[j].n;
+    }
+    fileprefetch(f, off, e[i].n);
+    argfdput();
+  }
+}
+
+// Perform up to n of the operations queued in the ring at
+// address ur, posting their results; see ring.h. Returns how
+// many it performed, or -1 if the ring can't be read.
+uint64
+sys_ringenter(void)
+{
+  struct proc *p = myproc();
+  struct sqe e[RINGBATCH];
+  struct cqe c;
+  struct ring *r;
+  uint64 ur;
+  uint sqhead, sqtail, cqhead, cqtail;
+  int n, k, done = 0;
+
+  if(argaddr(0, &ur) < 0 || argint(1, &n) < 0)
+    return -1;
+  r = (struct ring*)ur;
+  if(copyin(p->pagetable, (char*)&sqhead, (uint64)&r->sqhead, sizeof(uint)) < 0 ||
+     copyin(p->pagetable, (char*)&cqtail, (uint64)&r->cqtail, sizeof(uint)) < 0)
+    return -1;
+
+  while(done < n && !p->killed){
+    if(copyin(p->pagetable, (char*)&sqtail, (uint64)&r->sqtail, sizeof(uint)) < 0 ||
+       copyin(p->pagetable, (char*)&cqhead, (uint64)&r->cqhead, sizeof(uint)) < 0 ||
+       sqtail - sqhead > RINGSIZE || cqtail - cqhead > RINGSIZE)
+      return done > 0 ? done : -1;
+    k = min(n - done, sqtail - sqhead);
+    k = min(k, RINGSIZE - (cqtail - cqhead));
+    k = min(k, RINGBATCH);
+    if(k == 0)
+      break;
+    for(int i = 0; i < k; i++)
+      if(copyin(p->pagetable, (char*)&e[i], (uint64)&r->sq[(sqhead + i) % RINGSIZE],
+                sizeof(e[i])) < 0)
+        return done > 0 ? done : -1;
+
+    ringprefetch(e, k);
+    for(int i = 0; i < k; i++){
+      c.data = e[i].data;
+      c.res = ringop(&e[i]);
+      c.pad = 0;
+      argfdput();
+      if(copyout(p->pagetable, (uint64)&r->cq[(cqtail + i) % RINGSIZE],
+                 (char*)&c, sizeof(c)) < 0)
+        return done > 0 ? done : -1;
+    }
+    sqhead += k;
+    cqtail += k;
+    done += k;
+    // the completions before the index that shows them.
+    __sync_synchronize();
+    if(copyout(p->pagetable, (uint64)&r->sqhead, (char*)&sqhead, sizeof(uint)) < 0 ||
+       copyout(p->pagetable, (uint64)&r->cqtail, (char*)&cqtail, sizeof(uint)) < 0)
+      return -1;
+  }
+  return done;
+}
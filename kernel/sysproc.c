@@ -35,19 +35,21 @@ sys_wait(void)
   uint64 p;
   if(argaddr(0, &p) < 0)
     return -1;
+  // wait() copies out the status with proc locks held.
+  if(p != 0)
+    uvmprefault(p, sizeof(int));
   return wait(p);
 }
 
 uint64
 sys_sbrk(void)
 {
-  int addr;
+  uint64 addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if(growproc(n, &addr) < 0)
     return -1;
   return addr;
 }
@@ -56,21 +58,10 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return tsleep(n);
 }
 
 uint64
@@ -91,7 +82,113 @@ sys_uptime(void)
   uint xticks;
 
   acquire(&tickslock);
+  tickupdate();
   xticks = ticks;
   release(&tickslock);
   return xticks;
 }
+
+uint64
+sys_nanotime(void)
+{
+  return nsec();
+}
+
+// log the system calls whose bits are set in mask, in this
+// process and the children it makes from now on.
+uint64
+sys_trace(void)
+{
+  uint64 mask;
+
+  if(argaddr(0, &mask) < 0)
+    return -1;
+  myproc()->tracemask = mask;
+  return 0;
+}
+
+uint64
+sys_setpriority(void)
+{
+  int pid, nice;
+
+  if(argint(0, &pid) < 0 || argint(1, &nice) < 0)
+    return -1;
+  return setpriority(pid, nice);
+}
+
+uint64
+sys_setaffinity(void)
+{
+  int pid;
+  uint64 mask;
+
+  if(argint(0, &pid) < 0 || argaddr(1, &mask) < 0)
+    return -1;
+  return setaffinity(pid, mask);
+}
+
+uint64
+sys_getaffinity(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  return getaffinity(pid);
+}
+
+uint64
+sys_shmat(void)
+{
+  int key, len;
+
+  if(argint(0, &key) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return shmat(key, len);
+}
+
+uint64
+sys_shmdt(void)
+{
+  uint64 addr;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  return shmdt(addr);
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  if(argint(0, &tid) < 0 || argaddr(1, &p) < 0)
+    return -1;
+  // join() copies out the status with a proc lock held.
+  if(p != 0)
+    uvmprefault(p, sizeof(int));
+  return join(tid, p);
+}
+
+uint64
+sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+    return -1;
+  return futex(addr, op, val);
+}
@@ -0,0 +1,272 @@
+//
+// Timers.
+// Each hart's CLINT timer is one-shot: timervec disarms it after
+// every interrupt, and clockintr() programs the next one. A hart
+// that is running processes asks for an interrupt at each tick
+// boundary, to preempt them. An idle hart asks only for the
+// earliest deadline of a process in tsleep(), and ready() kicks
+// it, by setting its mtimecmp to 0, when there is work for it.
+// ticks is computed from mtime, so it stays right however few
+// timer interrupts there are.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+// processes in tsleep() and pollsleep(), by deadline.
+// protected by tickslock.
+static struct proc *timers;
+
+// poll() sleeps under tickslock, so that neither a pollwake()
+// nor its deadline can come between its last look at its files
+// and its sleep.
+static uint pollseq;            // bumped by each pollwake()
+static int npollers;            // processes in poll()
+
+// harts waiting in wfi for a deadline or a kick.
+static int idle[NCPU];
+
+// the tick each hart last saw in clockintr().
+static uint lasttick[NCPU];
+
+static struct {
+  uint64 intr;                  // timer interrupts taken
+  uint64 kicks;                 // idle harts woken by ready()
+  uint64 idles;                 // waits in timeridle()
+} tstats;
+
+static uint64
+mtime(void)
+{
+  return *(volatile uint64*)KCLINT_MTIME;
+}
+
+// ask for a timer interrupt on this hart when mtime reaches when.
+static void
+timerset(uint64 when)
+{
+  push_off();
+  *(volatile uint64*)KCLINT_MTIMECMP(cpuid()) = when;
+  pop_off();
+}
+
+// Bring ticks up to date with mtime, waking processes whose
+// deadlines have passed. Caller must hold tickslock.
+void
+tickupdate(void)
+{
+  uint now = mtime() / TICKCYCLES;
+  struct proc *p;
+
+  if(now == ticks)
+    return;
+  ticks = now;
+  wakeup(&ticks);
+  while((p = timers) != 0 && (int)(ticks - p->wakeat) >= 0){
+    timers = p->tnext;
+    wakeup(p->tchan);
+  }
+}
+
+// when a busy hart should next be interrupted: at the next
+// tick, or sooner while profiling.
+static uint64
+timernext(void)
+{
+  uint64 cycles = profiling ? PROFCYCLES : TICKCYCLES;
+
+  return (mtime() / cycles + 1) * cycles;
+}
+
+// a timer interrupt, or a kick, on any hart. returns 1 if it
+// is the hart's first since a new tick began.
+int
+clockintr()
+{
+  int id = cpuid(), tick;
+
+  acquire(&tickslock);
+  tickupdate();
+  tick = lasttick[id] != ticks;
+  lasttick[id] = ticks;
+  release(&tickslock);
+  __sync_fetch_and_add(&tstats.intr, 1);
+
+  timerset(timernext());
+  return tick;
+}
+
+// queue p to be woken on chan n ticks from now.
+// caller must hold tickslock.
+static void
+timeradd(struct proc *p, int n, void *chan)
+{
+  struct proc **pp;
+
+  // ticks may be behind if this hart was idle.
+  tickupdate();
+  p->wakeat = ticks + n;
+  p->tchan = chan;
+  for(pp = &timers; *pp && (int)((*pp)->wakeat - p->wakeat) <= 0; pp = &(*pp)->tnext)
+    ;
+  p->tnext = *pp;
+  *pp = p;
+}
+
+// take p off the queue, unless clockintr() took it off
+// already. caller must hold tickslock.
+static void
+timerdel(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &timers; *pp; pp = &(*pp)->tnext){
+    if(*pp == p){
+      *pp = p->tnext;
+      break;
+    }
+  }
+}
+
+// nanoseconds since boot, from the time CSR.
+uint64
+nsec(void)
+{
+  uint64 t = r_time();
+
+  return t / TIMEFREQ * 1000000000 + t % TIMEFREQ * 1000000000 / TIMEFREQ;
+}
+
+// Sleep for n ticks. Returns 0, or -1 if killed first.
+int
+tsleep(int n)
+{
+  struct proc *p = myproc();
+  int r = 0;
+
+  acquire(&tickslock);
+  timeradd(p, n, &p->wakeat);
+  while((int)(ticks - p->wakeat) < 0){
+    if(p->killed){
+      r = -1;
+      break;
+    }
+    sleep(&p->wakeat, &tickslock);
+  }
+  timerdel(p);
+  release(&tickslock);
+  return r;
+}
+
+// A file that a process may be poll()ing may have become
+// ready: wake the pollers, if there are any.
+void
+pollwake(void)
+{
+  __sync_synchronize();
+  if(npollers == 0)
+    return;
+  acquire(&tickslock);
+  pollseq++;
+  wakeup(&pollseq);
+  release(&tickslock);
+}
+
+// poll() starts, or ends if begin is 0. A pollwake() from
+// then on, up to the end, doesn't miss it.
+void
+pollcount(int begin)
+{
+  __sync_fetch_and_add(&npollers, begin ? 1 : -1);
+}
+
+// how many pollwake()s there have been, for pollsleep().
+uint
+pollgen(void)
+{
+  __sync_synchronize();
+  return pollseq;
+}
+
+// Sleep until a pollwake() after pollgen() returned gen, or
+// for n ticks, forever if n < 0. Returns -1 if killed.
+int
+pollsleep(uint gen, int n)
+{
+  struct proc *p = myproc();
+
+  acquire(&tickslock);
+  if(pollseq == gen && !p->killed){
+    if(n >= 0)
+      timeradd(p, n, &pollseq);
+    sleep(&pollseq, &tickslock);
+    if(n >= 0)
+      timerdel(p);
+  }
+  release(&tickslock);
+  return p->killed ? -1 : 0;
+}
+
+// Called by an idle hart, with interrupts off, before it checks
+// the run queues one last time and waits in wfi: program the
+// timer for the earliest deadline only, and let ready() know
+// to kick this hart.
+void
+timeridle(void)
+{
+  uint64 when = -1, now;
+  int id = cpuid(), d;
+
+  acquire(&tickslock);
+  tickupdate();
+  if(timers){
+    now = mtime() / TICKCYCLES;
+    d = timers->wakeat - (uint)now;
+    when = d <= 0 ? 0 : (now + d) * TICKCYCLES;
+  }
+  release(&tickslock);
+  timerset(when);
+
+  // a kick must come after the timer is programmed, and
+  // the run queues checked after idle is set.
+  __sync_synchronize();
+  idle[id] = 1;
+  __sync_synchronize();
+  __sync_fetch_and_add(&tstats.idles, 1);
+}
+
+// Called by a hart leaving wfi: back to a timer tick.
+void
+timerbusy(void)
+{
+  idle[cpuid()] = 0;
+  timerset(timernext());
+}
+
+// A process was just queued for hart id. If id is idle, wake
+// it; if it is busy, wake some idle hart to steal the process.
+void
+timerkick(int id)
+{
+  __sync_synchronize();
+  if(!idle[id]){
+    for(id = 0; id < NCPU && !idle[id]; id++)
+      ;
+    if(id == NCPU)
+      return;
+  }
+  *(volatile uint64*)KCLINT_MTIMECMP(id) = 0;
+  __sync_fetch_and_add(&tstats.kicks, 1);
+}
+
+int
+statstimer(char *buf, int sz)
+{
+  return snprintf(buf, sz, "timer: ticks %d interrupts %d idle waits %d kicks %d\n",
+                  ticks, (int)tstats.intr, (int)tstats.idles, (int)tstats.kicks);
+}
@@ -19,7 +19,7 @@ extern int devintr();
 void
 trapinit(void)
 {
-  initlock(&tickslock, "time");
+  initticketlock(&tickslock, "time");
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -27,6 +27,9 @@ void
 trapinithart(void)
 {
   w_stvec((uint64)kernelvec);
+  // let user code read the cycle, time and instret CSRs;
+  // see struct usyscall.
+  w_scounteren(r_scounteren() | 7);
 }
 
 //
@@ -36,7 +39,7 @@ trapinithart(void)
 void
 usertrap(void)
 {
-  int which_dev = 0;
+  int which_dev = 0, r = 0;
 
   if((r_sstatus() & SSTATUS_SPP) != 0)
     panic("usertrap: not from user mode");
@@ -67,18 +70,33 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            (r = uvmfault(r_stval(), r_scause() == 12 ? PTE_X :
+                          r_scause() == 13 ? PTE_R : PTE_W)) == 0){
+    // fetch, load or store to a lazily allocated, demand-paged,
+    // swapped-out or copy-on-write page, which is now mapped.
+    p->swapwaits = 0;
+  } else if(r == -2 && swapwait(p)){
+    // out of memory; retry once kswapd has written some out.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
     p->killed = 1;
   }
 
+  if(which_dev >= 2)
+    profsample(p->trapframe->epc, 1);
+
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this timer interrupt ends p's turn.
+  // nothing is using user memory here, so kswapd may take some.
+  if(which_dev == 2 && schedtick()){
+    p->swappable = 1;
     yield();
+    p->swappable = 0;
+  }
 
   usertrapret();
 }
@@ -119,13 +137,14 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = uvmsatp(p);
+  tlbtrampoline();
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(TRAPFRAMET(p->tslot), satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -149,8 +168,12 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  if(which_dev >= 2)
+    profsample(sepc, 0);
+
+  // give up the CPU if this timer interrupt ends the
+  // current process's turn.
+  if(which_dev == 2 && schedtick())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -159,18 +182,10 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
-void
-clockintr()
-{
-  acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
-  release(&tickslock);
-}
-
 // check if it's an external interrupt or software interrupt,
 // and handle it.
-// returns 2 if timer interrupt,
+// returns 2 if timer interrupt at a new tick,
+// 3 if one between ticks, while profiling,
 // 1 if other device,
 // 0 if not recognized.
 int
@@ -204,15 +219,13 @@ devintr()
     // software interrupt from a machine-mode timer interrupt,
     // forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
+    int tick = clockintr();
+
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    return tick ? 2 : 3;
   } else {
     return 0;
   }
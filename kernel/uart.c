@@ -10,6 +10,8 @@
 #include "proc.h"
 #include "defs.h"
 
+static int statsuart(char*, int);
+
 // the UART control registers are memory-mapped
 // at address UART0. this macro returns the
 // address of one of the registers.
@@ -38,12 +40,17 @@
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
-// the transmit output buffer.
+#define UART_FIFO 16           // bytes the transmit FIFO holds
+
+// the transmit output buffer, a ring of pages
+// allocated by uartbufinit() once kinit() has run.
 struct spinlock uart_tx_lock;
-#define UART_TX_BUF_SIZE 32
-char uart_tx_buf[UART_TX_BUF_SIZE];
-int uart_tx_w; // write next to uart_tx_buf[uart_tx_w++]
-int uart_tx_r; // read next from uart_tx_buf[uar_tx_r++]
+#define UART_TX_ORDER 1
+#define UART_TX_BUF_SIZE (PGSIZE << UART_TX_ORDER)
+char *uart_tx_buf;
+uint64 uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
+uint64 uart_tx_r; // read next from uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]
+uint64 uart_tx_waits;      // times a writer found the buffer full
 
 extern volatile int panicked; // from printf.c
 
@@ -77,15 +84,25 @@ uartinit(void)
   initlock(&uart_tx_lock, "uart");
 }
 
-// add a character to the output buffer and tell the
+void
+uartbufinit(void)
+{
+  if((uart_tx_buf = kalloc_pages(UART_TX_ORDER)) == 0)
+    panic("uartbufinit");
+  statsregister("uart", statsuart, 0);
+}
+
+// add n bytes from buf to the output buffer and tell the
 // UART to start sending if it isn't already.
-// blocks if the output buffer is full.
+// blocks while the output buffer is full.
 // because it may block, it can't be called
 // from interrupts; it's only suitable for use
 // by write().
 void
-uartputc(int c)
+uartwrite(char *buf, int n)
 {
+  int i = 0;
+
   acquire(&uart_tx_lock);
 
   if(panicked){
@@ -93,19 +110,20 @@ uartputc(int c)
       ;
   }
 
-  while(1){
-    if(((uart_tx_w + 1) % UART_TX_BUF_SIZE) == uart_tx_r){
+  while(i < n){
+    if(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
       // buffer is full.
       // wait for uartstart() to open up space in the buffer.
-      sleep(&uart_tx_r, &uart_tx_lock);
-    } else {
-      uart_tx_buf[uart_tx_w] = c;
-      uart_tx_w = (uart_tx_w + 1) % UART_TX_BUF_SIZE;
+      uart_tx_waits++;
       uartstart();
-      release(&uart_tx_lock);
-      return;
+      sleep(&uart_tx_r, &uart_tx_lock);
+      continue;
     }
+    while(i < n && uart_tx_w < uart_tx_r + UART_TX_BUF_SIZE)
+      uart_tx_buf[uart_tx_w++ % UART_TX_BUF_SIZE] = buf[i++];
   }
+  uartstart();
+  release(&uart_tx_lock);
 }
 
 // alternate version of uartputc() that doesn't 
@@ -130,34 +148,31 @@ uartputc_sync(int c)
   pop_off();
 }
 
-// if the UART is idle, and a character is waiting
-// in the transmit buffer, send it.
+// if the UART is idle, and characters are waiting
+// in the transmit buffer, send as many as its FIFO holds.
 // caller must hold uart_tx_lock.
 // called from both the top- and bottom-half.
 void
 uartstart()
 {
-  while(1){
-    if(uart_tx_w == uart_tx_r){
-      // transmit buffer is empty.
-      return;
-    }
-    
-    if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
-      // the UART transmit holding register is full,
-      // so we cannot give it another byte.
-      // it will interrupt when it's ready for a new byte.
-      return;
-    }
-    
-    int c = uart_tx_buf[uart_tx_r];
-    uart_tx_r = (uart_tx_r + 1) % UART_TX_BUF_SIZE;
-    
-    // maybe uartputc() is waiting for space in the buffer.
-    wakeup(&uart_tx_r);
-    
-    WriteReg(THR, c);
+  if(uart_tx_w == uart_tx_r){
+    // transmit buffer is empty.
+    return;
+  }
+
+  if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
+    // the UART transmit FIFO isn't empty yet.
+    // it will interrupt when it is.
+    return;
   }
+
+  // with FIFOs enabled, LSR_TX_IDLE means the whole
+  // FIFO is empty.
+  for(int i = 0; i < UART_FIFO && uart_tx_r != uart_tx_w; i++)
+    WriteReg(THR, uart_tx_buf[uart_tx_r++ % UART_TX_BUF_SIZE]);
+
+  // maybe uartwrite() is waiting for space in the buffer.
+  wakeup(&uart_tx_r);
 }
 
 // read one input character from the UART.
@@ -192,3 +207,11 @@ uartintr(void)
   uartstart();
   release(&uart_tx_lock);
 }
+
+static int
+statsuart(char *buf, int sz)
+{
+  return snprintf(buf, sz, "uart: out %d queued %d waits %d\n",
+                  (int)uart_tx_r, (int)(uart_tx_w - uart_tx_r),
+                  (int)uart_tx_waits);
+}
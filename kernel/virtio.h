@@ -36,6 +36,7 @@
 
 // device feature bits
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
+#define VIRTIO_BLK_F_FLUSH           9	/* Flush command supported */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
@@ -45,7 +46,10 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 64
+
+// blocks merged into one request, at most.
+#define MAXSEG 8
 
 struct VRingDesc {
   uint64 addr;
@@ -64,6 +68,14 @@ struct VRingUsedElem {
 // for disk ops
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_FLUSH 4 // make completed writes durable
+
+// the first descriptor of a disk op points at this.
+struct virtio_blk_outhdr {
+  uint32 type;
+  uint32 reserved;
+  uint64 sector;
+};
 
 struct UsedArea {
   uint16 flags;
@@ -17,6 +17,9 @@
 #include "buf.h"
 #include "virtio.h"
 
+static int statsdisk(char*, int);
+static void diskreset(void);
+
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
@@ -35,13 +38,37 @@ static struct disk {
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
   // track info about in-flight operations,
-  // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // for use when completion interrupt arrives,
+  // indexed by descriptor: the buf of each data
+  // descriptor, and the status and the request header
+  // of each chain, by its first.
   struct {
     struct buf *b;
     char status;
+    char flush;     // a flush, which virtio_disk_flush() waits for
+    char write;
+    uint64 start;   // r_time() when submitted
   } info[NUM];
-  
+  struct virtio_blk_outhdr ops[NUM];
+
+  uint64 nreq;      // requests submitted,
+  uint64 nblock;    // and blocks in them
+  uint64 ncomplete; // requests completed
+  uint64 nintr;
+  uint64 nflush;
+  uint64 nread;     // blocks read,
+  uint64 nwrite;    // and written
+  int canflush;     // device has a write cache to flush
+
+  // histograms by log2, as in proc.c: of read and write
+  // service times, from submission to the completion
+  // interrupt, in time CSR cycles; and of how many requests
+  // were in flight when each was submitted.
+  int inflight;
+  uint64 rhist[NHIST];
+  uint64 whist[NHIST];
+  uint64 depth[NHIST];
+
   struct spinlock vdisk_lock;
   
 } __attribute__ ((aligned (PGSIZE))) disk;
@@ -76,6 +103,7 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.canflush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -110,6 +138,14 @@ virtio_disk_init(void)
     disk.free[i] = 1;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  statsregister("disk", statsdisk, diskreset);
+  statscounter("disk", "requests", &disk.nreq, 0);
+  statscounter("disk", "blocks", &disk.nblock, 0);
+  statscounter("disk", "completed", &disk.ncomplete, 0);
+  statscounter("disk", "interrupts", &disk.nintr, 0);
+  statscounter("disk", "flushes", &disk.nflush, 0);
+  statscounter("disk", "reads", &disk.nread, 0);
+  statscounter("disk", "writes", &disk.nwrite, 0);
 }
 
 // find a free descriptor, mark it non-free, return its index.
@@ -151,10 +187,12 @@ free_chain(int i)
   }
 }
 
+// allocate n descriptors, into idx, or none.
+// returns 0 on success, -1 if there aren't n free.
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -165,89 +203,168 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// Start reading or writing the n buffers in bs, without waiting
+// for the disk; virtio_disk_wait() waits for each. Runs of
+// consecutive blocks go as one request of up to MAXSEG blocks,
+// and the device is told about them all at once.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_submit(struct buf **bs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  int idx[MAXSEG+2];
+  int i, j, nseg, queued = 0;
 
   acquire(&disk.vdisk_lock);
+  for(i = 0; i < n; i += nseg){
+    for(nseg = 1; nseg < MAXSEG && i + nseg < n; nseg++)
+      if(bs[i+nseg]->blockno != bs[i+nseg-1]->blockno + 1)
+        break;
+
+    // the spec says that legacy block operations use a
+    // descriptor for type/reserved/sector, then descriptors
+    // for the data, then one for a 1-byte status result.
+    while(allocn_desc(idx, nseg + 2) < 0){
+      // let the device start on what's queued, so that
+      // descriptors come free.
+      if(queued){
+        *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+        queued = 0;
+      }
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    }
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
+    // format the descriptors.
+    // qemu's virtio-blk.c reads them.
+    struct virtio_blk_outhdr *hdr = &disk.ops[idx[0]];
+    if(write)
+      hdr->type = VIRTIO_BLK_T_OUT; // write the disk
+    else
+      hdr->type = VIRTIO_BLK_T_IN; // read the disk
+    hdr->reserved = 0;
+    hdr->sector = (uint64)bs[i]->blockno * (BSIZE / 512);
+
+    disk.desc[idx[0]].addr = (uint64) hdr;
+    disk.desc[idx[0]].len = sizeof(*hdr);
+    disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
+    disk.desc[idx[0]].next = idx[1];
+
+    for(j = 0; j < nseg; j++){
+      struct buf *b = bs[i+j];
+      struct VRingDesc *d = &disk.desc[idx[1+j]];
+      d->addr = (uint64) b->data;
+      d->len = BSIZE;
+      if(write)
+        d->flags = 0; // device reads b->data
+      else
+        d->flags = VRING_DESC_F_WRITE; // device writes b->data
+      d->flags |= VRING_DESC_F_NEXT;
+      d->next = idx[2+j];
+
+      // record struct buf for virtio_disk_intr().
+      b->disk = 1;
+      disk.info[idx[1+j]].b = b;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+
+    disk.info[idx[0]].status = 0;
+    disk.desc[idx[nseg+1]].addr = (uint64) &disk.info[idx[0]].status;
+    disk.desc[idx[nseg+1]].len = 1;
+    disk.desc[idx[nseg+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+    disk.desc[idx[nseg+1]].next = 0;
+
+    // avail[0] is flags
+    // avail[1] tells the device how far to look in avail[2...].
+    // avail[2...] are desc[] indices the device should process.
+    // we only tell device the first index in our chain of descriptors.
+    histadd(disk.depth, disk.inflight);
+    disk.inflight++;
+    disk.info[idx[0]].write = write;
+    disk.info[idx[0]].start = r_time();
+
+    disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
+    __sync_synchronize();
+    disk.avail[1] = disk.avail[1] + 1;
+    queued = 1;
+    disk.nreq++;
+    disk.nblock += nseg;
+    if(write)
+      disk.nwrite += nseg;
+    else
+      disk.nread += nseg;
   }
-  
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
-
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
-
-  if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  if(queued)
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  release(&disk.vdisk_lock);
+}
+
+// Wait for the disk to finish with b, submitted by
+// virtio_disk_submit().
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  while(b->disk == 1)
+    sleep(b, &disk.vdisk_lock);
+  release(&disk.vdisk_lock);
+}
 
+// Read or write the n buffers in bs, and wait for them all.
+void
+virtio_disk_rwv(struct buf **bs, int n, int write)
+{
+  virtio_disk_submit(bs, n, write);
+  for(int i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_rwv(&b, 1, write);
+}
+
+// Make the writes the device has completed durable, if it
+// caches them, and wait until it has.
+void
+virtio_disk_flush(void)
+{
+  int idx[2];
+
+  if(!disk.canflush)
+    return;
+  acquire(&disk.vdisk_lock);
+  while(allocn_desc(idx, 2) < 0)
+    sleep(&disk.free[0], &disk.vdisk_lock);
+
+  // a header and a status, with no data.
+  struct virtio_blk_outhdr *hdr = &disk.ops[idx[0]];
+  hdr->type = VIRTIO_BLK_T_FLUSH;
+  hdr->reserved = 0;
+  hdr->sector = 0;
+  disk.desc[idx[0]].addr = (uint64) hdr;
+  disk.desc[idx[0]].len = sizeof(*hdr);
+  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  disk.desc[idx[0]].next = idx[1];
   disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
-
-  // avail[0] is flags
-  // avail[1] tells the device how far to look in avail[2...].
-  // avail[2...] are desc[] indices the device should process.
-  // we only tell device the first index in our chain of descriptors.
+  disk.info[idx[0]].flush = 1;
+  disk.desc[idx[1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[1]].len = 1;
+  disk.desc[idx[1]].flags = VRING_DESC_F_WRITE;
+  disk.desc[idx[1]].next = 0;
+
   disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
   __sync_synchronize();
   disk.avail[1] = disk.avail[1] + 1;
+  disk.nflush++;
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
-
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
-  }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
+  while(disk.info[idx[0]].flush)
+    sleep(&disk.info[idx[0]], &disk.vdisk_lock);
   release(&disk.vdisk_lock);
 }
 
+// Finish each request the device has completed since the
+// last interrupt: wake the waiters for its buffers and free
+// its descriptors.
 void
 virtio_disk_intr()
 {
@@ -258,13 +375,71 @@ virtio_disk_intr()
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
-    
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+
+    for(int i = disk.desc[id].next; ; i = disk.desc[i].next){
+      struct buf *b = disk.info[i].b;
+      if(b == 0)
+        break;  // the status descriptor
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+      disk.info[i].b = 0;
+    }
+    if(disk.info[id].flush){
+      disk.info[id].flush = 0;
+      wakeup(&disk.info[id]);
+    } else {
+      disk.inflight--;
+      histadd(disk.info[id].write ? disk.whist : disk.rhist,
+              r_time() - disk.info[id].start);
+    }
+    free_chain(id);
+    disk.ncomplete++;
 
     disk.used_idx = (disk.used_idx + 1) % NUM;
   }
+  disk.nintr++;
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   release(&disk.vdisk_lock);
 }
+
+static int
+statsdiskhist(char *buf, int sz, char *name, uint64 *h)
+{
+  int n;
+
+  n = snprintf(buf, sz, "disk %s:", name);
+  for(int i = 0; i < NHIST; i++)
+    if(h[i])
+      n += snprintf(buf+n, sz-n, " %d:%d", i, (int)h[i]);
+  n += snprintf(buf+n, sz-n, "\n");
+  return n;
+}
+
+static int
+statsdisk(char *buf, int sz)
+{
+  int n;
+
+  acquire(&disk.vdisk_lock);
+  n = snprintf(buf, sz, "disk: requests %d blocks %d completed %d interrupts %d flushes %d\n"
+               "disk: reads %d writes %d in flight %d\n"
+               "disk histograms: log2(cycles):count, log2(depth):count\n",
+               (int)disk.nreq, (int)disk.nblock, (int)disk.ncomplete, (int)disk.nintr,
+               (int)disk.nflush, (int)disk.nread, (int)disk.nwrite, disk.inflight);
+  n += statsdiskhist(buf+n, sz-n, "read", disk.rhist);
+  n += statsdiskhist(buf+n, sz-n, "write", disk.whist);
+  n += statsdiskhist(buf+n, sz-n, "depth", disk.depth);
+  release(&disk.vdisk_lock);
+  return n;
+}
+
+static void
+diskreset(void)
+{
+  acquire(&disk.vdisk_lock);
+  memset(disk.rhist, 0, sizeof(disk.rhist));
+  memset(disk.whist, 0, sizeof(disk.whist));
+  memset(disk.depth, 0, sizeof(disk.depth));
+  release(&disk.vdisk_lock);
+}
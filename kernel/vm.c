@@ -17,6 +17,32 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static void kvmshare(pagetable_t, pagetable_t, uint64, uint64);
+static pagetable_t ptchild(pagetable_t, int);
+
+// per-hart memory counters for the statistics device. each
+// hart updates only its own, with interrupts off, so they
+// need no lock.
+static struct vmstat {
+  uint64 tagged;       // satp switches that kept the TLB
+  uint64 full;         // full TLB flushes
+  uint64 asid;         // flushes of one address space
+  uint64 page;         // flushes of one page
+  uint64 rollover;     // ASID generations used up
+  uint64 ptalloc;      // page-table pages allocated
+  uint64 ptfree;       // page-table pages freed
+  uint64 fault;        // user page faults resolved
+  uint64 cow;          // copy-on-write pages copied
+  uint64 mega;         // heap megapages allocated
+  uint64 split;        // megapages split into 4K pages
+} vmstats[NCPU];
+
+int statscopyin(char*, int);
+static int statsvm(char*, int);
+
+#define VMSTATN(x, n) do { push_off(); vmstats[cpuid()].x += (n); pop_off(); } while(0)
+#define VMSTAT(x) VMSTATN(x, 1)
+
 /*
  * create a direct-map page table for the kernel.
  */
@@ -32,8 +58,9 @@ kvminit()
   // virtio mmio disk interface
   kvmmap(VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
-  // CLINT
+  // CLINT, and its alias for timer.c.
   kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+  kvmmap(KCLINT, CLINT, 0x10000, PTE_R | PTE_W);
 
   // PLIC
   kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W);
@@ -47,47 +74,386 @@ kvminit()
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
+
+#ifdef LAB_PGTBL
+  statsregister("copyin", statscopyin, 0);
+#endif
+  statsregister("vm", statsvm, 0);
+  statscounter("vm", "tagged", &vmstats[0].tagged, sizeof(vmstats[0]));
+  statscounter("vm", "full", &vmstats[0].full, sizeof(vmstats[0]));
+  statscounter("vm", "asid", &vmstats[0].asid, sizeof(vmstats[0]));
+  statscounter("vm", "page", &vmstats[0].page, sizeof(vmstats[0]));
+  statscounter("vm", "rollover", &vmstats[0].rollover, sizeof(vmstats[0]));
+  statscounter("vm", "fault", &vmstats[0].fault, sizeof(vmstats[0]));
+  statscounter("vm", "cow", &vmstats[0].cow, sizeof(vmstats[0]));
+  statscounter("vm", "mega", &vmstats[0].mega, sizeof(vmstats[0]));
+  statscounter("vm", "split", &vmstats[0].split, sizeof(vmstats[0]));
 }
 
+// Create a per-process kernel page table.
+// The top-level entries 1..254 (kernel text, data and RAM) are
+// shared with kernel_pagetable. Entry 0 holds the user mappings,
+// so it gets its own level-1 table, but the device registers in
+// it point at the kernel's own leaf tables instead of new copies.
+// The CLINT is left out; timer.c uses its alias at KCLINT,
+// in the shared entries. Entry 255
+// holds the kernel stack and the trampoline.
+// Creating one costs a constant four pages: the root, entry 0's
+// level-1 table, and the level-1 and level-0 tables the trampoline
+// needs under entry 255. The stack's page comes on top.
 pagetable_t
 uvmcreate_kpgtbl() {
-  pagetable_t kpagetable = (pagetable_t) uvmcreate();
+  pagetable_t kpagetable, l1, kl1;
+
+  if((kpagetable = uvmcreate()) == 0)
+    return 0;
+  if((l1 = uvmcreate()) == 0){
+    kfree(kpagetable);
+    VMSTAT(ptfree);
+    return 0;
+  }
+  kpagetable[0] = PA2PTE(l1) | PTE_V;
 
-  // copy the kernel page table to this user specific kernel page table
-  // the first entry is for user vm, the last entry is per process kernel stack
-  // so only those pages which will be vary among processes will not be copied
   for (int i = 1; i < 255; i++) {
     kpagetable[i] = kernel_pagetable[i];
   }
 
-  // map the kernel address in first entry
-  ukvmmap(kpagetable, UART0, UART0, PGSIZE, PTE_R | PTE_W);
-  ukvmmap(kpagetable, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
-  ukvmmap(kpagetable, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
-  ukvmmap(kpagetable, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
+  kl1 = (pagetable_t)PTE2PA(kernel_pagetable[0]);
+  kvmshare(l1, kl1, UART0, PGSIZE);
+  kvmshare(l1, kl1, VIRTIO0, PGSIZE);
+  kvmshare(l1, kl1, PLIC, 0x400000);
 
-  // map the kernel address in last entry
-  ukvmmap(kpagetable, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
+  if(mappages(kpagetable, TRAMPOLINE, PGSIZE, (uint64)trampoline, PTE_R | PTE_X) != 0){
+    uvmfree_kpgtbl(kpagetable, 0);
+    return 0;
+  }
 
   return kpagetable;
 }
 
-void free_entry(pagetable_t level1) {
-  for (int i = 0; i < 512; i++) {
-    pte_t pte = level1[i];
-    if (pte & PTE_V) {
-      kfree((void *)PTE2PA(pte));
-    }
+// Point the level-1 entries of l1 that cover [va, va+sz) at
+// the leaf tables kl1 uses for the same addresses.
+static void
+kvmshare(pagetable_t l1, pagetable_t kl1, uint64 va, uint64 sz)
+{
+  uint64 a;
+
+  for(a = PGROUNDDOWN(va); a < va + sz; a += PGSIZE * 512)
+    l1[PX(1, a)] = kl1[PX(1, a)];
+}
+
+// The lower-level table that entry i of pagetable points
+// at, or 0. pagetable may be 0.
+static pagetable_t
+ptchild(pagetable_t pagetable, int i)
+{
+  if(pagetable == 0)
+    return 0;
+  pte_t pte = pagetable[i];
+  if((pte & PTE_V) == 0 || (pte & (PTE_R|PTE_W|PTE_X)) != 0)
+    return 0;
+  return (pagetable_t)PTE2PA(pte);
+}
+
+// Visit the page-table pages of pagetable, which is at the given
+// level, except those it shares with kpt or upt, the kernel's and
+// the user's tables at the same position (either may be 0). Frees
+// them if dofree is set. Returns how many there are. Leaves are
+// never freed.
+static int
+kvmwalkpages(pagetable_t pagetable, pagetable_t kpt, pagetable_t upt, int level, int dofree)
+{
+  int n = 1;
+
+  for(int i = 0; level > 0 && i < 512; i++){
+    pagetable_t child = ptchild(pagetable, i);
+    if(child == 0 || child == ptchild(kpt, i) || child == ptchild(upt, i))
+      continue;
+    n += kvmwalkpages(child, ptchild(kpt, i), ptchild(upt, i), level - 1, dofree);
+  }
+  if(dofree){
+    kfree((void*)pagetable);
+    VMSTAT(ptfree);
+  }
+  return n;
+}
+
+// Free a per-process kernel page table, but not what it shares
+// with kernel_pagetable or with the user page table upagetable,
+// nor the pages it maps. upagetable must not be freed yet.
+void
+uvmfree_kpgtbl(pagetable_t pagetable, pagetable_t upagetable) {
+  kvmwalkpages(pagetable, kernel_pagetable, upagetable, 2, 1);
+}
+
+// Count the valid user leaf PTEs in pagetable, which is at
+// the given level, in pages.
+static int
+uvmresident(pagetable_t pagetable, int level)
+{
+  int n = 0;
+
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(PTE_LEAF(pte))
+      n += (pte & PTE_U) ? 1 << (9 * level) : 0;
+    else if(level > 0)
+      n += uvmresident((pagetable_t)PTE2PA(pte), level - 1);
+  }
+  return n;
+}
+
+// Number of page-table pages that belong to a process:
+// its user page table and the unshared part of its
+// kernel page table.
+int
+proc_pgtblpages(struct proc *p)
+{
+  int n = 0;
+
+  if(p->pagetable)
+    n += kvmwalkpages(p->pagetable, 0, 0, 2, 0);
+  if(p->kpagetable)
+    n += kvmwalkpages(p->kpagetable, kernel_pagetable, p->pagetable, 2, 0);
+  return n;
+}
+
+// Number of user pages of p that are present in memory.
+int
+proc_residentpages(struct proc *p)
+{
+  if(p->pagetable == 0)
+    return 0;
+  return uvmresident(p->pagetable, 2);
+}
+
+// ASIDs.
+//
+// Every process gets a pair of address-space identifiers: asid
+// tags the TLB entries of its user page table and asid+1 those of
+// its kernel page table, so that the scheduler and the trampoline
+// can switch satp without flushing the whole TLB. The global
+// kernel page table uses KERNEL_ASID.
+//
+// ASIDs are handed out in increasing order and are never reused
+// within a generation. When they run out a new generation begins;
+// each hart flushes its whole TLB the next time it switches to a
+// process, and processes holding ASIDs of an older generation get
+// new ones. If the hardware has no ASIDs, everything uses ASID 0,
+// and every satp switch flushes the TLB as before.
+
+#define KERNEL_ASID 1
+
+struct {
+  struct spinlock lock;
+  uint max;            // largest ASID the hardware supports, or 0
+  uint next;           // next free ASID in this generation
+  uint64 generation;
+} asids;
+
+
+// find out how many ASID bits satp implements.
+// must run with paging on.
+void
+asidinit(void)
+{
+  uint64 satp = r_satp();
+
+  initlock(&asids.lock, "asid");
+  w_satp(satp | SATP_ASID_MASK);
+  asids.max = SATP_ASID(r_satp());
+  w_satp(satp);
+  sfence_vma();
+  if(asids.max <= KERNEL_ASID + 2)
+    asids.max = 0;
+  asids.next = KERNEL_ASID + 1;
+  asids.generation = 1;
+}
+
+// Give p a fresh pair of ASIDs, starting a new generation
+// if they have run out. Caller must hold asids.lock.
+static void
+asidalloc(struct proc *p)
+{
+  if(asids.next + 1 > asids.max){
+    asids.generation++;
+    asids.next = KERNEL_ASID + 1;
+    VMSTAT(rollover);
+  }
+  p->asid = asids.next;
+  p->asidgen = asids.generation;
+  p->asidcpus = 0;
+  asids.next += 2;
+}
+
+// Flush this hart's TLB if it may hold entries from an
+// older ASID generation. Interrupts must be off.
+static void
+asidsync(uint64 generation)
+{
+  struct cpu *c = mycpu();
+
+  if(c->asidgen != generation){
+    sfence_vma();
+    VMSTAT(full);
+    c->asidgen = generation;
+  }
+}
+
+// Prepare to run p on this hart: make sure p's ASIDs belong to
+// the current generation and that this hart's TLB holds nothing
+// from earlier ones. Interrupts must be off.
+void
+asidswitch(struct proc *p)
+{
+  uint64 generation;
+
+  if(asids.max == 0 || p->leader->nthread > 1)
+    return;
+  acquire(&asids.lock);
+  if(p->asidgen != asids.generation)
+    asidalloc(p);
+  generation = asids.generation;
+  release(&asids.lock);
+  asidsync(generation);
+  p->asidcpus |= 1L << cpuid();
+}
+
+// satp values for p's user and kernel page tables.
+// The threads of a process run untagged: they share its page
+// tables, and a thread that changes them can't flush the TLBs
+// of the harts the others run on, so each hart flushes its own
+// whenever it switches to one of them.
+uint64
+uvmsatp(struct proc *p)
+{
+  if(asids.max == 0 || p->leader->nthread > 1)
+    return MAKE_SATP(p->pagetable);
+  return MAKE_SATP_ASID(p->pagetable, p->asid);
+}
+
+uint64
+kvmsatp(struct proc *p)
+{
+  if(p == 0){
+    if(asids.max == 0)
+      return MAKE_SATP(kernel_pagetable);
+    return MAKE_SATP_ASID(kernel_pagetable, KERNEL_ASID);
+  }
+  if(asids.max == 0 || p->leader->nthread > 1)
+    return MAKE_SATP(p->kpagetable);
+  return MAKE_SATP_ASID(p->kpagetable, p->asid + 1);
+}
+
+// Load satp. An untagged satp needs a full flush, since the
+// TLB may hold entries of the previous page table.
+void
+satpswitch(uint64 satp)
+{
+  w_satp(satp);
+  if(SATP_ASID(satp) == 0){
+    sfence_vma();
+    VMSTAT(full);
+  } else {
+    VMSTAT(tagged);
   }
-  kfree(level1);
 }
 
-// only free the first and the last tbl entrys
+// Count a trip through the trampoline to user space and back
+// that didn't flush the TLB.
 void
-uvmfree_kpgtbl(pagetable_t pagetable) {
-  free_entry((void *)PTE2PA(pagetable[0]));
-  free_entry((void *)PTE2PA(pagetable[255]));
-  kfree(pagetable);
+tlbtrampoline(void)
+{
+  if(asids.max != 0)
+    VMSTATN(tagged, 2);
+}
+
+// Called by p, after it changed its own page tables, to drop
+// stale TLB entries: all of them if va is -1, else the ones
+// for the page at va. Entries in this hart's TLB are flushed
+// by ASID. If p has run on other harts with its current ASIDs,
+// their TLBs may also hold stale entries, so p moves to a new
+// pair of ASIDs instead, which no TLB holds entries for.
+static void
+tlbflushrange(struct proc *p, uint64 va)
+{
+  uint64 generation;
+
+  if(asids.max == 0 || p->leader->nthread > 1){
+    sfence_vma();
+    VMSTAT(full);
+    return;
+  }
+
+  push_off();
+  if(p->asidcpus & ~(1L << cpuid())){
+    acquire(&asids.lock);
+    asidalloc(p);
+    generation = asids.generation;
+    release(&asids.lock);
+    asidsync(generation);
+    p->asidcpus = 1L << cpuid();
+    w_satp(kvmsatp(p));
+    VMSTAT(asid);
+  } else if(va == -1){
+    sfence_vma_asid(p->asid);
+    sfence_vma_asid(p->asid + 1);
+    VMSTAT(asid);
+  } else {
+    sfence_vma_page(va, p->asid);
+    sfence_vma_page(va, p->asid + 1);
+    VMSTAT(page);
+  }
+  pop_off();
+}
+
+void
+tlbflush(struct proc *p)
+{
+  tlbflushrange(p, -1);
+}
+
+void
+tlbflushpage(struct proc *p, uint64 va)
+{
+  tlbflushrange(p, PGROUNDDOWN(va));
+}
+
+static int
+statsvm(char *buf, int sz)
+{
+  struct vmstat t;
+  int n;
+
+  memset(&t, 0, sizeof(t));
+  for(int i = 0; i < NCPU; i++){
+    struct vmstat *v = &vmstats[i];
+    t.tagged += v->tagged;
+    t.full += v->full;
+    t.asid += v->asid;
+    t.page += v->page;
+    t.rollover += v->rollover;
+    t.ptalloc += v->ptalloc;
+    t.ptfree += v->ptfree;
+  }
+
+  n = snprintf(buf, sz, "asids: %d\n", asids.max);
+  n += snprintf(buf+n, sz-n, "tlb tagged switches: %d\n", (int)t.tagged);
+  n += snprintf(buf+n, sz-n, "tlb full flushes: %d\n", (int)t.full);
+  n += snprintf(buf+n, sz-n, "tlb asid flushes: %d\n", (int)t.asid);
+  n += snprintf(buf+n, sz-n, "tlb page flushes: %d\n", (int)t.page);
+  n += snprintf(buf+n, sz-n, "asid rollovers: %d\n", (int)t.rollover);
+  n += snprintf(buf+n, sz-n, "page-table pages: %d\n", (int)(t.ptalloc - t.ptfree));
+  for(int i = 0; i < NCPU; i++){
+    struct vmstat *v = &vmstats[i];
+    n += snprintf(buf+n, sz-n, "vm %d: tagged %d full %d asid %d page %d ptalloc %d ptfree %d fault %d cow %d mega %d split %d\n",
+                  i, (int)v->tagged, (int)v->full, (int)v->asid, (int)v->page,
+                  (int)v->ptalloc, (int)v->ptfree, (int)v->fault, (int)v->cow,
+                  (int)v->mega, (int)v->split);
+  }
+  return n;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -95,8 +461,12 @@ uvmfree_kpgtbl(pagetable_t pagetable) {
 void
 kvminithart()
 {
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(kvmsatp(0));
   sfence_vma();
+
+  // per-process kernel page tables share the user's leaf page
+  // tables, PTE_U and all; see copy_upgtbl().
+  w_sstatus(r_sstatus() | SSTATUS_SUM);
 }
 
 // Return the address of the PTE in page table pagetable
@@ -111,24 +481,40 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va is inside a megapage, returns its level-1 leaf PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but stop at the PTE at *level, or at a leaf PTE
+// above it, and set *level to the level of the PTE returned.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
+      VMSTAT(ptalloc);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -139,18 +525,20 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  // the 4K page holding va, if in a megapage.
+  pa = PTE2PA(*pte) + (PGROUNDDOWN(va) & (PXSIZE(level) - 1));
   return pa;
 }
 
@@ -160,7 +548,7 @@ walkaddr(pagetable_t pagetable, uint64 va)
 void
 kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kernel_pagetable, va, sz, pa, perm) != 0)
+  if(mapmegapages(kernel_pagetable, va, sz, pa, perm) != 0)
     panic("kvmmap");
 }
 
@@ -178,17 +566,19 @@ ukvmmap(pagetable_t pagetable, uint64 va, uint64 pa, uint64 sz, int perm)
 uint64
 kvmpa(uint64 va)
 {
-  uint64 off = va % PGSIZE;
+  uint64 off;
   pte_t *pte;
   uint64 pa;
+  int level = 0;
   struct proc *p = myproc();
   
   // use process kernel pgtbl, because we are using kernel stack here
-  pte = walk(p->kpagetable, va, 0);
+  pte = walklevel(p->kpagetable, va, 0, &level);
   if(pte == 0)
     panic("kvmpa");
   if((*pte & PTE_V) == 0)
     panic("kvmpa");
+  off = va & (PXSIZE(level) - 1);
   pa = PTE2PA(*pte);
   return pa+off;
 }
@@ -221,25 +611,80 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Like mappages(), but map with 2MB megapages wherever va and pa
+// are both megapage-aligned and at least a megapage remains, and
+// with 4K pages elsewhere. For the kernel's direct map, where it
+// saves most page-table pages and TLB entries.
+int
+mapmegapages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
+{
+  uint64 a, end;
+  pte_t *pte;
+  int level;
+
+  a = PGROUNDDOWN(va);
+  end = PGROUNDDOWN(va + size - 1) + PGSIZE;
+  while(a < end){
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && end - a >= MEGAPGSIZE){
+      level = 1;
+      if((pte = walklevel(pagetable, a, 1, &level)) == 0)
+        return -1;
+      if(*pte & PTE_V) {
+        printf("%p\n", a);
+        panic("remap");
+      }
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      a += MEGAPGSIZE;
+      pa += MEGAPGSIZE;
+    } else {
+      if(mappages(pagetable, a, PGSIZE, pa, perm) != 0)
+        return -1;
+      a += PGSIZE;
+      pa += PGSIZE;
+    }
+  }
+  return 0;
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never allocated (holes left
+// by lazy allocation) are skipped; swapped-out ones give up
+// their swap slots. Megapages must be removed
+// whole; split them with uvmsplit() first otherwise.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+    level = 0;
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      if(do_free)
+        swapfree(*pte);
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level != 0){
+      if(a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > va + npages*PGSIZE)
+        panic("uvmunmap: part of a megapage");
+      if(do_free)
+        kfree_pages((void*)PTE2PA(*pte), MEGAORDER);
+      *pte = 0;
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -248,16 +693,45 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   }
 }
 
+// If va is inside a megapage of pagetable, replace the
+// megapage with a leaf table of 4K PTEs for the same memory,
+// whose pages then each hold their own reference. The
+// caller must mirror the change with copy_upgtbl() and flush
+// the TLB. Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pagetable_t l0;
+  pte_t *pte;
+  uint64 pa;
+  int level = 1, flags;
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || !PTE_LEAF(*pte))
+    return 0;
+  if((l0 = (pagetable_t)kzalloc()) == 0)
+    return -1;
+  VMSTAT(ptalloc);
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  ksplitpages((void*)pa, MEGAORDER);
+  for(int i = 0; i < 512; i++)
+    l0[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(l0) | PTE_V;
+  VMSTAT(split);
+  return 0;
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
+  VMSTAT(ptalloc);
   return pagetable;
 }
 
@@ -291,12 +765,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   oldsz = PGROUNDUP(oldsz);
 
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -306,47 +779,47 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   return newsz;
 }
 
+// Make the kernel page table's view of user memory between
+// oldsz and newsz (in either order) match upagetable. Rather
+// than copying PTEs, kpagetable's level-1 entries point at the
+// user's own leaf page-table pages, which the kernel can use
+// because kvminithart() sets SSTATUS_SUM. So changes to user
+// PTEs need no mirroring, only changes to upagetable's level-1
+// table do: new leaf tables, or a whole new user page table.
 void
 copy_upgtbl(pagetable_t upagetable, pagetable_t kpagetable, uint64 oldsz, uint64 newsz)
 {
-  if (newsz > oldsz) {
-    // add new mapping
-    uint64 a;
-    oldsz = PGROUNDUP(oldsz);
-    for(a = oldsz; a < newsz; a += PGSIZE){
-      pte_t *pte = walk(upagetable, a, 0);
-      if (pte == 0) {
-        panic("copy upgtbl: failed to get pte");
-      }
+  pagetable_t ul1, kl1;
+  uint64 lo, hi, i;
 
-      pte_t *kpte = walk(kpagetable, a, 1);
-      if (pte == 0) {
-        panic("copy upgtbl: failed to create pte");
-      }
-      uint64 flag = PTE_FLAGS(*pte) & (~PTE_U);
-      *kpte = ((*pte) & (~0x3FF)) | flag;
-      // *kpte = PA2PTE(PTE2PA(*pte)) | flag;
-    }
-  } else {
-    // unmap old mapping
-    if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
-      int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-      uvmunmap(kpagetable, PGROUNDUP(newsz), npages, 0);
-    }
-  }
-}
+  lo = oldsz < newsz ? oldsz : newsz;
+  hi = oldsz < newsz ? newsz : oldsz;
+  if(hi > PLIC)
+    panic("copy_upgtbl");
+  if(lo == hi)
+    return;
 
+  ul1 = ptchild(upagetable, 0);
+  kl1 = (pagetable_t)PTE2PA(kpagetable[0]);
+  for(i = PX(1, lo); i <= PX(1, hi - 1); i++)
+    kl1[i] = ul1 ? ul1[i] : 0;
+}
 
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if
+// a megapage that newsz ends inside of could not be split.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
   if(newsz >= oldsz)
     return oldsz;
 
+  if(PGROUNDUP(newsz) % MEGAPGSIZE != 0 &&
+     uvmsplit(pagetable, PGROUNDUP(newsz)) < 0)
+    return oldsz;
+
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
     uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
@@ -373,6 +846,7 @@ freewalk(pagetable_t pagetable)
     }
   }
   kfree((void*)pagetable);
+  VMSTAT(ptfree);
 }
 
 // Free user memory pages,
@@ -385,42 +859,406 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
+// Free a dead process's user memory below sz, and the page-table
+// pages that mapped it, but keep its user page table pagetable
+// and kernel page table kpagetable as proc_pagetable() and
+// uvmcreate_kpgtbl() made them, for another process to reuse.
+void
+uvmrecycle(pagetable_t pagetable, pagetable_t kpagetable, uint64 sz)
+{
+  pagetable_t kl1 = (pagetable_t)PTE2PA(kpagetable[0]);
+
+  // unlink the user leaf tables the kernel page table shares.
+  for(int i = 0; i < PX(1, PLIC); i++)
+    kl1[i] = 0;
+
+  if(sz > 0)
+    uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+  // everything but the trampoline, trapframe and USYSCALL
+  // pages, at the top.
+  for(int i = 0; i < PX(2, TRAPFRAME); i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(PTE_LEAF(pte))
+      panic("uvmrecycle: leaf");
+    freewalk((pagetable_t)PTE2PA(pte));
+    pagetable[i] = 0;
+  }
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: writable pages are
+// marked copy-on-write in both parent and child,
+// and the physical memory is shared until one of
+// them stores to it (see uvmcow()).
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages present in old's [start, end) into new too.
+// If cow is set, writable pages become copy-on-write in both;
+// otherwise both map them writable, sharing their contents.
+// Megapages in old are split into 4K pages first, so the
+// caller must mirror old with copy_upgtbl().
+// Returns 0 on success, -1 on failure, after unmapping what
+// it mapped in new.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
+{
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = start; i < end; i += PGSIZE){
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0)
+      continue;  // lazily allocated, not touched yet
+    if(*pte & PTE_SWAP){
+      // share the swap slot; each reads its own copy back.
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(*pte);
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(level != 0){
+      if(uvmsplit(old, i) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    krefpage((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Give the page at user virtual address va a private,
+// writable copy if it is shared copy-on-write. The last
+// process holding a COW page just takes it over.
+// Returns 0 on success, -1 if va isn't a COW page, or -2
+// if there is no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0)
+    return -1;
+  if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcount((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -2;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  VMSTAT(cow);
+  return 0;
+}
+
+// Back the 2MB-aligned region of p's heap around va with a
+// zeroed megapage, if all of it is below p->sz, none of it
+// is read from the executable or already present, and a
+// contiguous 2MB of memory is free. Returns 0 if it did so,
+// -1 if the fault should be served with a 4K page instead.
+static int
+uvmmegafault(struct proc *p, uint64 va)
+{
+  uint64 m = va & ~(MEGAPGSIZE - 1);
+  pte_t *pte;
+  char *mem;
+  int level;
+
+  if(m + MEGAPGSIZE > p->sz)
+    return -1;
+  for(int i = 0; i < p->nexecseg; i++){
+    struct execseg *sg = &p->execseg[i];
+    if(m < sg->va + sg->filesz && m + MEGAPGSIZE > sg->va)
+      return -1;
+  }
+  level = 1;
+  pte = walklevel(p->pagetable, m, 0, &level);
+  if(pte && (*pte & PTE_V))
+    return -1;
+
+  if((mem = kalloc_pages(MEGAORDER)) == 0)
+    return -1;
+  level = 1;
+  if((pte = walklevel(p->pagetable, m, 1, &level)) == 0){
+    kfree_pages(mem, MEGAORDER);
+    return -1;
+  }
+  memset(mem, 0, MEGAPGSIZE);
+  *pte = PA2PTE(mem) | PTE_W|PTE_X|PTE_R|PTE_U|PTE_V;
+  VMSTAT(mega);
+  return 0;
+}
+
+// Map the page at pa, which a fault on va in process p filled,
+// with permissions perm, unless another thread of p mapped va
+// first. Returns 0 if pa was mapped, 1 if va already was, and
+// -1 if out of memory.
+int
+uvmfaultmap(struct proc *p, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  int r = 0;
+
+  acquire(&p->sharelock);
+  if((pte = walk(p->pagetable, va, 1)) == 0)
+    r = -1;
+  else if(*pte & (PTE_V|PTE_SWAP))
+    r = 1;
+  else
+    *pte = PA2PTE(pa) | perm | PTE_V;
+  release(&p->sharelock);
+  return r;
+}
+
+// Handle a page fault at user virtual address va in the
+// current process, for an access that needed permission perm
+// (PTE_R, PTE_W or PTE_X). A missing page below p->sz is part
+// of the program image, which execfault() maps shared with the
+// other processes running it, or of the lazily allocated heap
+// or bss, and gets a zeroed page; one above it may be part of
+// a memory-mapped file, see mmapfault(); a store to a
+// copy-on-write page gets a private copy; a swapped-out page
+// is read back in, see swapin(). Either way the process's kernel page table mirror
+// is brought up to date.
+// The page tables and the memory layout are the leader's, and
+// other threads may fault on the same page at once, so changes
+// are made under its sharelock, which isn't held while reading
+// a page in. A fault on a page that is already mapped with perm
+// lost such a race, and only needs retrying.
+// Returns 0 if the access can be retried, -1 if va is not a
+// valid address, or -2 if memory has run out.
+int
+uvmfault(uint64 va, int perm)
+{
+  struct proc *p = myproc()->leader;
+  pte_t *pte;
+  char *mem;
+  int r;
+
+  if(va >= PLIC)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  acquire(&p->sharelock);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if((*pte & PTE_U) && (*pte & perm))
+      r = 0;
+    else if(perm == PTE_W)
+      r = uvmcow(p->pagetable, va);
+    else
+      r = -1;
+  } else if(pte && (*pte & PTE_SWAP)){
+    release(&p->sharelock);
+    r = swapin(pte);
+    acquire(&p->sharelock);
+  } else if(va >= p->sz){
+    release(&p->sharelock);
+    r = mmapfault(p, va, perm == PTE_W);
+    acquire(&p->sharelock);
+  } else if(uvmmegafault(p, va) == 0){
+    va = va & ~(MEGAPGSIZE - 1);
+    r = 0;
+  } else if(execpaged(p, va)){
+    release(&p->sharelock);
+    r = execfault(p, va);
+    acquire(&p->sharelock);
+    // a store wants its own copy of the shared page now.
+    pte = walk(p->pagetable, va, 0);
+    if(r == 0 && perm == PTE_W && (*pte & PTE_W) == 0)
+      r = uvmcow(p->pagetable, va);
+  } else {
+    release(&p->sharelock);
+    if((mem = kzalloc()) == 0)
+      r = -2;
+    else if((r = uvmfaultmap(p, va, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U)) != 0)
+      r = r < 0 ? -2 : 0;
+    else
+      mem = 0;
+    if(mem)
+      kfree(mem);
+    acquire(&p->sharelock);
+  }
+  if(r == 0)
+    copy_upgtbl(p->pagetable, p->kpagetable, va, va + PGSIZE);
+  release(&p->sharelock);
+  if(r < 0)
+    return r;
+
+  tlbflushpage(myproc(), va);
+  VMSTAT(fault);
+  return 0;
+}
+
+// Resolve all of p's copy-on-write pages, before it gets its
+// first thread: a thread breaking COW would leave stale entries
+// for the old page in the TLBs of harts other threads run on.
+// Returns 0, or -1 if out of memory.
+int
+uvmunshare(struct proc *p)
+{
+  pte_t *pte;
+  uint64 a;
+
+  for(a = 0; a < PLIC; a += PGSIZE){
+    if(a >= PGROUNDUP(p->sz) && vmalookup(p, a) == 0)
+      continue;
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && (*pte & PTE_COW) &&
+       uvmcow(p->pagetable, a) < 0)
+      return -1;
+  }
+  tlbflush(p);
+  return 0;
+}
+
+// Make sure the user pages covering [va, va+len) in the
+// current process are present, so that the kernel can read
+// them directly through its page table.
+// Returns 0 on success, -1 on failure.
+int
+uvmtouch(uint64 va, uint64 len)
+{
+  struct proc *p = myproc()->leader;
+  uint64 a;
+  pte_t *pte;
+
+  if(len == 0)
+    return 0;
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    if(a >= MAXVA)
+      return -1;
+    pte = walk(p->pagetable, a, 0);
+    if((pte == 0 || (*pte & PTE_V) == 0) && uvmfault(a, PTE_R) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Lend out the heap page at va of process p, making it
+// copy-on-write if it is writable. Returns its physical
+// address, with a reference the caller must kfree(), or 0
+// if va is not a present page of p's heap.
+uint64
+uvmgetpage(struct proc *p, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  // a thread couldn't drop the other threads' TLB entries for
+  // the page it makes read-only.
+  if(va % PGSIZE != 0 || va + PGSIZE > p->sz || p->nthread > 1)
+    return 0;
+  if(uvmsplit(p->pagetable, va) < 0)
+    return 0;
+  copy_upgtbl(p->pagetable, p->kpagetable, va, va + PGSIZE);
+  pte = walk(p->pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return 0;
+  if(*pte & PTE_W){
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+    tlbflushpage(p, va);
+  }
+  pa = PTE2PA(*pte);
+  krefpage((void*)pa);
+  return pa;
+}
+
+// Replace the heap page at va of process p with the page at
+// pa, copy-on-write, freeing the old one. Takes over the
+// caller's reference to pa on success. Returns 0 on success,
+// -1 if va is not in p's heap or memory has run out. A page p
+// can't write, such as text or a shared page-cache page, or one
+// of the program image not yet read in, is not heap.
+int
+uvmputpage(struct proc *p, uint64 va, uint64 pa)
+{
+  pte_t *pte;
+  uint flags;
+
+  if(va % PGSIZE != 0 || va + PGSIZE > p->sz || p->nthread > 1)
+    return -1;
+  if(uvmsplit(p->pagetable, va) < 0)
+    return -1;
+  if((pte = walk(p->pagetable, va, 1)) == 0)
+    return -1;
+  if(*pte & (PTE_V|PTE_SWAP)){
+    if((*pte & PTE_U) == 0 || (*pte & (PTE_W|PTE_COW)) == 0)
+      return -1;
+  } else if(execpaged(p, va))
+    return -1;
+  if(*pte & PTE_V)
+    kfree((void*)PTE2PA(*pte));
+  else if(*pte & PTE_SWAP)
+    swapfree(*pte);
+  flags = PTE_R|PTE_X|PTE_U|PTE_V;
+  if(krefcount((void*)pa) == 1)
+    flags |= PTE_W;
+  else
+    flags |= PTE_COW;
+  *pte = PA2PTE(pa) | flags;
+  copy_upgtbl(p->pagetable, p->kpagetable, va, va + PGSIZE);
+  tlbflushpage(p, va);
+  return 0;
+}
+
+// Fault in the not yet present pages of [va, va+len) in the
+// current process that are read from a file: those of memory-
+// mapped files, of the program image, and of swap. System calls
+// that copy to or from user memory with a pipe, inode or proc
+// lock held call this first, since such a fault has to sleep.
+void
+uvmprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc()->leader;
+  uint64 a;
+  pte_t *pte;
+
+  for(a = PGROUNDDOWN(va); a < va + len && a < PLIC; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V))
+      continue;
+    if((pte && (*pte & PTE_SWAP)) || vmalookup(p, a) || execpaged(p, a))
+      uvmfault(a, PTE_R);
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -441,9 +1279,21 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
+    if(va0 >= MAXVA)
+      return -1;
+    pte = walk(pagetable, va0, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_COW)){
+      // not allocated yet, or shared copy-on-write.
+      if(pagetable != myproc()->pagetable || uvmfault(va0, PTE_W) < 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & PTE_W) == 0)
+      return -1;
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
@@ -537,7 +1387,7 @@ void print_pgtbl_helper(pagetable_t pagetable, int level) {
         printf(".. ");
       }
       printf("..%d: pte %p pa %p\n", i, pte, PTE2PA(pte));
-      if (level < 3) {
+      if (level < 3 && !PTE_LEAF(pte)) {
         print_pgtbl_helper((pagetable_t)PTE2PA(pte), level + 1);
       }
     }
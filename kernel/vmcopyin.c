@@ -29,30 +29,62 @@ statscopyin(char *buf, int sz) {
 int
 copyin_new(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
   if (srcva >= p->sz || srcva+len >= p->sz || srcva+len < srcva)
     return -1;
+  if (uvmtouch(srcva, len) < 0)
+    return -1;
   memmove((void *) dst, (void *)srcva, len);
   stats.ncopyin++;   // XXX lock
   return 0;
 }
 
+// a word with a zero byte in it has this nonzero.
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
 // Return 0 on success, -1 on error.
+//
+// Goes a page at a time, and in each looks for the '\0' a word
+// at a time once srcva is word-aligned; words are stored whole
+// if dst is aligned the same way.
 int
 copyinstr_new(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
   char *s = (char *) srcva;
-  
+  int aligned = ((srcva ^ (uint64)dst) & 7) == 0;
+  uint64 i, n, w;
+
   stats.ncopyinstr++;   // XXX lock
-  for(int i = 0; i < max && srcva + i < p->sz; i++){
-    dst[i] = s[i];
-    if(s[i] == '\0')
-      return 0;
+  for(i = 0; i < max && srcva + i < p->sz; ){
+    if(uvmtouch(srcva + i, 1) < 0)
+      return -1;
+    // to the end of this page, of max, or of memory.
+    n = PGROUNDDOWN(srcva + i) + PGSIZE - srcva;
+    if(n > max)
+      n = max;
+    if(srcva + n > p->sz)
+      n = p->sz - srcva;
+    for(; i < n && (srcva + i) % 8; i++)
+      if((dst[i] = s[i]) == '\0')
+        return 0;
+    for(; i + 8 <= n; i += 8){
+      w = *(uint64*)(s + i);
+      if(HASZERO(w))
+        break;
+      if(aligned)
+        *(uint64*)(dst + i) = w;
+      else
+        for(int j = 0; j < 8; j++)
+          dst[i + j] = s[i + j];
+    }
+    for(; i < n; i++)
+      if((dst[i] = s[i]) == '\0')
+        return 0;
   }
   return -1;
 }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #define stat xv6_stat  // avoid clash with host struct stat
 #include "kernel/types.h"
@@ -16,30 +17,45 @@
 #endif
 
 #define NINODES 200
+#define MAXINODES 65535  // struct dirent's inum is a ushort
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+// followed by the swap area.
+
+uint fssize = FSSIZE;
+uint ninodes = NINODES;
+uint nswap = SWAPSIZE;
+int nbitmap;
+int ninodeblocks;
+int nlog = LOGSIZE + 1;  // header included
+int nopblocks = MAXOPBLOCKS;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
+// the image is mapped, so that sectors are read and written in
+// memory; it starts out as one hole, which reads as zeroes.
 int fsfd;
+char *img;
+size_t imgsize;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
+// data blocks reserved for a file by iprealloc(), [extnext, extend).
+uint extnext, extend;
+
 
-void balloc(int);
+void balloc(uint);
+char *sect(uint);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void iprealloc(uint inum, uint nblk);
+void dxbuild(uint inum);
 
 // convert to intel byte order
 ushort
@@ -68,16 +84,59 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, tmpino, inum, off, nroot;
+  static char buf[64*BSIZE];
   struct dirent de;
-  char buf[BSIZE];
   struct dinode din;
+  off_t size;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  // -s n: the file system is n blocks.
+  // -i n: it has n inodes.
+  // -w n: the swap area after it is n blocks.
+  // -l n: n data blocks in the log.
+  // -o n: FS operations may write up to n blocks.
+  for(; argc > 2 && argv[1][0] == '-'; argc -= 2, argv += 2){
+    if(strcmp(argv[1], "-s") == 0)
+      fssize = strtoul(argv[2], 0, 0);
+    else if(strcmp(argv[1], "-i") == 0)
+      ninodes = strtoul(argv[2], 0, 0);
+    else if(strcmp(argv[1], "-w") == 0)
+      nswap = strtoul(argv[2], 0, 0);
+    else if(strcmp(argv[1], "-l") == 0)
+      nlog = atoi(argv[2]) + 1;
+    else if(strcmp(argv[1], "-o") == 0)
+      nopblocks = atoi(argv[2]);
+    else
+      break;
+  }
+  if(argc < 2 || argv[1][0] == '-'){
+    fprintf(stderr, "Usage: mkfs [-s blocks] [-i inodes] [-w swapblocks] "
+            "[-l logblocks] [-o opblocks] fs.img files...\n");
+    exit(1);
+  }
+  if(nopblocks < MAXOPBLOCKS || nlog - 1 < nopblocks || nlog > MAXNLOG){
+    fprintf(stderr, "mkfs: need %d <= opblocks <= logblocks <= %d\n",
+            MAXOPBLOCKS, (int)MAXNLOG - 1);
+    exit(1);
+  }
+  if(ninodes < ROOTINO + 2 || ninodes > MAXINODES){
+    fprintf(stderr, "mkfs: need %d <= inodes <= %d\n", ROOTINO + 2, MAXINODES);
+    exit(1);
+  }
+  // the kernel sizes its swap slot table for SWAPSIZE.
+  if(nswap > SWAPSIZE || nswap % (4096 / BSIZE) != 0){
+    fprintf(stderr, "mkfs: swap blocks must be a multiple of %d up to %d\n",
+            4096 / BSIZE, SWAPSIZE);
+    exit(1);
+  }
+  nbitmap = fssize/BPB + 1;
+  ninodeblocks = ninodes/IPB + 1;
+  if(fssize > 0xffffffffU - nswap ||
+     fssize <= 2 + nlog + ninodeblocks + nbitmap + argc){
+    fprintf(stderr, "mkfs: %u blocks is too small or too big\n", fssize);
     exit(1);
   }
 
@@ -89,34 +148,46 @@ main(int argc, char *argv[])
     perror(argv[1]);
     exit(1);
   }
+  imgsize = (size_t)(fssize + nswap) * BSIZE;
+  if(ftruncate(fsfd, imgsize) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
+  img = mmap(0, imgsize, PROT_READ|PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if(img == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
 
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.swapstart = xint(fssize);
+  sb.nswap = xint(nswap);
+  sb.nopblocks = xint(nopblocks);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %u swap %u op blocks %d\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize, nswap, nopblocks);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
-  memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  memmove(img + BSIZE, &sb, sizeof(sb));
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
+  // ".", "..", "tmp" and a name per file, in one run of blocks,
+  // with the whole block the size is rounded up to below.
+  nroot = (3 + argc - 2) * sizeof(struct dirent) / BSIZE + 1;
+  iprealloc(rootino, nroot);
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
@@ -128,11 +199,35 @@ main(int argc, char *argv[])
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
+  // an empty /tmp, for the kernel to mount the ram disk on.
+  tmpino = ialloc(T_DIR);
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(tmpino);
+  strcpy(de.name, "tmp");
+  iappend(rootino, &de, sizeof(de));
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(tmpino);
+  strcpy(de.name, ".");
+  iappend(tmpino, &de, sizeof(de));
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(rootino);
+  strcpy(de.name, "..");
+  iappend(tmpino, &de, sizeof(de));
+
+  rinode(rootino, &din);
+  din.nlink = xshort(xshort(din.nlink) + 1);
+  winode(rootino, &din);
+
   for(i = 2; i < argc; i++){
-    // get rid of "user/"
+    // get rid of "user/", or "kernel/" of kernel.sym
     char *shortname;
     if(strncmp(argv[i], "user/", 5) == 0)
       shortname = argv[i] + 5;
+    else if(strncmp(argv[i], "kernel/", 7) == 0)
+      shortname = argv[i] + 7;
     else
       shortname = argv[i];
     
@@ -150,6 +245,10 @@ main(int argc, char *argv[])
     if(shortname[0] == '_')
       shortname += 1;
 
+    if(freeinode >= ninodes){
+      fprintf(stderr, "mkfs: out of inodes\n");
+      exit(1);
+    }
     inum = ialloc(T_FILE);
 
     bzero(&de, sizeof(de));
@@ -157,6 +256,11 @@ main(int argc, char *argv[])
     strncpy(de.name, shortname, DIRSIZ);
     iappend(rootino, &de, sizeof(de));
 
+    if((size = lseek(fd, 0, SEEK_END)) < 0 || lseek(fd, 0, SEEK_SET) != 0){
+      perror(argv[i]);
+      exit(1);
+    }
+    iprealloc(inum, (size + BSIZE - 1) / BSIZE);
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
 
@@ -169,23 +273,32 @@ main(int argc, char *argv[])
   off = ((off/BSIZE) + 1) * BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
+  dxbuild(rootino);
 
   balloc(freeblock);
 
+  if(munmap(img, imgsize) < 0 || close(fsfd) < 0){
+    perror(argv[1]);
+    exit(1);
+  }
   exit(0);
 }
 
-void
-wsect(uint sec, void *buf)
+// the image's sector sec; there are no others to read or write.
+char*
+sect(uint sec)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
-    perror("write");
+  if(sec >= fssize){
+    fprintf(stderr, "mkfs: file system full\n");
     exit(1);
   }
+  return img + (size_t)sec * BSIZE;
+}
+
+void
+wsect(uint sec, void *buf)
+{
+  memmove(sect(sec), buf, BSIZE);
 }
 
 void
@@ -218,14 +331,7 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
-    perror("read");
-    exit(1);
-  }
+  memmove(buf, sect(sec), BSIZE);
 }
 
 uint
@@ -242,24 +348,92 @@ ialloc(ushort type)
   return inum;
 }
 
+// mark blocks [0, used) allocated in the bitmap, whose blocks
+// are still zero.
 void
-balloc(int used)
+balloc(uint used)
 {
-  uchar buf[BSIZE];
-  int i;
-
-  printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
-  }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  uchar *bits = (uchar*)sect(xint(sb.bmapstart));
+
+  printf("balloc: first %u blocks have been allocated\n", used);
+  assert(used <= fssize);
+  memset(bits, 0xff, used/8);
+  if(used % 8)
+    bits[used/8] = (1 << (used%8)) - 1;
+  printf("balloc: write bitmap blocks at sector %d\n", xint(sb.bmapstart));
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// a new data block: the next of the run iprealloc() reserved, if
+// any is left, else the next free one.
+uint
+dalloc(void)
+{
+  if(extnext < extend)
+    return extnext++;
+  return freeblock++;
+}
+
+// the disk block holding block fbn of the file din describes,
+// allocated if need be. see bmap() in kernel/fs.c.
+uint
+fbmap(struct dinode *din, uint fbn)
+{
+  uint indirect[NINDIRECT];
+  uint addr, i, level, per;
+
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0)
+      din->addrs[fbn] = xint(dalloc());
+    return xint(din->addrs[fbn]);
+  }
+  fbn -= NDIRECT;
+  for(level = 1, per = NINDIRECT; fbn >= per; level++){
+    fbn -= per;
+    per *= NINDIRECT;
+  }
+  if(xint(din->addrs[NDIRECT+level-1]) == 0)
+    din->addrs[NDIRECT+level-1] = xint(freeblock++);
+  addr = xint(din->addrs[NDIRECT+level-1]);
+  for(; level > 0; level--){
+    per /= NINDIRECT;
+    rsect(addr, (char*)indirect);
+    i = fbn / per;
+    fbn %= per;
+    if(indirect[i] == 0){
+      indirect[i] = xint(level == 1 ? dalloc() : freeblock++);
+      wsect(addr, (char*)indirect);
+    }
+    addr = xint(indirect[i]);
+  }
+  return addr;
+}
+
+// give the first nblk blocks of inode inum, which has none yet,
+// one contiguous run of data blocks, with the indirect blocks
+// that map them after it, for sequential reads to be sequential
+// on disk.
+void
+iprealloc(uint inum, uint nblk)
+{
+  struct dinode din;
+
+  assert(nblk <= MAXFILE);
+  rinode(inum, &din);
+  extnext = freeblock;
+  freeblock += nblk;
+  extend = freeblock;
+  if(extend > fssize || extend < extnext){
+    fprintf(stderr, "mkfs: file system full\n");
+    exit(1);
+  }
+  for(uint fbn = 0; fbn < nblk; fbn++)
+    fbmap(&din, fbn);
+  assert(extnext == extend);
+  winode(inum, &din);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -267,7 +441,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -276,22 +449,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = fbmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -303,3 +461,80 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// same as dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// give directory inum a hash index if it is big enough to need
+// one, with as few buckets as hold its entries. see struct dxhead
+// in kernel/fs.h.
+void
+dxbuild(uint inum)
+{
+  static struct dxbucket b[1<<DXMAXDEPTH];
+  struct dirent *de;
+  struct dxhead h;
+  char buf[BSIZE];
+  struct dinode din;
+  uint size, n, depth, i, k, mask;
+
+  rinode(inum, &din);
+  size = xint(din.size);
+  if(size <= DXMIN*BSIZE)
+    return;
+  n = size / sizeof(struct dirent);
+  de = malloc(size);
+  for(i = 0; i < size / BSIZE; i++)
+    rsect(fbmap(&din, i), (char*)de + i*BSIZE);
+
+  for(depth = 1; depth <= DXMAXDEPTH; depth++){
+    mask = (1 << depth) - 1;
+    bzero(b, sizeof(b));
+    for(i = 0; i < n; i++){
+      if(de[i].inum == 0)
+        continue;
+      k = dirhash(de[i].name) & mask;
+      if(b[k].n == DXNENT)
+        break;
+      b[k].e[b[k].n].hash = xint(dirhash(de[i].name));
+      b[k].e[b[k].n].slot = xint(i);
+      b[k].n++;
+    }
+    if(i == n)
+      break;
+  }
+  if(depth > DXMAXDEPTH){
+    printf("dxbuild: inode %d stays unindexed\n", inum);
+    free(de);
+    return;
+  }
+
+  bzero(&h, sizeof(h));
+  h.magic = xint(DXMAGIC);
+  h.size = xint(size);
+  h.depth = xshort(depth);
+  h.nblock = xshort(1 + (1 << depth));
+  for(i = 0; i < n && h.nfree < DXNFREE; i++)
+    if(de[i].inum == 0)
+      h.free[h.nfree++] = xint(i);
+  h.nfree = xshort(h.nfree);
+  for(k = 0; k < (1 << depth); k++){
+    h.bucket[k] = xshort(1 + k);
+    b[k].n = xshort(b[k].n);
+    b[k].depth = xshort(depth);
+    wsect(fbmap(&din, DIRIDX + 1 + k), (char*)&b[k]);
+  }
+  bzero(buf, sizeof(buf));
+  memmove(buf, &h, sizeof(h));
+  wsect(fbmap(&din, DIRIDX), buf);
+  winode(inum, &din);
+  free(de);
+}
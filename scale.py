@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+#
+# Boot xv6 under each CPU count given, run "scale <cpus>" in it,
+# and print how each workload's throughput scales, with the locks
+# that spun the most. Run by "make scale".
+#
+#   python3 scale.py [cpus...]
+#
+
+import os
+import re
+import select
+import signal
+import subprocess
+import sys
+import time
+
+TIMEOUT = 300
+
+
+def run(cpus):
+    cmd = ["make", "-s", "--no-print-directory", "qemu", "CPUS=%d" % cpus]
+    p = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                         stderr=subprocess.STDOUT, start_new_session=True)
+    out = b""
+    sent = False
+    deadline = time.time() + TIMEOUT
+    try:
+        while b"scale done" not in out:
+            if time.time() > deadline:
+                sys.exit("scale.py: timed out with CPUS=%d" % cpus)
+            r, _, _ = select.select([p.stdout], [], [], 1)
+            if not r:
+                continue
+            buf = os.read(p.stdout.fileno(), 4096)
+            if buf == b"":
+                sys.exit("scale.py: qemu exited with CPUS=%d" % cpus)
+            out += buf
+            if not sent and b"$ " in out:
+                p.stdin.write(b"scale %d\n" % cpus)
+                p.stdin.flush()
+                sent = True
+    finally:
+        os.killpg(p.pid, signal.SIGTERM)
+        p.wait()
+    return out.decode("utf-8", "replace")
+
+
+def main():
+    cpus = [int(a) for a in sys.argv[1:]] or [1, 2, 4, 8]
+    ops = {}        # (workload, cpus) -> ops per tick
+    locks = {}      # (workload, cpus) -> top lock line
+    names = []
+    for n in cpus:
+        print("running with CPUS=%d" % n, file=sys.stderr)
+        for line in run(n).splitlines():
+            m = re.match(r"scale (\w+) workers \d+ ops (\d+) ticks (\d+)", line)
+            if m:
+                w = m.group(1)
+                if w not in names:
+                    names.append(w)
+                ops[w, n] = int(m.group(2)) / max(int(m.group(3)), 1)
+                continue
+            m = re.match(r"scale (\w+) lock (\S+): .*contended (\d+) spins (\d+)",
+                         line)
+            if m and (m.group(1), n) not in locks:
+                locks[m.group(1), n] = "%s %s/%s" % m.group(2, 3, 4)
+
+    print("ops per tick, and speedup over CPUS=%d" % cpus[0])
+    print("%-8s" % "" + "".join("%16s" % ("cpus=%d" % n) for n in cpus))
+    for w in names:
+        base = ops.get((w, cpus[0]), 0)
+        row = "%-8s" % w
+        for n in cpus:
+            v = ops.get((w, n), 0)
+            row += "%16s" % ("%.1f x%.2f" % (v, v / base if base else 0))
+        print(row)
+
+    print()
+    print("lock that spun the most: name contended/spins")
+    print("%-8s" % "" + "".join("%24s" % ("cpus=%d" % n) for n in cpus))
+    for w in names:
+        print("%-8s" % w + "".join("%24s" % locks.get((w, n), "-") for n in cpus))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,292 @@
+// bench: time basic kernel operations.
+//
+//   bench              run them all
+//   bench name...      run only these: null fork exec pipelat
+//                      pipebw files seqio memory
+//
+// Prints a line per benchmark:
+//
+//   name ops bytes/op ns/op cycles/op instret/op
+//
+// with bytes/op 0 for the latency ones. pipelat also prints
+// ctxsw, files prints create and unlink, seqio seqwrite and
+// seqread, and memory sbrk and fault.
+//
+// Cycles and instructions are those the hart counted, for all
+// processes on it, so they only add up when the benchmark
+// stayed on one hart; ns are right regardless.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define PGSIZE 4096
+
+static char *argv0;
+static char buf[PGSIZE];
+
+static uint64 ns0, cy0, in0;
+
+static void
+start(void)
+{
+  ns0 = nanotime();
+  cy0 = rdcycle();
+  in0 = rdinstret();
+}
+
+static uint64 ns, cy, in;
+
+static void
+stop(void)
+{
+  ns = nanotime() - ns0;
+  cy = rdcycle() - cy0;
+  in = rdinstret() - in0;
+}
+
+static void
+report(char *name, int ops, int bytes)
+{
+  printf("%s %d %d %l %l %l\n", name, ops, bytes,
+         ns / ops, cy / ops, in / ops);
+}
+
+static void
+fail(char *what)
+{
+  fprintf(2, "bench: %s failed\n", what);
+  exit(1);
+}
+
+static void
+null(void)
+{
+  enum { N = 10000 };
+
+  start();
+  for(int i = 0; i < N; i++)
+    sysgetpid();
+  stop();
+  report("null", N, 0);
+}
+
+static void
+forkexit(void)
+{
+  enum { N = 100 };
+
+  start();
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0)
+      fail("fork");
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  stop();
+  report("fork", N, 0);
+}
+
+static void
+forkexec(void)
+{
+  enum { N = 50 };
+  char *args[] = { argv0, "-x", 0 };
+
+  start();
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0)
+      fail("fork");
+    if(pid == 0){
+      exec(argv0, args);
+      fail("exec");
+    }
+    wait(0);
+  }
+  stop();
+  report("exec", N, 0);
+}
+
+// a child sends back each byte it is sent. where both processes
+// share a hart, each round trip is two context switches.
+static void
+pipelat(void)
+{
+  enum { N = 1000 };
+  int to[2], from[2], pid;
+  char c = 0;
+
+  if(pipe(to) < 0 || pipe(from) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(to[1]);
+    close(from[0]);
+    while(read(to[0], &c, 1) == 1)
+      write(from[1], &c, 1);
+    exit(0);
+  }
+  close(to[0]);
+  close(from[1]);
+  start();
+  for(int i = 0; i < N; i++){
+    if(write(to[1], &c, 1) != 1 || read(from[0], &c, 1) != 1)
+      fail("pipe round trip");
+  }
+  stop();
+  report("pipelat", N, 0);
+  report("ctxsw", 2 * N, 0);
+  close(to[1]);
+  close(from[0]);
+  wait(0);
+}
+
+static void
+pipebw(void)
+{
+  enum { N = 256 };
+  int fds[2], pid, n, total = 0;
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(fds[0]);
+    for(int i = 0; i < N; i++)
+      if(write(fds[1], buf, PGSIZE) != PGSIZE)
+        fail("pipe write");
+    exit(0);
+  }
+  close(fds[1]);
+  start();
+  while((n = read(fds[0], buf, PGSIZE)) > 0)
+    total += n;
+  stop();
+  report("pipebw", N, PGSIZE);
+  close(fds[0]);
+  wait(0);
+  if(total != N * PGSIZE)
+    fail("pipe read");
+}
+
+static void
+files(void)
+{
+  enum { N = 100 };
+  char name[] = "bench.00";
+  int fd, i;
+
+  start();
+  for(i = 0; i < N; i++){
+    name[6] = '0' + i / 10;
+    name[7] = '0' + i % 10;
+    if((fd = open(name, O_CREATE | O_WRONLY)) < 0)
+      fail("create");
+    close(fd);
+  }
+  stop();
+  report("create", N, 0);
+  start();
+  for(i = 0; i < N; i++){
+    name[6] = '0' + i / 10;
+    name[7] = '0' + i % 10;
+    if(unlink(name) < 0)
+      fail("unlink");
+  }
+  stop();
+  report("unlink", N, 0);
+}
+
+static void
+seqio(void)
+{
+  enum { N = 128 };
+  int fd, i;
+
+  if((fd = open("bench.seq", O_CREATE | O_TRUNC | O_WRONLY)) < 0)
+    fail("create");
+  start();
+  for(i = 0; i < N; i++)
+    if(write(fd, buf, PGSIZE) != PGSIZE)
+      fail("write");
+  fsync(fd);
+  stop();
+  report("seqwrite", N, PGSIZE);
+  close(fd);
+
+  if((fd = open("bench.seq", O_RDONLY)) < 0)
+    fail("open");
+  start();
+  for(i = 0; i < N; i++)
+    if(read(fd, buf, PGSIZE) != PGSIZE)
+      fail("read");
+  stop();
+  report("seqread", N, PGSIZE);
+  close(fd);
+  unlink("bench.seq");
+}
+
+// sbrk only moves the break; pages come on first touch.
+static void
+memory(void)
+{
+  enum { N = 256 };
+  char *a;
+
+  start();
+  for(int i = 0; i < N; i++)
+    if(sbrk(PGSIZE) == (char*)-1)
+      fail("sbrk");
+  stop();
+  report("sbrk", N, 0);
+  a = sbrk(0) - N * PGSIZE;
+  start();
+  for(int i = 0; i < N; i++)
+    a[i * PGSIZE] = 1;
+  stop();
+  report("fault", N, 0);
+  sbrk(-N * PGSIZE);
+}
+
+struct bench {
+  char *name;
+  void (*fn)(void);
+} benches[] = {
+  { "null", null },
+  { "fork", forkexit },
+  { "exec", forkexec },
+  { "pipelat", pipelat },
+  { "pipebw", pipebw },
+  { "files", files },
+  { "seqio", seqio },
+  { "memory", memory },
+  { 0, 0 },
+};
+
+int
+main(int argc, char *argv[])
+{
+  struct bench *b;
+
+  // what the exec benchmark runs.
+  if(argc == 2 && strcmp(argv[1], "-x") == 0)
+    exit(0);
+
+  argv0 = argv[0];
+  printf("# name ops bytes/op ns/op cycles/op instret/op\n");
+  for(b = benches; b->name; b++){
+    int run = argc == 1;
+    for(int i = 1; i < argc; i++)
+      if(strcmp(argv[i], b->name) == 0)
+        run = 1;
+    if(run)
+      b->fn();
+  }
+  exit(0);
+}
@@ -9,6 +9,13 @@ cat(int fd)
 {
   int n;
 
+  // files go to the output in the kernel, without
+  // being copied through buf.
+  while((n = sendfile(1, fd, 64*1024)) > 0)
+    ;
+  if(n == 0)
+    return;
+
   while((n = read(fd, buf, sizeof(buf))) > 0) {
     if (write(1, buf, n) != n) {
       fprintf(2, "cat: write error\n");
@@ -0,0 +1,23 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// print the kernel's recent messages, from the kmsg device.
+
+char buf[512];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n;
+
+  if((fd = open("kmsg", O_RDONLY)) < 0){
+    fprintf(2, "dmesg: cannot open kmsg\n");
+    exit(1);
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    write(1, buf, n);
+  close(fd);
+  exit(0);
+}
@@ -0,0 +1,96 @@
+// Time a stressfs-like workload in each of the directories
+// given, by default / (the virtio disk) and /tmp (the ram disk):
+// NPROC processes each write a file 512 bytes at a time, read
+// it back and remove it, then create and remove small files.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+#define NPROC  4
+#define NWRITE 200   // 512-byte writes per file
+#define NFILE  50    // small files per process
+
+static char data[512];
+
+static void
+work(int i)
+{
+  char path[] = "fsbench0";
+  char small[] = "fsbench0-00";
+  int fd, j;
+
+  path[7] += i;
+  if((fd = open(path, O_CREATE | O_RDWR)) < 0){
+    printf("fsbench: cannot create %s\n", path);
+    exit(1);
+  }
+  for(j = 0; j < NWRITE; j++)
+    if(write(fd, data, sizeof(data)) != sizeof(data)){
+      printf("fsbench: write failed\n");
+      exit(1);
+    }
+  close(fd);
+
+  fd = open(path, O_RDONLY);
+  for(j = 0; j < NWRITE; j++)
+    read(fd, data, sizeof(data));
+  close(fd);
+  unlink(path);
+
+  small[7] += i;
+  for(j = 0; j < NFILE; j++){
+    small[9] = '0' + j / 10;
+    small[10] = '0' + j % 10;
+    if((fd = open(small, O_CREATE | O_RDWR)) >= 0){
+      write(fd, data, 16);
+      close(fd);
+    }
+  }
+  for(j = 0; j < NFILE; j++){
+    small[9] = '0' + j / 10;
+    small[10] = '0' + j % 10;
+    unlink(small);
+  }
+}
+
+static int
+bench(char *dir)
+{
+  int i, t0;
+
+  if(chdir(dir) < 0){
+    printf("fsbench: cannot cd %s\n", dir);
+    return -1;
+  }
+  t0 = uptime();
+  for(i = 0; i < NPROC; i++){
+    if(fork() == 0){
+      work(i);
+      exit(0);
+    }
+  }
+  for(i = 0; i < NPROC; i++)
+    wait(0);
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static char *dflt[] = { "fsbench", "/", "/tmp" };
+  int i, n;
+
+  memset(data, 'a', sizeof(data));
+  if(argc < 2){
+    argc = 3;
+    argv = dflt;
+  }
+  for(i = 1; i < argc; i++){
+    if((n = bench(argv[i])) < 0)
+      exit(1);
+    printf("%s: %d ticks\n", argv[i], n);
+  }
+  exit(0);
+}
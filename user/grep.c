@@ -1,52 +1,204 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+//   grep [-c] pattern [file ...]
+//
+// -c prints how many lines match instead of the lines.
+//
+// Any match must contain the longest run of plain characters in
+// the pattern, so grep looks for that run through the whole
+// buffer with Boyer-Moore-Horspool, and runs the matcher only on
+// lines that have it; a pattern that is all plain characters
+// needs no matcher at all.
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
 
-char buf[1024];
+char buf[16384];
+char out[4096];
+int nout;
 int match(char*, char*);
 
+char lit[128];      // the run of plain characters, if nlit > 0
+int nlit;
+int litonly;        // pattern is just lit
+int skip[256];      // Horspool shifts for lit
+
+// find the longest run of characters the pattern matches only
+// literally, taking its pieces the way matchhere() does.
+void
+compile(char *re)
+{
+  int start = -1, n = 0, i;
+
+  nlit = 0;
+  litonly = 0;
+  i = re[0] == '^' ? 1 : 0;
+  for(; ; i++){
+    int plain = re[i] && re[i+1] != '*' && re[i] != '.' &&
+                !(re[i] == '$' && re[i+1] == '\0');
+    if(plain){
+      if(n++ == 0)
+        start = i;
+      continue;
+    }
+    if(n > nlit && n < sizeof(lit)){
+      nlit = n;
+      memmove(lit, re + start, n);
+    }
+    n = 0;
+    if(re[i] == '\0')
+      break;
+    if(re[i+1] == '*')
+      i++;
+  }
+  litonly = nlit > 0 && nlit == strlen(re);
+
+  for(i = 0; i < 256; i++)
+    skip[i] = nlit;
+  for(i = 0; i < nlit - 1; i++)
+    skip[(uchar)lit[i]] = nlit - 1 - i;
+}
+
+// first occurrence of lit in s[0..n), or 0.
+char*
+search(char *s, int n)
+{
+  char *p = s, *e = s + n - nlit;
+  int i;
+
+  while(p <= e){
+    uchar c = p[nlit-1];
+    if(c == (uchar)lit[nlit-1]){
+      for(i = nlit - 2; i >= 0 && p[i] == lit[i]; i--)
+        ;
+      if(i < 0)
+        return p;
+    }
+    p += skip[c];
+  }
+  return 0;
+}
+
+void
+flush(void)
+{
+  if(nout > 0)
+    write(1, out, nout);
+  nout = 0;
+}
+
 void
-grep(char *pattern, int fd)
+emit(char *p, int n)
 {
-  int n, m;
-  char *p, *q;
+  if(nout + n > sizeof(out))
+    flush();
+  if(n > sizeof(out)){
+    write(1, p, n);
+    return;
+  }
+  memmove(out + nout, p, n);
+  nout += n;
+}
+
+// grep the whole lines in buf[0..m), each ending in '\n' but
+// perhaps the last. a line may hold a '\0', so its end is
+// looked for within buf[0..m), not with strchr().
+// returns how many match, writing them out unless count.
+int
+lines(char *pattern, int m, int count)
+{
+  char *p = buf, *end = buf + m, *q, c;
+  int nmatch = 0;
+
+  while(p < end){
+    if(nlit > 0){
+      if((q = search(p, end - p)) == 0)
+        break;
+      while(q > p && q[-1] != '\n')
+        q--;
+      p = q;
+    }
+    for(q = p; q < end && *q != '\n'; q++)
+      ;
+    // buf[m] may be the start of the next, partial line.
+    c = *q;
+    *q = 0;
+    if(litonly || match(pattern, p)){
+      nmatch++;
+      *q = c;
+      if(!count && q < end)
+        emit(p, q+1 - p);
+      else if(!count){
+        emit(p, q - p);
+        emit("\n", 1);
+      }
+    }
+    *q = c;
+    p = q+1;
+  }
+  return nmatch;
+}
 
+int
+grep(char *pattern, int fd, int count)
+{
+  int n, m, k, nmatch;
+  char *q;
+
+  nmatch = 0;
   m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
+  // two bytes spare, for a '\n' and a '\0' after a line.
+  while((n = read(fd, buf+m, sizeof(buf)-m-2)) > 0){
     m += n;
     buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
-      }
-      p = q+1;
-    }
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+    // up to the last newline, or all of a full buffer
+    // holding part of one long line.
+    for(q = buf + m; q > buf && q[-1] != '\n'; q--)
+      ;
+    if(q == buf && m == sizeof(buf)-2){
+      buf[m++] = '\n';
+      buf[m] = '\0';
+      q = buf + m;
     }
+    k = q - buf;
+    nmatch += lines(pattern, k, count);
+    m -= k;
+    memmove(buf, q, m);
+    buf[m] = '\0';
+  }
+  // a last line without a newline.
+  if(m > 0){
+    buf[m++] = '\n';
+    buf[m] = '\0';
+    nmatch += lines(pattern, m, count);
   }
+  flush();
+  return nmatch;
 }
 
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
+  int fd, i, count = 0, n;
   char *pattern;
 
+  if(argc > 1 && strcmp(argv[1], "-c") == 0){
+    count = 1;
+    argc--;
+    argv++;
+  }
   if(argc <= 1){
-    fprintf(2, "usage: grep pattern [file ...]\n");
+    fprintf(2, "usage: grep [-c] pattern [file ...]\n");
     exit(1);
   }
   pattern = argv[1];
+  compile(pattern);
 
   if(argc <= 2){
-    grep(pattern, 0);
+    n = grep(pattern, 0, count);
+    if(count)
+      printf("%d\n", n);
     exit(0);
   }
 
@@ -55,7 +207,11 @@ main(int argc, char *argv[])
       printf("grep: cannot open %s\n", argv[i]);
       exit(1);
     }
-    grep(pattern, fd);
+    n = grep(pattern, fd, count);
+    if(count && argc > 3)
+      printf("%s:%d\n", argv[i], n);
+    else if(count)
+      printf("%d\n", n);
     close(fd);
   }
   exit(0);
@@ -102,4 +258,3 @@ int matchstar(int c, char *re, char *text)
   }while(*text!='\0' && (*text++==c || c=='.'));
   return 0;
 }
-
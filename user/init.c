@@ -19,6 +19,9 @@ main(void)
   if(open("console", O_RDWR) < 0){
     mknod("console", CONSOLE, 0);
     mknod("statistics", STATS, 0);
+    mknod("kmsg", KMSG, 0);
+    mknod("profile", PROF, 0);
+    mknod("counters", COUNTERS, 0);
     open("console", O_RDWR);
   }
   dup(0);  // stdout
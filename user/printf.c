@@ -1,15 +1,94 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 #include <stdarg.h>
 
 static char digits[] = "0123456789ABCDEF";
 
+// Output is buffered per fd. A fully buffered fd is written out
+// when its buffer fills, on fflush(), and before exit, fork and
+// exec, which would lose or copy what it holds, and close, after
+// which the fd may be something else; a line-buffered one at each
+// newline too, and an unbuffered one at the end of each printf.
+// An fd's mode is picked at its first printf: the console is
+// line-buffered, except fd 2, which is not buffered, and files
+// and pipes are fully buffered.
+#define OUTSZ 512
+
+static struct {
+  int mode;                     // 0 until picked
+  int n;
+  char buf[OUTSZ];
+} out[NOFILE];
+
+extern void (*iosync)(int);
+
+void
+fflush(int fd)
+{
+  if(fd < 0){
+    for(fd = 0; fd < NOFILE; fd++)
+      fflush(fd);
+    return;
+  }
+  if(fd < NOFILE && out[fd].n > 0){
+    write(fd, out[fd].buf, out[fd].n);
+    out[fd].n = 0;
+  }
+}
+
+// flush fd, or all fds if it is -1, and pick its mode afresh.
+static void
+sync(int fd)
+{
+  fflush(fd);
+  if(fd >= 0 && fd < NOFILE)
+    out[fd].mode = 0;
+}
+
+void
+setvbuf(int fd, int mode)
+{
+  if(fd < 0 || fd >= NOFILE)
+    return;
+  fflush(fd);
+  out[fd].mode = mode;
+  iosync = sync;
+}
+
+static int
+outmode(int fd)
+{
+  struct stat st;
+
+  if(fd < 0 || fd >= NOFILE)
+    return _IONBF;
+  if(out[fd].mode == 0){
+    if(fd == 2)
+      out[fd].mode = _IONBF;
+    else if(fstat(fd, &st) == 0 && st.type == T_DEVICE)
+      out[fd].mode = _IOLBF;
+    else
+      out[fd].mode = _IOFBF;
+    iosync = sync;
+  }
+  return out[fd].mode;
+}
+
 static void
 putc(int fd, char c)
 {
-  write(fd, &c, 1);
+  if(fd < 0 || fd >= NOFILE){
+    write(fd, &c, 1);
+    return;
+  }
+  if(out[fd].n == OUTSZ)
+    fflush(fd);
+  out[fd].buf[out[fd].n++] = c;
+  if(c == '\n' && out[fd].mode == _IOLBF)
+    fflush(fd);
 }
 
 static void
@@ -52,8 +131,9 @@ void
 vprintf(int fd, const char *fmt, va_list ap)
 {
   char *s;
-  int c, i, state;
+  int c, i, state, mode;
 
+  mode = outmode(fd);
   state = 0;
   for(i = 0; fmt[i]; i++){
     c = fmt[i] & 0xff;
@@ -92,6 +172,8 @@ vprintf(int fd, const char *fmt, va_list ap)
       state = 0;
     }
   }
+  if(mode == _IONBF)
+    fflush(fd);
 }
 
 void
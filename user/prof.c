@@ -0,0 +1,212 @@
+// prof: sampling profiler.
+//
+//   prof on      start taking samples, dropping old ones
+//   prof off     stop
+//   prof         print how many samples fell in each function
+//
+// Kernel pcs are looked up in kernel.sym, and a process's in
+// <its name>.sym, if they are in the file system; see PROFSYMS
+// in the Makefile. Others are printed as is.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/prof.h"
+#include "user/user.h"
+
+#define NTABLE  16      // symbol tables loaded at most
+#define NHIST   512     // functions counted at most
+
+struct sym {
+  uint64 addr;
+  char *name;
+};
+
+struct table {
+  char name[16];        // "kernel", or a process's name
+  struct sym *sym;      // 0 if there is no .sym file
+  int nsym;
+} tables[NTABLE];
+int ntable;
+
+struct hist {
+  struct table *t;
+  char *fn;             // function, or 0 if unknown
+  uint64 pc;            // and the pc, if so
+  int n;
+} hist[NHIST];
+int nhist;
+
+struct profsample samples[64];
+
+static int
+hexval(char c)
+{
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// read file into memory, with each line's "address name"
+// made a struct sym.
+static void
+loadsyms(struct table *t, char *file)
+{
+  struct stat st;
+  char *buf, *p, *end;
+  int fd, n;
+
+  if((fd = open(file, O_RDONLY)) < 0)
+    return;
+  if(fstat(fd, &st) < 0 || (buf = malloc(st.size + 1)) == 0){
+    close(fd);
+    return;
+  }
+  n = read(fd, buf, st.size);
+  close(fd);
+  if(n < 0)
+    n = 0;
+  buf[n] = 0;
+
+  t->nsym = 0;
+  for(p = buf; *p; p++)
+    if(*p == '\n')
+      t->nsym++;
+  if((t->sym = malloc((t->nsym + 1) * sizeof(struct sym))) == 0)
+    return;
+  t->nsym = 0;
+  for(p = buf; *p; p = end){
+    struct sym *s = &t->sym[t->nsym];
+    for(end = p; *end && *end != '\n'; end++)
+      ;
+    if(*end)
+      *end++ = 0;
+    s->addr = 0;
+    for(; hexval(*p) >= 0; p++)
+      s->addr = s->addr * 16 + hexval(*p);
+    if(*p != ' ' || p[1] == 0 || p[1] == '.' || p[1] == '$')
+      continue;     // sections and local labels
+    s->name = p + 1;
+    t->nsym++;
+  }
+}
+
+static struct table*
+table(char *name)
+{
+  char file[32];
+  struct table *t;
+
+  for(t = tables; t < &tables[ntable]; t++)
+    if(strcmp(t->name, name) == 0)
+      return t;
+  if(ntable == NTABLE)
+    return 0;
+  t = &tables[ntable++];
+  strcpy(t->name, name);
+  strcpy(file, name);
+  strcpy(file + strlen(file), ".sym");
+  loadsyms(t, file);
+  return t;
+}
+
+// the function of t that holds pc: the one with the highest
+// address at or below it.
+static char*
+lookup(struct table *t, uint64 pc)
+{
+  struct sym *best = 0;
+
+  for(int i = 0; i < t->nsym; i++)
+    if(t->sym[i].addr <= pc && (best == 0 || t->sym[i].addr > best->addr))
+      best = &t->sym[i];
+  return best ? best->name : 0;
+}
+
+static void
+count(struct profsample *s)
+{
+  struct table *t;
+  struct hist *h;
+  char *fn;
+
+  s->name[sizeof(s->name) - 1] = 0;
+  if((t = table(s->user ? s->name : "kernel")) == 0)
+    return;
+  fn = lookup(t, s->pc);
+  for(h = hist; h < &hist[nhist]; h++)
+    if(h->t == t && h->fn == fn && (fn || h->pc == s->pc))
+      break;
+  if(h == &hist[nhist]){
+    if(nhist == NHIST)
+      return;
+    nhist++;
+    h->t = t;
+    h->fn = fn;
+    h->pc = s->pc;
+    h->n = 0;
+  }
+  h->n++;
+}
+
+static void
+ctl(char *c)
+{
+  int fd;
+
+  if((fd = open("profile", O_WRONLY)) < 0 || write(fd, c, 1) != 1){
+    fprintf(2, "prof: can't write profile\n");
+    exit(1);
+  }
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, total = 0;
+
+  if(argc == 2 && strcmp(argv[1], "on") == 0){
+    ctl("1");
+    exit(0);
+  }
+  if(argc == 2 && strcmp(argv[1], "off") == 0){
+    ctl("0");
+    exit(0);
+  }
+  if(argc != 1){
+    fprintf(2, "usage: prof [on|off]\n");
+    exit(1);
+  }
+
+  if((fd = open("profile", O_RDONLY)) < 0){
+    fprintf(2, "prof: can't open profile\n");
+    exit(1);
+  }
+  while((n = read(fd, samples, sizeof(samples))) > 0){
+    for(int i = 0; i < n / sizeof(samples[0]); i++)
+      count(&samples[i]);
+    total += n / sizeof(samples[0]);
+  }
+  close(fd);
+
+  // most samples first.
+  for(int i = 0; i < nhist; i++){
+    struct hist *h = &hist[i];
+    for(int j = i + 1; j < nhist; j++){
+      if(hist[j].n > h->n){
+        struct hist x = *h;
+        *h = hist[j];
+        hist[j] = x;
+      }
+    }
+    if(h->fn)
+      printf("%d\t%s\t%s\n", h->n, h->t->name, h->fn);
+    else
+      printf("%d\t%s\t%p\n", h->n, h->t->name, h->pc);
+  }
+  printf("%d samples\n", total);
+  exit(0);
+}
@@ -0,0 +1,90 @@
+#include "kernel/types.h"
+#include "kernel/ring.h"
+#include "user/user.h"
+
+// Queue operations on a ring (see kernel/ring.h), perform
+// them all with one ringenter(), and take their results.
+// The ring must start out zeroed, as ring_init() leaves it.
+
+void
+ring_init(struct ring *r)
+{
+  memset(r, 0, sizeof(*r));
+}
+
+// Queue an operation. Returns 0, or -1 if the queue is full.
+static int
+ring_queue(struct ring *r, int op, int fd, uint64 addr, int n, uint off, uint64 data)
+{
+  struct sqe *e;
+
+  if(r->sqtail - r->sqhead == RINGSIZE)
+    return -1;
+  e = &r->sq[r->sqtail % RINGSIZE];
+  e->op = op;
+  e->fd = fd;
+  e->addr = addr;
+  e->n = n;
+  e->off = off;
+  e->data = data;
+  // the entry before the index that shows it.
+  __sync_synchronize();
+  r->sqtail++;
+  return 0;
+}
+
+int
+ring_read(struct ring *r, int fd, void *buf, int n, uint64 data)
+{
+  return ring_queue(r, RING_READ, fd, (uint64)buf, n, 0, data);
+}
+
+int
+ring_write(struct ring *r, int fd, const void *buf, int n, uint64 data)
+{
+  return ring_queue(r, RING_WRITE, fd, (uint64)buf, n, 0, data);
+}
+
+int
+ring_pread(struct ring *r, int fd, void *buf, int n, uint off, uint64 data)
+{
+  return ring_queue(r, RING_PREAD, fd, (uint64)buf, n, off, data);
+}
+
+int
+ring_pwrite(struct ring *r, int fd, const void *buf, int n, uint off, uint64 data)
+{
+  return ring_queue(r, RING_PWRITE, fd, (uint64)buf, n, off, data);
+}
+
+int
+ring_open(struct ring *r, const char *path, int omode, uint64 data)
+{
+  return ring_queue(r, RING_OPEN, -1, (uint64)path, omode, 0, data);
+}
+
+int
+ring_close(struct ring *r, int fd, uint64 data)
+{
+  return ring_queue(r, RING_CLOSE, fd, 0, 0, 0, data);
+}
+
+// Perform the queued operations, as many as there is room
+// for the results of. Returns how many, or -1.
+int
+ring_submit(struct ring *r)
+{
+  return ringenter(r, r->sqtail - r->sqhead);
+}
+
+// Take the next result into *c. Returns 1, or 0 if there is none.
+int
+ring_reap(struct ring *r, struct cqe *c)
+{
+  if(r->cqhead == r->cqtail)
+    return 0;
+  __sync_synchronize();
+  *c = r->cq[r->cqhead % RINGSIZE];
+  r->cqhead++;
+  return 1;
+}
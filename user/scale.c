@@ -0,0 +1,220 @@
+//
+// scale: run workers in parallel against loops that lean on one
+// subsystem each, and report how much they got done and which
+// locks they fought over.
+//
+//   scale [workers [workload...]]
+//
+// workers defaults to 1; workloads are kalloc, bcache, fork and
+// namei, by default all of them. For each, after resetting the
+// statistics device's counters, the workers loop for RUNTICKS
+// ticks and it prints
+//
+//   scale <workload> workers <n> ops <ops> ticks <ticks>
+//   scale <workload> lock <a "lock" line of the statistics device>
+//
+// the latter for the NLOCK locks that spun the most, and finally
+// "scale done". scale.py runs it under each CPU count and
+// tabulates the results; see "make scale".
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define RUNTICKS 20
+#define NLOCK    3
+#define NPAGE    32     // pages kalloc touches per round
+#define FILESZ   (32*1024)
+
+static char buf[16384];
+
+// kalloc: grow, touch and give back memory.
+static int
+kallocloop(int i)
+{
+  char *a = sbrk(NPAGE * 4096);
+
+  if(a == (char*)-1)
+    return 0;
+  for(int j = 0; j < NPAGE; j++)
+    a[j * 4096] = j;
+  sbrk(-NPAGE * 4096);
+  return NPAGE;
+}
+
+// bcache: small reads spread over a file every worker reads,
+// all hits once it is cached.
+static int
+bcacheloop(int i)
+{
+  static int fd = -1;
+  static uint off;
+  char b[64];
+
+  if(fd < 0 && (fd = open("scale.bc", O_RDONLY)) < 0)
+    return 0;
+  off = (off + 1024 + i * 64) % FILESZ;
+  return pread(fd, b, sizeof(b), off) == sizeof(b);
+}
+
+static int
+forkloop(int i)
+{
+  int pid = fork();
+
+  if(pid < 0)
+    return 0;
+  if(pid == 0)
+    exit(0);
+  wait(0);
+  return 1;
+}
+
+// namei: look up a deep path, each worker its own.
+static int
+nameiloop(int i)
+{
+  char path[] = "scale.d/a/b/c/f0";
+  struct stat st;
+
+  path[15] += i % 10;
+  return stat(path, &st) == 0;
+}
+
+static void
+setup(void)
+{
+  char path[] = "scale.d/a/b/c/f0";
+  int fd;
+
+  memset(buf, 'x', sizeof(buf));
+  if((fd = open("scale.bc", O_CREATE | O_TRUNC | O_WRONLY)) >= 0){
+    for(int n = 0; n < FILESZ; n += sizeof(buf))
+      write(fd, buf, sizeof(buf));
+    close(fd);
+  }
+  mkdir("scale.d");
+  mkdir("scale.d/a");
+  mkdir("scale.d/a/b");
+  mkdir("scale.d/a/b/c");
+  for(int i = 0; i < 10; i++){
+    path[15] = '0' + i;
+    if((fd = open(path, O_CREATE | O_WRONLY)) >= 0)
+      close(fd);
+  }
+}
+
+static void
+cleanup(void)
+{
+  char path[] = "scale.d/a/b/c/f0";
+
+  for(int i = 0; i < 10; i++){
+    path[15] = '0' + i;
+    unlink(path);
+  }
+  unlink("scale.d/a/b/c");
+  unlink("scale.d/a/b");
+  unlink("scale.d/a");
+  unlink("scale.d");
+  unlink("scale.bc");
+}
+
+// print the first NLOCK "lock" lines of the statistics device.
+static void
+locks(char *name)
+{
+  int n, nlock = 0;
+  char *p, *e;
+
+  n = statistics(buf, sizeof(buf) - 1);
+  buf[n] = 0;
+  for(p = buf; *p && nlock < NLOCK; p = e){
+    for(e = p; *e && *e != '\n'; e++)
+      ;
+    if(*e)
+      *e++ = 0;
+    if(memcmp(p, "lock ", 5) == 0){
+      printf("scale %s %s\n", name, p);
+      nlock++;
+    }
+  }
+}
+
+static void
+run(char *name, int (*loop)(int), int workers)
+{
+  int fds[2], fd, t0, t1, i, done, ops = 0;
+
+  if((fd = open("statistics", O_WRONLY)) >= 0){
+    write(fd, "r", 1);
+    close(fd);
+  }
+  if(pipe(fds) < 0){
+    printf("scale: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  for(i = 0; i < workers; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("scale: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      done = 0;
+      while(uptime() - t0 < RUNTICKS)
+        done += loop(i);
+      write(fds[1], &done, sizeof(done));
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  while(read(fds[0], &done, sizeof(done)) == sizeof(done))
+    ops += done;
+  close(fds[0]);
+  for(i = 0; i < workers; i++)
+    wait(0);
+  t1 = uptime();
+
+  printf("scale %s workers %d ops %d ticks %d\n", name, workers, ops, t1 - t0);
+  locks(name);
+}
+
+struct workload {
+  char *name;
+  int (*loop)(int);
+} workloads[] = {
+  { "kalloc", kallocloop },
+  { "bcache", bcacheloop },
+  { "fork", forkloop },
+  { "namei", nameiloop },
+  { 0, 0 },
+};
+
+int
+main(int argc, char *argv[])
+{
+  struct workload *w;
+  int workers = 1;
+
+  if(argc > 1 && (workers = atoi(argv[1])) < 1){
+    fprintf(2, "usage: scale [workers [workload...]]\n");
+    exit(1);
+  }
+  setup();
+  for(w = workloads; w->name; w++){
+    int want = argc <= 2;
+    for(int i = 2; i < argc; i++)
+      if(strcmp(argv[i], w->name) == 0)
+        want = 1;
+    if(want)
+      run(w->name, w->loop, workers);
+  }
+  cleanup();
+  printf("scale done\n");
+  exit(0);
+}
@@ -1,6 +1,7 @@
 // Shell.
 
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
 
@@ -52,12 +53,20 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 
-// Execute cmd.  Never returns.
-void
-runcmd(struct cmd *cmd)
+int stdfd[3] = { 0, 1, 2 };
+int parseerr;     // set by syntax()
+
+// Start cmd with its standard input, output and error taken
+// from fd[0], fd[1] and fd[2]. Simple commands and pipelines
+// are spawn()ed, without a copy of the shell; background
+// commands run in a forked shell. Returns the number of
+// children to wait for.
+int
+startcmd(struct cmd *cmd, int *fd)
 {
-  int p[2];
+  int p[2], f[3], n;
   struct backcmd *bcmd;
   struct execcmd *ecmd;
   struct listcmd *lcmd;
@@ -65,69 +74,73 @@ runcmd(struct cmd *cmd)
   struct redircmd *rcmd;
 
   if(cmd == 0)
-    exit(1);
+    return 0;
 
   switch(cmd->type){
   default:
-    panic("runcmd");
+    panic("startcmd");
 
   case EXEC:
     ecmd = (struct execcmd*)cmd;
     if(ecmd->argv[0] == 0)
-      exit(1);
-    exec(ecmd->argv[0], ecmd->argv);
-    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
-    break;
+      return 0;
+    if(spawn(ecmd->argv[0], ecmd->argv, fd, 3) < 0){
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
 
   case REDIR:
     rcmd = (struct redircmd*)cmd;
-    close(rcmd->fd);
-    if(open(rcmd->file, rcmd->mode) < 0){
+    memmove(f, fd, sizeof(f));
+    if((f[rcmd->fd] = open(rcmd->file, rcmd->mode)) < 0){
       fprintf(2, "open %s failed\n", rcmd->file);
-      exit(1);
+      return 0;
     }
-    runcmd(rcmd->cmd);
-    break;
+    n = startcmd(rcmd->cmd, f);
+    close(f[rcmd->fd]);
+    return n;
 
   case LIST:
     lcmd = (struct listcmd*)cmd;
-    if(fork1() == 0)
-      runcmd(lcmd->left);
-    wait(0);
-    runcmd(lcmd->right);
-    break;
+    for(n = startcmd(lcmd->left, fd); n > 0; n--)
+      wait(0);
+    return startcmd(lcmd->right, fd);
 
   case PIPE:
     pcmd = (struct pipecmd*)cmd;
-    if(pipe(p) < 0)
-      panic("pipe");
-    if(fork1() == 0){
-      close(1);
-      dup(p[1]);
-      close(p[0]);
-      close(p[1]);
-      runcmd(pcmd->left);
-    }
-    if(fork1() == 0){
-      close(0);
-      dup(p[0]);
-      close(p[0]);
-      close(p[1]);
-      runcmd(pcmd->right);
+    if(pipe(p) < 0){
+      fprintf(2, "pipe failed\n");
+      return 0;
     }
+    memmove(f, fd, sizeof(f));
+    f[1] = p[1];
+    n = startcmd(pcmd->left, f);
+    memmove(f, fd, sizeof(f));
+    f[0] = p[0];
+    n += startcmd(pcmd->right, f);
     close(p[0]);
     close(p[1]);
-    wait(0);
-    wait(0);
-    break;
+    return n;
 
   case BACK:
     bcmd = (struct backcmd*)cmd;
-    if(fork1() == 0)
-      runcmd(bcmd->cmd);
-    break;
+    if(fork1() == 0){
+      // our children go to init when we exit.
+      for(int i = 0; i < 3; i++){
+        if(fd[i] != i){
+          close(i);
+          dup(fd[i]);
+        }
+      }
+      for(int i = 3; i < NOFILE; i++)
+        close(i);
+      startcmd(bcmd->cmd, stdfd);
+      exit(0);
+    }
+    return 1;
   }
-  exit(0);
+  return 0;
 }
 
 int
@@ -145,6 +158,7 @@ int
 main(void)
 {
   static char buf[100];
+  struct cmd *cmd;
   int fd;
 
   // Ensure that three file descriptors are open.
@@ -164,9 +178,10 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    cmd = parsecmd(buf);
+    for(int n = startcmd(cmd, stdfd); n > 0; n--)
+      wait(0);
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -324,18 +339,34 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// Report a syntax error. The shell parses commands itself
+// rather than in a child, so it carries on parsing, and
+// parsecmd() throws the result away.
+void
+syntax(char *msg)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", msg);
+  parseerr = 1;
+}
+
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -379,8 +410,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -405,8 +438,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -431,13 +466,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
+    if(argc >= MAXARGS){
+      syntax("too many args");
+      break;
+    }
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -491,3 +530,40 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -1,24 +1,133 @@
+// stats: print the statistics device.
+//
+//   stats [subsystem...]     the text of these subsystems, or all
+//   stats -a                 the text of all subsystems
+//   stats -c [subsystem...]  the counters, from the counters device
+//   stats -r                 reset the counters
+//
+// In the pgtbl lab, plain stats prints just the copyin lines, as
+// it always has, since grade-lab-pgtbl counts the copyins between
+// two runs of it. A single subsystem's text has no "== name" line.
+
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/stats.h"
 #include "user/user.h"
 
 #define SZ 4096
 char buf[SZ];
+char line[512];
+
+int nwant;
+char **want;
+char *copyin[] = { "copyin" };
 
+// is subsystem name one of those asked for?
 int
-main(void)
+wanted(char *name)
+{
+  if(nwant == 0)
+    return 1;
+  for(int i = 0; i < nwant; i++)
+    if(strcmp(want[i], name) == 0)
+      return 1;
+  return 0;
+}
+
+// print the lines of the subsystems wanted; each one's text
+// starts with a "== name" line, left out if just one is wanted.
+void
+text(void)
 {
-  int i, n;
-  
-  while (1) {
-    n = statistics(buf, SZ);
-    for (i = 0; i < n; i++) {
-      write(1, buf+i, 1);
+  int fd, n, len = 0, show = 1, hdr;
+
+  if((fd = open("statistics", O_RDONLY)) < 0){
+    fprintf(2, "stats: open failed\n");
+    exit(1);
+  }
+  while((n = read(fd, buf, SZ)) > 0){
+    for(int i = 0; i < n; i++){
+      line[len++] = buf[i];
+      if(buf[i] != '\n' && len < sizeof(line) - 1)
+        continue;
+      line[len] = 0;
+      hdr = memcmp(line, "== ", 3) == 0;
+      if(hdr){
+        char *e = strchr(line, '\n');
+        if(e)
+          *e = 0;
+        show = wanted(line + 3);
+        if(e)
+          *e = '\n';
+      }
+      if(show && !(hdr && nwant == 1))
+        write(1, line, len);
+      len = 0;
     }
-    if (n != SZ)
-      break;
   }
+  close(fd);
+}
+
+void
+counters(void)
+{
+  static struct counterrec r[16];
+  int fd, n;
+  uint64 t;
 
+  if((fd = open("counters", O_RDONLY)) < 0){
+    fprintf(2, "stats: open counters failed\n");
+    exit(1);
+  }
+  while((n = read(fd, r, sizeof(r))) > 0){
+    for(int i = 0; i < n / sizeof(r[0]); i++){
+      if(!wanted(r[i].sys))
+        continue;
+      t = 0;
+      for(int j = 0; j < r[i].ncpu; j++)
+        t += r[i].n[j];
+      printf("%s %s: %l", r[i].sys, r[i].name, t);
+      if(r[i].ncpu > 1)
+        for(int j = 0; j < r[i].ncpu; j++)
+          printf(" %l", r[i].n[j]);
+      printf("\n");
+    }
+  }
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd;
+
+  if(argc > 1 && strcmp(argv[1], "-r") == 0){
+    if((fd = open("statistics", O_WRONLY)) < 0 || write(fd, "r", 1) != 1){
+      fprintf(2, "stats: reset failed\n");
+      exit(1);
+    }
+    close(fd);
+    exit(0);
+  }
+
+  if(argc > 1 && strcmp(argv[1], "-c") == 0){
+    nwant = argc - 2;
+    want = argv + 2;
+    counters();
+  } else if(argc > 1 && strcmp(argv[1], "-a") == 0){
+    text();
+  } else {
+    nwant = argc - 1;
+    want = argv + 1;
+#ifdef LAB_PGTBL
+    if(nwant == 0){
+      nwant = 1;
+      want = copyin;
+    }
+#endif
+    text();
+  }
   exit(0);
 }
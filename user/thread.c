@@ -0,0 +1,106 @@
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Threads, on clone() and join(), and mutexes, on futex().
+//
+// thread_start() gives each thread a stack of STACKSIZE bytes
+// from malloc(), with the function to run and its argument at
+// the top, and thread_join() frees it.
+
+#define STACKSIZE (4*4096)
+#define NSTACK    16
+
+struct tstart {
+  void (*fn)(void*);
+  void *arg;
+};
+
+static struct {
+  struct mutex lock;
+  int tid[NSTACK];
+  char *stack[NSTACK];
+} threads;
+
+static void
+start(void *a)
+{
+  struct tstart *ts = a;
+
+  ts->fn(ts->arg);
+  exit(0);
+}
+
+// Start a thread that runs fn(arg). Returns its thread id,
+// or -1.
+int
+thread_start(void (*fn)(void*), void *arg)
+{
+  struct tstart *ts;
+  char *stack;
+  int i, tid;
+
+  if((stack = malloc(STACKSIZE)) == 0)
+    return -1;
+  ts = (struct tstart*)(stack + STACKSIZE) - 1;
+  ts->fn = fn;
+  ts->arg = arg;
+
+  mutex_lock(&threads.lock);
+  for(i = 0; i < NSTACK && threads.tid[i]; i++)
+    ;
+  // riscv sp must be 16-byte aligned.
+  if(i == NSTACK || (tid = clone(start, ts, (void*)((uint64)ts & ~15))) < 0){
+    mutex_unlock(&threads.lock);
+    free(stack);
+    return -1;
+  }
+  threads.tid[i] = tid;
+  threads.stack[i] = stack;
+  mutex_unlock(&threads.lock);
+  return tid;
+}
+
+// Wait for thread tid to finish. Returns 0, or -1.
+int
+thread_join(int tid)
+{
+  if(join(tid, 0) < 0)
+    return -1;
+  mutex_lock(&threads.lock);
+  for(int i = 0; i < NSTACK; i++){
+    if(threads.tid[i] == tid){
+      free(threads.stack[i]);
+      threads.tid[i] = 0;
+      break;
+    }
+  }
+  mutex_unlock(&threads.lock);
+  return 0;
+}
+
+// A mutex is 0 when free, 1 when held, and 2 when held with
+// threads maybe waiting in futex(), which unlock must wake.
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while(c != 0){
+    futex(&m->state, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    __sync_lock_release(&m->state);
+    futex(&m->state, FUTEX_WAKE, 1);
+  }
+}
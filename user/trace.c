@@ -0,0 +1,24 @@
+// trace: run a command, logging the system calls it and its
+// children make whose numbers' bits are set in mask.
+//
+//   trace 32 grep hello README     log its reads (SYS_read is 5)
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  if(argc < 3 || argv[1][0] < '0' || argv[1][0] > '9'){
+    fprintf(2, "usage: trace mask command [args...]\n");
+    exit(1);
+  }
+  if(trace(atoi(argv[1])) < 0){
+    fprintf(2, "trace: trace failed\n");
+    exit(1);
+  }
+  exec(argv[2], &argv[2]);
+  fprintf(2, "trace: exec %s failed\n", argv[2]);
+  exit(1);
+}
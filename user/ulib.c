@@ -1,8 +1,89 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
 #include "user/user.h"
 
+// set by printf.c once it buffers output, to flush an fd, or
+// all of them if it is -1, before what would lose or copy it.
+void (*iosync)(int);
+
+int
+fork(void)
+{
+  if(iosync)
+    iosync(-1);
+  return sysfork();
+}
+
+int
+exit(int status)
+{
+  if(iosync)
+    iosync(-1);
+  sysexit(status);
+}
+
+int
+exec(char *path, char **argv)
+{
+  if(iosync)
+    iosync(-1);
+  return sysexec(path, argv);
+}
+
+int
+close(int fd)
+{
+  if(iosync)
+    iosync(fd);
+  return sysclose(fd);
+}
+
+// getpid(), uptime() and nanotime() read what the kernel keeps
+// in the USYSCALL page, and the time CSR, rather than make
+// system calls.
+static volatile struct usyscall *usys = (struct usyscall*)USYSCALL;
+
+int
+getpid(void)
+{
+  // a thread's pid is its own, not the process's.
+  if(usys->nthread > 1)
+    return sysgetpid();
+  return usys->pid;
+}
+
+int
+uptime(void)
+{
+  return r_time() / usys->tickcycles;
+}
+
+// nanoseconds since boot.
+uint64
+nanotime(void)
+{
+  uint64 t = r_time(), f = usys->timefreq;
+
+  return t / f * 1000000000 + t % f * 1000000000 / f;
+}
+
+// this hart's cycle and retired instruction counters.
+uint64
+rdcycle(void)
+{
+  return r_cycle();
+}
+
+uint64
+rdinstret(void)
+{
+  return r_instret();
+}
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -32,14 +113,35 @@ strlen(const char *s)
   return n;
 }
 
+// memset() and memmove() go eight 64-bit words at a time
+// once dst is aligned, memmove() only if src is aligned the
+// same way; the ends, and the rest, a byte at a time.
+
+#define WSIZE  8
+#define WMASK  (WSIZE - 1)
+#define LINE   (8 * WSIZE)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  char *d = (char *) dst;
+  uint64 w, *wd;
+
+  for(; n > 0 && ((uint64)d & WMASK); n--)
+    *d++ = c;
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(; n >= LINE; n -= LINE, d += LINE){
+    wd = (uint64*)d;
+    wd[0] = w; wd[1] = w; wd[2] = w; wd[3] = w;
+    wd[4] = w; wd[5] = w; wd[6] = w; wd[7] = w;
   }
+  for(; n >= WSIZE; n -= WSIZE, d += WSIZE)
+    *(uint64*)d = w;
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -95,20 +197,56 @@ atoi(const char *s)
   return n;
 }
 
+// copy a line from s to d, loading it all before
+// storing any, so that it may overlap.
+static inline void
+line(uint64 *d, const uint64 *s)
+{
+  uint64 w0 = s[0], w1 = s[1], w2 = s[2], w3 = s[3];
+  uint64 w4 = s[4], w5 = s[5], w6 = s[6], w7 = s[7];
+
+  d[0] = w0; d[1] = w1; d[2] = w2; d[3] = w3;
+  d[4] = w4; d[5] = w5; d[6] = w6; d[7] = w7;
+}
+
 void*
 memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  int words;
 
   dst = vdst;
   src = vsrc;
+  words = (((uint64)src ^ (uint64)dst) & WMASK) == 0;
   if (src > dst) {
+    if(words){
+      for(; n > 0 && ((uint64)dst & WMASK); n--)
+        *dst++ = *src++;
+      for(; n >= LINE; n -= LINE, src += LINE, dst += LINE)
+        line((uint64*)dst, (const uint64*)src);
+      for(; n >= WSIZE; n -= WSIZE, src += WSIZE, dst += WSIZE)
+        *(uint64*)dst = *(const uint64*)src;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(words){
+      for(; n > 0 && ((uint64)dst & WMASK); n--)
+        *--dst = *--src;
+      for(; n >= LINE; n -= LINE){
+        src -= LINE;
+        dst -= LINE;
+        line((uint64*)dst, (const uint64*)src);
+      }
+      for(; n >= WSIZE; n -= WSIZE){
+        src -= WSIZE;
+        dst -= WSIZE;
+        *(uint64*)dst = *(const uint64*)src;
+      }
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
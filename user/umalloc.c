@@ -3,88 +3,186 @@
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator with segregated size classes.
+//
+// A small request is rounded up to a power-of-two block,
+// header included, of between MINBLOCK and MAXBLOCK bytes.
+// Each size class has its own free list, filled by carving
+// CHUNK bytes from sbrk() into blocks, so that small malloc()
+// and free() are a list push or pop.
+//
+// Bigger requests are rounded up to whole pages and come
+// straight from sbrk(). Freed ones go on an address-ordered
+// list, merged with their neighbours, and are given back to
+// the kernel with a negative sbrk() once they reach the top
+// of the heap, unless the kernel refuses, as it does while the
+// process has threads. A mutex makes it safe for threads.
 
 typedef long Align;
 
 union header {
   struct {
-    union header *ptr;
-    uint size;
+    union header *ptr;  // next free block
+    uint size;          // bytes, header included
+    int class;          // size class, or LARGE
   } s;
-  Align x;
+  Align x[2];
 };
 
 typedef union header Header;
 
-static Header base;
-static Header *freep;
+#define MINSHIFT 5
+#define NCLASS   8
+#define MINBLOCK (1 << MINSHIFT)
+#define MAXBLOCK (MINBLOCK << (NCLASS-1))
+#define CHUNK    (4*4096)
+#define LARGE    (-1)
+#define PAGE     4096
+
+static Header *freelist[NCLASS];
+static Header *large;     // free large blocks, by address
+static struct mutex lock;
+
+static int
+sizeclass(uint n)
+{
+  int c = 0;
+
+  while((MINBLOCK << c) < n)
+    c++;
+  return c;
+}
+
+static int
+morecore(int c)
+{
+  uint bsize = MINBLOCK << c;
+  char *p;
+
+  p = sbrk(CHUNK);
+  if(p == (char*)-1)
+    return -1;
+  for(char *b = p; b + bsize <= p + CHUNK; b += bsize){
+    Header *hp = (Header*)b;
+    hp->s.size = bsize;
+    hp->s.class = c;
+    hp->s.ptr = freelist[c];
+    freelist[c] = hp;
+  }
+  return 0;
+}
+
+// put bp on the large free list, merging it with its
+// neighbours, and give the top of the heap back if it's free.
+static void
+freelarge(Header *bp)
+{
+  Header *p, *prev;
+
+  prev = 0;
+  for(p = large; p && p < bp; p = p->s.ptr)
+    prev = p;
+  bp->s.ptr = p;
+  if(p && (char*)bp + bp->s.size == (char*)p){
+    bp->s.size += p->s.size;
+    bp->s.ptr = p->s.ptr;
+  }
+  if(prev && (char*)prev + prev->s.size == (char*)bp){
+    prev->s.size += bp->s.size;
+    prev->s.ptr = bp->s.ptr;
+  } else if(prev)
+    prev->s.ptr = bp;
+  else
+    large = bp;
+
+  // the last block on the list is the only one that
+  // can be at the top of the heap.
+  prev = 0;
+  for(p = large; p->s.ptr; p = p->s.ptr)
+    prev = p;
+  if((char*)p + p->s.size == sbrk(0) && sbrk(-p->s.size) != (char*)-1){
+    if(prev)
+      prev->s.ptr = 0;
+    else
+      large = 0;
+  }
+}
+
+static void*
+malloclarge(uint nbytes)
+{
+  Header *p, **pp;
+  uint size;
+
+  if(nbytes > 0x7fffffff - PAGE - sizeof(Header))
+    return 0;
+  size = (nbytes + sizeof(Header) + PAGE - 1) & ~(PAGE - 1);
+
+  for(pp = &large; (p = *pp) != 0; pp = &p->s.ptr){
+    if(p->s.size < size)
+      continue;
+    if(p->s.size == size)
+      *pp = p->s.ptr;
+    else {
+      // take the tail, leaving the head on the list.
+      p->s.size -= size;
+      p = (Header*)((char*)p + p->s.size);
+    }
+    p->s.size = size;
+    p->s.class = LARGE;
+    return (void*)(p + 1);
+  }
+
+  p = (Header*)sbrk(size);
+  if(p == (Header*)-1)
+    return 0;
+  p->s.size = size;
+  p->s.class = LARGE;
+  return (void*)(p + 1);
+}
 
 void
 free(void *ap)
 {
-  Header *bp, *p;
+  Header *bp;
 
+  if(ap == 0)
+    return;
   bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  mutex_lock(&lock);
+  if(bp->s.class == LARGE)
+    freelarge(bp);
+  else {
+    bp->s.ptr = freelist[bp->s.class];
+    freelist[bp->s.class] = bp;
+  }
+  mutex_unlock(&lock);
 }
 
-static Header*
-morecore(uint nu)
+static void*
+mallocsmall(uint nbytes)
 {
-  char *p;
-  Header *hp;
+  Header *p;
+  int c;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
+  c = sizeclass(nbytes + sizeof(Header));
+  if(freelist[c] == 0 && morecore(c) < 0)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  p = freelist[c];
+  freelist[c] = p->s.ptr;
+  return (void*)(p + 1);
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  void *p;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
-  }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
-  }
+  mutex_lock(&lock);
+  if(nbytes > MAXBLOCK - sizeof(Header))
+    p = malloclarge(nbytes);
+  else
+    p = mallocsmall(nbytes);
+  mutex_unlock(&lock);
+  return p;
 }
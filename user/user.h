@@ -1,17 +1,26 @@
 struct stat;
 struct rtcdate;
 struct sysinfo;
+struct iovec;
+struct ring;
+struct pollfd;
+struct cqe;
+
+// buffering modes, for setvbuf()
+#define _IOFBF 1    // fully buffered
+#define _IOLBF 2    // line-buffered
+#define _IONBF 3    // unbuffered
 
 // system calls
-int fork(void);
-int exit(int) __attribute__((noreturn));
+int sysfork(void);
+int sysexit(int) __attribute__((noreturn));
 int wait(int*);
 int pipe(int*);
 int write(int, const void*, int);
 int read(int, void*, int);
-int close(int);
+int sysclose(int);
 int kill(int);
-int exec(char*, char**);
+int sysexec(char*, char**);
 int open(const char*, int);
 int mknod(const char*, short, short);
 int unlink(const char*);
@@ -20,10 +29,33 @@ int link(const char*, const char*);
 int mkdir(const char*);
 int chdir(const char*);
 int dup(int);
-int getpid(void);
+int sysgetpid(void);
 char* sbrk(int);
 int sleep(int);
-int uptime(void);
+int sysuptime(void);
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+void *shmat(int, int);
+int shmdt(void*);
+int spawn(char*, char**, int*, int);
+int setpriority(int, int);
+int clone(void(*)(void*), void*, void*);
+int join(int, int*);
+int futex(int*, int, int);
+int fsync(int);
+int sendfile(int, int, int);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int ringenter(struct ring*, int);
+int pipesize(int, int);
+int poll(struct pollfd*, int, int);
+int fcntl(int, int, int);
+uint64 sysnanotime(void);
+int trace(uint64);
+int setaffinity(int, uint64);
+uint64 getaffinity(int);
 #ifdef LAB_NET
 int connect(uint32, uint16, uint16);
 #endif
@@ -36,6 +68,8 @@ char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
+void fflush(int);
+void setvbuf(int, int);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
@@ -45,3 +79,32 @@ int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
 int statistics(void*, int);
+int fork(void);
+int exit(int) __attribute__((noreturn));
+int exec(char*, char**);
+int close(int);
+int getpid(void);
+int uptime(void);
+uint64 nanotime(void);
+uint64 rdcycle(void);
+uint64 rdinstret(void);
+
+// thread.c
+struct mutex {
+  int state;
+};
+int thread_start(void (*)(void*), void*);
+int thread_join(int);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+
+// ring.c
+void ring_init(struct ring*);
+int ring_read(struct ring*, int, void*, int, uint64);
+int ring_write(struct ring*, int, const void*, int, uint64);
+int ring_pread(struct ring*, int, void*, int, uint, uint64);
+int ring_pwrite(struct ring*, int, const void*, int, uint, uint64);
+int ring_open(struct ring*, const char*, int, uint64);
+int ring_close(struct ring*, int, uint64);
+int ring_submit(struct ring*);
+int ring_reap(struct ring*, struct cqe*);
@@ -7,6 +7,10 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/ring.h"
+#include "kernel/poll.h"
+#include "kernel/prof.h"
+#include "kernel/stats.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -523,6 +527,10 @@ writetest(char *s)
   }
 }
 
+// past the singly-indirect blocks, and into the doubly-
+// indirect ones.
+#define BIGBLOCKS (NDIRECT + NINDIRECT + 20)
+
 void
 writebig(char *s)
 {
@@ -534,7 +542,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", i);
@@ -554,7 +562,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGBLOCKS){
         printf("%s: read only %d blocks from big", n);
         exit(1);
       }
@@ -680,1398 +688,3238 @@ exectest(char *s)
 
 }
 
-// simple fork and pipe read/write
-
+// spawn() echo with its output on a pipe: the child must get
+// only the descriptors it was given, so the read sees EOF.
 void
-pipe1(char *s)
+spawntest(char *s)
 {
-  int fds[2], pid, xstatus;
-  int seq, i, n, cc, total;
-  enum { N=5, SZ=1033 };
-  
+  char *echoargv[] = { "echo", "spawned", 0 };
+  int fds[2], cfd[3], pid, xstatus, n, cc;
+  char buf[32];
+
   if(pipe(fds) != 0){
     printf("%s: pipe() failed\n", s);
     exit(1);
   }
-  pid = fork();
-  seq = 0;
-  if(pid == 0){
-    close(fds[0]);
-    for(n = 0; n < N; n++){
-      for(i = 0; i < SZ; i++)
-        buf[i] = seq++;
-      if(write(fds[1], buf, SZ) != SZ){
-        printf("%s: pipe1 oops 1\n", s);
-        exit(1);
-      }
-    }
-    exit(0);
-  } else if(pid > 0){
-    close(fds[1]);
-    total = 0;
-    cc = 1;
-    while((n = read(fds[0], buf, cc)) > 0){
-      for(i = 0; i < n; i++){
-        if((buf[i] & 0xff) != (seq++ & 0xff)){
-          printf("%s: pipe1 oops 2\n", s);
-          return;
-        }
-      }
-      total += n;
-      cc = cc * 2;
-      if(cc > sizeof(buf))
-        cc = sizeof(buf);
-    }
-    if(total != N * SZ){
-      printf("%s: pipe1 oops 3 total %d\n", total);
-      exit(1);
-    }
-    close(fds[0]);
-    wait(&xstatus);
-    exit(xstatus);
-  } else {
-    printf("%s: fork() failed\n", s);
+  cfd[0] = -1;
+  cfd[1] = fds[1];
+  cfd[2] = 2;
+  pid = spawn("echo", echoargv, cfd, 3);
+  if(pid < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  n = 0;
+  while((cc = read(fds[0], buf + n, sizeof(buf) - 1 - n)) > 0)
+    n += cc;
+  close(fds[0]);
+  buf[n] = 0;
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+  if(strcmp(buf, "spawned\n") != 0){
+    printf("%s: wrong output %s\n", s, buf);
+    exit(1);
+  }
+
+  cfd[1] = 1;
+  if(spawn("nonexistent", echoargv, cfd, 3) >= 0){
+    printf("%s: spawn of nonexistent file succeeded\n", s);
+    exit(1);
+  }
+  cfd[1] = 19;
+  if(spawn("echo", echoargv, cfd, 3) >= 0){
+    printf("%s: spawn with a closed descriptor succeeded\n", s);
     exit(1);
   }
 }
 
-// meant to be run w/ at most two CPUs
+// setpriority() takes levels 0..NPRIO-1 of existing processes,
+// and a child computing at the lowest level still finishes.
 void
-preempt(char *s)
+prioritytest(char *s)
 {
-  int pid1, pid2, pid3;
-  int pfds[2];
+  int pid, xstatus;
 
-  pid1 = fork();
-  if(pid1 < 0) {
-    printf("%s: fork failed");
+  if(setpriority(getpid(), -1) == 0 || setpriority(getpid(), NPRIO) == 0 ||
+     setpriority(999999, 0) == 0){
+    printf("%s: bad setpriority succeeded\n", s);
     exit(1);
   }
-  if(pid1 == 0)
-    for(;;)
-      ;
-
-  pid2 = fork();
-  if(pid2 < 0) {
+  pid = fork();
+  if(pid < 0){
     printf("%s: fork failed\n", s);
     exit(1);
   }
-  if(pid2 == 0)
-    for(;;)
+  if(pid == 0){
+    uint64 t0 = uptime();
+    if(setpriority(getpid(), NPRIO-1) != 0)
+      exit(1);
+    while(uptime() < t0 + 3)
       ;
-
-  pipe(pfds);
-  pid3 = fork();
-  if(pid3 < 0) {
-     printf("%s: fork failed\n", s);
-     exit(1);
+    exit(0);
   }
-  if(pid3 == 0){
-    close(pfds[0]);
-    if(write(pfds[1], "x", 1) != 1)
-      printf("%s: preempt write error");
-    close(pfds[1]);
-    for(;;)
-      ;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
   }
-
-  close(pfds[1]);
-  if(read(pfds[0], buf, sizeof(buf)) != 1){
-    printf("%s: preempt read error");
-    return;
+  if(setpriority(getpid(), 0) != 0){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
   }
-  close(pfds[0]);
-  printf("kill... ");
-  kill(pid1);
-  kill(pid2);
-  kill(pid3);
-  printf("wait... ");
-  wait(0);
-  wait(0);
-  wait(0);
 }
 
-// try to find any races between exit and wait
+// more processes at once than the table used to hold,
+// killed by pid.
 void
-exitwait(char *s)
+manyprocs(char *s)
 {
-  int i, pid;
+  enum { N=100 };
+  int fds[2], pids[N], i, xstatus;
+  char c;
 
-  for(i = 0; i < 100; i++){
-    pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed\n", s);
-      exit(1);
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork %d failed\n", s, i);
+      break;
     }
-    if(pid){
-      int xstate;
-      if(wait(&xstate) != pid){
-        printf("%s: wait wrong pid\n", s);
-        exit(1);
-      }
-      if(i != xstate) {
-        printf("%s: wait wrong exit status\n", s);
-        exit(1);
-      }
-    } else {
-      exit(i);
+    if(pids[i] == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  for(int j = 0; j < i; j++)
+    if(kill(pids[j]) != 0){
+      printf("%s: kill %d failed\n", s, pids[j]);
+      exit(1);
     }
+  for(int j = 0; j < i; j++)
+    wait(&xstatus);
+  if(wait(0) != -1){
+    printf("%s: more children than were forked\n", s);
+    exit(1);
+  }
+  if(i < N){
+    printf("%s: forked only %d of %d\n", s, i, N);
+    exit(1);
+  }
+  if(kill(pids[0]) == 0){
+    printf("%s: killed a dead process\n", s);
+    exit(1);
   }
 }
 
-// try to find races in the reparenting
-// code that handles a parent exiting
-// when it still has live children.
+// threads sharing a counter under a mutex, and a process
+// that exits with its threads still running.
+struct mutex tmutex;
+volatile int tcount;
+
 void
-reparent(char *s)
+tcountfn(void *arg)
 {
-  int master_pid = getpid();
-  for(int i = 0; i < 200; i++){
-    int pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed\n", s);
-      exit(1);
-    }
-    if(pid){
-      if(wait(0) != pid){
-        printf("%s: wait wrong pid\n", s);
-        exit(1);
-      }
-    } else {
-      int pid2 = fork();
-      if(pid2 < 0){
-        kill(master_pid);
-        exit(1);
-      }
-      exit(0);
-    }
+  for(int i = 0; i < 1000; i++){
+    mutex_lock(&tmutex);
+    tcount += (uint64)arg;
+    mutex_unlock(&tmutex);
   }
-  exit(0);
 }
 
-// what if two children exit() at the same time?
 void
-twochildren(char *s)
+tspinfn(void *arg)
 {
-  for(int i = 0; i < 1000; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("%s: fork failed\n", s);
+  for(;;)
+    tcount++;
+}
+
+void
+threadtest(char *s)
+{
+  enum { N=4 };
+  int tids[N], pid, xstatus;
+
+  tcount = 0;
+  for(int i = 0; i < N; i++){
+    if((tids[i] = thread_start(tcountfn, (void*)1)) < 0){
+      printf("%s: thread_start failed\n", s);
       exit(1);
     }
-    if(pid1 == 0){
-      exit(0);
-    } else {
-      int pid2 = fork();
-      if(pid2 < 0){
-        printf("%s: fork failed\n", s);
-        exit(1);
-      }
-      if(pid2 == 0){
-        exit(0);
-      } else {
-        wait(0);
-        wait(0);
-      }
+  }
+  if(fork() != -1){
+    printf("%s: fork with threads succeeded\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    if(thread_join(tids[i]) != 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
     }
   }
+  if(tcount != N*1000){
+    printf("%s: count %d, not %d\n", s, tcount, N*1000);
+    exit(1);
+  }
+  if(thread_join(tids[0]) != -1){
+    printf("%s: joined a thread twice\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < N; i++)
+      thread_start(tspinfn, 0);
+    exit(7);
+  }
+  wait(&xstatus);
+  if(xstatus != 7){
+    printf("%s: exit status %d\n", s, xstatus);
+    exit(1);
+  }
 }
 
-// concurrent forks to try to expose locking bugs.
+// fsync() of files written by several processes at once,
+// whose writes are committed together.
 void
-forkfork(char *s)
+fsynctest(char *s)
 {
-  enum { N=2 };
-  
+  enum { N = 4 };
+  char name[] = "fsync0";
+  int fd, xstatus;
+
   for(int i = 0; i < N; i++){
     int pid = fork();
     if(pid < 0){
-      printf("%s: fork failed", s);
+      printf("%s: fork failed\n", s);
       exit(1);
     }
     if(pid == 0){
-      for(int j = 0; j < 200; j++){
-        int pid1 = fork();
-        if(pid1 < 0){
+      name[5] = '0' + i;
+      if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+        printf("%s: create %s failed\n", s, name);
+        exit(1);
+      }
+      for(int j = 0; j < 20; j++){
+        if(write(fd, name, sizeof(name)) != sizeof(name)){
+          printf("%s: write failed\n", s);
           exit(1);
         }
-        if(pid1 == 0){
-          exit(0);
-        }
-        wait(0);
       }
+      if(fsync(fd) != 0){
+        printf("%s: fsync failed\n", s);
+        exit(1);
+      }
+      close(fd);
       exit(0);
     }
   }
-
-  int xstatus;
   for(int i = 0; i < N; i++){
     wait(&xstatus);
-    if(xstatus != 0) {
-      printf("%s: fork in child failed", s);
+    if(xstatus != 0)
       exit(1);
-    }
+  }
+  if(fsync(-1) != -1 || fsync(NOFILE) != -1){
+    printf("%s: fsync of a bad fd succeeded\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    name[5] = '0' + i;
+    unlink(name);
   }
 }
 
+// sendfile() of a file to a pipe, whole pages and a part
+// of one, and to another file.
 void
-forkforkfork(char *s)
+sendfiletest(char *s)
 {
-  unlink("stopforking");
+  enum { N = 2*4096 + 100 };
+  int fd, fd2, fds[2], pid, xstatus, i;
 
-  int pid = fork();
+  for(i = 0; i < N; i++)
+    buf[i] = i % 251;
+  if((fd = open("sf", O_CREATE|O_RDWR)) < 0 || write(fd, buf, N) != N){
+    printf("%s: create sf failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
   if(pid < 0){
-    printf("%s: fork failed", s);
+    printf("%s: fork failed\n", s);
     exit(1);
   }
   if(pid == 0){
-    while(1){
-      int fd = open("stopforking", 0);
-      if(fd >= 0){
-        exit(0);
-      }
-      if(fork() < 0){
-        close(open("stopforking", O_CREATE|O_RDWR));
+    close(fds[1]);
+    memset(buf, 0, N);
+    for(i = 0; i < N; ){
+      int n = read(fds[0], buf + i, N - i);
+      if(n <= 0)
+        break;
+      i += n;
+    }
+    if(i != N || read(fds[0], buf, 1) != 0){
+      printf("%s: read %d bytes from the pipe\n", s, i);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if((uchar)buf[i] != i % 251){
+        printf("%s: wrong byte %d from the pipe\n", s, i);
+        exit(1);
       }
     }
-
     exit(0);
   }
+  close(fds[0]);
+  fd = open("sf", O_RDONLY);
+  if(sendfile(fds[1], fd, 2*N) != N || sendfile(fds[1], fd, N) != 0){
+    printf("%s: sendfile to a pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  close(fd);
 
-  sleep(20); // two seconds
-  close(open("stopforking", O_CREATE|O_RDWR));
-  wait(0);
-  sleep(10); // one second
-}
-
-// regression test. does reparent() violate the parent-then-child
-// locking order when giving away a child to init, so that exit()
-// deadlocks against init's wait()? also used to trigger a "panic:
-// release" due to exit() releasing a different p->parent->lock than
-// it acquired.
-void
-reparent2(char *s)
-{
-  for(int i = 0; i < 800; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("fork failed\n");
+  fd = open("sf", O_RDONLY);
+  if((fd2 = open("sf2", O_CREATE|O_RDWR)) < 0 || sendfile(fd2, fd, N) != N){
+    printf("%s: sendfile to a file failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  close(fd);
+  memset(buf, 0, N);
+  fd2 = open("sf2", O_RDONLY);
+  if(read(fd2, buf, N + 1) != N){
+    printf("%s: sf2 has the wrong size\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if((uchar)buf[i] != i % 251){
+      printf("%s: wrong byte %d in sf2\n", s, i);
       exit(1);
     }
-    if(pid1 == 0){
-      fork();
-      fork();
-      exit(0);
-    }
-    wait(0);
   }
 
-  exit(0);
+  // only files can be sent.
+  if(pipe(fds) != 0 || sendfile(fd2, fds[0], 1) != -1){
+    printf("%s: sendfile from a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(fd2);
+  unlink("sf");
+  unlink("sf2");
 }
 
-// allocate all mem, free it, and allocate again
+// readv()/writev() across several buffers, and pread()/
+// pwrite(), which leave the file offset be.
 void
-mem(char *s)
+rwvtest(char *s)
 {
-  void *m1, *m2;
-  int pid;
+  struct iovec iov[3];
+  char a[5], b[7], c[3];
+  int fd, fds[2];
 
-  if((pid = fork()) == 0){
-    m1 = 0;
-    while((m2 = malloc(10001)) != 0){
-      *(char**)m2 = m1;
-      m1 = m2;
-    }
-    while(m1){
-      m2 = *(char**)m1;
-      free(m1);
-      m1 = m2;
-    }
-    m1 = malloc(1024*20);
-    if(m1 == 0){
-      printf("couldn't allocate mem?!!\n", s);
-      exit(1);
-    }
-    free(m1);
-    exit(0);
-  } else {
-    int xstatus;
-    wait(&xstatus);
-    if(xstatus == -1){
-      // probably page fault, so might be lazy lab,
-      // so OK.
-      exit(0);
-    }
-    exit(xstatus);
+  if((fd = open("rwv", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create rwv failed\n", s);
+    exit(1);
   }
-}
+  iov[0].base = (uint64)"hello";
+  iov[0].len = 5;
+  iov[1].base = (uint64)", ";
+  iov[1].len = 2;
+  iov[2].base = (uint64)"world";
+  iov[2].len = 5;
+  if(writev(fd, iov, 3) != 12){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  // at offset 5, without moving the offset from 12.
+  if(pwrite(fd, ";", 1, 5) != 1 || write(fd, "!", 1) != 1){
+    printf("%s: pwrite failed\n", s);
+    exit(1);
+  }
+  close(fd);
 
-// More file system tests
+  fd = open("rwv", O_RDONLY);
+  iov[0].base = (uint64)a;
+  iov[0].len = sizeof(a);
+  iov[1].base = (uint64)b;
+  iov[1].len = sizeof(b);
+  iov[2].base = (uint64)c;
+  iov[2].len = sizeof(c);
+  if(readv(fd, iov, 3) != 13 || memcmp(a, "hello", 5) != 0 ||
+     memcmp(b, "; worl", 6) != 0 || b[6] != 'd' || c[0] != '!'){
+    printf("%s: readv read the wrong bytes\n", s);
+    exit(1);
+  }
+  if(pread(fd, a, 5, 7) != 5 || memcmp(a, "world", 5) != 0 ||
+     pread(fd, a, 5, 13) != 0 || read(fd, a, 1) != 0){
+    printf("%s: pread failed\n", s);
+    exit(1);
+  }
+  if(readv(fd, iov, IOV_MAX + 1) != -1){
+    printf("%s: readv of too many iovecs succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
 
-// two processes write to the same file descriptor
-// is the offset shared? does inode locking work?
+  if(pipe(fds) != 0 || pread(fds[0], a, 1, 0) != -1 || pwrite(fds[1], a, 1, 0) != -1){
+    printf("%s: pread/pwrite of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("rwv");
+}
+
+// the ram disk mounted on /tmp: a file system of its own,
+// with .. of its root leading back to /.
 void
-sharedfd(char *s)
+tmpfstest(char *s)
 {
-  int fd, pid, i, n, nc, np;
-  enum { N = 1000, SZ=10};
-  char buf[SZ];
+  struct stat root, tmp, st;
+  static char buf[5000];
+  int fd, i;
 
-  unlink("sharedfd");
-  fd = open("sharedfd", O_CREATE|O_RDWR);
-  if(fd < 0){
-    printf("%s: cannot open sharedfd for writing", s);
+  if(stat("/", &root) < 0 || stat("/tmp", &tmp) < 0 || tmp.dev == root.dev){
+    printf("%s: /tmp is not mounted\n", s);
     exit(1);
   }
-  pid = fork();
-  memset(buf, pid==0?'c':'p', sizeof(buf));
-  for(i = 0; i < N; i++){
+  if((fd = open("/tmp/tf", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create /tmp/tf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = i;
+  for(i = 0; i < 4; i++)
     if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
-      printf("%s: write sharedfd failed\n", s);
+      printf("%s: write /tmp/tf failed\n", s);
+      exit(1);
+    }
+  close(fd);
+  fd = open("/tmp/tf", O_RDONLY);
+  for(i = 0; i < 4; i++){
+    memset(buf, 0, sizeof(buf));
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[4999] != (char)4999){
+      printf("%s: read /tmp/tf failed\n", s);
       exit(1);
     }
   }
-  if(pid == 0) {
-    exit(0);
-  } else {
-    int xstatus;
-    wait(&xstatus);
-    if(xstatus != 0)
-      exit(xstatus);
-  }
-  
   close(fd);
-  fd = open("sharedfd", 0);
-  if(fd < 0){
-    printf("%s: cannot open sharedfd for reading\n", s);
+
+  if(link("/tmp/tf", "/tf") == 0){
+    printf("%s: link across devices succeeded\n", s);
     exit(1);
   }
-  nc = np = 0;
-  while((n = read(fd, buf, sizeof(buf))) > 0){
-    for(i = 0; i < sizeof(buf); i++){
-      if(buf[i] == 'c')
-        nc++;
-      if(buf[i] == 'p')
-        np++;
-    }
+  if(unlink("/tmp") == 0){
+    printf("%s: unlink of mount point succeeded\n", s);
+    exit(1);
   }
-  close(fd);
-  unlink("sharedfd");
-  if(nc == N*SZ && np == N*SZ){
-    exit(0);
-  } else {
-    printf("%s: nc/np test fails\n", s);
+  if(mkdir("/tmp/td") != 0 || chdir("/tmp/td") != 0 || chdir("../..") != 0 ||
+     stat(".", &st) < 0 || st.dev != root.dev || st.ino != root.ino){
+    printf("%s: .. out of /tmp went wrong\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp/td") != 0 || unlink("/tmp/tf") != 0){
+    printf("%s: unlink in /tmp failed\n", s);
     exit(1);
   }
 }
 
-// four processes write different files at the same
-// time, to test block allocation.
-void
-fourfiles(char *s)
+// copy the program src to dst, and run it with argument arg,
+// its output going to the file pcout. returns what it wrote.
+static char*
+pcrun(char *s, char *src, char *dst, char *arg)
 {
-  int fd, pid, i, j, n, total, pi;
-  char *names[] = { "f0", "f1", "f2", "f3" };
-  char *fname;
-  enum { N=12, NCHILD=4, SZ=500 };
-  
-  for(pi = 0; pi < NCHILD; pi++){
-    fname = names[pi];
-    unlink(fname);
+  static char buf[512];
+  char *argv[] = { dst, arg, 0 };
+  int fd, fd1, n, xstatus;
 
-    pid = fork();
-    if(pid < 0){
-      printf("fork failed\n", s);
-      exit(1);
-    }
-
-    if(pid == 0){
-      fd = open(fname, O_CREATE | O_RDWR);
-      if(fd < 0){
-        printf("create failed\n", s);
-        exit(1);
-      }
+  if((fd = open(src, O_RDONLY)) < 0 || (fd1 = open(dst, O_CREATE|O_TRUNC|O_WRONLY)) < 0){
+    printf("%s: copy %s failed\n", s, src);
+    exit(1);
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    write(fd1, buf, n);
+  close(fd);
+  close(fd1);
 
-      memset(buf, '0'+pi, SZ);
-      for(i = 0; i < N; i++){
-        if((n = write(fd, buf, SZ)) != SZ){
-          printf("write failed %d\n", n);
-          exit(1);
-        }
-      }
-      exit(0);
-    }
+  if(fork() == 0){
+    close(1);
+    close(2);
+    open("pcout", O_CREATE|O_TRUNC|O_WRONLY);
+    dup(1);
+    exec(dst, argv);
+    exit(1);
   }
+  wait(&xstatus);
+  fd = open("pcout", O_RDONLY);
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[n < 0 ? 0 : n] = '\0';
+  return buf;
+}
 
+// processes running the same program share its pages; a
+// program rewritten in place runs as it now is.
+void
+pcachetest(char *s)
+{
+  char *argv[] = { "pcx", "again", 0 };
   int xstatus;
-  for(pi = 0; pi < NCHILD; pi++){
-    wait(&xstatus);
-    if(xstatus != 0)
-      exit(xstatus);
-  }
 
-  for(i = 0; i < NCHILD; i++){
-    fname = names[i];
-    fd = open(fname, 0);
-    total = 0;
-    while((n = read(fd, buf, sizeof(buf))) > 0){
-      for(j = 0; j < n; j++){
-        if(buf[j] != '0'+i){
-          printf("wrong char\n", s);
-          exit(1);
-        }
-      }
-      total += n;
+  if(strcmp(pcrun(s, "echo", "pcx", "hello"), "hello\n") != 0){
+    printf("%s: copy of echo didn't echo\n", s);
+    exit(1);
+  }
+  // the same, now from the page cache.
+  for(int i = 0; i < 4; i++){
+    if(fork() == 0){
+      close(1);
+      exec("pcx", argv);
+      exit(1);
     }
-    close(fd);
-    if(total != N*SZ){
-      printf("wrong length %d\n", total);
+  }
+  for(int i = 0; i < 4; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: pcx failed\n", s);
       exit(1);
     }
-    unlink(fname);
   }
+  if(strcmp(pcrun(s, "kill", "pcx", 0), "usage: kill pid...\n") != 0){
+    printf("%s: rewritten pcx ran stale pages\n", s);
+    exit(1);
+  }
+  unlink("pcx");
+  unlink("pcout");
 }
 
-// four processes create and delete different files in same directory
+static void
+upidfn(void *arg)
+{
+  *(int*)arg = getpid() == sysgetpid();
+}
+
+// getpid() and uptime(), answered from the USYSCALL page,
+// agree with the system calls, and the page is read-only.
 void
-createdelete(char *s)
+usyscalltest(char *s)
 {
-  enum { N = 20, NCHILD=4 };
-  int pid, i, fd, pi;
-  char name[32];
+  int pid, xstatus, ok = 0, t;
 
-  for(pi = 0; pi < NCHILD; pi++){
-    pid = fork();
-    if(pid < 0){
-      printf("fork failed\n", s);
+  if(getpid() != sysgetpid()){
+    printf("%s: getpid %d, sysgetpid %d\n", s, getpid(), sysgetpid());
+    exit(1);
+  }
+  t = uptime();
+  if(t > sysuptime() || sysuptime() > uptime() || uptime() - t > 2){
+    printf("%s: uptime and sysuptime disagree\n", s);
+    exit(1);
+  }
+  sleep(2);
+  if(uptime() < t + 2){
+    printf("%s: uptime didn't advance\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid == 0){
+    if(getpid() != sysgetpid())
+      exit(1);
+    *(volatile int*)USYSCALL = 0;
+    exit(2);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: child's getpid wrong, or USYSCALL page writable\n", s);
+    exit(1);
+  }
+
+  if(thread_join(thread_start(upidfn, &ok)) < 0 || !ok){
+    printf("%s: thread's getpid wrong\n", s);
+    exit(1);
+  }
+  if(getpid() != sysgetpid()){
+    printf("%s: getpid wrong after thread exit\n", s);
+    exit(1);
+  }
+}
+
+// operations queued on a ring and performed by one ringenter().
+void
+ringtest(char *s)
+{
+  static struct ring r;
+  struct cqe c[8];
+  char buf[10];
+  int fd, n;
+
+  ring_init(&r);
+  ring_open(&r, "ringf", O_CREATE|O_RDWR, 1);
+  if(ring_submit(&r) != 1 || !ring_reap(&r, &c[0]) || c[0].data != 1 || (fd = c[0].res) < 0){
+    printf("%s: ring open failed\n", s);
+    exit(1);
+  }
+
+  ring_write(&r, fd, "abc", 3, 2);
+  ring_write(&r, fd, "def", 3, 3);
+  ring_write(&r, fd, "ghi", 3, 4);
+  ring_pwrite(&r, fd, "X", 1, 0, 5);
+  ring_pread(&r, fd, buf, 9, 0, 6);
+  ring_read(&r, fd, buf, 1, 7);     // at the end
+  ring_close(&r, fd, 8);
+  ring_write(&r, fd, "jkl", 3, 9);  // closed
+  if((n = ring_submit(&r)) != 8){
+    printf("%s: ring_submit did %d\n", s, n);
+    exit(1);
+  }
+  for(int i = 0; i < 8; i++){
+    if(!ring_reap(&r, &c[i]) || c[i].data != i + 2){
+      printf("%s: completion %d missing\n", s, i);
       exit(1);
     }
+  }
+  if(ring_reap(&r, &c[0])){
+    printf("%s: extra completion\n", s);
+    exit(1);
+  }
+  if(c[0].res != 3 || c[1].res != 3 || c[2].res != 3 || c[3].res != 1 ||
+     c[4].res != 9 || c[5].res != 0 || c[6].res != 0 || c[7].res != -1 ||
+     memcmp(buf, "Xbcdefghi", 9) != 0){
+    printf("%s: ring results wrong\n", s);
+    exit(1);
+  }
+  if(ringenter((struct ring*)0xfffffffff0, 1) != -1){
+    printf("%s: ringenter of a bad ring succeeded\n", s);
+    exit(1);
+  }
+  unlink("ringf");
+}
 
-    if(pid == 0){
-      name[0] = 'p' + pi;
-      name[2] = '\0';
-      for(i = 0; i < N; i++){
-        name[1] = '0' + i;
-        fd = open(name, O_CREATE | O_RDWR);
-        if(fd < 0){
-          printf("%s: create failed\n", s);
+// memmove() and memset() at every alignment, overlapping both
+// ways, against a byte at a time; and the kernel's copies, by
+// writing and reading at odd offsets, and opening names at them.
+void
+memtest(char *s)
+{
+  static char a[300], b[300], ref[300];
+  char name[32];
+  int fd;
+
+  for(int off = 0; off < 9; off++){
+    for(int doff = 0; doff < 9; doff++){
+      for(int len = 0; len < 150; len += 7){
+        for(int i = 0; i < sizeof(a); i++)
+          a[i] = ref[i] = i * 7 + 1;
+        // from a+off to a+doff, overlapping unless len is 0.
+        memmove(a + doff + 64, a + off + 64, len);
+        for(int i = 0; i < len; i++)
+          ref[doff + 64 + i] = (off + 64 + i) * 7 + 1;
+        memset(a + off + 200, off, len % 90);
+        for(int i = 0; i < len % 90; i++)
+          ref[off + 200 + i] = off;
+        if(memcmp(a, ref, sizeof(a)) != 0){
+          printf("%s: memmove/memset %d %d %d wrong\n", s, off, doff, len);
           exit(1);
         }
-        close(fd);
-        if(i > 0 && (i % 2 ) == 0){
-          name[1] = '0' + (i / 2);
-          if(unlink(name) < 0){
-            printf("%s: unlink failed\n", s);
-            exit(1);
-          }
-        }
       }
-      exit(0);
     }
   }
 
-  int xstatus;
-  for(pi = 0; pi < NCHILD; pi++){
-    wait(&xstatus);
-    if(xstatus != 0)
+  fd = open("memf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create memf failed\n", s);
+    exit(1);
+  }
+  for(int off = 0; off < 9; off++){
+    for(int i = 0; i < sizeof(a); i++)
+      a[i] = i ^ off;
+    memset(b, 0, sizeof(b));
+    if(pwrite(fd, a + off, 200, off) != 200 || pread(fd, b + 9 - off, 200, off) != 200 ||
+       memcmp(a + off, b + 9 - off, 200) != 0){
+      printf("%s: read/write at %d wrong\n", s, off);
       exit(1);
+    }
   }
+  close(fd);
+  unlink("memf");
 
-  name[0] = name[1] = name[2] = 0;
-  for(i = 0; i < N; i++){
-    for(pi = 0; pi < NCHILD; pi++){
-      name[0] = 'p' + pi;
-      name[1] = '0' + i;
-      fd = open(name, 0);
-      if((i == 0 || i >= N/2) && fd < 0){
-        printf("%s: oops createdelete %s didn't exist\n", s, name);
-        exit(1);
-      } else if((i >= 1 && i < N/2) && fd >= 0){
-        printf("%s: oops createdelete %s did exist\n", s, name);
-        exit(1);
-      }
-      if(fd >= 0)
-        close(fd);
+  for(int off = 0; off < 9; off++){
+    memset(name, 0, sizeof(name));
+    strcpy(name + off, "memfname");
+    fd = open(name + off, O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: open at %d failed\n", s, off);
+      exit(1);
+    }
+    close(fd);
+    if(unlink(name + off) != 0){
+      printf("%s: unlink at %d failed\n", s, off);
+      exit(1);
     }
   }
+}
 
-  for(i = 0; i < N; i++){
-    for(pi = 0; pi < NCHILD; pi++){
-      name[0] = 'p' + i;
-      name[1] = '0' + i;
-      unlink(name);
-    }
+// a kernel message about a faulting child shows up in kmsg
+// once kprintd has drained it.
+void
+kmsgtest(char *s)
+{
+  static char buf[16384+1];
+  char want[16], *w;
+  int fd, n, tot, pid, id;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
   }
+  if(pid == 0){
+    *(volatile int*)0xfffffffff0 = 1;
+    exit(0);
+  }
+  wait(0);
+  sleep(3);
+
+  // "pid=<pid>\n", digits written backwards from the end.
+  w = want + sizeof(want) - 1;
+  *w = 0;
+  *--w = '\n';
+  for(id = pid; id > 0; id /= 10)
+    *--w = '0' + id % 10;
+  w -= 4;
+  memmove(w, "pid=", 4);
+
+  if((fd = open("kmsg", O_RDONLY)) < 0){
+    printf("%s: open kmsg failed\n", s);
+    exit(1);
+  }
+  // read to the end, so the next reader starts at the beginning.
+  tot = 0;
+  while((n = read(fd, buf + tot, sizeof(buf) - 1 - tot)) > 0)
+    if((tot += n) == sizeof(buf) - 1)
+      tot = 0;
+  close(fd);
+  for(n = 0; n + strlen(w) <= tot; n++)
+    if(memcmp(buf + n, w, strlen(w)) == 0)
+      return;
+  printf("%s: %s not in kmsg\n", s, w);
+  exit(1);
 }
 
-// can I unlink a file and still read it?
+// a pipe's data ring grows with pipesize(), keeping what it
+// holds, and can then take a big write with nobody reading.
 void
-unlinkread(char *s)
+pipesizetest(char *s)
 {
-  enum { SZ = 5 };
-  int fd, fd1;
+  static char buf[60001], buf2[60001];
+  int fds[2], fd, n;
 
-  fd = open("unlinkread", O_CREATE | O_RDWR);
-  if(fd < 0){
-    printf("%s: create unlinkread failed\n", s);
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(pipesize(fds[0], 0) != 4096){
+    printf("%s: default pipe size wrong\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < sizeof(buf); i++)
+    buf[i] = i % 251;
+  // the first write leaves bytes in the data ring, so no pages
+  // are lent after it, and the second is all copied into the ring.
+  if(write(fds[1], buf + 1, 1000) != 1000 || pipesize(fds[1], 40000) != 65536 ||
+     write(fds[1], buf + 1001, 59000) != 59000){
+    printf("%s: write to a grown pipe failed\n", s);
+    exit(1);
+  }
+  if(pipesize(fds[1], 4096) != -1 || pipesize(fds[1], 1 << 20) != -1){
+    printf("%s: pipesize of too little or too much succeeded\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  for(int tot = 0; (n = read(fds[0], buf2 + 1 + tot, sizeof(buf2) - 1 - tot)) != 0; tot += n){
+    if(n < 0){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  }
+  if(memcmp(buf + 1, buf2 + 1, 60000) != 0){
+    printf("%s: pipe data wrong\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+
+  fd = open("echo", O_RDONLY);
+  if(fd >= 0 && pipesize(fd, 0) != -1){
+    printf("%s: pipesize of a file succeeded\n", s);
     exit(1);
   }
-  write(fd, "hello", SZ);
   close(fd);
+}
 
-  fd = open("unlinkread", O_RDWR);
-  if(fd < 0){
-    printf("%s: open unlinkread failed\n", s);
+// poll() on pipes: nothing ready, a write end, a write from a
+// child waking it, a timeout, a closed end, a bad fd.
+void
+polltest(char *s)
+{
+  int a[2], b[2], pid, t0;
+  struct pollfd fds[3];
+  char c;
+
+  if(pipe(a) != 0 || pipe(b) != 0){
+    printf("%s: pipe() failed\n", s);
     exit(1);
   }
-  if(unlink("unlinkread") != 0){
-    printf("%s: unlink unlinkread failed\n", s);
+  fds[0].fd = a[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = b[0];
+  fds[1].events = POLLIN;
+  fds[2].fd = b[1];
+  fds[2].events = POLLOUT;
+  if(poll(fds, 2, 0) != 0 || poll(fds + 2, 1, 0) != 1 || fds[2].revents != POLLOUT){
+    printf("%s: poll of idle pipes wrong\n", s);
     exit(1);
   }
 
-  fd1 = open("unlinkread", O_CREATE | O_RDWR);
-  write(fd1, "yyy", 3);
-  close(fd1);
+  t0 = uptime();
+  if(poll(fds, 2, 3) != 0 || uptime() - t0 < 3){
+    printf("%s: poll timeout wrong\n", s);
+    exit(1);
+  }
 
-  if(read(fd, buf, sizeof(buf)) != SZ){
-    printf("%s: unlinkread read failed", s);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
     exit(1);
   }
-  if(buf[0] != 'h'){
-    printf("%s: unlinkread wrong data\n", s);
+  if(pid == 0){
+    sleep(2);
+    write(b[1], "x", 1);
+    exit(0);
+  }
+  if(poll(fds, 2, -1) != 1 || fds[0].revents != 0 || fds[1].revents != POLLIN){
+    printf("%s: poll missed the child's write\n", s);
     exit(1);
   }
-  if(write(fd, buf, 10) != 10){
-    printf("%s: unlinkread write failed\n", s);
+  wait(0);
+  read(b[0], &c, 1);
+
+  close(a[1]);
+  fds[2].fd = 100;
+  if(poll(fds, 3, 0) != 2 || fds[0].revents != (POLLIN|POLLHUP) ||
+     fds[1].revents != 0 || fds[2].revents != POLLNVAL){
+    printf("%s: poll of a closed pipe or bad fd wrong\n", s);
     exit(1);
   }
-  close(fd);
-  unlink("unlinkread");
+  close(a[0]);
+  close(b[0]);
+  close(b[1]);
 }
 
+// O_NONBLOCK pipes return EAGAIN where they would sleep, and
+// a part of a write that there is room for.
 void
-linktest(char *s)
+nonblocktest(char *s)
 {
-  enum { SZ = 5 };
-  int fd;
-
-  unlink("lf1");
-  unlink("lf2");
+  static char buf[5001];
+  int fds[2], fd;
+  char c;
 
-  fd = open("lf1", O_CREATE|O_RDWR);
-  if(fd < 0){
-    printf("%s: create lf1 failed\n", s);
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
     exit(1);
   }
-  if(write(fd, "hello", SZ) != SZ){
-    printf("%s: write lf1 failed\n", s);
+  if(fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0 ||
+     fcntl(fds[0], F_GETFL, 0) != (O_RDONLY|O_NONBLOCK) ||
+     fcntl(fds[1], F_GETFL, 0) != (O_WRONLY|O_NONBLOCK)){
+    printf("%s: fcntl failed\n", s);
     exit(1);
   }
-  close(fd);
+  if(read(fds[0], &c, 1) != EAGAIN){
+    printf("%s: read of an empty pipe didn't return EAGAIN\n", s);
+    exit(1);
+  }
+  // writes of less than a page, which is never lent, wherever
+  // buf is: the second fills the 4096-byte data ring.
+  if(write(fds[1], buf + 1, 3000) != 3000 || write(fds[1], buf + 1, 3000) != 1096 ||
+     write(fds[1], buf + 1, 1) != EAGAIN){
+    printf("%s: write to a full pipe wrong\n", s);
+    exit(1);
+  }
+  if(read(fds[0], buf + 1, 5000) != 4096 || read(fds[0], &c, 1) != EAGAIN){
+    printf("%s: read of a full pipe wrong\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 0){
+    printf("%s: read of a closed pipe wrong\n", s);
+    exit(1);
+  }
+  close(fds[0]);
 
-  if(link("lf1", "lf2") < 0){
-    printf("%s: link lf1 lf2 failed\n", s);
+  if((fd = open("console", O_RDWR|O_NONBLOCK)) < 0 ||
+     fcntl(fd, F_GETFL, 0) != (O_RDWR|O_NONBLOCK)){
+    printf("%s: open console O_NONBLOCK failed\n", s);
     exit(1);
   }
-  unlink("lf1");
+  close(fd);
+}
 
-  if(open("lf1", 0) >= 0){
-    printf("%s: unlinked lf1 but it is still there!\n", s);
+// nanotime() agrees with the system call and with sleep(),
+// and the cycle and instruction counters run; they are the
+// hart's, which may change, so only differ.
+void
+clocktest(char *s)
+{
+  uint64 a, b, c, cy, in;
+
+  a = nanotime();
+  b = sysnanotime();
+  c = nanotime();
+  if(a > b || b > c){
+    printf("%s: nanotime out of order\n", s);
     exit(1);
   }
+  cy = rdcycle();
+  in = rdinstret();
+  sleep(2);
+  if(nanotime() - c < 100000000 || rdcycle() == cy || rdinstret() == in){
+    printf("%s: clocks didn't advance\n", s);
+    exit(1);
+  }
+}
 
-  fd = open("lf2", 0);
-  if(fd < 0){
-    printf("%s: open lf2 failed\n", s);
+// the profiler takes samples of a spinning process, in user
+// mode, and stops when turned off.
+void
+proftest(char *s)
+{
+  static struct profsample ps[64];
+  int fd, n, mine = 0, t0;
+
+  if((fd = open("profile", O_RDWR)) < 0 || write(fd, "1", 1) != 1){
+    printf("%s: can't turn profiling on\n", s);
     exit(1);
   }
-  if(read(fd, buf, sizeof(buf)) != SZ){
-    printf("%s: read lf2 failed\n", s);
+  for(t0 = uptime(); uptime() - t0 < 3; )
+    ;
+  if(write(fd, "0", 1) != 1){
+    printf("%s: can't turn profiling off\n", s);
+    exit(1);
+  }
+  while((n = read(fd, ps, sizeof(ps))) > 0)
+    for(int i = 0; i < n / sizeof(ps[0]); i++)
+      if(ps[i].pid == getpid() && ps[i].user)
+        mine++;
+  if(n < 0 || mine == 0){
+    printf("%s: no samples of this process\n", s);
+    exit(1);
+  }
+  if(read(fd, ps, sizeof(ps)) != 0){
+    printf("%s: samples while off\n", s);
     exit(1);
   }
   close(fd);
+}
 
-  if(link("lf2", "lf2") >= 0){
-    printf("%s: link lf2 lf2 succeeded! oops\n", s);
+// the statistics device counts system calls, after a reset,
+// and a trace mask is inherited without breaking anything.
+void
+syscalltest(char *s)
+{
+  static char buf[16384];
+  char *want = "syscall getpid: calls ";
+  int fd, n, i, calls = -1, pid, xstatus;
+
+  if((fd = open("statistics", O_WRONLY)) < 0 || write(fd, "r", 1) != 1){
+    printf("%s: can't reset statistics\n", s);
     exit(1);
   }
-
-  unlink("lf2");
-  if(link("lf2", "lf1") >= 0){
-    printf("%s: link non-existant succeeded! oops\n", s);
+  close(fd);
+  for(i = 0; i < 100; i++)
+    sysgetpid();
+  n = statistics(buf, sizeof(buf) - 1);
+  buf[n] = 0;
+  for(i = 0; i + strlen(want) < n; i++){
+    if(memcmp(buf + i, want, strlen(want)) == 0){
+      calls = atoi(buf + i + strlen(want));
+      break;
+    }
+  }
+  if(calls < 100){
+    printf("%s: getpid counted %d times\n", s, calls);
     exit(1);
   }
 
-  if(link(".", "lf1") >= 0){
-    printf("%s: link . lf1 succeeded! oops\n", s);
+  if(trace(1L << 11) < 0){
+    printf("%s: trace failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid == 0){
+    sysgetpid();
+    exit(0);
+  }
+  trace(0);
+  if(pid < 0 || wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: traced child failed\n", s);
     exit(1);
   }
 }
 
-// test concurrent create/link/unlink of the same file
+// the counters device has kalloc's per-hart counters, and
+// reads of both devices start over after the end.
 void
-concreate(char *s)
+countertest(char *s)
 {
-  enum { N = 40 };
-  char file[3];
-  int i, pid, n, fd;
-  char fa[N];
-  struct {
-    ushort inum;
-    char name[DIRSIZ];
-  } de;
+  static struct counterrec r[8];
+  static char buf[512];
+  int fd, n, pass, found;
+  uint64 t;
+
+  for(pass = 0; pass < 2; pass++){
+    if((fd = open("counters", O_RDONLY)) < 0){
+      printf("%s: can't open counters\n", s);
+      exit(1);
+    }
+    found = 0;
+    while((n = read(fd, r, sizeof(r))) > 0){
+      for(int i = 0; i < n / sizeof(r[0]); i++){
+        if(strcmp(r[i].sys, "kalloc") || strcmp(r[i].name, "alloc"))
+          continue;
+        t = 0;
+        for(int j = 0; j < r[i].ncpu; j++)
+          t += r[i].n[j];
+        found = r[i].ncpu == NCPU && t > 0;
+      }
+    }
+    close(fd);
+    if(n < 0 || !found){
+      printf("%s: no kalloc alloc counter\n", s);
+      exit(1);
+    }
 
-  file[0] = 'C';
-  file[2] = '\0';
-  for(i = 0; i < N; i++){
-    file[1] = '0' + i;
-    unlink(file);
-    pid = fork();
-    if(pid && (i % 3) == 1){
-      link("C0", file);
-    } else if(pid == 0 && (i % 5) == 1){
-      link("C0", file);
-    } else {
-      fd = open(file, O_CREATE | O_RDWR);
-      if(fd < 0){
-        printf("concreate create %s failed\n", file);
-        exit(1);
-      }
-      close(fd);
-    }
-    if(pid == 0) {
-      exit(0);
-    } else {
-      int xstatus;
-      wait(&xstatus);
-      if(xstatus != 0)
-        exit(1);
-    }
-  }
-
-  memset(fa, 0, sizeof(fa));
-  fd = open(".", 0);
-  n = 0;
-  while(read(fd, &de, sizeof(de)) > 0){
-    if(de.inum == 0)
-      continue;
-    if(de.name[0] == 'C' && de.name[2] == '\0'){
-      i = de.name[1] - '0';
-      if(i < 0 || i >= sizeof(fa)){
-        printf("%s: concreate weird file %s\n", s, de.name);
-        exit(1);
-      }
-      if(fa[i]){
-        printf("%s: concreate duplicate file %s\n", s, de.name);
-        exit(1);
-      }
-      fa[i] = 1;
-      n++;
-    }
-  }
-  close(fd);
-
-  if(n != N){
-    printf("%s: concreate not enough files in directory listing\n", s);
-    exit(1);
-  }
-
-  for(i = 0; i < N; i++){
-    file[1] = '0' + i;
-    pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed\n", s);
+    if((fd = open("statistics", O_RDONLY)) < 0 ||
+       (n = read(fd, buf, sizeof(buf))) <= 0 || memcmp(buf, "== ", 3) != 0){
+      printf("%s: statistics read failed\n", s);
       exit(1);
     }
-    if(((i % 3) == 0 && pid == 0) ||
-       ((i % 3) == 1 && pid != 0)){
-      close(open(file, 0));
-      close(open(file, 0));
-      close(open(file, 0));
-      close(open(file, 0));
-      close(open(file, 0));
-      close(open(file, 0));
-    } else {
-      unlink(file);
-      unlink(file);
-      unlink(file);
-      unlink(file);
-      unlink(file);
-      unlink(file);
-    }
-    if(pid == 0)
-      exit(0);
-    else
-      wait(0);
+    while(read(fd, buf, sizeof(buf)) > 0)
+      ;
+    close(fd);
   }
 }
 
-// another concurrent link/unlink/create test,
-// to look for deadlocks.
+// a process's disk writes show on its line of the statistics
+// device.
 void
-linkunlink(char *s)
+iostattest(char *s)
 {
-  int pid, i;
+  enum { SZ = 64*1024 };
+  char *b, *p, *e;
+  int fd, n, pid = getpid(), writes = -1;
 
-  unlink("x");
-  pid = fork();
-  if(pid < 0){
-    printf("%s: fork failed\n", s);
+  if((fd = open("iostat", O_CREATE | O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
     exit(1);
   }
-
-  unsigned int x = (pid ? 1 : 97);
-  for(i = 0; i < 100; i++){
-    x = x * 1103515245 + 12345;
-    if((x % 3) == 0){
-      close(open("x", O_RDWR | O_CREATE));
-    } else if((x % 3) == 1){
-      link("cat", "x");
-    } else {
-      unlink("x");
+  memset(buf, 'i', BSIZE);
+  for(int i = 0; i < 4; i++)
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
     }
-  }
+  fsync(fd);
+  close(fd);
+  unlink("iostat");
 
-  if(pid)
-    wait(0);
-  else
-    exit(0);
+  if((b = sbrk(SZ)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  n = statistics(b, SZ - 1);
+  b[n < 0 ? 0 : n] = 0;
+  for(p = b; *p; p = e){
+    for(e = p; *e && *e != '\n'; e++)
+      ;
+    if(*e)
+      *e++ = 0;
+    if(memcmp(p, "proc ", 5) != 0 || atoi(p + 5) != pid)
+      continue;
+    for(; *p; p++)
+      if(memcmp(p, " writes ", 8) == 0)
+        writes = atoi(p + 8);
+  }
+  sbrk(-SZ);
+  if(writes < 4){
+    printf("%s: %d writes counted\n", s, writes);
+    exit(1);
+  }
 }
 
-// directory that uses indirect blocks
+// grow the descriptor table past NOFILE, up to MAXFD, and check
+// that the lowest free descriptor is always the one handed out
+// and that a child gets the whole table.
 void
-bigdir(char *s)
+manyfds(char *s)
 {
-  enum { N = 500 };
-  int i, fd;
-  char name[10];
-
-  unlink("bd");
+  int fds[2], fd, last = -1, pid, xstatus;
+  char c;
 
-  fd = open("bd", O_CREATE);
-  if(fd < 0){
-    printf("%s: bigdir create failed\n", s);
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
     exit(1);
   }
-  close(fd);
-
-  for(i = 0; i < N; i++){
-    name[0] = 'x';
-    name[1] = '0' + (i / 64);
-    name[2] = '0' + (i % 64);
-    name[3] = '\0';
-    if(link("bd", name) != 0){
-      printf("%s: bigdir link(bd, %s) failed\n", s, name);
+  while((fd = dup(fds[1])) >= 0){
+    if(fd != last + 1 && last >= 0){
+      printf("%s: dup returned %d after %d\n", s, fd, last);
       exit(1);
     }
+    last = fd;
   }
-
-  unlink("bd");
-  for(i = 0; i < N; i++){
-    name[0] = 'x';
-    name[1] = '0' + (i / 64);
-    name[2] = '0' + (i % 64);
-    name[3] = '\0';
-    if(unlink(name) != 0){
-      printf("%s: bigdir unlink failed", s);
-      exit(1);
-    }
+  if(last != MAXFD - 1){
+    printf("%s: only got to fd %d\n", s, last);
+    exit(1);
   }
-}
-
-void
-subdir(char *s)
-{
-  int fd, cc;
-
-  unlink("ff");
-  if(mkdir("dd") != 0){
-    printf("%s: mkdir dd failed\n", s);
+  close(NOFILE + 3);
+  if(dup(fds[1]) != NOFILE + 3){
+    printf("%s: lowest free fd not reused\n", s);
     exit(1);
   }
 
-  fd = open("dd/ff", O_CREATE | O_RDWR);
-  if(fd < 0){
-    printf("%s: create dd/ff failed\n", s);
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
     exit(1);
   }
-  write(fd, "ff", 2);
-  close(fd);
-
-  if(unlink("dd") >= 0){
-    printf("%s: unlink dd (non-empty dir) succeeded!\n", s);
+  if(pid == 0)
+    exit(write(MAXFD - 1, "x", 1) == 1 ? 0 : 1);
+  wait(&xstatus);
+  if(xstatus != 0 || read(fds[0], &c, 1) != 1 || c != 'x'){
+    printf("%s: child could not write its last fd\n", s);
     exit(1);
   }
+  for(fd = 3; fd < MAXFD; fd++)
+    if(fd != fds[0] && fd != fds[1])
+      close(fd);
+  close(fds[0]);
+  close(fds[1]);
+}
 
-  if(mkdir("/dd/dd") != 0){
-    printf("subdir mkdir dd/dd failed\n", s);
+// pin this process to each hart in turn, and a child to hart 0.
+void
+affinitytest(char *s)
+{
+  int pid = getpid(), xstatus;
+  uint64 all = getaffinity(pid);
+  volatile int x = 0;
+
+  if(all == 0 || all == -1){
+    printf("%s: getaffinity failed\n", s);
     exit(1);
   }
-
-  fd = open("dd/dd/ff", O_CREATE | O_RDWR);
-  if(fd < 0){
-    printf("%s: create dd/dd/ff failed\n", s);
+  if(setaffinity(pid, 0) != -1 || setaffinity(pid, 1L << 63) != -1 ||
+     setaffinity(-1, all) != -1){
+    printf("%s: bad setaffinity succeeded\n", s);
     exit(1);
   }
-  write(fd, "FF", 2);
-  close(fd);
+  for(int i = 0; i < 64; i++){
+    if((all & (1L << i)) == 0)
+      continue;
+    if(setaffinity(pid, 1L << i) != 0 || getaffinity(pid) != (1L << i)){
+      printf("%s: setaffinity to hart %d failed\n", s, i);
+      exit(1);
+    }
+    for(int j = 0; j < 100000; j++)
+      x++;
+  }
 
-  fd = open("dd/dd/../ff", 0);
-  if(fd < 0){
-    printf("%s: open dd/dd/../ff failed\n", s);
+  setaffinity(pid, 1);
+  if((xstatus = fork()) < 0){
+    printf("%s: fork failed\n", s);
     exit(1);
   }
-  cc = read(fd, buf, sizeof(buf));
-  if(cc != 2 || buf[0] != 'f'){
-    printf("%s: dd/dd/../ff wrong content\n", s);
-    exit(1);
+  if(xstatus == 0){
+    sleep(1);
+    exit(getaffinity(getpid()) == 1 ? 0 : 1);
   }
-  close(fd);
-
-  if(link("dd/dd/ff", "dd/dd/ffff") != 0){
-    printf("link dd/dd/ff dd/dd/ffff failed\n", s);
+  wait(&xstatus);
+  if(setaffinity(pid, all) != 0 || xstatus != 0){
+    printf("%s: child did not inherit its mask\n", s);
     exit(1);
   }
+}
 
-  if(unlink("dd/dd/ff") != 0){
-    printf("%s: unlink dd/dd/ff failed\n", s);
+// printf to a pipe is fully buffered, and what is left in
+// the buffer comes out at exit.
+void
+bufiotest(char *s)
+{
+  static char buf[1024];
+  int fds[2], pid, n, total = 0;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
     exit(1);
   }
-  if(open("dd/dd/ff", O_RDONLY) >= 0){
-    printf("%s: open (unlinked) dd/dd/ff succeeded\n", s);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
     exit(1);
   }
-
-  if(chdir("dd") != 0){
-    printf("%s: chdir dd failed\n", s);
+  if(pid == 0){
+    close(fds[0]);
+    for(int i = 0; i < 100; i++)
+      fprintf(fds[1], "%d\n", i % 10);
+    exit(0);
+  }
+  close(fds[1]);
+  while((n = read(fds[0], buf + total, sizeof(buf) - total)) > 0)
+    total += n;
+  close(fds[0]);
+  wait(0);
+  if(total != 200 || buf[198] != '9' || buf[199] != '\n'){
+    printf("%s: got %d bytes\n", s, total);
     exit(1);
   }
-  if(chdir("dd/../../dd") != 0){
-    printf("%s: chdir dd/../../dd failed\n", s);
+}
+
+// simple fork and pipe read/write
+
+void
+pipe1(char *s)
+{
+  int fds[2], pid, xstatus;
+  int seq, i, n, cc, total;
+  enum { N=5, SZ=1033 };
+  
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
     exit(1);
   }
-  if(chdir("dd/../../../dd") != 0){
-    printf("chdir dd/../../dd failed\n", s);
+  pid = fork();
+  seq = 0;
+  if(pid == 0){
+    close(fds[0]);
+    for(n = 0; n < N; n++){
+      for(i = 0; i < SZ; i++)
+        buf[i] = seq++;
+      if(write(fds[1], buf, SZ) != SZ){
+        printf("%s: pipe1 oops 1\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  } else if(pid > 0){
+    close(fds[1]);
+    total = 0;
+    cc = 1;
+    while((n = read(fds[0], buf, cc)) > 0){
+      for(i = 0; i < n; i++){
+        if((buf[i] & 0xff) != (seq++ & 0xff)){
+          printf("%s: pipe1 oops 2\n", s);
+          return;
+        }
+      }
+      total += n;
+      cc = cc * 2;
+      if(cc > sizeof(buf))
+        cc = sizeof(buf);
+    }
+    if(total != N * SZ){
+      printf("%s: pipe1 oops 3 total %d\n", total);
+      exit(1);
+    }
+    close(fds[0]);
+    wait(&xstatus);
+    exit(xstatus);
+  } else {
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+}
+
+// meant to be run w/ at most two CPUs
+void
+preempt(char *s)
+{
+  int pid1, pid2, pid3;
+  int pfds[2];
+
+  pid1 = fork();
+  if(pid1 < 0) {
+    printf("%s: fork failed");
+    exit(1);
+  }
+  if(pid1 == 0)
+    for(;;)
+      ;
+
+  pid2 = fork();
+  if(pid2 < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid2 == 0)
+    for(;;)
+      ;
+
+  pipe(pfds);
+  pid3 = fork();
+  if(pid3 < 0) {
+     printf("%s: fork failed\n", s);
+     exit(1);
+  }
+  if(pid3 == 0){
+    close(pfds[0]);
+    if(write(pfds[1], "x", 1) != 1)
+      printf("%s: preempt write error");
+    close(pfds[1]);
+    for(;;)
+      ;
+  }
+
+  close(pfds[1]);
+  if(read(pfds[0], buf, sizeof(buf)) != 1){
+    printf("%s: preempt read error");
+    return;
+  }
+  close(pfds[0]);
+  printf("kill... ");
+  kill(pid1);
+  kill(pid2);
+  kill(pid3);
+  printf("wait... ");
+  wait(0);
+  wait(0);
+  wait(0);
+}
+
+// try to find any races between exit and wait
+void
+exitwait(char *s)
+{
+  int i, pid;
+
+  for(i = 0; i < 100; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid){
+      int xstate;
+      if(wait(&xstate) != pid){
+        printf("%s: wait wrong pid\n", s);
+        exit(1);
+      }
+      if(i != xstate) {
+        printf("%s: wait wrong exit status\n", s);
+        exit(1);
+      }
+    } else {
+      exit(i);
+    }
+  }
+}
+
+// try to find races in the reparenting
+// code that handles a parent exiting
+// when it still has live children.
+void
+reparent(char *s)
+{
+  int master_pid = getpid();
+  for(int i = 0; i < 200; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid){
+      if(wait(0) != pid){
+        printf("%s: wait wrong pid\n", s);
+        exit(1);
+      }
+    } else {
+      int pid2 = fork();
+      if(pid2 < 0){
+        kill(master_pid);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  exit(0);
+}
+
+// what if two children exit() at the same time?
+void
+twochildren(char *s)
+{
+  for(int i = 0; i < 1000; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid1 == 0){
+      exit(0);
+    } else {
+      int pid2 = fork();
+      if(pid2 < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid2 == 0){
+        exit(0);
+      } else {
+        wait(0);
+        wait(0);
+      }
+    }
+  }
+}
+
+// concurrent forks to try to expose locking bugs.
+void
+forkfork(char *s)
+{
+  enum { N=2 };
+  
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < 200; j++){
+        int pid1 = fork();
+        if(pid1 < 0){
+          exit(1);
+        }
+        if(pid1 == 0){
+          exit(0);
+        }
+        wait(0);
+      }
+      exit(0);
+    }
+  }
+
+  int xstatus;
+  for(int i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0) {
+      printf("%s: fork in child failed", s);
+      exit(1);
+    }
+  }
+}
+
+void
+forkforkfork(char *s)
+{
+  unlink("stopforking");
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed", s);
+    exit(1);
+  }
+  if(pid == 0){
+    while(1){
+      int fd = open("stopforking", 0);
+      if(fd >= 0){
+        exit(0);
+      }
+      if(fork() < 0){
+        close(open("stopforking", O_CREATE|O_RDWR));
+      }
+    }
+
+    exit(0);
+  }
+
+  sleep(20); // two seconds
+  close(open("stopforking", O_CREATE|O_RDWR));
+  wait(0);
+  sleep(10); // one second
+}
+
+// regression test. does reparent() violate the parent-then-child
+// locking order when giving away a child to init, so that exit()
+// deadlocks against init's wait()? also used to trigger a "panic:
+// release" due to exit() releasing a different p->parent->lock than
+// it acquired.
+void
+reparent2(char *s)
+{
+  for(int i = 0; i < 800; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid1 == 0){
+      fork();
+      fork();
+      exit(0);
+    }
+    wait(0);
+  }
+
+  exit(0);
+}
+
+// allocate all mem, free it, and allocate again
+void
+mem(char *s)
+{
+  void *m1, *m2;
+  int pid;
+
+  if((pid = fork()) == 0){
+    m1 = 0;
+    while((m2 = malloc(10001)) != 0){
+      *(char**)m2 = m1;
+      m1 = m2;
+    }
+    while(m1){
+      m2 = *(char**)m1;
+      free(m1);
+      m1 = m2;
+    }
+    m1 = malloc(1024*20);
+    if(m1 == 0){
+      printf("couldn't allocate mem?!!\n", s);
+      exit(1);
+    }
+    free(m1);
+    exit(0);
+  } else {
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus == -1){
+      // probably page fault, so might be lazy lab,
+      // so OK.
+      exit(0);
+    }
+    exit(xstatus);
+  }
+}
+
+// More file system tests
+
+// two processes write to the same file descriptor
+// is the offset shared? does inode locking work?
+void
+sharedfd(char *s)
+{
+  int fd, pid, i, n, nc, np;
+  enum { N = 1000, SZ=10};
+  char buf[SZ];
+
+  unlink("sharedfd");
+  fd = open("sharedfd", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot open sharedfd for writing", s);
+    exit(1);
+  }
+  pid = fork();
+  memset(buf, pid==0?'c':'p', sizeof(buf));
+  for(i = 0; i < N; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write sharedfd failed\n", s);
+      exit(1);
+    }
+  }
+  if(pid == 0) {
+    exit(0);
+  } else {
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  
+  close(fd);
+  fd = open("sharedfd", 0);
+  if(fd < 0){
+    printf("%s: cannot open sharedfd for reading\n", s);
+    exit(1);
+  }
+  nc = np = 0;
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    for(i = 0; i < sizeof(buf); i++){
+      if(buf[i] == 'c')
+        nc++;
+      if(buf[i] == 'p')
+        np++;
+    }
+  }
+  close(fd);
+  unlink("sharedfd");
+  if(nc == N*SZ && np == N*SZ){
+    exit(0);
+  } else {
+    printf("%s: nc/np test fails\n", s);
+    exit(1);
+  }
+}
+
+// four processes write different files at the same
+// time, to test block allocation.
+void
+fourfiles(char *s)
+{
+  int fd, pid, i, j, n, total, pi;
+  char *names[] = { "f0", "f1", "f2", "f3" };
+  char *fname;
+  enum { N=12, NCHILD=4, SZ=500 };
+  
+  for(pi = 0; pi < NCHILD; pi++){
+    fname = names[pi];
+    unlink(fname);
+
+    pid = fork();
+    if(pid < 0){
+      printf("fork failed\n", s);
+      exit(1);
+    }
+
+    if(pid == 0){
+      fd = open(fname, O_CREATE | O_RDWR);
+      if(fd < 0){
+        printf("create failed\n", s);
+        exit(1);
+      }
+
+      memset(buf, '0'+pi, SZ);
+      for(i = 0; i < N; i++){
+        if((n = write(fd, buf, SZ)) != SZ){
+          printf("write failed %d\n", n);
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+
+  int xstatus;
+  for(pi = 0; pi < NCHILD; pi++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    fname = names[i];
+    fd = open(fname, 0);
+    total = 0;
+    while((n = read(fd, buf, sizeof(buf))) > 0){
+      for(j = 0; j < n; j++){
+        if(buf[j] != '0'+i){
+          printf("wrong char\n", s);
+          exit(1);
+        }
+      }
+      total += n;
+    }
+    close(fd);
+    if(total != N*SZ){
+      printf("wrong length %d\n", total);
+      exit(1);
+    }
+    unlink(fname);
+  }
+}
+
+// four processes create and delete different files in same directory
+void
+createdelete(char *s)
+{
+  enum { N = 20, NCHILD=4 };
+  int pid, i, fd, pi;
+  char name[32];
+
+  for(pi = 0; pi < NCHILD; pi++){
+    pid = fork();
+    if(pid < 0){
+      printf("fork failed\n", s);
+      exit(1);
+    }
+
+    if(pid == 0){
+      name[0] = 'p' + pi;
+      name[2] = '\0';
+      for(i = 0; i < N; i++){
+        name[1] = '0' + i;
+        fd = open(name, O_CREATE | O_RDWR);
+        if(fd < 0){
+          printf("%s: create failed\n", s);
+          exit(1);
+        }
+        close(fd);
+        if(i > 0 && (i % 2 ) == 0){
+          name[1] = '0' + (i / 2);
+          if(unlink(name) < 0){
+            printf("%s: unlink failed\n", s);
+            exit(1);
+          }
+        }
+      }
+      exit(0);
+    }
+  }
+
+  int xstatus;
+  for(pi = 0; pi < NCHILD; pi++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  name[0] = name[1] = name[2] = 0;
+  for(i = 0; i < N; i++){
+    for(pi = 0; pi < NCHILD; pi++){
+      name[0] = 'p' + pi;
+      name[1] = '0' + i;
+      fd = open(name, 0);
+      if((i == 0 || i >= N/2) && fd < 0){
+        printf("%s: oops createdelete %s didn't exist\n", s, name);
+        exit(1);
+      } else if((i >= 1 && i < N/2) && fd >= 0){
+        printf("%s: oops createdelete %s did exist\n", s, name);
+        exit(1);
+      }
+      if(fd >= 0)
+        close(fd);
+    }
+  }
+
+  for(i = 0; i < N; i++){
+    for(pi = 0; pi < NCHILD; pi++){
+      name[0] = 'p' + i;
+      name[1] = '0' + i;
+      unlink(name);
+    }
+  }
+}
+
+// can I unlink a file and still read it?
+void
+unlinkread(char *s)
+{
+  enum { SZ = 5 };
+  int fd, fd1;
+
+  fd = open("unlinkread", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create unlinkread failed\n", s);
+    exit(1);
+  }
+  write(fd, "hello", SZ);
+  close(fd);
+
+  fd = open("unlinkread", O_RDWR);
+  if(fd < 0){
+    printf("%s: open unlinkread failed\n", s);
+    exit(1);
+  }
+  if(unlink("unlinkread") != 0){
+    printf("%s: unlink unlinkread failed\n", s);
+    exit(1);
+  }
+
+  fd1 = open("unlinkread", O_CREATE | O_RDWR);
+  write(fd1, "yyy", 3);
+  close(fd1);
+
+  if(read(fd, buf, sizeof(buf)) != SZ){
+    printf("%s: unlinkread read failed", s);
+    exit(1);
+  }
+  if(buf[0] != 'h'){
+    printf("%s: unlinkread wrong data\n", s);
+    exit(1);
+  }
+  if(write(fd, buf, 10) != 10){
+    printf("%s: unlinkread write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("unlinkread");
+}
+
+void
+linktest(char *s)
+{
+  enum { SZ = 5 };
+  int fd;
+
+  unlink("lf1");
+  unlink("lf2");
+
+  fd = open("lf1", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create lf1 failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "hello", SZ) != SZ){
+    printf("%s: write lf1 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(link("lf1", "lf2") < 0){
+    printf("%s: link lf1 lf2 failed\n", s);
+    exit(1);
+  }
+  unlink("lf1");
+
+  if(open("lf1", 0) >= 0){
+    printf("%s: unlinked lf1 but it is still there!\n", s);
+    exit(1);
+  }
+
+  fd = open("lf2", 0);
+  if(fd < 0){
+    printf("%s: open lf2 failed\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, sizeof(buf)) != SZ){
+    printf("%s: read lf2 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(link("lf2", "lf2") >= 0){
+    printf("%s: link lf2 lf2 succeeded! oops\n", s);
+    exit(1);
+  }
+
+  unlink("lf2");
+  if(link("lf2", "lf1") >= 0){
+    printf("%s: link non-existant succeeded! oops\n", s);
+    exit(1);
+  }
+
+  if(link(".", "lf1") >= 0){
+    printf("%s: link . lf1 succeeded! oops\n", s);
+    exit(1);
+  }
+}
+
+// test concurrent create/link/unlink of the same file
+void
+concreate(char *s)
+{
+  enum { N = 40 };
+  char file[3];
+  int i, pid, n, fd;
+  char fa[N];
+  struct {
+    ushort inum;
+    char name[DIRSIZ];
+  } de;
+
+  file[0] = 'C';
+  file[2] = '\0';
+  for(i = 0; i < N; i++){
+    file[1] = '0' + i;
+    unlink(file);
+    pid = fork();
+    if(pid && (i % 3) == 1){
+      link("C0", file);
+    } else if(pid == 0 && (i % 5) == 1){
+      link("C0", file);
+    } else {
+      fd = open(file, O_CREATE | O_RDWR);
+      if(fd < 0){
+        printf("concreate create %s failed\n", file);
+        exit(1);
+      }
+      close(fd);
+    }
+    if(pid == 0) {
+      exit(0);
+    } else {
+      int xstatus;
+      wait(&xstatus);
+      if(xstatus != 0)
+        exit(1);
+    }
+  }
+
+  memset(fa, 0, sizeof(fa));
+  fd = open(".", 0);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) > 0){
+    if(de.inum == 0)
+      continue;
+    if(de.name[0] == 'C' && de.name[2] == '\0'){
+      i = de.name[1] - '0';
+      if(i < 0 || i >= sizeof(fa)){
+        printf("%s: concreate weird file %s\n", s, de.name);
+        exit(1);
+      }
+      if(fa[i]){
+        printf("%s: concreate duplicate file %s\n", s, de.name);
+        exit(1);
+      }
+      fa[i] = 1;
+      n++;
+    }
+  }
+  close(fd);
+
+  if(n != N){
+    printf("%s: concreate not enough files in directory listing\n", s);
+    exit(1);
+  }
+
+  for(i = 0; i < N; i++){
+    file[1] = '0' + i;
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(((i % 3) == 0 && pid == 0) ||
+       ((i % 3) == 1 && pid != 0)){
+      close(open(file, 0));
+      close(open(file, 0));
+      close(open(file, 0));
+      close(open(file, 0));
+      close(open(file, 0));
+      close(open(file, 0));
+    } else {
+      unlink(file);
+      unlink(file);
+      unlink(file);
+      unlink(file);
+      unlink(file);
+      unlink(file);
+    }
+    if(pid == 0)
+      exit(0);
+    else
+      wait(0);
+  }
+}
+
+// another concurrent link/unlink/create test,
+// to look for deadlocks.
+void
+linkunlink(char *s)
+{
+  int pid, i;
+
+  unlink("x");
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+
+  unsigned int x = (pid ? 1 : 97);
+  for(i = 0; i < 100; i++){
+    x = x * 1103515245 + 12345;
+    if((x % 3) == 0){
+      close(open("x", O_RDWR | O_CREATE));
+    } else if((x % 3) == 1){
+      link("cat", "x");
+    } else {
+      unlink("x");
+    }
+  }
+
+  if(pid)
+    wait(0);
+  else
+    exit(0);
+}
+
+// directory that uses indirect blocks
+void
+bigdir(char *s)
+{
+  enum { N = 500 };
+  int i, fd;
+  char name[10];
+
+  unlink("bd");
+
+  fd = open("bd", O_CREATE);
+  if(fd < 0){
+    printf("%s: bigdir create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    name[0] = 'x';
+    name[1] = '0' + (i / 64);
+    name[2] = '0' + (i % 64);
+    name[3] = '\0';
+    if(link("bd", name) != 0){
+      printf("%s: bigdir link(bd, %s) failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  unlink("bd");
+  for(i = 0; i < N; i++){
+    name[0] = 'x';
+    name[1] = '0' + (i / 64);
+    name[2] = '0' + (i % 64);
+    name[3] = '\0';
+    if(unlink(name) != 0){
+      printf("%s: bigdir unlink failed", s);
+      exit(1);
+    }
+  }
+}
+
+// a directory big enough to be indexed, with entries
+// removed and added again in the middle.
+void
+dirindex(char *s)
+{
+  enum { N = 400 };
+  int i, fd;
+  char name[16];
+
+  if(mkdir("dx") != 0){
+    printf("%s: mkdir dx failed\n", s);
+    exit(1);
+  }
+  fd = open("dx/f", O_CREATE);
+  if(fd < 0){
+    printf("%s: create dx/f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    name[0] = 'd'; name[1] = 'x'; name[2] = '/';
+    name[3] = 'a' + i / 26 / 26; name[4] = 'a' + i / 26 % 26;
+    name[5] = 'a' + i % 26; name[6] = '\0';
+    if(link("dx/f", name) != 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i += 2){
+    name[3] = 'a' + i / 26 / 26; name[4] = 'a' + i / 26 % 26;
+    name[5] = 'a' + i % 26;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 26 / 26; name[4] = 'a' + i / 26 % 26;
+    name[5] = 'a' + i % 26;
+    fd = open(name, O_RDONLY);
+    if((fd >= 0) != (i % 2 == 1)){
+      printf("%s: open %s returned %d\n", s, name, fd);
+      exit(1);
+    }
+    if(fd >= 0)
+      close(fd);
+    // the removed ones back, under other names.
+    if(i % 2 == 0){
+      name[3] = 'A' + i / 26 / 26;
+      if(link("dx/f", name) != 0){
+        printf("%s: link %s again failed\n", s, name);
+        exit(1);
+      }
+    }
+  }
+  if((fd = open("dx/..", O_RDONLY)) < 0 || link("dx/f", "dx/aab") == 0){
+    printf("%s: dx lookups wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    name[3] = (i % 2 ? 'a' : 'A') + i / 26 / 26; name[4] = 'a' + i / 26 % 26;
+    name[5] = 'a' + i % 26;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s at the end failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("dx/f") != 0 || unlink("dx") != 0){
+    printf("%s: unlink dx failed\n", s);
+    exit(1);
+  }
+}
+
+void
+subdir(char *s)
+{
+  int fd, cc;
+
+  unlink("ff");
+  if(mkdir("dd") != 0){
+    printf("%s: mkdir dd failed\n", s);
+    exit(1);
+  }
+
+  fd = open("dd/ff", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create dd/ff failed\n", s);
+    exit(1);
+  }
+  write(fd, "ff", 2);
+  close(fd);
+
+  if(unlink("dd") >= 0){
+    printf("%s: unlink dd (non-empty dir) succeeded!\n", s);
+    exit(1);
+  }
+
+  if(mkdir("/dd/dd") != 0){
+    printf("subdir mkdir dd/dd failed\n", s);
+    exit(1);
+  }
+
+  fd = open("dd/dd/ff", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create dd/dd/ff failed\n", s);
+    exit(1);
+  }
+  write(fd, "FF", 2);
+  close(fd);
+
+  fd = open("dd/dd/../ff", 0);
+  if(fd < 0){
+    printf("%s: open dd/dd/../ff failed\n", s);
+    exit(1);
+  }
+  cc = read(fd, buf, sizeof(buf));
+  if(cc != 2 || buf[0] != 'f'){
+    printf("%s: dd/dd/../ff wrong content\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(link("dd/dd/ff", "dd/dd/ffff") != 0){
+    printf("link dd/dd/ff dd/dd/ffff failed\n", s);
+    exit(1);
+  }
+
+  if(unlink("dd/dd/ff") != 0){
+    printf("%s: unlink dd/dd/ff failed\n", s);
+    exit(1);
+  }
+  if(open("dd/dd/ff", O_RDONLY) >= 0){
+    printf("%s: open (unlinked) dd/dd/ff succeeded\n", s);
+    exit(1);
+  }
+
+  if(chdir("dd") != 0){
+    printf("%s: chdir dd failed\n", s);
+    exit(1);
+  }
+  if(chdir("dd/../../dd") != 0){
+    printf("%s: chdir dd/../../dd failed\n", s);
+    exit(1);
+  }
+  if(chdir("dd/../../../dd") != 0){
+    printf("chdir dd/../../dd failed\n", s);
+    exit(1);
+  }
+  if(chdir("./..") != 0){
+    printf("%s: chdir ./.. failed\n", s);
+    exit(1);
+  }
+
+  fd = open("dd/dd/ffff", 0);
+  if(fd < 0){
+    printf("%s: open dd/dd/ffff failed\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, sizeof(buf)) != 2){
+    printf("%s: read dd/dd/ffff wrong len\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(open("dd/dd/ff", O_RDONLY) >= 0){
+    printf("%s: open (unlinked) dd/dd/ff succeeded!\n", s);
+    exit(1);
+  }
+
+  if(open("dd/ff/ff", O_CREATE|O_RDWR) >= 0){
+    printf("%s: create dd/ff/ff succeeded!\n", s);
+    exit(1);
+  }
+  if(open("dd/xx/ff", O_CREATE|O_RDWR) >= 0){
+    printf("%s: create dd/xx/ff succeeded!\n", s);
+    exit(1);
+  }
+  if(open("dd", O_CREATE) >= 0){
+    printf("%s: create dd succeeded!\n", s);
+    exit(1);
+  }
+  if(open("dd", O_RDWR) >= 0){
+    printf("%s: open dd rdwr succeeded!\n", s);
+    exit(1);
+  }
+  if(open("dd", O_WRONLY) >= 0){
+    printf("%s: open dd wronly succeeded!\n", s);
+    exit(1);
+  }
+  if(link("dd/ff/ff", "dd/dd/xx") == 0){
+    printf("%s: link dd/ff/ff dd/dd/xx succeeded!\n", s);
+    exit(1);
+  }
+  if(link("dd/xx/ff", "dd/dd/xx") == 0){
+    printf("%s: link dd/xx/ff dd/dd/xx succeeded!\n", s);
+    exit(1);
+  }
+  if(link("dd/ff", "dd/dd/ffff") == 0){
+    printf("%s: link dd/ff dd/dd/ffff succeeded!\n", s);
+    exit(1);
+  }
+  if(mkdir("dd/ff/ff") == 0){
+    printf("%s: mkdir dd/ff/ff succeeded!\n", s);
+    exit(1);
+  }
+  if(mkdir("dd/xx/ff") == 0){
+    printf("%s: mkdir dd/xx/ff succeeded!\n", s);
+    exit(1);
+  }
+  if(mkdir("dd/dd/ffff") == 0){
+    printf("%s: mkdir dd/dd/ffff succeeded!\n", s);
+    exit(1);
+  }
+  if(unlink("dd/xx/ff") == 0){
+    printf("%s: unlink dd/xx/ff succeeded!\n", s);
+    exit(1);
+  }
+  if(unlink("dd/ff/ff") == 0){
+    printf("%s: unlink dd/ff/ff succeeded!\n", s);
+    exit(1);
+  }
+  if(chdir("dd/ff") == 0){
+    printf("%s: chdir dd/ff succeeded!\n", s);
+    exit(1);
+  }
+  if(chdir("dd/xx") == 0){
+    printf("%s: chdir dd/xx succeeded!\n", s);
+    exit(1);
+  }
+
+  if(unlink("dd/dd/ffff") != 0){
+    printf("%s: unlink dd/dd/ff failed\n", s);
+    exit(1);
+  }
+  if(unlink("dd/ff") != 0){
+    printf("%s: unlink dd/ff failed\n", s);
+    exit(1);
+  }
+  if(unlink("dd") == 0){
+    printf("%s: unlink non-empty dd succeeded!\n", s);
+    exit(1);
+  }
+  if(unlink("dd/dd") < 0){
+    printf("%s: unlink dd/dd failed\n", s);
+    exit(1);
+  }
+  if(unlink("dd") < 0){
+    printf("%s: unlink dd failed\n", s);
+    exit(1);
+  }
+}
+
+// test writes that are larger than the log.
+void
+bigwrite(char *s)
+{
+  int fd, sz;
+
+  unlink("bigwrite");
+  for(sz = 499; sz < (MAXOPBLOCKS+2)*BSIZE; sz += 471){
+    fd = open("bigwrite", O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf("%s: cannot create bigwrite\n", s);
+      exit(1);
+    }
+    int i;
+    for(i = 0; i < 2; i++){
+      int cc = write(fd, buf, sz);
+      if(cc != sz){
+        printf("%s: write(%d) ret %d\n", s, sz, cc);
+        exit(1);
+      }
+    }
+    close(fd);
+    unlink("bigwrite");
+  }
+}
+
+void
+bigfile(char *s)
+{
+  enum { N = 20, SZ=600 };
+  int fd, i, total, cc;
+
+  unlink("bigfile.dat");
+  fd = open("bigfile.dat", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create bigfile", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, i, SZ);
+    if(write(fd, buf, SZ) != SZ){
+      printf("%s: write bigfile failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("bigfile.dat", 0);
+  if(fd < 0){
+    printf("%s: cannot open bigfile\n", s);
+    exit(1);
+  }
+  total = 0;
+  for(i = 0; ; i++){
+    cc = read(fd, buf, SZ/2);
+    if(cc < 0){
+      printf("%s: read bigfile failed\n", s);
+      exit(1);
+    }
+    if(cc == 0)
+      break;
+    if(cc != SZ/2){
+      printf("%s: short read bigfile\n", s);
+      exit(1);
+    }
+    if(buf[0] != i/2 || buf[SZ/2-1] != i/2){
+      printf("%s: read bigfile wrong data\n", s);
+      exit(1);
+    }
+    total += cc;
+  }
+  close(fd);
+  if(total != N*SZ){
+    printf("%s: read bigfile wrong total\n", s);
+    exit(1);
+  }
+  unlink("bigfile.dat");
+}
+
+void
+fourteen(char *s)
+{
+  int fd;
+
+  // DIRSIZ is 14.
+
+  if(mkdir("12345678901234") != 0){
+    printf("%s: mkdir 12345678901234 failed\n", s);
+    exit(1);
+  }
+  if(mkdir("12345678901234/123456789012345") != 0){
+    printf("%s: mkdir 12345678901234/123456789012345 failed\n", s);
+    exit(1);
+  }
+  fd = open("123456789012345/123456789012345/123456789012345", O_CREATE);
+  if(fd < 0){
+    printf("%s: create 123456789012345/123456789012345/123456789012345 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("12345678901234/12345678901234/12345678901234", 0);
+  if(fd < 0){
+    printf("%s: open 12345678901234/12345678901234/12345678901234 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(mkdir("12345678901234/12345678901234") == 0){
+    printf("%s: mkdir 12345678901234/12345678901234 succeeded!\n", s);
+    exit(1);
+  }
+  if(mkdir("123456789012345/12345678901234") == 0){
+    printf("%s: mkdir 12345678901234/123456789012345 succeeded!\n", s);
+    exit(1);
+  }
+
+  // clean up
+  unlink("123456789012345/12345678901234");
+  unlink("12345678901234/12345678901234");
+  unlink("12345678901234/12345678901234/12345678901234");
+  unlink("123456789012345/123456789012345/123456789012345");
+  unlink("12345678901234/123456789012345");
+  unlink("12345678901234");
+}
+
+void
+rmdot(char *s)
+{
+  if(mkdir("dots") != 0){
+    printf("%s: mkdir dots failed\n", s);
+    exit(1);
+  }
+  if(chdir("dots") != 0){
+    printf("%s: chdir dots failed\n", s);
+    exit(1);
+  }
+  if(unlink(".") == 0){
+    printf("%s: rm . worked!\n", s);
+    exit(1);
+  }
+  if(unlink("..") == 0){
+    printf("%s: rm .. worked!\n", s);
+    exit(1);
+  }
+  if(chdir("/") != 0){
+    printf("%s: chdir / failed\n", s);
+    exit(1);
+  }
+  if(unlink("dots/.") == 0){
+    printf("%s: unlink dots/. worked!\n", s);
+    exit(1);
+  }
+  if(unlink("dots/..") == 0){
+    printf("%s: unlink dots/.. worked!\n", s);
+    exit(1);
+  }
+  if(unlink("dots") != 0){
+    printf("%s: unlink dots failed!\n", s);
+    exit(1);
+  }
+}
+
+void
+dirfile(char *s)
+{
+  int fd;
+
+  fd = open("dirfile", O_CREATE);
+  if(fd < 0){
+    printf("%s: create dirfile failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(chdir("dirfile") == 0){
+    printf("%s: chdir dirfile succeeded!\n", s);
+    exit(1);
+  }
+  fd = open("dirfile/xx", 0);
+  if(fd >= 0){
+    printf("%s: create dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  fd = open("dirfile/xx", O_CREATE);
+  if(fd >= 0){
+    printf("%s: create dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  if(mkdir("dirfile/xx") == 0){
+    printf("%s: mkdir dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  if(unlink("dirfile/xx") == 0){
+    printf("%s: unlink dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  if(link("README", "dirfile/xx") == 0){
+    printf("%s: link to dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  if(unlink("dirfile") != 0){
+    printf("%s: unlink dirfile failed!\n", s);
+    exit(1);
+  }
+
+  fd = open(".", O_RDWR);
+  if(fd >= 0){
+    printf("%s: open . for writing succeeded!\n", s);
+    exit(1);
+  }
+  fd = open(".", 0);
+  if(write(fd, "x", 1) > 0){
+    printf("%s: write . succeeded!\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// test that iput() is called at the end of _namei().
+// also tests empty file names.
+void
+iref(char *s)
+{
+  int i, fd;
+
+  for(i = 0; i < NINODE + 1; i++){
+    if(mkdir("irefd") != 0){
+      printf("%s: mkdir irefd failed\n", s);
+      exit(1);
+    }
+    if(chdir("irefd") != 0){
+      printf("%s: chdir irefd failed\n", s);
+      exit(1);
+    }
+
+    mkdir("");
+    link("README", "");
+    fd = open("", O_CREATE);
+    if(fd >= 0)
+      close(fd);
+    fd = open("xx", O_CREATE);
+    if(fd >= 0)
+      close(fd);
+    unlink("xx");
+  }
+
+  // clean up
+  for(i = 0; i < NINODE + 1; i++){
+    chdir("..");
+    unlink("irefd");
+  }
+
+  chdir("/");
+}
+
+// test that fork fails gracefully
+// the forktest binary also does this, but it runs out of proc entries first.
+// inside the bigger usertests binary, we run out of memory first.
+void
+forktest(char *s)
+{
+  enum{ N = 1000 };
+  int n, pid;
+
+  for(n=0; n<N; n++){
+    pid = fork();
+    if(pid < 0)
+      break;
+    if(pid == 0)
+      exit(0);
+  }
+
+  if (n == 0) {
+    printf("%s: no fork at all!\n", s);
+    exit(1);
+  }
+
+  if(n == N){
+    printf("%s: fork claimed to work 1000 times!\n", s);
+    exit(1);
+  }
+
+  for(; n > 0; n--){
+    if(wait(0) < 0){
+      printf("%s: wait stopped early\n", s);
+      exit(1);
+    }
+  }
+
+  if(wait(0) != -1){
+    printf("%s: wait got too many\n", s);
+    exit(1);
+  }
+}
+
+void
+sbrkbasic(char *s)
+{
+  enum { TOOMUCH=1024*1024*1024};
+  int i, pid, xstatus;
+  char *c, *a, *b;
+
+  // does sbrk() return the expected failure value?
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed in sbrkbasic\n");
+    exit(1);
+  }
+  if(pid == 0){
+    a = sbrk(TOOMUCH);
+    if(a == (char*)0xffffffffffffffffL){
+      // it's OK if this fails.
+      exit(0);
+    }
+    
+    for(b = a; b < a+TOOMUCH; b += 4096){
+      *b = 99;
+    }
+    
+    // we should not get here! either sbrk(TOOMUCH)
+    // should have failed, or (with lazy allocation)
+    // a pagefault should have killed this process.
+    exit(1);
+  }
+
+  wait(&xstatus);
+  if(xstatus == 1){
+    printf("%s: too much memory allocated!\n", s);
+    exit(1);
+  }
+
+  // can one sbrk() less than a page?
+  a = sbrk(0);
+  for(i = 0; i < 5000; i++){
+    b = sbrk(1);
+    if(b != a){
+      printf("%s: sbrk test failed %d %x %x\n", i, a, b);
+      exit(1);
+    }
+    *b = 1;
+    a = b + 1;
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: sbrk test fork failed\n", s);
+    exit(1);
+  }
+  c = sbrk(1);
+  c = sbrk(1);
+  if(c != a + 1){
+    printf("%s: sbrk test failed post-fork\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(&xstatus);
+  exit(xstatus);
+}
+
+void
+sbrkmuch(char *s)
+{
+  enum { BIG=100*1024*1024 };
+  char *c, *oldbrk, *a, *lastaddr, *p;
+  uint64 amt;
+
+  oldbrk = sbrk(0);
+
+  // can one grow address space to something big?
+  a = sbrk(0);
+  amt = BIG - (uint64)a;
+  p = sbrk(amt);
+  if (p != a) {
+    printf("%s: sbrk test failed to grow big address space; enough phys mem?\n", s);
+    exit(1);
+  }
+
+  // touch each page to make sure it exists.
+  char *eee = sbrk(0);
+  for(char *pp = a; pp < eee; pp += 4096)
+    *pp = 1;
+
+  lastaddr = (char*) (BIG-1);
+  *lastaddr = 99;
+
+  // can one de-allocate?
+  a = sbrk(0);
+  c = sbrk(-PGSIZE);
+  if(c == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk could not deallocate\n", s);
     exit(1);
   }
-  if(chdir("./..") != 0){
-    printf("%s: chdir ./.. failed\n", s);
+  c = sbrk(0);
+  if(c != a - PGSIZE){
+    printf("%s: sbrk deallocation produced wrong address, a %x c %x\n", a, c);
     exit(1);
   }
 
-  fd = open("dd/dd/ffff", 0);
-  if(fd < 0){
-    printf("%s: open dd/dd/ffff failed\n", s);
+  // can one re-allocate that page?
+  a = sbrk(0);
+  c = sbrk(PGSIZE);
+  if(c != a || sbrk(0) != a + PGSIZE){
+    printf("%s: sbrk re-allocation failed, a %x c %x\n", a, c);
     exit(1);
   }
-  if(read(fd, buf, sizeof(buf)) != 2){
-    printf("%s: read dd/dd/ffff wrong len\n", s);
+  if(*lastaddr == 99){
+    // should be zero
+    printf("%s: sbrk de-allocation didn't really deallocate\n", s);
     exit(1);
   }
-  close(fd);
 
-  if(open("dd/dd/ff", O_RDONLY) >= 0){
-    printf("%s: open (unlinked) dd/dd/ff succeeded!\n", s);
+  a = sbrk(0);
+  c = sbrk(-(sbrk(0) - oldbrk));
+  if(c != a){
+    printf("%s: sbrk downsize failed, a %x c %x\n", a, c);
     exit(1);
   }
+}
 
-  if(open("dd/ff/ff", O_CREATE|O_RDWR) >= 0){
-    printf("%s: create dd/ff/ff succeeded!\n", s);
-    exit(1);
-  }
-  if(open("dd/xx/ff", O_CREATE|O_RDWR) >= 0){
-    printf("%s: create dd/xx/ff succeeded!\n", s);
-    exit(1);
-  }
-  if(open("dd", O_CREATE) >= 0){
-    printf("%s: create dd succeeded!\n", s);
-    exit(1);
-  }
-  if(open("dd", O_RDWR) >= 0){
-    printf("%s: open dd rdwr succeeded!\n", s);
-    exit(1);
-  }
-  if(open("dd", O_WRONLY) >= 0){
-    printf("%s: open dd wronly succeeded!\n", s);
+// sbrk more than physical memory and touch only a few pages;
+// with lazy allocation only the touched pages cost memory.
+// system calls must also work on untouched heap pages.
+void
+sbrklazy(char *s)
+{
+  enum { BIG=160*1024*1024 };
+  char *a, *p;
+  int fd;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
     exit(1);
   }
-  if(link("dd/ff/ff", "dd/dd/xx") == 0){
-    printf("%s: link dd/ff/ff dd/dd/xx succeeded!\n", s);
-    exit(1);
+  for(p = a; p < a + BIG; p += 1024*4096)
+    *p = 'x';
+  for(p = a; p < a + BIG; p += 1024*4096){
+    if(*p != 'x' || *(p + 4096) != 0){
+      printf("%s: lazy page has wrong contents\n", s);
+      exit(1);
+    }
   }
-  if(link("dd/xx/ff", "dd/dd/xx") == 0){
-    printf("%s: link dd/xx/ff dd/dd/xx succeeded!\n", s);
+
+  // read() into and write() from pages never touched.
+  fd = open("lazy", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
     exit(1);
   }
-  if(link("dd/ff", "dd/dd/ffff") == 0){
-    printf("%s: link dd/ff dd/dd/ffff succeeded!\n", s);
+  if(write(fd, a + 8*4096 + 100, 4096) != 4096){
+    printf("%s: write from lazy page failed\n", s);
     exit(1);
   }
-  if(mkdir("dd/ff/ff") == 0){
-    printf("%s: mkdir dd/ff/ff succeeded!\n", s);
+  close(fd);
+  fd = open("lazy", O_RDONLY);
+  if(read(fd, a + 40*4096 + 10, 4096) != 4096){
+    printf("%s: read into lazy page failed\n", s);
     exit(1);
   }
-  if(mkdir("dd/xx/ff") == 0){
-    printf("%s: mkdir dd/xx/ff succeeded!\n", s);
-    exit(1);
+  close(fd);
+  unlink("lazy");
+  for(int i = 0; i < 4096; i++){
+    if(a[40*4096 + 10 + i] != 0){
+      printf("%s: lazy page not zero\n", s);
+      exit(1);
+    }
   }
-  if(mkdir("dd/dd/ffff") == 0){
-    printf("%s: mkdir dd/dd/ffff succeeded!\n", s);
+
+  if(sbrk(-BIG) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
     exit(1);
   }
-  if(unlink("dd/xx/ff") == 0){
-    printf("%s: unlink dd/xx/ff succeeded!\n", s);
+}
+
+// a big heap is backed by megapages. check that fork, a write
+// by the child, sbrk shrinking into the middle of a megapage,
+// and pipe page lending all split them correctly.
+void
+sbrkmega(char *s)
+{
+  char *a, *b;
+  int i, pid, xstatus, fds[2];
+  uint64 big = 8*1024*1024;
+
+  a = sbrk(big + 2*1024*1024);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
     exit(1);
   }
-  if(unlink("dd/ff/ff") == 0){
-    printf("%s: unlink dd/ff/ff succeeded!\n", s);
+  b = (char*)(((uint64)a + 2*1024*1024 - 1) & ~(2*1024*1024 - 1));
+  for(i = 0; i < big; i += 4096)
+    b[i] = i / 4096;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
     exit(1);
   }
-  if(chdir("dd/ff") == 0){
-    printf("%s: chdir dd/ff succeeded!\n", s);
-    exit(1);
+  if(pid == 0){
+    for(i = 0; i < big; i += 4096*7)
+      b[i] = 0xff;
+    exit(0);
   }
-  if(chdir("dd/xx") == 0){
-    printf("%s: chdir dd/xx succeeded!\n", s);
-    exit(1);
+  wait(&xstatus);
+  for(i = 0; i < big; i += 4096){
+    if(b[i] != (char)(i / 4096)){
+      printf("%s: parent sees child's write at %d\n", s, i);
+      exit(1);
+    }
   }
 
-  if(unlink("dd/dd/ffff") != 0){
-    printf("%s: unlink dd/dd/ff failed\n", s);
-    exit(1);
-  }
-  if(unlink("dd/ff") != 0){
-    printf("%s: unlink dd/ff failed\n", s);
+  // lend a page from the middle of a (now split) megapage.
+  if(pipe(fds) < 0 || write(fds[1], b + 4096*9, 4096) != 4096){
+    printf("%s: pipe write failed\n", s);
     exit(1);
   }
-  if(unlink("dd") == 0){
-    printf("%s: unlink non-empty dd succeeded!\n", s);
+  b[4096*9] = 0x7f;
+  if(read(fds[0], b + 4096*3, 4096) != 4096 || b[4096*3] != 9){
+    printf("%s: pipe read wrong data\n", s);
     exit(1);
   }
-  if(unlink("dd/dd") < 0){
-    printf("%s: unlink dd/dd failed\n", s);
+  close(fds[0]);
+  close(fds[1]);
+
+  // shrink to 1MB into the last megapage.
+  if(sbrk(-(int)(sbrk(0) - (b + big - 1024*1024))) == (char*)-1){
+    printf("%s: shrinking sbrk failed\n", s);
     exit(1);
   }
-  if(unlink("dd") < 0){
-    printf("%s: unlink dd failed\n", s);
+  if(b[big - 1024*1024 - 4096] != (char)((big - 1024*1024 - 4096) / 4096)){
+    printf("%s: lost data below the new break\n", s);
     exit(1);
   }
 }
 
-// test writes that are larger than the log.
+// fork a process that is using more than half of physical
+// memory; this only works if fork shares pages copy-on-write.
+// also check that parent and child see their own writes.
 void
-bigwrite(char *s)
+cowfork(char *s)
 {
-  int fd, sz;
+  enum { BIG=80*1024*1024 };
+  char *a, *p;
+  int pid, xstatus;
 
-  unlink("bigwrite");
-  for(sz = 499; sz < (MAXOPBLOCKS+2)*BSIZE; sz += 471){
-    fd = open("bigwrite", O_CREATE | O_RDWR);
-    if(fd < 0){
-      printf("%s: cannot create bigwrite\n", s);
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 4096)
+    *(int*)p = 1;
+
+  for(int i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
       exit(1);
     }
-    int i;
-    for(i = 0; i < 2; i++){
-      int cc = write(fd, buf, sz);
-      if(cc != sz){
-        printf("%s: write(%d) ret %d\n", s, sz, cc);
+    if(pid == 0){
+      for(p = a; p < a + BIG; p += 64*4096){
+        if(*(int*)p != 1){
+          printf("%s: child saw wrong value\n", s);
+          exit(1);
+        }
+        *(int*)p = 2;
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+    for(p = a; p < a + BIG; p += 64*4096){
+      if(*(int*)p != 1){
+        printf("%s: parent saw child's write\n", s);
         exit(1);
       }
     }
-    close(fd);
-    unlink("bigwrite");
   }
-}
 
-void
-bigfile(char *s)
-{
-  enum { N = 20, SZ=600 };
-  int fd, i, total, cc;
-
-  unlink("bigfile.dat");
-  fd = open("bigfile.dat", O_CREATE | O_RDWR);
-  if(fd < 0){
-    printf("%s: cannot create bigfile", s);
+  // copyout() into a COW page must not be seen by the other side.
+  int fds[2];
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
     exit(1);
   }
-  for(i = 0; i < N; i++){
-    memset(buf, i, SZ);
-    if(write(fd, buf, SZ) != SZ){
-      printf("%s: write bigfile failed\n", s);
+  pid = fork();
+  if(pid == 0){
+    if(read(fds[0], a, 4) != 4 || *(int*)a != 3)
       exit(1);
-    }
+    exit(0);
   }
-  close(fd);
-
-  fd = open("bigfile.dat", 0);
-  if(fd < 0){
-    printf("%s: cannot open bigfile\n", s);
+  int v = 3;
+  if(write(fds[1], &v, 4) != 4){
+    printf("%s: pipe write failed\n", s);
     exit(1);
   }
-  total = 0;
-  for(i = 0; ; i++){
-    cc = read(fd, buf, SZ/2);
-    if(cc < 0){
-      printf("%s: read bigfile failed\n", s);
-      exit(1);
-    }
-    if(cc == 0)
-      break;
-    if(cc != SZ/2){
-      printf("%s: short read bigfile\n", s);
-      exit(1);
-    }
-    if(buf[0] != i/2 || buf[SZ/2-1] != i/2){
-      printf("%s: read bigfile wrong data\n", s);
-      exit(1);
-    }
-    total += cc;
-  }
-  close(fd);
-  if(total != N*SZ){
-    printf("%s: read bigfile wrong total\n", s);
+  wait(&xstatus);
+  if(xstatus != 0 || *(int*)a != 1){
+    printf("%s: copyout broke COW\n", s);
     exit(1);
   }
-  unlink("bigfile.dat");
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-BIG);
 }
 
-void
-fourteen(char *s)
+// the number after key on the line of the statistics device
+// that starts with prefix, or -1.
+int
+statnum(char *prefix, char *key)
 {
-  int fd;
+  static char sbuf[32768];
+  char *l, *e, *k;
+  int n;
+
+  n = statistics(sbuf, sizeof(sbuf) - 1);
+  sbuf[n < 0 ? 0 : n] = 0;
+  for(l = sbuf; *l; l = *e ? e + 1 : e){
+    if((e = strchr(l, '\n')) == 0)
+      e = l + strlen(l);
+    if(memcmp(l, prefix, strlen(prefix)) != 0)
+      continue;
+    for(k = l; k + strlen(key) <= e; k++)
+      if(memcmp(k, key, strlen(key)) == 0)
+        return atoi(k + strlen(key));
+  }
+  return -1;
+}
 
-  // DIRSIZ is 14.
+// touch more pages than are free, so that kswapd writes some out,
+// and check that every page reads back what was written, in the
+// process and in a forked child, whose writes the parent mustn't see.
+void
+swaptest(char *s)
+{
+  char *a;
+  uint64 *w;
+  int nfree, slots, out, in, n, stride, pid, xstatus;
 
-  if(mkdir("12345678901234") != 0){
-    printf("%s: mkdir 12345678901234 failed\n", s);
+  nfree = statnum("free pages", "pages ");
+  slots = statnum("swap:", "slots ");
+  out = statnum("swap:", "out ");
+  if(nfree < 0 || slots < 0 || out < 0){
+    printf("%s: no free pages or swap on the statistics device\n", s);
     exit(1);
   }
-  if(mkdir("12345678901234/123456789012345") != 0){
-    printf("%s: mkdir 12345678901234/123456789012345 failed\n", s);
+  if(slots < 8){
+    printf("%s: too little swap (%d slots)\n", s, slots);
     exit(1);
   }
-  fd = open("123456789012345/123456789012345/123456789012345", O_CREATE);
-  if(fd < 0){
-    printf("%s: create 123456789012345/123456789012345/123456789012345 failed\n", s);
+  n = nfree + slots / 8;
+  if((a = sbrk(n * 4096)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
     exit(1);
   }
-  close(fd);
-  fd = open("12345678901234/12345678901234/12345678901234", 0);
-  if(fd < 0){
-    printf("%s: open 12345678901234/12345678901234/12345678901234 failed\n", s);
-    exit(1);
+  for(int i = 0; i < n; i++){
+    w = (uint64*)(a + i*4096);
+    w[0] = i * 2654435761UL;
+    w[511] = ~w[0];
   }
-  close(fd);
-
-  if(mkdir("12345678901234/12345678901234") == 0){
-    printf("%s: mkdir 12345678901234/12345678901234 succeeded!\n", s);
+  if(statnum("swap:", "out ") <= out){
+    printf("%s: %d pages touched with %d free, none swapped out\n", s, n, nfree);
     exit(1);
   }
-  if(mkdir("123456789012345/12345678901234") == 0){
-    printf("%s: mkdir 12345678901234/123456789012345 succeeded!\n", s);
-    exit(1);
+  for(int i = 0; i < n; i++){
+    w = (uint64*)(a + i*4096);
+    if(w[0] != i * 2654435761UL || w[511] != ~w[0]){
+      printf("%s: page %d lost its contents\n", s, i);
+      exit(1);
+    }
   }
 
-  // clean up
-  unlink("123456789012345/12345678901234");
-  unlink("12345678901234/12345678901234");
-  unlink("12345678901234/12345678901234/12345678901234");
-  unlink("123456789012345/123456789012345/123456789012345");
-  unlink("12345678901234/123456789012345");
-  unlink("12345678901234");
-}
-
-void
-rmdot(char *s)
-{
-  if(mkdir("dots") != 0){
-    printf("%s: mkdir dots failed\n", s);
-    exit(1);
-  }
-  if(chdir("dots") != 0){
-    printf("%s: chdir dots failed\n", s);
-    exit(1);
-  }
-  if(unlink(".") == 0){
-    printf("%s: rm . worked!\n", s);
-    exit(1);
-  }
-  if(unlink("..") == 0){
-    printf("%s: rm .. worked!\n", s);
+  in = statnum("swap:", "in ");
+  stride = n / (slots / 8);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
     exit(1);
   }
-  if(chdir("/") != 0){
-    printf("%s: chdir / failed\n", s);
-    exit(1);
+  if(pid == 0){
+    for(int i = 0; i < n; i++){
+      w = (uint64*)(a + i*4096);
+      if(w[0] != i * 2654435761UL || w[511] != ~w[0]){
+        printf("%s: child's page %d lost its contents\n", s, i);
+        exit(1);
+      }
+    }
+    for(int i = 0; i < n; i += stride){
+      w = (uint64*)(a + i*4096);
+      w[0] = ~w[0];
+    }
+    for(int i = 0; i < n; i += stride){
+      w = (uint64*)(a + i*4096);
+      if(w[0] != w[511]){
+        printf("%s: child lost its write to page %d\n", s, i);
+        exit(1);
+      }
+    }
+    exit(0);
   }
-  if(unlink("dots/.") == 0){
-    printf("%s: unlink dots/. worked!\n", s);
+  wait(&xstatus);
+  if(xstatus != 0)
     exit(1);
-  }
-  if(unlink("dots/..") == 0){
-    printf("%s: unlink dots/.. worked!\n", s);
+  if(statnum("swap:", "in ") <= in){
+    printf("%s: no pages swapped in across fork\n", s);
     exit(1);
   }
-  if(unlink("dots") != 0){
-    printf("%s: unlink dots failed!\n", s);
-    exit(1);
+  for(int i = 0; i < n; i++){
+    w = (uint64*)(a + i*4096);
+    if(w[0] != i * 2654435761UL || w[511] != ~w[0]){
+      printf("%s: page %d changed across fork\n", s, i);
+      exit(1);
+    }
   }
+  sbrk(-n * 4096);
 }
 
+// mmap() a file MAP_PRIVATE and MAP_SHARED, check that only
+// shared writes reach the file, that munmap() can trim either
+// end, and that a child inherits the mapping.
 void
-dirfile(char *s)
+mmapfile(char *s)
 {
-  int fd;
+  enum { N=2*4096 + 2048 };
+  char *buf, *a;
+  int fd, pid, xstatus;
 
-  fd = open("dirfile", O_CREATE);
-  if(fd < 0){
-    printf("%s: create dirfile failed\n", s);
+  buf = malloc(N);
+  for(int i = 0; i < N; i++)
+    buf[i] = 'a' + i % 23;
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: create failed\n", s);
     exit(1);
   }
-  close(fd);
-  if(chdir("dirfile") == 0){
-    printf("%s: chdir dirfile succeeded!\n", s);
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap private failed\n", s);
     exit(1);
   }
-  fd = open("dirfile/xx", 0);
-  if(fd >= 0){
-    printf("%s: create dirfile/xx succeeded!\n", s);
+  if(memcmp(a, buf, N) != 0 || a[N] != 0){
+    printf("%s: mapped contents wrong\n", s);
     exit(1);
   }
-  fd = open("dirfile/xx", O_CREATE);
-  if(fd >= 0){
-    printf("%s: create dirfile/xx succeeded!\n", s);
+  a[0] = 'X';
+  if(munmap(a, N) != 0){
+    printf("%s: munmap failed\n", s);
     exit(1);
   }
-  if(mkdir("dirfile/xx") == 0){
-    printf("%s: mkdir dirfile/xx succeeded!\n", s);
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
     exit(1);
   }
-  if(unlink("dirfile/xx") == 0){
-    printf("%s: unlink dirfile/xx succeeded!\n", s);
+  if(a[0] != buf[0]){
+    printf("%s: private write reached the file\n", s);
     exit(1);
   }
-  if(link("README", "dirfile/xx") == 0){
-    printf("%s: link to dirfile/xx succeeded!\n", s);
+  pid = fork();
+  if(pid == 0){
+    if(memcmp(a, buf, N) != 0)
+      exit(1);
+    a[4096] = 'Y';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || a[4096] != 'Y'){
+    printf("%s: child didn't share the mapping\n", s);
     exit(1);
   }
-  if(unlink("dirfile") != 0){
-    printf("%s: unlink dirfile failed!\n", s);
+  a[1] = 'Z';
+  // trim the last page, then the rest.
+  if(munmap(a + 2*4096, 4096) != 0 || munmap(a, 2*4096) != 0){
+    printf("%s: munmap failed\n", s);
     exit(1);
   }
+  close(fd);
 
-  fd = open(".", O_RDWR);
-  if(fd >= 0){
-    printf("%s: open . for writing succeeded!\n", s);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, N) != N || buf[1] != 'Z' || buf[4096] != 'Y'){
+    printf("%s: shared write not written back\n", s);
     exit(1);
   }
-  fd = open(".", 0);
-  if(write(fd, "x", 1) > 0){
-    printf("%s: write . succeeded!\n", s);
+  // writing through a read-only mapping must fail.
+  a = mmap(0, N, PROT_READ, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap read-only failed\n", s);
     exit(1);
   }
   close(fd);
-}
-
-// test that iput() is called at the end of _namei().
-// also tests empty file names.
-void
-iref(char *s)
-{
-  int i, fd;
-
-  for(i = 0; i < NINODE + 1; i++){
-    if(mkdir("irefd") != 0){
-      printf("%s: mkdir irefd failed\n", s);
-      exit(1);
-    }
-    if(chdir("irefd") != 0){
-      printf("%s: chdir irefd failed\n", s);
-      exit(1);
-    }
-
-    mkdir("");
-    link("README", "");
-    fd = open("", O_CREATE);
-    if(fd >= 0)
-      close(fd);
-    fd = open("xx", O_CREATE);
-    if(fd >= 0)
-      close(fd);
-    unlink("xx");
-  }
-
-  // clean up
-  for(i = 0; i < NINODE + 1; i++){
-    chdir("..");
-    unlink("irefd");
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, a, 10) > 0){
+    printf("%s: read() into read-only mapping succeeded\n", s);
+    exit(1);
   }
-
-  chdir("/");
+  close(fd);
+  unlink("mmapfile");
+  free(buf);
 }
 
-// test that fork fails gracefully
-// the forktest binary also does this, but it runs out of proc entries first.
-// inside the bigger usertests binary, we run out of memory first.
+// a shared memory segment is shared across fork(), outlives
+// a detach while others have it attached, and is found again
+// by key.
 void
-forktest(char *s)
+shmshared(char *s)
 {
-  enum{ N = 1000 };
-  int n, pid;
+  enum { KEY=0x5347, N=2*4096 };
+  char *a, *b;
+  int pid, xstatus;
 
-  for(n=0; n<N; n++){
-    pid = fork();
-    if(pid < 0)
-      break;
-    if(pid == 0)
-      exit(0);
+  a = shmat(KEY, N);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: shmat failed\n", s);
+    exit(1);
   }
-
-  if (n == 0) {
-    printf("%s: no fork at all!\n", s);
+  if(a[0] != 0 || a[N-1] != 0){
+    printf("%s: new segment not zeroed\n", s);
     exit(1);
   }
-
-  if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
     exit(1);
   }
-
-  for(; n > 0; n--){
-    if(wait(0) < 0){
-      printf("%s: wait stopped early\n", s);
+  if(pid == 0){
+    a[0] = 'A';
+    a[4096] = 'B';
+    if(shmdt(a) != 0)
       exit(1);
-    }
+    b = shmat(KEY, 4096);
+    if(b == (char*)0xffffffffffffffffL || b[0] != 'A')
+      exit(1);
+    b[1] = 'C';
+    exit(0);
   }
-
-  if(wait(0) != -1){
-    printf("%s: wait got too many\n", s);
+  wait(&xstatus);
+  if(xstatus != 0 || a[0] != 'A' || a[1] != 'C' || a[4096] != 'B'){
+    printf("%s: child's writes not shared\n", s);
+    exit(1);
+  }
+  if(shmdt(a + 4096) == 0 || shmat(KEY, 4*N) != (char*)0xffffffffffffffffL){
+    printf("%s: bad shmdt or oversized shmat succeeded\n", s);
     exit(1);
   }
+  if(shmdt(a) != 0){
+    printf("%s: shmdt failed\n", s);
+    exit(1);
+  }
+  // the last detach freed it; the key makes a new one.
+  a = shmat(KEY, N);
+  if(a == (char*)0xffffffffffffffffL || a[0] != 0){
+    printf("%s: segment not freed\n", s);
+    exit(1);
+  }
+  shmdt(a);
 }
 
+// page-aligned whole-page pipe writes are lent to the reader
+// copy-on-write; check that neither side sees the other's
+// later writes, and that unaligned reads still work.
 void
-sbrkbasic(char *s)
+pipepages(char *s)
 {
-  enum { TOOMUCH=1024*1024*1024};
-  int i, pid, xstatus;
-  char *c, *a, *b;
+  enum { NPG=8 };
+  char *a, *b;
+  int fds[2], pid, xstatus;
+  uint64 top;
 
-  // does sbrk() return the expected failure value?
+  top = (uint64)sbrk(0);
+  sbrk(PGROUNDUP(top) - top);
+  a = sbrk(2*NPG*PGSIZE + PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  b = a + NPG*PGSIZE;
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
   pid = fork();
   if(pid < 0){
-    printf("fork failed in sbrkbasic\n");
+    printf("%s: fork failed\n", s);
     exit(1);
   }
   if(pid == 0){
-    a = sbrk(TOOMUCH);
-    if(a == (char*)0xffffffffffffffffL){
-      // it's OK if this fails.
-      exit(0);
-    }
-    
-    for(b = a; b < a+TOOMUCH; b += 4096){
-      *b = 99;
+    close(fds[0]);
+    for(int k = 0; k < 2; k++){
+      for(int i = 0; i < NPG*PGSIZE; i++)
+        a[i] = k + i / PGSIZE;
+      if(write(fds[1], a, NPG*PGSIZE) != NPG*PGSIZE)
+        exit(1);
     }
-    
-    // we should not get here! either sbrk(TOOMUCH)
-    // should have failed, or (with lazy allocation)
-    // a pagefault should have killed this process.
-    exit(1);
-  }
-
-  wait(&xstatus);
-  if(xstatus == 1){
-    printf("%s: too much memory allocated!\n", s);
-    exit(1);
+    for(int i = 0; i < NPG*PGSIZE; i++)
+      a[i] = 'x';
+    exit(0);
   }
-
-  // can one sbrk() less than a page?
-  a = sbrk(0);
-  for(i = 0; i < 5000; i++){
-    b = sbrk(1);
-    if(b != a){
-      printf("%s: sbrk test failed %d %x %x\n", i, a, b);
+  close(fds[1]);
+  // first round whole pages, second through an unaligned buffer.
+  for(int k = 0; k < 2; k++){
+    char *buf = b + k;
+    int n = 0, cc;
+    while(n < NPG*PGSIZE && (cc = read(fds[0], buf + n, NPG*PGSIZE - n)) > 0)
+      n += cc;
+    if(n != NPG*PGSIZE){
+      printf("%s: short read %d\n", s, n);
       exit(1);
     }
-    *b = 1;
-    a = b + 1;
-  }
-  pid = fork();
-  if(pid < 0){
-    printf("%s: sbrk test fork failed\n", s);
-    exit(1);
+    buf[0] = 'y';
+    for(int i = 1; i < NPG*PGSIZE; i++){
+      if(buf[i] != k + i / PGSIZE){
+        printf("%s: wrong byte at %d\n", s, i);
+        exit(1);
+      }
+    }
   }
-  c = sbrk(1);
-  c = sbrk(1);
-  if(c != a + 1){
-    printf("%s: sbrk test failed post-fork\n", s);
+  close(fds[0]);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: writer failed\n", s);
     exit(1);
   }
-  if(pid == 0)
-    exit(0);
-  wait(&xstatus);
-  exit(xstatus);
 }
 
+// small blocks of each size class must not overlap, and
+// freeing the big block at the top of the heap must give
+// its memory back to the kernel.
 void
-sbrkmuch(char *s)
+mallocsizes(char *s)
 {
-  enum { BIG=100*1024*1024 };
-  char *c, *oldbrk, *a, *lastaddr, *p;
-  uint64 amt;
-
-  oldbrk = sbrk(0);
-
-  // can one grow address space to something big?
-  a = sbrk(0);
-  amt = BIG - (uint64)a;
-  p = sbrk(amt);
-  if (p != a) {
-    printf("%s: sbrk test failed to grow big address space; enough phys mem?\n", s);
-    exit(1);
-  }
-
-  // touch each page to make sure it exists.
-  char *eee = sbrk(0);
-  for(char *pp = a; pp < eee; pp += 4096)
-    *pp = 1;
-
-  lastaddr = (char*) (BIG-1);
-  *lastaddr = 99;
+  char *p[64], *big, *top;
+  int i, j;
 
-  // can one de-allocate?
-  a = sbrk(0);
-  c = sbrk(-PGSIZE);
-  if(c == (char*)0xffffffffffffffffL){
-    printf("%s: sbrk could not deallocate\n", s);
-    exit(1);
+  for(i = 0; i < 64; i++){
+    if((p[i] = malloc(1 + i * 37)) == 0){
+      printf("%s: malloc failed\n", s);
+      exit(1);
+    }
+    memset(p[i], i, 1 + i * 37);
   }
-  c = sbrk(0);
-  if(c != a - PGSIZE){
-    printf("%s: sbrk deallocation produced wrong address, a %x c %x\n", a, c);
-    exit(1);
+  for(i = 0; i < 64; i++){
+    for(j = 0; j < 1 + i * 37; j++){
+      if(p[i][j] != (char)i){
+        printf("%s: block %d overwritten\n", s, i);
+        exit(1);
+      }
+    }
+    free(p[i]);
   }
 
-  // can one re-allocate that page?
-  a = sbrk(0);
-  c = sbrk(PGSIZE);
-  if(c != a || sbrk(0) != a + PGSIZE){
-    printf("%s: sbrk re-allocation failed, a %x c %x\n", a, c);
-    exit(1);
-  }
-  if(*lastaddr == 99){
-    // should be zero
-    printf("%s: sbrk de-allocation didn't really deallocate\n", s);
+  top = sbrk(0);
+  if((big = malloc(100*1024)) == 0){
+    printf("%s: big malloc failed\n", s);
     exit(1);
   }
-
-  a = sbrk(0);
-  c = sbrk(-(sbrk(0) - oldbrk));
-  if(c != a){
-    printf("%s: sbrk downsize failed, a %x c %x\n", a, c);
+  big[100*1024-1] = 1;
+  free(big);
+  if(sbrk(0) != top){
+    printf("%s: free didn't shrink the heap\n", s);
     exit(1);
   }
 }
@@ -2666,11 +4514,43 @@ main(int argc, char *argv[])
     {fourfiles, "fourfiles"},
     {sharedfd, "sharedfd"},
     {exectest, "exectest"},
+    {spawntest, "spawntest"},
+    {prioritytest, "prioritytest"},
+    {manyprocs, "manyprocs"},
+    {threadtest, "threadtest"},
+    {fsynctest, "fsynctest"},
+    {sendfiletest, "sendfiletest"},
+    {rwvtest, "rwvtest"},
+    {tmpfstest, "tmpfstest"},
+    {pcachetest, "pcachetest"},
+    {usyscalltest, "usyscalltest"},
+    {ringtest, "ringtest"},
+    {memtest, "memtest"},
+    {kmsgtest, "kmsgtest"},
+    {pipesizetest, "pipesizetest"},
+    {polltest, "polltest"},
+    {nonblocktest, "nonblocktest"},
+    {clocktest, "clocktest"},
+    {proftest, "proftest"},
+    {syscalltest, "syscalltest"},
+    {bufiotest, "bufiotest"},
+    {countertest, "countertest"},
+    {affinitytest, "affinitytest"},
+    {manyfds, "manyfds"},
+    {iostattest, "iostattest"},
     {bigargtest, "bigargtest"},
     {bigwrite, "bigwrite"},
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {sbrklazy, "sbrklazy"},
+    {sbrkmega, "sbrkmega"},
+    {cowfork, "cowfork"},
+    {swaptest, "swaptest"},
+    {mmapfile, "mmapfile"},
+    {shmshared, "shmshared"},
+    {pipepages, "pipepages"},
+    {mallocsizes, "mallocsizes"},
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
@@ -2694,6 +4574,7 @@ main(int argc, char *argv[])
     {iref, "iref"},
     {forktest, "forktest"},
     {bigdir, "bigdir"}, // slow
+    {dirindex, "dirindex"},
     { 0, 0},
   };
 
@@ -6,24 +6,26 @@ print "# generated by usys.pl - do not edit\n";
 
 print "#include \"kernel/syscall.h\"\n";
 
+# entry("name", "stub") names the stub other than the call.
 sub entry {
     my $name = shift;
-    print ".global $name\n";
-    print "${name}:\n";
+    my $stub = shift || $name;
+    print ".global $stub\n";
+    print "${stub}:\n";
     print " li a7, SYS_${name}\n";
     print " ecall\n";
     print " ret\n";
 }
 	
-entry("fork");
-entry("exit");
+entry("fork", "sysfork");
+entry("exit", "sysexit");
 entry("wait");
 entry("pipe");
 entry("read");
 entry("write");
-entry("close");
+entry("close", "sysclose");
 entry("kill");
-entry("exec");
+entry("exec", "sysexec");
 entry("open");
 entry("mknod");
 entry("unlink");
@@ -32,7 +34,30 @@ entry("link");
 entry("mkdir");
 entry("chdir");
 entry("dup");
-entry("getpid");
+entry("getpid", "sysgetpid");
 entry("sbrk");
 entry("sleep");
-entry("uptime");
+entry("uptime", "sysuptime");
+entry("mmap");
+entry("munmap");
+entry("shmat");
+entry("shmdt");
+entry("spawn");
+entry("setpriority");
+entry("clone");
+entry("join");
+entry("futex");
+entry("fsync");
+entry("sendfile");
+entry("pread");
+entry("pwrite");
+entry("readv");
+entry("writev");
+entry("ringenter");
+entry("pipesize");
+entry("poll");
+entry("fcntl");
+entry("nanotime", "sysnanotime");
+entry("trace");
+entry("setaffinity");
+entry("getaffinity");